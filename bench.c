@@ -0,0 +1,459 @@
+/*
+In-process benchmark: runs workloads straight against the fs_* operations, without a FUSE mount
+Every workload starts on a freshly formatted device, in memory unless an image file is given
+*/
+
+#include "fs.h"
+#include "memdisk.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATH_LEN 4096
+#define MAX_IO (1024 * 1024)
+
+// Parameters of the workloads
+static struct params {
+    int ops; // operations of the workloads that do not depend on a size
+    int file_size; // bytes of the file used by the read and write workloads
+    int io_size; // bytes per sequential read or write, random ones always move one block
+    int depth; // directories on the deep path
+    unsigned int seed;
+    int block_size; // geometry of the formatted device
+    int inode_num;
+} params = {
+    .ops = 10000,
+    .file_size = 8 * 1024 * 1024,
+    .io_size = 128 * 1024,
+    .depth = 64,
+    .seed = 1,
+    .block_size = BLOCK_SIZE,
+    .inode_num = 32768,
+};
+
+// Latency of every timed operation of the running workload
+static uint64_t* latency;
+static int op_num;
+static char io_buf[MAX_IO];
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void check(const char* what, int ret)
+{
+    if (ret < 0) {
+        fprintf(stderr, "%s failed: %d\n", what, ret);
+        exit(1);
+    }
+}
+
+// Time one operation of the running workload
+#define OP(call)                                 \
+    do {                                         \
+        uint64_t op_start = now_ns();            \
+        int op_ret = (call);                     \
+        latency[op_num++] = now_ns() - op_start; \
+        check(#call, op_ret);                    \
+    } while (0)
+
+static void open_file(const char* path, struct fuse_file_info* fi)
+{
+    memset(fi, 0, sizeof(*fi));
+    check("open", fs_open(path, fi));
+}
+
+static void make_file(const char* path, int size)
+{
+    struct fuse_file_info fi;
+    check("mknod", fs_mknod(path, 0644, 0));
+    open_file(path, &fi);
+    for (int offset = 0; offset < size; offset += params.io_size) {
+        check("write", fs_write(path, io_buf, params.io_size, offset, &fi));
+    }
+    check("fsync", fs_fsync(path, 0, &fi));
+}
+
+static void make_files(const char* dir, int num)
+{
+    char path[MAX_PATH_LEN];
+    check("mkdir", fs_mkdir(dir, 0755));
+    for (int i = 0; i < num; i++) {
+        sprintf(path, "%s/f%d", dir, i);
+        check("mknod", fs_mknod(path, 0644, 0));
+    }
+}
+
+// The path of the deepest directory of the `deep` workload
+static void deep_path(char* path)
+{
+    strcpy(path, "/deep");
+    for (int i = 0; i < params.depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+    }
+}
+
+// Each workload has an untimed setup and a timed run
+// A run ends with an `fsync`, so the device I/Os include writing back the buffered data and committing the journal
+struct workload {
+    const char* name;
+    void (*setup)();
+    void (*run)();
+    const char* sync_path;
+};
+
+static void create_setup()
+{
+    check("mkdir", fs_mkdir("/create", 0755));
+}
+static void create_run()
+{
+    char path[MAX_PATH_LEN];
+    for (int i = 0; i < params.ops; i++) {
+        sprintf(path, "/create/f%d", i);
+        OP(fs_mknod(path, 0644, 0));
+    }
+}
+
+static void deep_setup()
+{
+    char path[MAX_PATH_LEN] = "/deep";
+    check("mkdir", fs_mkdir(path, 0755));
+    for (int i = 0; i < params.depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        check("mkdir", fs_mkdir(path, 0755));
+    }
+}
+static void deep_run()
+{
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    deep_path(path);
+    for (int i = 0; i < params.ops; i++) {
+        OP(fs_getattr(path, &st));
+    }
+}
+
+static void seq_write_setup()
+{
+    check("mknod", fs_mknod("/seq", 0644, 0));
+}
+static void seq_write_run()
+{
+    struct fuse_file_info fi;
+    open_file("/seq", &fi);
+    for (int offset = 0; offset < params.file_size; offset += params.io_size) {
+        OP(fs_write("/seq", io_buf, params.io_size, offset, &fi));
+    }
+}
+
+static void seq_read_setup()
+{
+    make_file("/seq", params.file_size);
+}
+static void seq_read_run()
+{
+    struct fuse_file_info fi;
+    open_file("/seq", &fi);
+    for (int offset = 0; offset < params.file_size; offset += params.io_size) {
+        OP(fs_read("/seq", io_buf, params.io_size, offset, &fi));
+    }
+}
+
+static void rand_setup()
+{
+    make_file("/rand", params.file_size);
+}
+static void rand_write_run()
+{
+    struct fuse_file_info fi;
+    open_file("/rand", &fi);
+    for (int i = 0; i < params.ops; i++) {
+        off_t offset = (off_t)(rand_r(&params.seed) % (params.file_size / params.block_size)) * params.block_size;
+        OP(fs_write("/rand", io_buf, params.block_size, offset, &fi));
+    }
+}
+static void rand_read_run()
+{
+    struct fuse_file_info fi;
+    open_file("/rand", &fi);
+    for (int i = 0; i < params.ops; i++) {
+        off_t offset = (off_t)(rand_r(&params.seed) % (params.file_size / params.block_size)) * params.block_size;
+        OP(fs_read("/rand", io_buf, params.block_size, offset, &fi));
+    }
+}
+
+static void big_dir_setup()
+{
+    make_files("/big", params.ops);
+}
+static void big_dir_run()
+{
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    for (int i = 0; i < params.ops; i++) {
+        sprintf(path, "/big/f%d", rand_r(&params.seed) % params.ops);
+        OP(fs_getattr(path, &st));
+    }
+}
+
+static void unlink_setup()
+{
+    make_files("/unlink", params.ops);
+}
+static void unlink_run()
+{
+    char path[MAX_PATH_LEN];
+    for (int i = 0; i < params.ops; i++) {
+        sprintf(path, "/unlink/f%d", i);
+        OP(fs_unlink(path));
+    }
+}
+
+// The same files as `unlink`, in directories of 100, removed with one `FS_IOC_RMTREE`
+// The run waits for the tree to be freed, so the device I/Os are those of the whole removal
+static void rmtree_setup()
+{
+    char path[MAX_PATH_LEN];
+    check("mkdir", fs_mkdir("/rmtree", 0755));
+    for (int i = 0; i < params.ops; i++) {
+        sprintf(path, "/rmtree/d%d", i / 100);
+        if (i % 100 == 0) {
+            check("mkdir", fs_mkdir(path, 0755));
+        }
+        sprintf(path + strlen(path), "/f%d", i);
+        check("mknod", fs_mknod(path, 0644, 0));
+    }
+}
+static void rmtree_run()
+{
+    struct fs_rmtree_args args = { .name = "rmtree" };
+    struct fuse_file_info fi = { 0 };
+    OP(fs_ioctl("/", FS_IOC_RMTREE, NULL, &fi, 0, &args));
+    fs_rmtree_wait();
+}
+
+// Files written a chunk of each in turn, so their blocks interleave, then moved into runs with one `FS_IOC_DEFRAG`
+static void defrag_setup()
+{
+    char path[MAX_PATH_LEN];
+    struct fuse_file_info fi;
+    check("mkdir", fs_mkdir("/defrag", 0755));
+    for (int i = 0; i < 16; i++) {
+        sprintf(path, "/defrag/f%d", i);
+        check("mknod", fs_mknod(path, 0644, 0));
+    }
+    for (int offset = 0; offset < params.file_size / 16; offset += params.io_size) {
+        for (int i = 0; i < 16; i++) {
+            sprintf(path, "/defrag/f%d", i);
+            open_file(path, &fi);
+            check("write", fs_write(path, io_buf, params.io_size, offset, &fi));
+            check("fsync", fs_fsync(path, 0, &fi));
+        }
+    }
+}
+static void defrag_run()
+{
+    struct fuse_file_info fi = { 0 };
+    OP(fs_ioctl("/defrag", FS_IOC_DEFRAG, NULL, &fi, 0, NULL));
+}
+
+// Clones of one file, which should write only block pointers and reference counts
+// At most 100, well below FS_CLONE_MAX, which holds with -z as well
+static void clone_setup()
+{
+    make_file("/orig", params.file_size);
+    check("mkdir", fs_mkdir("/clone", 0755));
+}
+static void clone_run()
+{
+    char path[MAX_PATH_LEN];
+    struct fs_clone_args args = { .src = "/orig" };
+    struct fuse_file_info fi;
+    for (int i = 0; i < params.ops && i < 100; i++) {
+        sprintf(path, "/clone/f%d", i);
+        check("mknod", fs_mknod(path, 0644, 0));
+        open_file(path, &fi);
+        OP(fs_ioctl(path, FS_IOC_CLONE, NULL, &fi, 0, &args));
+    }
+}
+
+static struct workload workloads[] = {
+    { "create", create_setup, create_run, "/create" },
+    { "deep", deep_setup, deep_run, "/deep" },
+    { "seqwrite", seq_write_setup, seq_write_run, "/seq" },
+    { "seqread", seq_read_setup, seq_read_run, "/seq" },
+    { "randwrite", rand_setup, rand_write_run, "/rand" },
+    { "randread", rand_setup, rand_read_run, "/rand" },
+    { "bigdir", big_dir_setup, big_dir_run, "/big" },
+    { "unlink", unlink_setup, unlink_run, "/unlink" },
+    { "rmtree", rmtree_setup, rmtree_run, "/" },
+    { "clone", clone_setup, clone_run, "/clone" },
+    { "defrag", defrag_setup, defrag_run, "/defrag" },
+};
+#define WORKLOAD_NUM (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static int compare_latency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(double p)
+{
+    int i = p * op_num;
+    return latency[i < op_num ? i : op_num - 1] / 1000.0;
+}
+
+// A line of the report, printed once all workloads ran, as formatting the device prints too
+struct result {
+    const char* name;
+    int ops;
+    double ops_per_sec;
+    double p50, p90, p99, max; // microseconds
+    double reads, writes; // per operation
+};
+static struct result results[WORKLOAD_NUM];
+static int result_num;
+
+static void run_workload(struct workload* w)
+{
+    int start = fs_start(true);
+    if (start) {
+        fprintf(stderr, "cannot %s the device\n", start == -1 ? "open" : "format");
+        exit(1);
+    }
+    w->setup();
+
+    op_num = 0;
+    unsigned long reads = memdisk_reads, writes = memdisk_writes;
+    uint64_t begin = now_ns();
+    w->run();
+    struct fuse_file_info fi;
+    open_file(w->sync_path, &fi);
+    check("fsync", fs_fsync(w->sync_path, 0, &fi));
+    uint64_t elapsed = now_ns() - begin;
+    reads = memdisk_reads - reads;
+    writes = memdisk_writes - writes;
+
+    qsort(latency, op_num, sizeof(latency[0]), compare_latency);
+    results[result_num++] = (struct result) {
+        .name = w->name,
+        .ops = op_num,
+        .ops_per_sec = op_num / (elapsed / 1e9),
+        .p50 = percentile_us(0.5),
+        .p90 = percentile_us(0.9),
+        .p99 = percentile_us(0.99),
+        .max = latency[op_num - 1] / 1000.0,
+        .reads = (double)reads / op_num,
+        .writes = (double)writes / op_num,
+    };
+    fs_destroy(NULL);
+}
+
+// Whether `name` is in the comma-separated list
+static bool is_selected(const char* list, const char* name)
+{
+    int len = strlen(name);
+    for (const char* p = list; p != NULL; p = strchr(p, ',')) {
+        p += *p == ',';
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-w workload,...] [-n ops] [-s file_size] [-b io_size] [-d depth] [-r seed] [-k block_size] [-i inodes] [-f image] [-z] [-p] [-v]\n", name);
+    fprintf(stderr, "workloads:");
+    for (int i = 0; i < WORKLOAD_NUM; i++) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+    char* selected = NULL;
+    bool verbose = false, compress = false, tailpack = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:n:s:b:d:r:k:i:f:zpv")) != -1) {
+        switch (opt) {
+        case 'w':
+            selected = optarg;
+            break;
+        case 'n':
+            params.ops = atoi(optarg);
+            break;
+        case 's':
+            params.file_size = atoi(optarg);
+            break;
+        case 'b':
+            params.io_size = atoi(optarg);
+            break;
+        case 'd':
+            params.depth = atoi(optarg);
+            break;
+        case 'r':
+            params.seed = atoi(optarg);
+            break;
+        case 'k':
+            params.block_size = atoi(optarg);
+            break;
+        case 'i':
+            params.inode_num = atoi(optarg);
+            break;
+        case 'f':
+            memdisk_file = optarg;
+            break;
+        case 'z':
+            compress = true;
+            break;
+        case 'p':
+            tailpack = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (params.ops <= 0 || params.io_size <= 0 || params.io_size > MAX_IO || params.file_size < params.block_size || params.block_size > MAX_IO || params.depth < 0) {
+        usage(argv[0]);
+    }
+    // whole I/Os only, so every workload moves exactly `file_size` bytes
+    params.file_size -= params.file_size % params.io_size;
+    int max_ops = params.ops + params.file_size / params.io_size;
+    latency = malloc(sizeof(uint64_t) * max_ops);
+    memset(io_buf, 'x', sizeof(io_buf));
+    fs_set_compression(compress);
+    fs_set_tail_packing(tailpack);
+    fs_set_geometry(params.block_size, params.inode_num, DISK_SIZE);
+
+    for (int i = 0; i < WORKLOAD_NUM; i++) {
+        if (selected == NULL || is_selected(selected, workloads[i].name)) {
+            run_workload(&workloads[i]);
+        }
+    }
+    printf("%-10s %8s %12s %9s %9s %9s %9s %9s %9s\n", "workload", "ops", "ops/s", "p50 us", "p90 us", "p99 us", "max us", "reads/op", "writes/op");
+    for (int i = 0; i < result_num; i++) {
+        struct result* res = &results[i];
+        printf("%-10s %8d %12.1f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", res->name, res->ops, res->ops_per_sec,
+            res->p50, res->p90, res->p99, res->max, res->reads, res->writes);
+    }
+    if (verbose) {
+        dump_stats(stdout);
+    }
+    free(latency);
+    return 0;
+}
@@ -0,0 +1,36 @@
+/*
+The block trace of the buffer cache, written by the filesystem with `-o block_trace=FILE` and read by `cachesim`
+The header is followed by a record per access; a record of its own starts the accesses of every mount, so a trace may
+hold several mounts one after the other
+*/
+
+#ifndef BLOCK_TRACE_H
+#define BLOCK_TRACE_H
+
+#include <stdint.h>
+
+#define BLOCK_TRACE_MAGIC 0x43525442u // "BTRC"
+#define BLOCK_TRACE_VERSION 1
+
+struct block_trace_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+enum block_trace_op {
+    BLOCK_TRACE_READ, // `cached_disk_read` and its partial form: a miss fills a cache line
+    BLOCK_TRACE_WRITE, // `cached_disk_write`, its partial form and `cached_disk_write_many`
+    BLOCK_TRACE_PEEK, // a read that leaves the cache as it is on a miss: `cached_disk_peek`, or a spliced read
+    BLOCK_TRACE_MOUNT, // a mount starts with an empty cache, and `block` is its block size in bytes
+};
+
+// In the byte order of the machine that wrote it
+struct block_trace_record {
+    uint64_t time; // ns, on the monotonic clock
+    uint32_t block;
+    uint8_t op; // enum block_trace_op
+    uint8_t metadata; // the block holds metadata: below the data blocks, or a directory or indirect block
+    uint16_t reserved;
+};
+
+#endif
@@ -0,0 +1,561 @@
+/*
+Offline simulator of the buffer cache, on block traces written with `-o block_trace=FILE` or `replay run -B FILE`
+  cachesim [-p policy,...] [-c lines,...] [-S stripes] btrace...
+Every trace is replayed against every policy, at every cache size in lines, and the hit ratio, of metadata and data
+blocks apart too, the blocks read from the device and the blocks written back are reported
+Policies: lru, clock, 2q, arc, and random, the eviction of `evict_cache_line` in fs.c
+The cache is modeled write-back and write-allocate: a written line is dirty, and is written back when it is evicted or
+when its mount ends; as in fs.c, a block lives in stripe `block % stripes`, each with its own lines and policy
+*/
+
+#include "block_trace.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SIZES 32
+
+// The lines of a stripe and the ghosts of the blocks it evicted, in up to four lists:
+// LRU, CLOCK and random keep their lines in T1; 2Q keeps A1in in T1, Am in T2 and A1out in B1; ARC uses them as named
+enum list_id {
+    T1,
+    T2,
+    B1, // ghosts, from here on
+    B2,
+    LIST_NUM,
+};
+
+// Nodes 0 to LIST_NUM - 1 are the heads of the circular lists, least recently used first
+struct node {
+    uint32_t block;
+    int list;
+    int prev, next;
+    int slot; // in `lines`, while resident
+    bool dirty;
+    bool ref; // CLOCK
+};
+
+struct cache {
+    int cap; // lines
+    struct node* nodes;
+    int free_node; // chained through `next`
+    int* table; // node of a block, by open addressing; -1 for none
+    int table_mask;
+    int len[LIST_NUM];
+    int* lines; // the resident nodes, for random eviction
+    int resident;
+    unsigned int seed;
+    double p; // ARC: target length of T1
+    uint64_t accesses, hits, meta_accesses, meta_hits, device_reads, writebacks;
+};
+
+struct policy {
+    const char* name;
+    // Look `block` up; a miss fills a line only if `fill`
+    // Return the node of the block if it is resident afterwards, -1 if not, and whether it was a hit in `hit`
+    int (*access)(struct cache* c, uint32_t block, bool fill, bool* hit);
+};
+
+static int max_int(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+static bool is_ghost(const struct node* n)
+{
+    return n->list >= B1;
+}
+
+static uint32_t hash_block(uint32_t block)
+{
+    return block * 2654435761u;
+}
+
+static int find(struct cache* c, uint32_t block)
+{
+    for (uint32_t i = hash_block(block) & c->table_mask; c->table[i] != -1; i = (i + 1) & c->table_mask) {
+        if (c->nodes[c->table[i]].block == block) {
+            return c->table[i];
+        }
+    }
+    return -1;
+}
+
+static void table_add(struct cache* c, int n)
+{
+    uint32_t i = hash_block(c->nodes[n].block) & c->table_mask;
+    while (c->table[i] != -1) {
+        i = (i + 1) & c->table_mask;
+    }
+    c->table[i] = n;
+}
+
+// Entries after the removed one move back into the hole, so no lookup stops short of them
+static void table_remove(struct cache* c, int n)
+{
+    uint32_t i = hash_block(c->nodes[n].block) & c->table_mask;
+    while (c->table[i] != n) {
+        i = (i + 1) & c->table_mask;
+    }
+    c->table[i] = -1;
+    for (uint32_t j = (i + 1) & c->table_mask; c->table[j] != -1; j = (j + 1) & c->table_mask) {
+        uint32_t home = hash_block(c->nodes[c->table[j]].block) & c->table_mask;
+        // the entry stays if its home lies cyclically in (i, j]
+        if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) {
+            continue;
+        }
+        c->table[i] = c->table[j];
+        c->table[j] = -1;
+        i = j;
+    }
+}
+
+static void list_unlink(struct cache* c, int n)
+{
+    struct node* node = &c->nodes[n];
+    c->nodes[node->prev].next = node->next;
+    c->nodes[node->next].prev = node->prev;
+    c->len[node->list]--;
+}
+
+static void list_push(struct cache* c, int list, int n)
+{
+    struct node* node = &c->nodes[n];
+    node->list = list;
+    node->next = list;
+    node->prev = c->nodes[list].prev;
+    c->nodes[node->prev].next = n;
+    c->nodes[list].prev = n;
+    c->len[list]++;
+}
+
+static void list_move(struct cache* c, int list, int n)
+{
+    list_unlink(c, n);
+    list_push(c, list, n);
+}
+
+static int list_lru(struct cache* c, int list)
+{
+    return c->nodes[list].next;
+}
+
+// A new resident line for `block`, at the most recently used end of `list`
+static int add_line(struct cache* c, uint32_t block, int list)
+{
+    int n = c->free_node;
+    c->free_node = c->nodes[n].next;
+    c->nodes[n] = (struct node) { .block = block, .slot = c->resident };
+    c->lines[c->resident++] = n;
+    table_add(c, n);
+    list_push(c, list, n);
+    return n;
+}
+
+// Evict a resident line, writing it back if dirty, and keep it as a ghost in `ghost_list`, or forget it if -1
+static void evict(struct cache* c, int n, int ghost_list)
+{
+    struct node* node = &c->nodes[n];
+    c->writebacks += node->dirty;
+    node->dirty = false;
+    int last = c->lines[--c->resident];
+    c->lines[node->slot] = last;
+    c->nodes[last].slot = node->slot;
+    list_unlink(c, n);
+    if (ghost_list != -1) {
+        list_push(c, ghost_list, n);
+        return;
+    }
+    table_remove(c, n);
+    node->next = c->free_node;
+    c->free_node = n;
+}
+
+static void forget_ghost(struct cache* c, int n)
+{
+    list_unlink(c, n);
+    table_remove(c, n);
+    c->nodes[n].next = c->free_node;
+    c->free_node = n;
+}
+
+static int lru_access(struct cache* c, uint32_t block, bool fill, bool* hit)
+{
+    int n = find(c, block);
+    if ((*hit = n != -1)) {
+        list_move(c, T1, n);
+        return n;
+    }
+    if (!fill) {
+        return -1;
+    }
+    if (c->resident == c->cap) {
+        evict(c, list_lru(c, T1), -1);
+    }
+    return add_line(c, block, T1);
+}
+
+static int random_access(struct cache* c, uint32_t block, bool fill, bool* hit)
+{
+    int n = find(c, block);
+    if ((*hit = n != -1) || !fill) {
+        return n;
+    }
+    if (c->resident == c->cap) {
+        evict(c, c->lines[rand_r(&c->seed) % c->resident], -1);
+    }
+    return add_line(c, block, T1);
+}
+
+// Second chance: the hand passes over the lines referenced since it last came by, clearing their bits
+static int clock_access(struct cache* c, uint32_t block, bool fill, bool* hit)
+{
+    int n = find(c, block);
+    if ((*hit = n != -1)) {
+        c->nodes[n].ref = true;
+        return n;
+    }
+    if (!fill) {
+        return -1;
+    }
+    if (c->resident == c->cap) {
+        int hand;
+        while (c->nodes[hand = list_lru(c, T1)].ref) {
+            c->nodes[hand].ref = false;
+            list_move(c, T1, hand);
+        }
+        evict(c, hand, -1);
+    }
+    return add_line(c, block, T1);
+}
+
+// 2Q, after Johnson and Shasha: a block enters the FIFO A1in, and only one seen again after it left, while its ghost is
+// still in A1out, joins the LRU Am; A1in keeps a quarter of the lines, A1out remembers half as many blocks as fit
+static void two_q_reclaim(struct cache* c)
+{
+    if (c->resident < c->cap) {
+        return;
+    }
+    if (c->len[T1] > max_int(c->cap / 4, 1) || c->len[T2] == 0) {
+        evict(c, list_lru(c, T1), B1);
+        if (c->len[B1] > max_int(c->cap / 2, 1)) {
+            forget_ghost(c, list_lru(c, B1));
+        }
+    } else {
+        evict(c, list_lru(c, T2), -1);
+    }
+}
+
+static int two_q_access(struct cache* c, uint32_t block, bool fill, bool* hit)
+{
+    int n = find(c, block);
+    *hit = n != -1 && !is_ghost(&c->nodes[n]);
+    if (*hit) {
+        if (c->nodes[n].list == T2) {
+            list_move(c, T2, n);
+        }
+        return n;
+    }
+    if (!fill) {
+        return -1;
+    }
+    int list = T1;
+    if (n != -1) {
+        forget_ghost(c, n);
+        list = T2;
+    }
+    two_q_reclaim(c);
+    return add_line(c, block, list);
+}
+
+// ARC, after Megiddo and Modha: T1 holds the blocks seen once recently, T2 those seen again, and the ghosts in B1 and
+// B2 of the blocks evicted from each move the target length of T1 toward the list that would have kept them
+static void arc_replace(struct cache* c, bool in_b2)
+{
+    if (c->resident < c->cap) {
+        return;
+    }
+    if (c->len[T1] > 0 && (c->len[T1] > c->p || (in_b2 && c->len[T1] == (int)c->p) || c->len[T2] == 0)) {
+        evict(c, list_lru(c, T1), B1);
+    } else {
+        evict(c, list_lru(c, T2), B2);
+    }
+}
+
+static int arc_access(struct cache* c, uint32_t block, bool fill, bool* hit)
+{
+    int n = find(c, block);
+    *hit = n != -1 && !is_ghost(&c->nodes[n]);
+    if (*hit) {
+        list_move(c, T2, n);
+        return n;
+    }
+    if (!fill) {
+        return -1;
+    }
+    if (n != -1 && c->nodes[n].list == B1) {
+        c->p += c->len[B1] >= c->len[B2] ? 1 : (double)c->len[B2] / c->len[B1];
+        c->p = c->p > c->cap ? c->cap : c->p;
+        forget_ghost(c, n);
+        arc_replace(c, false);
+        return add_line(c, block, T2);
+    }
+    if (n != -1) {
+        c->p -= c->len[B2] >= c->len[B1] ? 1 : (double)c->len[B1] / c->len[B2];
+        c->p = c->p < 0 ? 0 : c->p;
+        forget_ghost(c, n);
+        arc_replace(c, true);
+        return add_line(c, block, T2);
+    }
+    int l1 = c->len[T1] + c->len[B1], total = l1 + c->len[T2] + c->len[B2];
+    if (l1 == c->cap) {
+        if (c->len[T1] < c->cap) {
+            forget_ghost(c, list_lru(c, B1));
+            arc_replace(c, false);
+        } else {
+            evict(c, list_lru(c, T1), -1);
+        }
+    } else if (total >= c->cap) {
+        if (total == 2 * c->cap) {
+            forget_ghost(c, list_lru(c, B2));
+        }
+        arc_replace(c, false);
+    }
+    return add_line(c, block, T1);
+}
+
+static const struct policy policies[] = {
+    { "lru", lru_access },
+    { "clock", clock_access },
+    { "2q", two_q_access },
+    { "arc", arc_access },
+    { "random", random_access },
+};
+#define POLICY_NUM (int)(sizeof(policies) / sizeof(policies[0]))
+
+static void init_cache(struct cache* c, int cap, unsigned int seed)
+{
+    // resident lines and as many ghosts, one more while a ghost turns into a line
+    int node_num = LIST_NUM + 2 * cap + 1, table_size = 1;
+    while (table_size < 2 * node_num) {
+        table_size *= 2;
+    }
+    *c = (struct cache) {
+        .cap = cap,
+        .nodes = malloc(sizeof(struct node) * node_num),
+        .free_node = LIST_NUM,
+        .table = malloc(sizeof(int) * table_size),
+        .table_mask = table_size - 1,
+        .lines = malloc(sizeof(int) * cap),
+        .seed = seed,
+    };
+    if (c->nodes == NULL || c->table == NULL || c->lines == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < LIST_NUM; i++) {
+        c->nodes[i] = (struct node) { .list = i, .prev = i, .next = i };
+    }
+    for (int i = LIST_NUM; i < node_num; i++) {
+        c->nodes[i].next = i + 1;
+    }
+    memset(c->table, -1, sizeof(int) * table_size);
+}
+
+// A mount ends: every dirty line is written back, and the next mount starts with an empty cache
+static void reset_cache(struct cache* c)
+{
+    for (int i = 0; i < c->resident; i++) {
+        c->writebacks += c->nodes[c->lines[i]].dirty;
+    }
+    struct cache fresh;
+    init_cache(&fresh, c->cap, c->seed);
+    fresh.accesses = c->accesses;
+    fresh.hits = c->hits;
+    fresh.meta_accesses = c->meta_accesses;
+    fresh.meta_hits = c->meta_hits;
+    fresh.device_reads = c->device_reads;
+    fresh.writebacks = c->writebacks;
+    free(c->nodes);
+    free(c->table);
+    free(c->lines);
+    *c = fresh;
+}
+
+static void access_block(struct cache* c, const struct policy* policy, const struct block_trace_record* rec)
+{
+    bool hit;
+    if (rec->op == BLOCK_TRACE_PEEK) {
+        int n = find(c, rec->block);
+        hit = n != -1 && !is_ghost(&c->nodes[n]);
+    } else {
+        int n = policy->access(c, rec->block, true, &hit);
+        if (rec->op == BLOCK_TRACE_WRITE) {
+            c->nodes[n].dirty = true;
+        }
+    }
+    c->accesses++;
+    c->hits += hit;
+    c->meta_accesses += rec->metadata;
+    c->meta_hits += rec->metadata && hit;
+    // whole blocks are written without being read first
+    c->device_reads += !hit && rec->op != BLOCK_TRACE_WRITE;
+}
+
+struct trace {
+    struct block_trace_record* records;
+    size_t num;
+};
+
+static int load_trace(const char* path, struct trace* trace)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+    struct block_trace_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != BLOCK_TRACE_MAGIC || header.version != BLOCK_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a block trace\n", path);
+        fclose(in);
+        return -1;
+    }
+    size_t cap = 1 << 16;
+    *trace = (struct trace) { .records = malloc(sizeof(struct block_trace_record) * cap) };
+    for (size_t got; trace->records != NULL && (got = fread(trace->records + trace->num, sizeof(struct block_trace_record), cap - trace->num, in)) > 0;) {
+        if ((trace->num += got) == cap) {
+            trace->records = realloc(trace->records, sizeof(struct block_trace_record) * (cap *= 2));
+        }
+    }
+    fclose(in);
+    if (trace->records == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return 0;
+}
+
+static void simulate(const char* path, const struct trace* trace, const bool* selected, const int* sizes, int size_num, int stripes)
+{
+    size_t meta = 0, writes = 0, accesses = 0;
+    int block_size = 0;
+    for (size_t i = 0; i < trace->num; i++) {
+        const struct block_trace_record* rec = &trace->records[i];
+        if (rec->op == BLOCK_TRACE_MOUNT) {
+            block_size = block_size == 0 ? (int)rec->block : block_size;
+            continue;
+        }
+        accesses++;
+        meta += rec->metadata;
+        writes += rec->op == BLOCK_TRACE_WRITE;
+    }
+    printf("%s: %zu accesses, %.1f%% writes, %.1f%% metadata, blocks of %d bytes\n", path, accesses,
+        100.0 * writes / (accesses ? accesses : 1), 100.0 * meta / (accesses ? accesses : 1), block_size);
+    printf("%-8s %7s %8s %8s %8s %10s %10s %12s\n", "policy", "lines", "hit%", "meta%", "data%", "reads", "writebacks", "written KiB");
+
+    for (int p = 0; p < POLICY_NUM; p++) {
+        for (int s = 0; selected[p] && s < size_num; s++) {
+            int stripe_num = stripes < sizes[s] ? stripes : sizes[s];
+            struct cache* caches = malloc(sizeof(struct cache) * stripe_num);
+            for (int i = 0; i < stripe_num; i++) {
+                // the lines are shared out like in fs.c, where every stripe has as many
+                init_cache(&caches[i], sizes[s] / stripe_num, i);
+            }
+            for (size_t i = 0; i < trace->num; i++) {
+                const struct block_trace_record* rec = &trace->records[i];
+                if (rec->op == BLOCK_TRACE_MOUNT) {
+                    for (int j = 0; j < stripe_num; j++) {
+                        reset_cache(&caches[j]);
+                    }
+                    continue;
+                }
+                access_block(&caches[rec->block % stripe_num], &policies[p], rec);
+            }
+            struct cache sum = { 0 };
+            for (int i = 0; i < stripe_num; i++) {
+                reset_cache(&caches[i]);
+                sum.accesses += caches[i].accesses;
+                sum.hits += caches[i].hits;
+                sum.meta_accesses += caches[i].meta_accesses;
+                sum.meta_hits += caches[i].meta_hits;
+                sum.device_reads += caches[i].device_reads;
+                sum.writebacks += caches[i].writebacks;
+                free(caches[i].nodes);
+                free(caches[i].table);
+                free(caches[i].lines);
+            }
+            free(caches);
+            uint64_t data_accesses = sum.accesses - sum.meta_accesses, data_hits = sum.hits - sum.meta_hits;
+            printf("%-8s %7d %8.2f %8.2f %8.2f %10llu %10llu %12llu\n", policies[p].name, stripe_num * (sizes[s] / stripe_num),
+                100.0 * sum.hits / (sum.accesses ? sum.accesses : 1), 100.0 * sum.meta_hits / (sum.meta_accesses ? sum.meta_accesses : 1),
+                100.0 * data_hits / (data_accesses ? data_accesses : 1), (unsigned long long)sum.device_reads,
+                (unsigned long long)sum.writebacks, (unsigned long long)sum.writebacks * block_size / 1024);
+        }
+    }
+    printf("\n");
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-p policy,...] [-c lines,...] [-S stripes] btrace...\n", name);
+    fprintf(stderr, "policies:");
+    for (int i = 0; i < POLICY_NUM; i++) {
+        fprintf(stderr, " %s", policies[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+    bool selected[POLICY_NUM];
+    int sizes[MAX_SIZES] = { 8, 16, 32, 64, 128, 256, 512, 1024 }, size_num = 8, stripes = 8, opt;
+    memset(selected, true, sizeof(selected));
+    while ((opt = getopt(argc, argv, "p:c:S:")) != -1) {
+        switch (opt) {
+        case 'p':
+            memset(selected, false, sizeof(selected));
+            for (char* name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+                int i = 0;
+                while (i < POLICY_NUM && strcmp(policies[i].name, name) != 0) {
+                    i++;
+                }
+                if (i == POLICY_NUM) {
+                    usage(argv[0]);
+                }
+                selected[i] = true;
+            }
+            break;
+        case 'c':
+            size_num = 0;
+            for (char* size = strtok(optarg, ","); size != NULL && size_num < MAX_SIZES; size = strtok(NULL, ",")) {
+                if ((sizes[size_num++] = atoi(size)) <= 0) {
+                    usage(argv[0]);
+                }
+            }
+            break;
+        case 'S':
+            if ((stripes = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+    for (int i = optind; i < argc; i++) {
+        struct trace trace;
+        if (load_trace(argv[i], &trace)) {
+            return 1;
+        }
+        simulate(argv[i], &trace, selected, sizes, size_num, stripes);
+        free(trace.records);
+    }
+    return 0;
+}
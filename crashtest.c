@@ -0,0 +1,181 @@
+/*
+Crash tests: a child process runs a scenario on a device in an image file and exits without unmounting, as in a crash;
+the device is then checked read-only, and mounted again and checked for what the scenario made durable
+  crashtest [-f image] [scenario...]
+Only what reached the image survives the child: its buffer cache, write buffers and running transaction are lost
+*/
+
+#include "fs.h"
+#include "memdisk.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_IO (1024 * 1024)
+
+static char io_buf[MAX_IO], read_buf[MAX_IO];
+
+static void check(const char* what, int ret)
+{
+    if (ret < 0) {
+        fprintf(stderr, "%s failed: %d\n", what, ret);
+        exit(1);
+    }
+}
+
+// The bytes of file `seed` at `offset`, different for every file and every block
+static void fill(char* buf, int size, int seed, int offset)
+{
+    for (int i = 0; i < size; i++) {
+        buf[i] = (char)((offset + i) / 4096 * 31 + seed * 101 + (offset + i) % 251);
+    }
+}
+
+static void write_file(const char* path, int size, int seed, bool sync)
+{
+    struct fuse_file_info fi = { 0 };
+    check("mknod", fs_mknod(path, 0644, 0));
+    check("open", fs_open(path, &fi));
+    for (int offset = 0; offset < size; offset += MAX_IO) {
+        int n = size - offset < MAX_IO ? size - offset : MAX_IO;
+        fill(io_buf, n, seed, offset);
+        check("write", fs_write(path, io_buf, n, offset, &fi));
+    }
+    if (sync) {
+        check("fsync", fs_fsync(path, 0, &fi));
+    }
+}
+
+// Return 0 if the file holds `size` bytes of file `seed`, -1 if it holds anything else
+static int verify_file(const char* path, int size, int seed)
+{
+    struct fuse_file_info fi = { 0 };
+    struct stat st;
+    if (fs_getattr(path, &st) || st.st_size != size || fs_open(path, &fi)) {
+        return -1;
+    }
+    for (int offset = 0; offset < size; offset += MAX_IO) {
+        int n = size - offset < MAX_IO ? size - offset : MAX_IO;
+        fill(io_buf, n, seed, offset);
+        if (fs_read(path, read_buf, n, offset, &fi) != n || memcmp(io_buf, read_buf, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// An fsynced file survives, in a directory made by the same transactions as the format
+static void fsync_run()
+{
+    check("mkdir", fs_mkdir("/x", 0755));
+    write_file("/x/y", 64 * 1024, 1, true);
+}
+static int fsync_check()
+{
+    return verify_file("/x/y", 64 * 1024, 1);
+}
+
+// The blocks of a file removed by a transaction that has not committed are not reused for the data of another file,
+// which would be written in place before the removal is durable
+static void reuse_run()
+{
+    write_file("/a", 2 * 1024 * 1024, 2, true);
+    check("unlink", fs_unlink("/a"));
+    write_file("/b", 4 * 1024 * 1024, 3, false);
+    struct fuse_file_info fi = { 0 };
+    check("open", fs_open("/b", &fi));
+    // written back, without committing the journal
+    for (int offset = 0; offset < 4 * 1024 * 1024; offset += 4096) {
+        fs_read("/b", read_buf, 1, offset, &fi);
+    }
+}
+static int reuse_check()
+{
+    struct stat st;
+    return fs_getattr("/a", &st) == -ENOENT || verify_file("/a", 2 * 1024 * 1024, 2) == 0 ? 0 : -1;
+}
+
+static struct scenario {
+    const char* name;
+    void (*run)();
+    int (*check)();
+} scenarios[] = {
+    { "fsync", fsync_run, fsync_check },
+    { "reuse", reuse_run, reuse_check },
+};
+#define SCENARIO_NUM (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+// Check the device mounted read-only, as `fsck` without `-y` does: it must read as it does once mounted, without a
+// single write, though the journal holds transactions to replay
+static int check_read_only(struct scenario* s)
+{
+    unsigned long writes = memdisk_writes;
+    if (fs_attach_read_only()) {
+        printf("%-8s the device does not mount read-only\n", s->name);
+        return -1;
+    }
+    int ret = s->check();
+    int problems = ret == 0 ? fs_check(1, false, stdout) : 0;
+    fs_detach();
+    if (ret || problems || memdisk_writes != writes) {
+        printf("%-8s %s, read-only\n", s->name, ret ? "lost or wrong data" : problems ? "inconsistent" : "written");
+        return -1;
+    }
+    return 0;
+}
+
+// Run the scenario on a new device in a child that exits without unmounting, then mount the device again and check it
+static int run_scenario(struct scenario* s)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        check("format", fs_start(true));
+        s->run();
+        _exit(0);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%-8s the scenario failed\n", s->name);
+        return -1;
+    }
+    if (check_read_only(s)) {
+        return -1;
+    }
+    if (fs_attach()) {
+        printf("%-8s the device does not mount\n", s->name);
+        return -1;
+    }
+    int ret = s->check();
+    int problems = ret == 0 ? fs_check(1, false, stdout) : 0;
+    fs_destroy(NULL);
+    printf("%-8s %s\n", s->name, ret ? "lost or wrong data" : problems ? "inconsistent" : "ok");
+    return ret || problems ? -1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    memdisk_file = "crashtest.img";
+    int opt;
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt != 'f') {
+            fprintf(stderr, "usage: %s [-f image] [scenario...]\n", argv[0]);
+            return 2;
+        }
+        memdisk_file = optarg;
+    }
+    int failed = 0;
+    for (int i = 0; i < SCENARIO_NUM; i++) {
+        bool selected = optind == argc;
+        for (int j = optind; j < argc; j++) {
+            selected |= strcmp(argv[j], scenarios[i].name) == 0;
+        }
+        if (selected) {
+            failed |= run_scenario(&scenarios[i]) != 0;
+        }
+    }
+    unlink(memdisk_file);
+    return failed;
+}
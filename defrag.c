@@ -0,0 +1,38 @@
+/*
+Defragment directories of the mount, with the FS_IOC_DEFRAG ioctl
+  defrag DIR...
+The files below each DIR are moved into runs of consecutive blocks, and the directories have their entries packed
+*/
+
+#include "fs_ioctl.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static int defrag_dir(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+    if (ioctl(fd, FS_IOC_DEFRAG) == -1) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    return close(fd) == -1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s DIR...\n", argv[0]);
+        return 2;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        ret |= defrag_dir(argv[i]);
+    }
+    return ret;
+}
@@ -4,12 +4,14 @@ Filesystem Lab disigned and implemented by Liang Junkai,RUC
 
 #include "disk.h"
 #include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 char disk_prefix[256];
 
-int disk_init()
+static int read_disk_prefix()
 {
     FILE* fp = fopen("fuse~", "r");
     if (fp == NULL)
@@ -17,6 +19,13 @@ int disk_init()
     fscanf(fp, "%s", disk_prefix);
     fclose(fp);
     strcpy(disk_prefix + strlen(disk_prefix) - 8, "vdisk/block");
+    return 0;
+}
+
+int disk_init()
+{
+    if (read_disk_prefix())
+        return 1;
     char name[256];
     char buffer[BLOCK_SIZE];
     memset(buffer, 0, sizeof(buffer));
@@ -32,6 +41,18 @@ int disk_init()
     return 0;
 }
 
+// Use the blocks left by an earlier run, without clearing them
+// Return 1 if there is no complete device yet
+int disk_attach()
+{
+    if (read_disk_prefix())
+        return 1;
+    char name[256];
+    strcpy(name, disk_prefix);
+    sprintf(name + strlen(name), "%d", BLOCK_NUM - 1);
+    return access(name, R_OK | W_OK) ? 1 : 0;
+}
+
 int disk_read(int block_id, void* buffer)
 {
     if (block_id >= BLOCK_NUM || block_id < 0)
@@ -56,4 +77,35 @@ int disk_write(int block_id, void* buffer)
     fwrite(buffer, BLOCK_SIZE, 1, disk);
     fclose(disk);
     return 0;
+}
+
+int disk_open(int block_id, int flags)
+{
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return -1;
+    char name[256];
+    strcpy(name, disk_prefix);
+    sprintf(name + strlen(name), "%d", block_id);
+    return open(name, flags);
+}
+
+// One block after the other, as every block is a file of its own
+int disk_read_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    for (int i = 0; i < count; i++)
+        if (disk_read(block_ids[i], buffers[i]))
+            return 1;
+    return 0;
+}
+
+int disk_write_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    for (int i = 0; i < count; i++)
+        if (disk_write(block_ids[i], buffers[i]))
+            return 1;
+    return 0;
+}
+
+void disk_set_metadata(int block_id, int metadata)
+{
 }
\ No newline at end of file
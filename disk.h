@@ -7,5 +7,13 @@ Filesystem Lab disigned and implemented by Liang Junkai,RUC
 #define DISK_SIZE (BLOCK_SIZE * BLOCK_NUM)
 
 int disk_init();
+int disk_attach();
 int disk_read(int block_id, void* buffer);
-int disk_write(int block_id, void* buffer);
\ No newline at end of file
+int disk_write(int block_id, void* buffer);
+int disk_open(int block_id, int flags);
+// Read or write `count` blocks, the i-th at `block_ids[i]` from or to `buffers[i]`; a device may serve them in parallel
+// Return 0 if all of them succeed
+int disk_read_blocks(const int* block_ids, void* const* buffers, int count);
+int disk_write_blocks(const int* block_ids, void* const* buffers, int count);
+// Tell the device whether a block holds metadata, which a tiered device keeps on its fast tier; others ignore it
+void disk_set_metadata(int block_id, int metadata);
\ No newline at end of file
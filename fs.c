@@ -2,14 +2,24 @@
 Filesystem Lab disigned and implemented by Liang Junkai,RUC
 */
 
+#include "block_trace.h"
 #include "disk.h"
+#include "fs.h"
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
 #include <fuse/fuse.h>
+#include <fuse/fuse_lowlevel.h>
+#include <fuse/fuse_opt.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,17 +40,7 @@ Filesystem Lab disigned and implemented by Liang Junkai,RUC
 
 #define ceil_div(a, b) (((a) + (b) - 1) / (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
-
-struct superblock {
-    uint32_t block_size;
-    uint32_t inode_size;
-    uint32_t inode_num;
-    uint32_t block_num;
-    uint32_t inode_bitmap_block;
-    uint32_t block_bitmap_block;
-    uint32_t inode_block;
-    uint32_t data_block;
-};
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 #define DIRECT_BLOCK_NUM 12
 #define SINGLE_INDIRECT_BLOCK_NUM 2
@@ -52,1083 +52,6606 @@ struct inode {
     uint32_t mtime;
     uint32_t ctime;
     uint32_t block_point[DIRECT_BLOCK_NUM];
-    uint32_t block_point_indirect[SINGLE_INDIRECT_BLOCK_NUM];
+    uint32_t block_point_indirect[SINGLE_INDIRECT_BLOCK_NUM]; // data block numbers, like `block_point`
+    uint32_t dir_free_block; // directories only: every block below this one is known to be full
 };
 
-#define INDIRECT_POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t)) // 1024
+// The geometry is chosen at mkfs, with `-o block_size=`, `-o inodes=` and `-o device_size=`, recorded in the superblock
+// and read back from it at every mount; the layout macros below all read it, their comments give the default values
+// A filesystem block spans `block_size / BLOCK_SIZE` consecutive blocks of the device, see `device_read`
+#define MIN_BLOCK_SIZE BLOCK_SIZE // 4096
+#define MAX_BLOCK_SIZE (64 * 1024)
+#define MAX_INODE_TABLE_SIZE (1 << 14) // blocks, as many as the superblock tracks in `inode_table_init`
+struct geometry {
+    int block_size;
+    int block_num;
+    int inode_num; // a multiple of the inodes per block
+    int block_bitmap_block;
+    int inode_block;
+    int journal_block;
+    int journal_block_num;
+    int refcount_block;
+    int data_block;
+} geo;
+
+#define FS_BLOCK_SIZE (geo.block_size) // 4096
+#define FS_BLOCK_NUM (geo.block_num) // 65536
+#define DEVICE_BLOCKS_PER_BLOCK (FS_BLOCK_SIZE / BLOCK_SIZE)
+#define MAX_DEVICE_BLOCKS_PER_BLOCK (MAX_BLOCK_SIZE / BLOCK_SIZE)
+
+#define INDIRECT_POINTERS_PER_BLOCK (FS_BLOCK_SIZE / (int)sizeof(uint32_t)) // 1024
 
 #define INODE_SIZE 128
-#define INODE_NUM 32768
-#define INODE_TABLE_SIZE (INODE_NUM * INODE_SIZE / BLOCK_SIZE) // 1024
-#define DATA_BITMAP_BLOCK_NUM 16
+#define INODE_NUM (geo.inode_num) // 32768
+#define INODE_TABLE_SIZE (INODE_NUM / (FS_BLOCK_SIZE / INODE_SIZE)) // 1024
 
 #define SUPERBLOCK_BLOCK 0
 #define BITMAP_BLOCK_INODE 1
-#define BITMAP_BLOCK_DATA 2
-#define INODE_TABLE_START (BITMAP_BLOCK_DATA + DATA_BITMAP_BLOCK_NUM) // 18
-#define DATA_BLOCK_START (INODE_TABLE_START + INODE_TABLE_SIZE) // 1042
-#define DATA_BLOCK_SIZE (BLOCK_NUM - DATA_BLOCK_START) // 64494
+#define BITMAP_BLOCK_DATA (geo.block_bitmap_block) // 2
+#define DATA_BITMAP_BLOCK_NUM (INODE_TABLE_START - BITMAP_BLOCK_DATA) // 2
+#define INODE_TABLE_START (geo.inode_block) // 4
+#define JOURNAL_START (geo.journal_block) // 1028
+#define JOURNAL_BLOCK_NUM (geo.journal_block_num) // 448
+#define REFCOUNT_START (geo.refcount_block) // 1476
+#define REFCOUNT_BLOCK_NUM (DATA_BLOCK_START - REFCOUNT_START) // 32
+#define DATA_BLOCK_START (geo.data_block) // 1508
+#define DATA_BLOCK_SIZE (FS_BLOCK_NUM - DATA_BLOCK_START) // 64028
+#define REFCOUNT_SIZE 2 // bytes of the reference count of a data block, see `block_refcount`
+#define REFCOUNTS_PER_BLOCK (FS_BLOCK_SIZE / REFCOUNT_SIZE)
+
+// The defaults, used by mkfs unless options say otherwise
+#define DEFAULT_BLOCK_SIZE MIN_BLOCK_SIZE
+#define DEFAULT_INODE_NUM 32768
+#define DEFAULT_DEVICE_SIZE DISK_SIZE
+#define JOURNAL_SIZE (448 * 4096) // bytes, but never fewer than JOURNAL_MIN_BLOCK_NUM blocks
+#define JOURNAL_MIN_BLOCK_NUM 256 // so a transaction has room for a few operations at once, see `journal_start`
+
+struct superblock {
+    uint32_t block_size;
+    uint32_t inode_size;
+    uint32_t inode_num;
+    uint32_t block_num;
+    uint32_t inode_bitmap_block;
+    uint32_t block_bitmap_block;
+    uint32_t inode_block;
+    uint32_t data_block;
+    uint32_t journal_block;
+    uint32_t journal_block_num;
+    uint32_t refcount_block;
+    uint32_t magic;
+    uint32_t state; // whether the filesystem was unmounted cleanly, so the free counts below can be trusted
+    uint32_t free_block_num;
+    uint32_t free_inode_num;
+    uint8_t inode_table_init[MAX_INODE_TABLE_SIZE / 8]; // inode-table blocks that have been zeroed, the others hold garbage
+};
+#define FS_MAGIC 0x31534653
+enum fs_state {
+    FS_MOUNTED = 1,
+    FS_CLEAN,
+};
 
 #define MIN_AVAILABLE_SIZE (250 * 1024 * 1024)
 #define MIN_FILE_NUM 32768
-#define MAX_FILE_SIZE 8 * 1024 * 1024
+#define MIN_FILE_SIZE_LIMIT (8 * 1024 * 1024) // the largest file must be at least this large
+
+#define MAX_IO_SIZE (128 * 1024) // largest read or write request negotiated with the kernel
+#define READ_BUF_MAX (MAX_IO_SIZE / MIN_BLOCK_SIZE + 1) // buffers describing a read, one per block it spans
 
-#define MAX_FILENAME_LEN 25
-#define DIR_ENTRY_SIZE 32
-#define DIR_ENTRY_NUM (BLOCK_SIZE / DIR_ENTRY_SIZE) // 128
+#define MAX_FILENAME_LEN 255
 
 #define ROOT_INODE 0
 
 #define DATA_BLOCK_PER_INODE (DIRECT_BLOCK_NUM + SINGLE_INDIRECT_BLOCK_NUM * INDIRECT_POINTERS_PER_BLOCK) // 2060
-#define DIR_ENTRY_PER_INODE (DATA_BLOCK_PER_INODE * DIR_ENTRY_NUM) // 263680
+#define MAX_FILE_SIZE min((int64_t)DATA_BLOCK_PER_INODE * FS_BLOCK_SIZE, (int64_t)INT32_MAX) // as sizes are 32-bit
+
+// A directory block is tiled by variable-length records: an 8-byte header followed by the name, padded to 4 bytes
+// Only `name_len` bytes of the name are stored on disk; the name is NUL terminated only in copies made by `dir_rec_copy`
 struct dir_entry {
-    char name[MAX_FILENAME_LEN];
-    uint32_t inode_pos;
+    uint32_t inode_pos; // 0 for an unused record
+    uint16_t rec_len; // distance to the next record, including any slack after this one, see `rec_len_of`
+    uint8_t name_len;
+    uint8_t type; // file type as a `DT_*` value, so listings need not read the inode
+    char name[MAX_FILENAME_LEN + 1];
+};
+
+#define DIR_REC_HEADER_SIZE offsetof(struct dir_entry, name) // 8
+#define DIR_REC_ALIGN 4
+#define DIR_REC_LEN(name_len) (ceil_div(DIR_REC_HEADER_SIZE + (name_len), DIR_REC_ALIGN) * DIR_REC_ALIGN)
+#define DIR_ENTRY_NUM (FS_BLOCK_SIZE / DIR_REC_LEN(1)) // 341, at most this many records fit in a block
+
+// Runtime options, given as `-o name` on the command line
+struct options {
+    int readdir_stat; // return the full stat of every entry in `readdir`
+    int lowlevel; // serve the low-level (inode number) API instead of the path-based one
+    int trace; // start with tracing on
+    int format; // format the device even if it holds a filesystem
+    int compress; // compress file data as it is written, see `compress_cluster`
+    int tailpack; // pack the last partial blocks of small files together as they are written, see `pack_tail`
+    int kcache; // let the kernel cache entries, attributes and file pages, see `open_keep_cache`
+    int kcache_timeout; // seconds the kernel trusts the entries and attributes it caches
+    int defrag; // seconds between two background passes of the defragmenter, none by default, see `defrag_tree`
+    int fsck; // check the filesystem and repair it before mounting, see `fs_check`
+    int block_size; // geometry of a new filesystem, see `set_geometry`; one already on the device keeps its own
+    int inode_num;
+    long device_size; // bytes, at most DISK_SIZE
+    char* stats_file; // where SIGUSR1 writes the statistics, `/tmp/fs-stats.<pid>` by default
+    char* op_log; // where every operation is logged for `replay`, none by default
+    char* block_trace; // where every access to the buffer cache is logged for `cachesim`, none by default
+} options = {
+    .block_size = DEFAULT_BLOCK_SIZE,
+    .inode_num = DEFAULT_INODE_NUM,
+    .device_size = DEFAULT_DEVICE_SIZE,
+    .kcache_timeout = 60,
+};
+
+#define FS_OPT(t, p) { t, offsetof(struct options, p), 1 }
+[[maybe_unused]] static const struct fuse_opt option_spec[] = { // unused by the library build
+    FS_OPT("readdir_stat", readdir_stat),
+    FS_OPT("lowlevel", lowlevel),
+    FS_OPT("trace", trace),
+    FS_OPT("format", format),
+    FS_OPT("compress", compress),
+    FS_OPT("tailpack", tailpack),
+    FS_OPT("kcache", kcache),
+    FS_OPT("fsck", fsck),
+    { "stats_file=%s", offsetof(struct options, stats_file), 0 },
+    { "op_log=%s", offsetof(struct options, op_log), 0 },
+    { "block_trace=%s", offsetof(struct options, block_trace), 0 },
+    { "block_size=%d", offsetof(struct options, block_size), 0 },
+    { "inodes=%d", offsetof(struct options, inode_num), 0 },
+    { "device_size=%ld", offsetof(struct options, device_size), 0 },
+    { "kcache_timeout=%d", offsetof(struct options, kcache_timeout), 0 },
+    { "defrag=%d", offsetof(struct options, defrag), 0 },
+    FUSE_OPT_END
 };
 
 int fs_mkdir(const char* path, mode_t mode);
+bool journal_read(int block_pos, char* buf);
+int write_superblock(enum fs_state state);
+int add_dir_entry_locked(int parent_inode, const struct dir_entry* entry);
+int resolve_parent(const char* path, struct dir_entry* entry);
+void defrag_stop();
+
+// Tracing and latency statistics, in place of logging every call to stdout
+// Every FUSE operation is timed into a latency histogram of its own; with tracing on, it is also recorded in a ring buffer
+// SIGUSR1 writes both to the stats file and SIGUSR2 turns tracing on or off, while the filesystem stays mounted
+// Building with -DNTRACE compiles the ring buffer out, the histograms stay
+enum fs_op {
+    OP_GETATTR,
+    OP_SETATTR,
+    OP_LOOKUP,
+    OP_READDIR,
+    OP_READ,
+    OP_WRITE,
+    OP_MKNOD,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_TRUNCATE,
+    OP_UTIME,
+    OP_STATFS,
+    OP_OPEN,
+    OP_RELEASE,
+    OP_OPENDIR,
+    OP_RELEASEDIR,
+    OP_FSYNC,
+    OP_IOCTL,
+    OP_RMTREE,
+    OP_DEFRAG,
+    OP_NUM
+};
+static const char* op_names[OP_NUM] = {
+    "getattr", "setattr", "lookup", "readdir", "read", "write", "mknod", "mkdir", "unlink", "rmdir",
+    "rename", "truncate", "utime", "statfs", "open", "release", "opendir", "releasedir", "fsync", "ioctl", "rmtree",
+    "defrag"
+};
 
-// Bit operations for the bitmap
-void set_bit(char* buf, int pos)
-{
-    buf[pos / 8] |= 1 << (pos % 8);
-}
-void clear_bit(char* buf, int pos)
+// Latencies in nanoseconds are bucketed by their highest bit and the two bits below it, so a bucket is at most 25% wide
+#define HIST_SUB_BITS 2
+#define HIST_BUCKET_NUM (64 << HIST_SUB_BITS)
+struct op_stats {
+    atomic_ulong count;
+    atomic_ulong max;
+    atomic_ulong bucket[HIST_BUCKET_NUM];
+} op_stats[OP_NUM];
+
+int hist_bucket(uint64_t ns)
 {
-    buf[pos / 8] &= ~(1 << (pos % 8));
+    if (ns < (1 << HIST_SUB_BITS)) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS | (ns >> (msb - HIST_SUB_BITS) & ((1 << HIST_SUB_BITS) - 1));
 }
-bool get_bit(char* buf, int pos)
+// The largest latency that falls into a bucket
+uint64_t hist_bucket_max(int bucket)
 {
-    return (buf[pos / 8] >> (pos % 8)) & 1;
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1, sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    return ((uint64_t)((1 << HIST_SUB_BITS) + sub + 1) << shift) - 1;
 }
-int find_empty_bit(char* buf, int size)
+
+// The latency below which a fraction `p` of the operations completed, rounded up to its bucket
+uint64_t op_percentile(struct op_stats* stats, double p)
 {
-    for (int i = 0; i < size; i++) {
-        if (buf[i / 8] & (1 << (i % 8))) {
-            continue;
+    uint64_t count = stats->count, seen = 0;
+    for (int b = 0; b < HIST_BUCKET_NUM; b++) {
+        seen += stats->bucket[b];
+        if (seen > 0 && seen >= p * count) {
+            return min(hist_bucket_max(b), (uint64_t)stats->max);
         }
-        return i;
     }
-    return -1;
+    return stats->max;
 }
 
-#define CACHE_LINE_NUM 8
-struct cache_line {
-    int block_pos;
-    char buf[BLOCK_SIZE];
-} cache[CACHE_LINE_NUM];
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifndef NTRACE
+// A slot is claimed by bumping the head, and published by storing its sequence number last,
+// so writers never wait for each other and a dump skips the slots being written
+#define TRACE_RECORD_NUM 16384
+struct trace_record {
+    atomic_ulong seq; // the index of the record in the trace plus one, or 0 while it is written
+    uint64_t start; // ns
+    uint64_t latency; // ns
+    int op;
+    int inode; // -1 if the operation is addressed by path
+    char name[48]; // path or entry name, truncated
+};
+struct trace_record trace_ring[TRACE_RECORD_NUM];
+atomic_ulong trace_head;
+atomic_bool trace_enabled;
 
-void init_cache()
+void trace_op(int op, int inode, const char* name, uint64_t start, uint64_t latency)
 {
-    for (int i = 0; i < CACHE_LINE_NUM; i++) {
-        cache[i].block_pos = -1;
-    }
+    unsigned long idx = atomic_fetch_add(&trace_head, 1);
+    struct trace_record* rec = &trace_ring[idx % TRACE_RECORD_NUM];
+    atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    rec->start = start;
+    rec->latency = latency;
+    rec->op = op;
+    rec->inode = inode;
+    snprintf(rec->name, sizeof(rec->name), "%s", name == NULL ? "" : name);
+    atomic_store_explicit(&rec->seq, idx + 1, memory_order_release);
 }
-int evict_cache_line()
+
+// Write the records still in the ring, oldest first
+void dump_trace(FILE* out)
 {
-    // choose the minimum block position to evict
-    int idx = rand() % CACHE_LINE_NUM;
-    int block_pos = cache[idx].block_pos;
-    // write back the cache line
-    if (block_pos != -1) {
-        if (disk_write(block_pos, cache[idx].buf)) {
-            return -1;
+    unsigned long head = trace_head;
+    fprintf(out, "trace %s, %lu records\n", trace_enabled ? "on" : "off", min(head, (unsigned long)TRACE_RECORD_NUM));
+    for (unsigned long idx = head > TRACE_RECORD_NUM ? head - TRACE_RECORD_NUM : 0; idx < head; idx++) {
+        struct trace_record* rec = &trace_ring[idx % TRACE_RECORD_NUM];
+        struct trace_record copy;
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) != idx + 1) {
+            continue;
+        }
+        memcpy((char*)&copy + sizeof(copy.seq), (char*)rec + sizeof(rec->seq), sizeof(copy) - sizeof(copy.seq));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&rec->seq, memory_order_relaxed) != idx + 1) {
+            continue; // overwritten while being copied
         }
+        fprintf(out, "%llu.%09llu %-10s %6d %10llu ns %s\n", (unsigned long long)(copy.start / 1000000000), (unsigned long long)(copy.start % 1000000000),
+            op_names[copy.op], copy.inode, (unsigned long long)copy.latency, copy.name);
     }
-    return idx;
 }
+#endif
 
-int cached_disk_read(int block_pos, char* buf)
+// Time an operation until the end of the enclosing scope, whichever way it returns
+struct op_scope {
+    enum fs_op op;
+    int inode;
+    const char* name;
+    uint64_t start;
+};
+void op_end(struct op_scope* scope)
 {
-#pragma unroll
-    for (int i = 0; i < CACHE_LINE_NUM; i++) {
-        if (cache[i].block_pos == block_pos) {
-            memcpy(buf, cache[i].buf, BLOCK_SIZE);
-            return 0;
-        }
+    uint64_t latency = now_ns() - scope->start;
+    struct op_stats* stats = &op_stats[scope->op];
+    stats->count++;
+    stats->bucket[hist_bucket(latency)]++;
+    unsigned long max = stats->max;
+    while (latency > max && !atomic_compare_exchange_weak(&stats->max, &max, latency)) {
     }
-
-    if (disk_read(block_pos, buf)) {
-        return -1;
+#ifndef NTRACE
+    if (trace_enabled) {
+        trace_op(scope->op, scope->inode, scope->name, scope->start, latency);
     }
-
-    int min_idx = evict_cache_line();
-    cache[min_idx].block_pos = block_pos;
-    memcpy(cache[min_idx].buf, buf, BLOCK_SIZE);
-    return 0;
+#endif
 }
+#define OP_SCOPE(op, name, inode) struct op_scope op_scope __attribute__((cleanup(op_end))) = { op, inode, name, now_ns() }
 
-int cached_disk_write(int block_pos, char* buf)
+void dump_stats(FILE* out)
 {
-#pragma unroll
-    for (int i = 0; i < CACHE_LINE_NUM; i++) {
-        if (cache[i].block_pos == block_pos) {
-            memcpy(cache[i].buf, buf, BLOCK_SIZE);
-            return 0;
+    fprintf(out, "%-10s %10s %12s %12s %12s\n", "op", "count", "p50 ns", "p99 ns", "max ns");
+    for (int op = 0; op < OP_NUM; op++) {
+        struct op_stats* stats = &op_stats[op];
+        if (stats->count == 0) {
+            continue;
         }
+        fprintf(out, "%-10s %10lu %12llu %12llu %12lu\n", op_names[op], (unsigned long)stats->count,
+            (unsigned long long)op_percentile(stats, 0.5), (unsigned long long)op_percentile(stats, 0.99), (unsigned long)stats->max);
     }
+#ifndef NTRACE
+    dump_trace(out);
+#endif
+}
 
-    if (disk_write(block_pos, buf)) {
-        return -1;
-    }
+// Operation log of the path-based front end, for the `replay` tool to run the workload of a live mount again
+// A line per operation: the time in microseconds, the operation, its paths and its numeric arguments
+// Bytes of a path that would split the line are written as %xx
+FILE* op_log;
+pthread_mutex_t op_log_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    int min_idx = evict_cache_line();
-    cache[min_idx].block_pos = block_pos;
-    memcpy(cache[min_idx].buf, buf, BLOCK_SIZE);
-    return 0;
+void log_path(const char* path)
+{
+    fputc(' ', op_log);
+    for (const char* c = path; *c != '\0'; c++) {
+        if ((unsigned char)*c <= ' ' || *c == '%' || *c == 0x7f) {
+            fprintf(op_log, "%%%02x", (unsigned char)*c);
+        } else {
+            fputc(*c, op_log);
+        }
+    }
 }
 
-int bitmap_used[3];
-int alloc_block(int bitmap_block, int bitmap_size)
+// `path2` may be NULL, and only the first `arg_num` of `a` and `b` are written
+void log_op(enum fs_op op, const char* path, const char* path2, int arg_num, long long a, long long b)
 {
-    // read the block bitmap
-    char block_bitmap[BLOCK_SIZE];
-    if (cached_disk_read(bitmap_block, block_bitmap)) {
-        return -1;
+    if (op_log == NULL) {
+        return;
     }
-
-    // find an empty block
-    int block_pos = find_empty_bit(block_bitmap, bitmap_size);
-    if (block_pos == -1) {
-        return -1;
+    pthread_mutex_lock(&op_log_lock);
+    fprintf(op_log, "%llu %s", (unsigned long long)(now_ns() / 1000), op_names[op]);
+    log_path(path);
+    if (path2 != NULL) {
+        log_path(path2);
     }
-
-    // set the block bitmap
-    set_bit(block_bitmap, block_pos);
-    if (cached_disk_write(bitmap_block, block_bitmap)) {
-        return -1;
+    if (arg_num > 0) {
+        fprintf(op_log, " %lld", a);
     }
-
-    bitmap_used[bitmap_block]++;
-    return block_pos;
+    if (arg_num > 1) {
+        fprintf(op_log, " %lld", b);
+    }
+    fputc('\n', op_log);
+    pthread_mutex_unlock(&op_log_lock);
 }
-int clear_block(int bitmap_block, int block_pos)
+
+void flush_op_log()
 {
-    // read the block bitmap
-    char block_bitmap[BLOCK_SIZE];
-    if (cached_disk_read(bitmap_block, block_bitmap)) {
-        return -1;
+    if (op_log != NULL) {
+        pthread_mutex_lock(&op_log_lock);
+        fflush(op_log);
+        pthread_mutex_unlock(&op_log_lock);
     }
+}
 
-    // clear the block bitmap
-    clear_bit(block_bitmap, block_pos);
-    if (cached_disk_write(bitmap_block, block_bitmap)) {
-        return -1;
-    }
+// Block trace of the buffer cache, for `cachesim` to replay under other eviction policies and cache sizes, see
+// block_trace.h; every mount starts with a header, then a record per access, buffered and written in batches
+// Directory and indirect blocks count as metadata once the journal takes them up in this mount, see `device_set_metadata`
+#define BLOCK_TRACE_BUFFER 4096 // records
+FILE* block_trace;
+pthread_mutex_t block_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+struct block_trace_record block_trace_buf[BLOCK_TRACE_BUFFER];
+int block_trace_num;
+_Atomic(uint8_t)* block_trace_metadata; // a bit per block of the device, while tracing
+
+// The caller must hold `block_trace_lock`
+void write_block_trace()
+{
+    fwrite(block_trace_buf, sizeof(block_trace_buf[0]), block_trace_num, block_trace);
+    block_trace_num = 0;
+}
 
-    bitmap_used[bitmap_block]--;
-    return 0;
+void flush_block_trace()
+{
+    if (block_trace != NULL) {
+        pthread_mutex_lock(&block_trace_lock);
+        write_block_trace();
+        fflush(block_trace);
+        pthread_mutex_unlock(&block_trace_lock);
+    }
 }
 
-// Get the real block position (block pointer) corresponding to the block_id of the inode
-int get_block_pos(struct inode* inode, int id, int* block_pos)
+// Start the records of a mount, once its geometry is known
+int start_block_trace()
 {
-    if (id < DIRECT_BLOCK_NUM) {
-        *block_pos = inode->block_point[id];
+    if (options.block_trace == NULL) {
         return 0;
-    } else {
-        int indirect_index = (id - DIRECT_BLOCK_NUM) / INDIRECT_POINTERS_PER_BLOCK, indirect_offset = (id - DIRECT_BLOCK_NUM) % INDIRECT_POINTERS_PER_BLOCK;
-
-        if (indirect_index >= SINGLE_INDIRECT_BLOCK_NUM) {
-            return -1; // Out of bounds
-        }
-
-        if (inode->block_point_indirect[indirect_index] == -1) {
-            *block_pos = -1;
-            return 0;
-        }
-
-        uint32_t indirect_buf[INDIRECT_POINTERS_PER_BLOCK];
-        if (cached_disk_read(inode->block_point_indirect[indirect_index], (char*)indirect_buf)) {
+    }
+    if (block_trace == NULL) {
+        struct block_trace_header header = { .magic = BLOCK_TRACE_MAGIC, .version = BLOCK_TRACE_VERSION };
+        if ((block_trace = fopen(options.block_trace, "w")) == NULL || fwrite(&header, sizeof(header), 1, block_trace) != 1) {
             return -1;
         }
-
-        *block_pos = indirect_buf[indirect_offset];
-        return 0;
     }
+    free(block_trace_metadata);
+    if ((block_trace_metadata = calloc(ceil_div(FS_BLOCK_NUM, 8), 1)) == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&block_trace_lock);
+    block_trace_buf[block_trace_num++] = (struct block_trace_record) {
+        .time = now_ns(),
+        .block = FS_BLOCK_SIZE,
+        .op = BLOCK_TRACE_MOUNT,
+    };
+    if (block_trace_num == BLOCK_TRACE_BUFFER) {
+        write_block_trace();
+    }
+    pthread_mutex_unlock(&block_trace_lock);
+    return 0;
 }
 
-// Set the real block position (block pointer) corresponding to the block_id of the inode
-int set_block_pos(struct inode* inode, int id, int block_pos)
+void trace_block(int block_pos, enum block_trace_op op)
 {
-    if (id < DIRECT_BLOCK_NUM) {
-        inode->block_point[id] = block_pos;
-        return 0;
-    } else {
-        int indirect_index = (id - DIRECT_BLOCK_NUM) / INDIRECT_POINTERS_PER_BLOCK, indirect_offset = (id - DIRECT_BLOCK_NUM) % INDIRECT_POINTERS_PER_BLOCK;
-
-        if (indirect_index >= SINGLE_INDIRECT_BLOCK_NUM) {
-            return -1; // Out of bounds
-        }
+    if (block_trace == NULL) {
+        return;
+    }
+    bool metadata = block_pos < DATA_BLOCK_START || (block_trace_metadata[block_pos / 8] >> (block_pos % 8) & 1);
+    pthread_mutex_lock(&block_trace_lock);
+    block_trace_buf[block_trace_num++] = (struct block_trace_record) {
+        .time = now_ns(),
+        .block = block_pos,
+        .op = op,
+        .metadata = metadata,
+    };
+    if (block_trace_num == BLOCK_TRACE_BUFFER) {
+        write_block_trace();
+    }
+    pthread_mutex_unlock(&block_trace_lock);
+}
 
-        if (inode->block_point_indirect[indirect_index] == -1) {
-            if (block_pos == -1) {
-                return 0; // Nothing to do, already -1
-            }
-            int indirect_block_pos = alloc_block(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE);
-            if (indirect_block_pos == -1) {
-                return -1;
-            }
-            inode->block_point_indirect[indirect_index] = indirect_block_pos;
-            // Initialize the indirect block
-            uint32_t zero_buf[INDIRECT_POINTERS_PER_BLOCK];
-            memset(zero_buf, -1, sizeof(zero_buf));
-            if (cached_disk_write(indirect_block_pos, (char*)zero_buf)) {
-                return -1;
-            }
+// Serve SIGUSR1 and SIGUSR2, which every other thread blocks
+void* stats_signal_thread([[maybe_unused]] void* arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    for (;;) {
+        int sig;
+        if (sigwait(&set, &sig)) {
+            continue;
         }
-
-        uint32_t indirect_buf[INDIRECT_POINTERS_PER_BLOCK];
-        if (cached_disk_read(inode->block_point_indirect[indirect_index], (char*)indirect_buf)) {
-            return -1;
+        if (sig == SIGUSR2) {
+#ifndef NTRACE
+            trace_enabled = !trace_enabled;
+#endif
+            continue;
         }
-
-        indirect_buf[indirect_offset] = block_pos;
-        if (cached_disk_write(inode->block_point_indirect[indirect_index], (char*)indirect_buf)) {
-            return -1;
+        FILE* out = fopen(options.stats_file, "w");
+        if (out != NULL) {
+            dump_stats(out);
+            fclose(out);
         }
-
-        return 0;
+        flush_op_log();
+        flush_block_trace();
     }
+    return NULL;
 }
 
-// Read and write the inode
-int inode_read(int inode_pos, struct inode* inode)
+// Called before any other thread is created, so they all inherit the blocked signals
+void block_stats_signals()
 {
-    int inode_block = inode_pos * INODE_SIZE / BLOCK_SIZE, inode_offset = inode_pos * INODE_SIZE % BLOCK_SIZE;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
 
-    char buf[BLOCK_SIZE];
-    if (cached_disk_read(INODE_TABLE_START + inode_block, buf)) {
-        return -1;
+// Called once the filesystem is mounted, since a daemonizing `fuse_main` loses the threads created before it forks
+void start_stats_thread()
+{
+    if (options.stats_file == NULL) {
+        static char default_stats_file[64];
+        sprintf(default_stats_file, "/tmp/fs-stats.%d", getpid());
+        options.stats_file = default_stats_file;
+    }
+#ifndef NTRACE
+    trace_enabled = options.trace;
+#endif
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_signal_thread, NULL) == 0) {
+        pthread_detach(thread);
     }
+}
 
-    memcpy(inode, buf + inode_offset, sizeof(struct inode));
-    return 0;
+// Bit operations for the bitmap
+void set_bit(char* buf, int pos)
+{
+    buf[pos / 8] |= 1 << (pos % 8);
 }
-int inode_write(int inode_pos, struct inode* inode)
+void clear_bit(char* buf, int pos)
 {
-    int inode_block = inode_pos * INODE_SIZE / BLOCK_SIZE, inode_offset = inode_pos * INODE_SIZE % BLOCK_SIZE;
-    char buf[BLOCK_SIZE];
-    if (cached_disk_read(INODE_TABLE_START + inode_block, buf)) {
-        return -1;
+    buf[pos / 8] &= ~(1 << (pos % 8));
+}
+bool get_bit(char* buf, int pos)
+{
+    return (buf[pos / 8] >> (pos % 8)) & 1;
+}
+int find_empty_bit(char* buf, int size)
+{
+    for (int i = 0; i < size; i++) {
+        if (buf[i / 8] & (1 << (i % 8))) {
+            continue;
+        }
+        return i;
     }
-    memcpy(buf + inode_offset, inode, sizeof(struct inode));
-    if (cached_disk_write(INODE_TABLE_START + inode_block, buf)) {
-        return -1;
+    return -1;
+}
+
+// Read and write filesystem blocks, as the device blocks they span, in one request to the device
+// A device may serve the blocks of a request in parallel, see stripedisk.h; `device_write_many` gives it many at once
+int device_read(int block_pos, char* buf)
+{
+    int ids[MAX_DEVICE_BLOCKS_PER_BLOCK];
+    void* bufs[MAX_DEVICE_BLOCKS_PER_BLOCK];
+    for (int i = 0; i < DEVICE_BLOCKS_PER_BLOCK; i++) {
+        ids[i] = block_pos * DEVICE_BLOCKS_PER_BLOCK + i;
+        bufs[i] = buf + i * BLOCK_SIZE;
     }
-    return 0;
+    return disk_read_blocks(ids, bufs, DEVICE_BLOCKS_PER_BLOCK) ? -1 : 0;
 }
+// Set by `fs_attach_read_only`: every write to the device fails, so a check leaves it as it found it
+bool device_read_only;
 
-void init_inode(struct inode* inode, mode_t mode)
+// The blocks are sorted first, so runs of consecutive ones reach the device together
+struct device_io {
+    int id;
+    void* buf;
+};
+int compare_device_io(const void* a, const void* b)
 {
-    inode->mode = mode;
-    inode->size = 0;
-    inode->atime = inode->mtime = inode->ctime = time(NULL);
-    memset(inode->block_point, -1, sizeof(inode->block_point));
-    memset(inode->block_point_indirect, -1, sizeof(inode->block_point_indirect));
+    return ((const struct device_io*)a)->id - ((const struct device_io*)b)->id;
 }
-int update_inode(int inode_pos)
+int device_write_many(const int* block_pos, char* const* bufs, int count)
 {
-    struct inode inode;
-    if (inode_read(inode_pos, &inode)) {
+    if (device_read_only) {
         return -1;
     }
-    inode.ctime = time(NULL);
-    if (inode_write(inode_pos, &inode)) {
+    int num = count * DEVICE_BLOCKS_PER_BLOCK;
+    struct device_io* ios = malloc(num * sizeof(struct device_io));
+    int* ids = malloc(num * sizeof(int));
+    void** device_bufs = malloc(num * sizeof(void*));
+    int ret = ios == NULL || ids == NULL || device_bufs == NULL ? -1 : 0;
+    if (ret == 0) {
+        for (int i = 0; i < num; i++) {
+            ios[i].id = block_pos[i / DEVICE_BLOCKS_PER_BLOCK] * DEVICE_BLOCKS_PER_BLOCK + i % DEVICE_BLOCKS_PER_BLOCK;
+            ios[i].buf = bufs[i / DEVICE_BLOCKS_PER_BLOCK] + i % DEVICE_BLOCKS_PER_BLOCK * BLOCK_SIZE;
+        }
+        qsort(ios, num, sizeof(struct device_io), compare_device_io);
+        for (int i = 0; i < num; i++) {
+            ids[i] = ios[i].id;
+            device_bufs[i] = ios[i].buf;
+        }
+        ret = disk_write_blocks(ids, device_bufs, num) ? -1 : 0;
+    }
+    free(ios);
+    free(ids);
+    free(device_bufs);
+    return ret;
+}
+int device_write(int block_pos, char* buf)
+{
+    if (device_read_only) {
         return -1;
     }
-    return 0;
+    int ids[MAX_DEVICE_BLOCKS_PER_BLOCK];
+    void* bufs[MAX_DEVICE_BLOCKS_PER_BLOCK];
+    for (int i = 0; i < DEVICE_BLOCKS_PER_BLOCK; i++) {
+        ids[i] = block_pos * DEVICE_BLOCKS_PER_BLOCK + i;
+        bufs[i] = buf + i * BLOCK_SIZE;
+    }
+    return disk_write_blocks(ids, bufs, DEVICE_BLOCKS_PER_BLOCK) ? -1 : 0;
 }
 
-// Read and write the data block
-int data_read(int block_pos, char* buf)
+// Tell the device which blocks hold metadata, see tierdisk.h
+void device_set_metadata(int block_pos, bool metadata)
 {
-    if (cached_disk_read(DATA_BLOCK_START + block_pos, buf)) {
-        return -1;
+    if (block_trace_metadata != NULL) {
+        if (metadata) {
+            block_trace_metadata[block_pos / 8] |= 1 << (block_pos % 8);
+        } else {
+            block_trace_metadata[block_pos / 8] &= ~(1 << (block_pos % 8));
+        }
+    }
+    for (int i = 0; i < DEVICE_BLOCKS_PER_BLOCK; i++) {
+        disk_set_metadata(block_pos * DEVICE_BLOCKS_PER_BLOCK + i, metadata);
     }
-    return 0;
 }
-int data_write(int block_pos, char* buf)
+
+// Lock order: an inode lock is taken before any bitmap lock, and a bitmap lock before any cache stripe lock
+// At most one inode lock is held at a time, except in `fs_rename`, which locks the two parent directories
+// in ascending lock index order (only once if they share a lock) and frees a replaced target after unlocking them,
+// and in `write_back_dirty_inodes` and `defrag_lock`, which only ever try other inode locks without waiting
+// The list of dirty inodes is locked after an inode lock, and released before any other lock is taken
+
+// The buffer cache is split into stripes, each with its own lock; a block always lives in stripe `block_pos % CACHE_STRIPE_NUM`
+#define CACHE_STRIPE_NUM 8
+#define CACHE_LINE_NUM 8 // per stripe
+struct cache_line {
+    int block_pos;
+    bool journaled; // the journal holds the latest image of the block, so the line is never written back
+    char* buf; // of FS_BLOCK_SIZE bytes
+};
+struct cache_stripe {
+    pthread_mutex_t lock;
+    unsigned int seed; // for random eviction
+    struct cache_line line[CACHE_LINE_NUM];
+} cache[CACHE_STRIPE_NUM];
+
+// The lines are sized for the block size of the geometry, so the cache is set up again whenever it changes
+int init_cache()
 {
-    if (cached_disk_write(DATA_BLOCK_START + block_pos, buf)) {
-        return -1;
+    for (int s = 0; s < CACHE_STRIPE_NUM; s++) {
+        pthread_mutex_init(&cache[s].lock, NULL);
+        cache[s].seed = s;
+        for (int i = 0; i < CACHE_LINE_NUM; i++) {
+            cache[s].line[i].block_pos = -1;
+            free(cache[s].line[i].buf);
+            if ((cache[s].line[i].buf = malloc(FS_BLOCK_SIZE)) == NULL) {
+                return -1;
+            }
+        }
     }
     return 0;
 }
 
-struct dir_entry* add_dir_entry(struct inode* inode, const struct dir_entry* entry)
+struct cache_stripe* cache_stripe_of(int block_pos)
 {
-    for (int i = 0; i < DIR_ENTRY_PER_INODE; i++) {
-        int block_id = i / DIR_ENTRY_NUM, block_offset = i % DIR_ENTRY_NUM;
-        int block_pos;
-        if (get_block_pos(inode, block_id, &block_pos)) {
-            return NULL;
-        }
-        if (block_pos == -1) {
-            block_pos = alloc_block(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE);
-            if (block_pos == -1) {
-                return NULL;
-            }
-            if (set_block_pos(inode, block_id, block_pos)) {
-                return NULL;
-            }
-        }
-        char buf[BLOCK_SIZE];
-        if (data_read(block_pos, buf)) {
-            return NULL;
-        }
-        struct dir_entry* dir_entry = (struct dir_entry*)(buf + block_offset * DIR_ENTRY_SIZE);
-        if (dir_entry->inode_pos == 0) {
-            *dir_entry = *entry;
-            inode->size += DIR_ENTRY_SIZE;
-            if (data_write(block_pos, buf)) {
-                return NULL;
-            }
-            return dir_entry;
+    return &cache[block_pos % CACHE_STRIPE_NUM];
+}
+
+// The caller must hold the stripe lock
+int evict_cache_line(struct cache_stripe* stripe)
+{
+    int idx = rand_r(&stripe->seed) % CACHE_LINE_NUM;
+    int block_pos = stripe->line[idx].block_pos;
+    // write back the cache line; read-only, no line differs from the device, as a write to one fails
+    if (block_pos != -1 && !stripe->line[idx].journaled && !device_read_only) {
+        if (device_write(block_pos, stripe->line[idx].buf)) {
+            return -1;
         }
     }
-    return NULL;
+    return idx;
 }
 
-struct dir_entry* find_dir_entry(struct inode* inode, const char* entry_name)
+// The caller must hold the stripe lock
+struct cache_line* find_cache_line(struct cache_stripe* stripe, int block_pos)
 {
-    for (int i = 0; i < DIR_ENTRY_PER_INODE; i++) {
-        int block_id = i / DIR_ENTRY_NUM, block_offset = i % DIR_ENTRY_NUM;
-        int block_pos;
-        if (get_block_pos(inode, block_id, &block_pos)) {
-            return NULL;
-        }
-        if (block_pos == -1) {
-            continue;
-        }
-        char buf[BLOCK_SIZE];
-        if (data_read(block_pos, buf)) {
-            return NULL;
-        }
-        struct dir_entry* entry = (struct dir_entry*)(buf + block_offset * DIR_ENTRY_SIZE);
-        if (entry->inode_pos == 0) {
-            continue;
-        }
-        if (strcmp(entry->name, entry_name) == 0) {
-            return entry;
+    for (int i = 0; i < CACHE_LINE_NUM; i++) {
+        if (stripe->line[i].block_pos == block_pos) {
+            return &stripe->line[i];
         }
     }
     return NULL;
 }
-int remove_dir_entry(struct inode* inode, const char* entry_name, struct dir_entry* old_entry)
+
+// Fill a cache line with the latest image of a block, from the journal if it holds one
+// The caller must hold the stripe lock
+int load_cache_line(struct cache_line* line, int block_pos)
 {
-    for (int i = 0; i < DIR_ENTRY_PER_INODE; i++) {
-        int block_id = i / DIR_ENTRY_NUM, block_offset = i % DIR_ENTRY_NUM;
-        int block_pos;
-        if (get_block_pos(inode, block_id, &block_pos)) {
-            return -1;
-        }
-        if (block_pos == -1) {
-            continue;
-        }
-        char buf[BLOCK_SIZE];
-        if (data_read(block_pos, buf)) {
-            return -1;
-        }
-        struct dir_entry* entry = (struct dir_entry*)(buf + block_offset * DIR_ENTRY_SIZE);
-        if (entry->inode_pos == 0) {
-            continue;
-        }
-        if (strcmp(entry->name, entry_name) == 0) {
-            *old_entry = *entry;
-            entry->inode_pos = 0;
-            inode->size -= DIR_ENTRY_SIZE;
-            if (data_write(block_pos, buf)) {
-                return -1;
-            }
-            return 0;
-        }
+    line->journaled = journal_read(block_pos, line->buf);
+    if (!line->journaled && device_read(block_pos, line->buf)) {
+        return -1;
     }
+    return 0;
+}
 
-    // release all unused data blocks
-    for (int block_id = 0; block_id < DATA_BLOCK_PER_INODE; block_id++) {
-        int block_pos;
-        if (get_block_pos(inode, block_id, &block_pos)) {
+// Read `size` bytes at `offset` of a block
+int cached_disk_read_part(int block_pos, int offset, char* buf, int size)
+{
+    trace_block(block_pos, BLOCK_TRACE_READ);
+    struct cache_stripe* stripe = cache_stripe_of(block_pos);
+    pthread_mutex_lock(&stripe->lock);
+    struct cache_line* line = find_cache_line(stripe, block_pos);
+    if (line == NULL) {
+        int idx = evict_cache_line(stripe);
+        if (idx == -1) {
+            pthread_mutex_unlock(&stripe->lock);
             return -1;
         }
-        if (block_pos == -1) {
-            continue;
-        }
-        char buf[BLOCK_SIZE];
-        if (data_read(block_pos, buf)) {
+        line = &stripe->line[idx];
+        line->block_pos = -1;
+        if (load_cache_line(line, block_pos)) {
+            pthread_mutex_unlock(&stripe->lock);
             return -1;
         }
-        bool used = false;
-        for (int i = 0; i < DIR_ENTRY_NUM; i++) {
-            struct dir_entry* entry = (struct dir_entry*)(buf + i * DIR_ENTRY_SIZE);
-            if (entry->inode_pos != 0) {
-                used = true;
-                break;
-            }
-        }
-        if (!used) {
-            if (clear_block(BITMAP_BLOCK_DATA, block_pos)) {
-                return -1;
-            }
-            if (set_block_pos(inode, block_id, -1)) {
-                return -1;
-            }
-        }
+        line->block_pos = block_pos;
     }
+    memcpy(buf, line->buf + offset, size);
+    pthread_mutex_unlock(&stripe->lock);
     return 0;
 }
 
-// Called every time a directory entry is visited. Return 0 to continue, nonzero to break
-typedef int (*walk_dir_entry_callback)(struct dir_entry*, void* context);
-int walk_dir_entry(struct inode* inode, walk_dir_entry_callback callback, void* context)
+// Read a block without filling a cache line, for sweeps over blocks read only once, which would evict all the others
+int cached_disk_peek(int block_pos, char* buf)
 {
-    // get the data blocks and find the entry
-    char buf[BLOCK_SIZE];
-    assert(inode->size % DIR_ENTRY_SIZE == 0);
-    for (int i = 0; i < DIR_ENTRY_PER_INODE; i++) {
-        int block_id = i / DIR_ENTRY_NUM, block_offset = i % DIR_ENTRY_NUM;
-        int block_pos;
-        if (get_block_pos(inode, block_id, &block_pos)) {
-            return -1;
+    trace_block(block_pos, BLOCK_TRACE_PEEK);
+    struct cache_stripe* stripe = cache_stripe_of(block_pos);
+    pthread_mutex_lock(&stripe->lock);
+    struct cache_line* line = find_cache_line(stripe, block_pos);
+    int ret = 0;
+    if (line != NULL) {
+        memcpy(buf, line->buf, FS_BLOCK_SIZE);
+    } else if (!journal_read(block_pos, buf)) {
+        ret = device_read(block_pos, buf);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return ret;
+}
+
+// Write `size` bytes at `offset` of a block
+// The update is atomic with respect to other cached reads and writes of the same block
+int cached_disk_write_part(int block_pos, int offset, const char* buf, int size)
+{
+    if (device_read_only) {
+        return -1;
+    }
+    trace_block(block_pos, BLOCK_TRACE_WRITE);
+    struct cache_stripe* stripe = cache_stripe_of(block_pos);
+    pthread_mutex_lock(&stripe->lock);
+    struct cache_line* line = find_cache_line(stripe, block_pos);
+    if (line != NULL) {
+        memcpy(line->buf + offset, buf, size);
+        pthread_mutex_unlock(&stripe->lock);
+        return 0;
+    }
+
+    int idx = evict_cache_line(stripe);
+    if (idx == -1) {
+        pthread_mutex_unlock(&stripe->lock);
+        return -1;
+    }
+    line = &stripe->line[idx];
+    line->block_pos = -1;
+    line->journaled = false;
+    if (size != FS_BLOCK_SIZE && device_read(block_pos, line->buf)) {
+        pthread_mutex_unlock(&stripe->lock);
+        return -1;
+    }
+    memcpy(line->buf + offset, buf, size);
+    if (device_write(block_pos, line->buf)) {
+        pthread_mutex_unlock(&stripe->lock);
+        return -1;
+    }
+    line->block_pos = block_pos;
+    pthread_mutex_unlock(&stripe->lock);
+    return 0;
+}
+
+int cached_disk_read(int block_pos, char* buf)
+{
+    return cached_disk_read_part(block_pos, 0, buf, FS_BLOCK_SIZE);
+}
+
+int cached_disk_write(int block_pos, char* buf)
+{
+    return cached_disk_write_part(block_pos, 0, buf, FS_BLOCK_SIZE);
+}
+
+// Write whole blocks at once: a cached one is updated in its line, like `cached_disk_write`, and the others go to the
+// device in one request, without taking lines from the blocks already cached
+int cached_disk_write_many(const int* block_pos, char* const* bufs, int count)
+{
+    if (device_read_only) {
+        return -1;
+    }
+    int* homes = malloc(sizeof(int) * count);
+    char** images = malloc(sizeof(char*) * count);
+    if (homes == NULL || images == NULL) {
+        free(homes);
+        free(images);
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        trace_block(block_pos[i], BLOCK_TRACE_WRITE);
+        struct cache_stripe* stripe = cache_stripe_of(block_pos[i]);
+        pthread_mutex_lock(&stripe->lock);
+        struct cache_line* line = find_cache_line(stripe, block_pos[i]);
+        if (line != NULL) {
+            memcpy(line->buf, bufs[i], FS_BLOCK_SIZE);
+        } else {
+            homes[n] = block_pos[i];
+            images[n++] = bufs[i];
         }
-        if (block_pos == -1) {
-            continue;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    int ret = n > 0 ? device_write_many(homes, images, n) : 0;
+    free(homes);
+    free(images);
+    return ret;
+}
+
+// Write every cached block back to the disk, keeping it cached
+// Blocks held by the journal reach the disk through it instead
+int sync_cache()
+{
+    for (int s = 0; s < CACHE_STRIPE_NUM; s++) {
+        int homes[CACHE_LINE_NUM];
+        char* bufs[CACHE_LINE_NUM];
+        int n = 0;
+        pthread_mutex_lock(&cache[s].lock);
+        for (int i = 0; i < CACHE_LINE_NUM; i++) {
+            if (cache[s].line[i].block_pos != -1 && !cache[s].line[i].journaled) {
+                homes[n] = cache[s].line[i].block_pos;
+                bufs[n++] = cache[s].line[i].buf;
+            }
         }
-        if (data_read(block_pos, buf)) {
+        if (n > 0 && device_write_many(homes, bufs, n)) {
+            pthread_mutex_unlock(&cache[s].lock);
             return -1;
         }
-        struct dir_entry* entry = (struct dir_entry*)(buf + block_offset * DIR_ENTRY_SIZE);
-        if (entry->inode_pos == 0) {
-            continue;
-        }
-        if (callback(entry, context)) {
-            return 0;
-        }
+        pthread_mutex_unlock(&cache[s].lock);
     }
     return 0;
 }
 
-#define MAX_LAYER 130
+// Metadata journal
+// Blocks of metadata (superblock, bitmaps, inode table, directory and indirect blocks) are never written in place by an
+// operation: `journal_write_part` updates an in-memory image of the block, which joins the running transaction
+// Each transaction is committed to the log with one sequential write: a descriptor listing the blocks, their images,
+// and a commit block with a checksum; once the log is half full, all images are written home and the log starts over
+// Operations run inside handles, and a commit waits for the running handles to end, so it never splits an operation;
+// many operations share one transaction, committed every `JOURNAL_COMMIT_INTERVAL` seconds, when it grows too large,
+// on `fsync` and at unmount
+// Data blocks are written home before the metadata that points at them is committed
+// A directory or indirect block that is freed is revoked, so replaying an older image never overwrites its new contents
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_LOG_START (JOURNAL_START + 1) // the first block holds the journal superblock
+#define JOURNAL_LOG_SIZE (JOURNAL_BLOCK_NUM - 1)
+#define JOURNAL_TXN_MAX (JOURNAL_LOG_SIZE / 2 - 2) // blocks in a transaction
+#define JOURNAL_HANDLE_CREDITS 32 // blocks a single operation is assumed to change at most
+#define JOURNAL_COMMIT_INTERVAL 1 // seconds
+#define JOURNAL_HASH_NUM 1024
+
+enum journal_record_type {
+    JOURNAL_SUPERBLOCK = 1,
+    JOURNAL_DESCRIPTOR,
+    JOURNAL_COMMIT,
+};
+struct journal_header {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t tid; // for the superblock, the first transaction in the log
+    uint32_t block_num; // images following a descriptor
+    uint32_t revoke_num; // revoked blocks listed after the images' block numbers
+    uint32_t checksum; // commit only: over the block numbers and the images
+    uint32_t blocks[]; // descriptor only
+};
+#define JOURNAL_DESCRIPTOR_ENTRIES ((FS_BLOCK_SIZE - sizeof(struct journal_header)) / sizeof(uint32_t))
+#define JOURNAL_REVOKE_MAX (JOURNAL_DESCRIPTOR_ENTRIES - JOURNAL_TXN_MAX)
 
-// Resolve the path to the inode
-// Return the inode position if the path exists, -1 otherwise
-int resolve_path_to_inode(const char* path, struct inode* inode)
+struct journal_block {
+    int block_pos;
+    bool dirty; // changed in the running transaction
+    bool logged; // an image is in the log
+    struct journal_block* next; // in the hash chain
+    struct journal_block *txn_prev, *txn_next; // in the running transaction, while dirty
+    char* buf; // of FS_BLOCK_SIZE bytes, allocated with the block
+};
+
+// The images are guarded by `map_lock`, which may be taken under a cache stripe lock but never the other way around
+// The handle count and the state of commits are guarded by `lock`
+struct journal {
+    pthread_mutex_t map_lock;
+    struct journal_block* hash[JOURNAL_HASH_NUM];
+    int block_num; // images held
+    struct journal_block txn; // sentinel of the list of dirty images
+    int txn_num;
+    int revoke[MAX_BLOCK_SIZE / sizeof(uint32_t)]; // JOURNAL_REVOKE_MAX of them are used
+    int revoke_num;
+    bool overflow; // a revoke was dropped, or the transaction outgrew the log
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int handles;
+    bool committing;
+    uint32_t tid; // of the running transaction
+    int head; // next free block of the log
+} journal = {
+    .txn = { .txn_prev = &journal.txn, .txn_next = &journal.txn },
+    .map_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+_Thread_local int journal_depth; // handles nest, only the outermost one counts
+_Thread_local int journal_handle_blocks; // blocks the outermost handle added to the transaction
+
+// The caller must hold `map_lock`
+struct journal_block** journal_find(int block_pos)
 {
-    char path_layer[MAX_LAYER][MAX_FILENAME_LEN];
-    int layer_count = 0;
-    char* path4dir = strdup(path);
-    char* dir = path4dir;
-    for (; strcmp(dir, "/") != 0 && strcmp(dir, ".") != 0; layer_count++, dir = dirname(dir)) {
-        const char* base = basename(dir);
-        assert(layer_count < MAX_LAYER);
-        strncpy(path_layer[layer_count], base, MAX_FILENAME_LEN);
-        printf("path_layer[%d]:%s\n", layer_count, path_layer[layer_count]);
+    struct journal_block** jb = &journal.hash[block_pos % JOURNAL_HASH_NUM];
+    while (*jb != NULL && (*jb)->block_pos != block_pos) {
+        jb = &(*jb)->next;
     }
-    free(path4dir);
+    return jb;
+}
 
-    int inode_pos = ROOT_INODE;
-    while (layer_count-- > 0) {
-        if (inode_read(inode_pos, inode)) {
-            return -1;
-        }
-        struct dir_entry* entry = find_dir_entry(inode, path_layer[layer_count]);
-        if (entry == NULL) {
-            return -1;
-        }
-        inode_pos = entry->inode_pos;
+// Copy the image of a block into `buf` if the journal holds one
+bool journal_read(int block_pos, char* buf)
+{
+    pthread_mutex_lock(&journal.map_lock);
+    struct journal_block* jb = *journal_find(block_pos);
+    if (jb != NULL) {
+        memcpy(buf, jb->buf, FS_BLOCK_SIZE);
     }
+    pthread_mutex_unlock(&journal.map_lock);
+    return jb != NULL;
+}
 
-    if (inode_read(inode_pos, inode)) {
-        return -1;
+// Mark the cached copy of a block as held by the journal, or not, updating part of it
+void journal_sync_cache_line(int block_pos, bool journaled, int offset, const char* buf, int size)
+{
+    struct cache_stripe* stripe = cache_stripe_of(block_pos);
+    pthread_mutex_lock(&stripe->lock);
+    struct cache_line* line = find_cache_line(stripe, block_pos);
+    if (line != NULL) {
+        if (size > 0) {
+            memcpy(line->buf + offset, buf, size);
+        }
+        line->journaled = journaled;
     }
-    return inode_pos;
+    pthread_mutex_unlock(&stripe->lock);
 }
 
-// Format the virtual block device: basic filesystem structure, root directory, etc.
-// Return 0 if the operation is successful, not 0 otherwise
-int mkfs()
+// Write `size` bytes at `offset` of a metadata block, as part of the running transaction
+int journal_write_part(int block_pos, int offset, const char* buf, int size)
 {
-    printf("Mkfs is called\n");
+    pthread_mutex_lock(&journal.map_lock);
+    bool held = *journal_find(block_pos) != NULL;
+    pthread_mutex_unlock(&journal.map_lock);
+
+    // the block is read before `map_lock` is taken, as reading it may take a stripe lock
+    // no one else can write it meanwhile: every metadata write comes through here and makes an image first
+    char image[FS_BLOCK_SIZE];
+    if (!held && size != FS_BLOCK_SIZE && cached_disk_read(block_pos, image)) {
+        return -1;
+    }
 
-    // clear the disk
-    char buf[BLOCK_SIZE] = { 0 };
-    for (int i = 0; i < BLOCK_NUM; i++) {
-        if (cached_disk_write(i, buf)) {
+    pthread_mutex_lock(&journal.map_lock);
+    struct journal_block** slot = journal_find(block_pos);
+    struct journal_block* jb = *slot;
+    bool added = false;
+    if (jb == NULL) {
+        jb = malloc(sizeof(struct journal_block) + FS_BLOCK_SIZE);
+        if (jb == NULL) {
+            pthread_mutex_unlock(&journal.map_lock);
             return -1;
         }
+        *jb = (struct journal_block) { .block_pos = block_pos, .buf = (char*)(jb + 1) };
+        memcpy(jb->buf, image, FS_BLOCK_SIZE);
+        *slot = jb;
+        journal.block_num++;
+        added = true;
+    }
+    memcpy(jb->buf + offset, buf, size);
+    if (!jb->dirty) {
+        jb->dirty = true;
+        jb->txn_prev = journal.txn.txn_prev;
+        jb->txn_next = &journal.txn;
+        journal.txn.txn_prev->txn_next = jb;
+        journal.txn.txn_prev = jb;
+        journal.txn_num++;
+        journal_handle_blocks++;
     }
+    pthread_mutex_unlock(&journal.map_lock);
 
-    static_assert(sizeof(struct inode) <= INODE_SIZE, "The inode should be smaller than INODE_SIZE");
-    static_assert(sizeof(struct superblock) <= BLOCK_SIZE, "The superblock should be smaller than BLOCK_SIZE");
-    static_assert(INODE_SIZE * INODE_NUM <= BLOCK_SIZE * (DATA_BLOCK_START - INODE_TABLE_START), "The inode table should be smaller than assigned blocks");
-    static_assert(BLOCK_SIZE % INODE_SIZE == 0, "The inode should be aligned with the block size");
+    // a block the journal takes up is metadata until it is freed, see `clear_block`
+    if (added) {
+        device_set_metadata(block_pos, true);
+    }
+    journal_sync_cache_line(block_pos, true, offset, buf, size);
+    return 0;
+}
 
-    // for bitmap
-    static_assert(INODE_NUM / 8 / BLOCK_SIZE <= 1, "The inode bitmap should be smaller than one block");
-    static_assert(DATA_BLOCK_SIZE / 8 / BLOCK_SIZE <= DATA_BITMAP_BLOCK_NUM, "The data bitmap should be smaller than DATA_BITMAP_BLOCK_NUM blocks");
+int journal_write(int block_pos, const char* buf)
+{
+    return journal_write_part(block_pos, 0, buf, FS_BLOCK_SIZE);
+}
 
-    static_assert(DATA_BLOCK_SIZE * BLOCK_SIZE >= MIN_AVAILABLE_SIZE, "The available size should be larger than MIN_AVAILABLE_SIZE");
-    static_assert(INODE_NUM >= MIN_FILE_NUM, "The file size should be larger than MIN_FILE_NUM");
-    static_assert(DATA_BLOCK_PER_INODE * BLOCK_SIZE >= MAX_FILE_SIZE, "The file size should be larger than MAX_FILE_SIZE");
+// Forget a freed directory or indirect block, which may be reused for file data written in place
+void journal_revoke(int block_pos)
+{
+    pthread_mutex_lock(&journal.map_lock);
+    struct journal_block** slot = journal_find(block_pos);
+    struct journal_block* jb = *slot;
+    if (jb == NULL) {
+        pthread_mutex_unlock(&journal.map_lock);
+        return;
+    }
+    if (jb->logged) {
+        if (journal.revoke_num < (int)JOURNAL_REVOKE_MAX) {
+            journal.revoke[journal.revoke_num++] = block_pos;
+        } else {
+            journal.overflow = true;
+        }
+    }
+    if (jb->dirty) {
+        jb->txn_prev->txn_next = jb->txn_next;
+        jb->txn_next->txn_prev = jb->txn_prev;
+        journal.txn_num--;
+    }
+    *slot = jb->next;
+    journal.block_num--;
+    free(jb);
+    pthread_mutex_unlock(&journal.map_lock);
 
-    static_assert(sizeof(struct dir_entry) <= DIR_ENTRY_SIZE, "The directory entry should be smaller than DIR_ENTRY_SIZE");
-    static_assert(DIR_ENTRY_SIZE * DIR_ENTRY_NUM <= BLOCK_SIZE, "The directory should be smaller than BLOCK_SIZE");
-    static_assert(BLOCK_SIZE % DIR_ENTRY_SIZE == 0, "The directory should be aligned with the block size");
+    journal_sync_cache_line(block_pos, false, 0, NULL, 0);
+}
 
-    // write the superblock
-    struct superblock sb = {
-        .block_size = BLOCK_SIZE,
-        .inode_size = INODE_SIZE,
-        .inode_num = INODE_NUM,
-        .inode_bitmap_block = BITMAP_BLOCK_INODE,
-        .block_bitmap_block = BITMAP_BLOCK_DATA,
-        .inode_block = INODE_TABLE_START,
-        .data_block = DATA_BLOCK_START,
-    };
-    init_cache();
+int journal_commit_locked();
+void release_freed_blocks(uint32_t tid);
+void release_spliced_reads(bool all);
 
-    if (cached_disk_write(SUPERBLOCK_BLOCK, (char*)&sb)) {
-        return -1;
+// Enter an operation that may change metadata
+// Waits while a commit runs, and commits first when the running transaction has no room for another operation
+void journal_start()
+{
+    if (journal_depth++ > 0) {
+        return;
+    }
+    journal_handle_blocks = 0;
+    pthread_mutex_lock(&journal.lock);
+    for (;;) {
+        if (!journal.committing) {
+            pthread_mutex_lock(&journal.map_lock);
+            int txn_num = journal.txn_num, revoke_num = journal.revoke_num;
+            pthread_mutex_unlock(&journal.map_lock);
+            int credits = (journal.handles + 1) * JOURNAL_HANDLE_CREDITS;
+            if (txn_num + credits <= JOURNAL_TXN_MAX && revoke_num + credits <= (int)JOURNAL_REVOKE_MAX) {
+                break;
+            }
+            if (journal.handles == 0) {
+                journal_commit_locked();
+                continue;
+            }
+        }
+        pthread_cond_wait(&journal.cond, &journal.lock);
     }
+    journal.handles++;
+    pthread_mutex_unlock(&journal.lock);
+}
 
-    // write the root directory
-    struct inode root_inode;
-    init_inode(&root_inode, DIRMODE);
-    if (inode_write(ROOT_INODE, &root_inode)) {
-        return -1;
+void journal_stop()
+{
+    if (--journal_depth > 0) {
+        return;
     }
+    pthread_mutex_lock(&journal.lock);
+    if (--journal.handles == 0) {
+        pthread_cond_broadcast(&journal.cond);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
 
-    int root_block_id = alloc_block(BITMAP_BLOCK_INODE, DATA_BLOCK_SIZE);
-    assert(root_block_id == ROOT_INODE);
+// Whether the running handle has used up half of its credits, so optional work such as writing back other inodes
+// should be left to later operations
+bool journal_handle_busy()
+{
+    return journal_depth > 0 && journal_handle_blocks >= JOURNAL_HANDLE_CREDITS / 2;
+}
 
-    return 0;
+void journal_handle_end([[maybe_unused]] int* handle)
+{
+    journal_stop();
 }
+// Run the rest of the enclosing scope inside a handle
+#define JOURNAL_HANDLE() int journal_handle __attribute__((cleanup(journal_handle_end))) = (journal_start(), 0)
 
-int getattr(struct inode* inode, struct stat* attr)
+uint32_t journal_checksum(uint32_t hash, const void* buf, int size)
 {
-    *attr = (struct stat) {
-        .st_mode = inode->mode,
-        .st_nlink = 1,
-        .st_uid = getuid(),
-        .st_gid = getgid(),
-        .st_size = inode->size,
-        .st_atime = inode->atime,
-        .st_mtime = inode->mtime,
-        .st_ctime = inode->ctime,
-    };
-    return 0;
+    // FNV-1a
+    for (int i = 0; i < size; i++) {
+        hash = (hash ^ ((const uint8_t*)buf)[i]) * 16777619;
+    }
+    return hash;
 }
 
-// Query the attributes of a regular file or directory
-// Return -ENOENT if the file or directory does not exist
-int fs_getattr(const char* path, struct stat* attr)
+int journal_write_superblock(uint32_t start_tid)
 {
-    printf("Getattr is called:%s\n", path);
+    char buf[FS_BLOCK_SIZE];
+    memset(buf, 0, FS_BLOCK_SIZE);
+    *(struct journal_header*)buf = (struct journal_header) {
+        .magic = JOURNAL_MAGIC,
+        .type = JOURNAL_SUPERBLOCK,
+        .tid = start_tid,
+    };
+    return device_write(JOURNAL_START, buf);
+}
 
-    struct inode inode;
-    int inode_pos = resolve_path_to_inode(path, &inode);
-    if (inode_pos == -1) {
-        return -ENOENT;
+// Drop every image and the running transaction
+// The caller must hold `map_lock`
+void journal_forget()
+{
+    for (int h = 0; h < JOURNAL_HASH_NUM; h++) {
+        while (journal.hash[h] != NULL) {
+            struct journal_block* jb = journal.hash[h];
+            journal.hash[h] = jb->next;
+            free(jb);
+        }
     }
-
-    return getattr(&inode, attr);
+    journal.block_num = 0;
+    journal.txn.txn_prev = journal.txn.txn_next = &journal.txn;
+    journal.txn_num = journal.revoke_num = 0;
+    journal.overflow = false;
 }
 
-struct fill_dir_context {
-    fuse_fill_dir_t filler;
-    void* buf;
-};
-int readaddr_callback(struct dir_entry* entry, void* context)
+// Write every image home and empty the log
+// The caller must be committing, so no handle is running
+// Normally the running transaction is empty by now; otherwise it did not fit in the log and reaches its home locations
+// without the guarantee of atomicity
+int journal_checkpoint()
 {
-    struct fill_dir_context* ctx = (struct fill_dir_context*)context;
-    struct inode inode;
-    if (inode_read(entry->inode_pos, &inode)) {
+    pthread_mutex_lock(&journal.map_lock);
+    // all images in one request, which the device may write in parallel
+    int* homes = malloc(sizeof(int) * (journal.block_num + 1));
+    char** images = malloc(sizeof(char*) * (journal.block_num + 1));
+    if (homes == NULL || images == NULL) {
+        pthread_mutex_unlock(&journal.map_lock);
+        free(homes);
+        free(images);
         return -1;
     }
-    struct stat st;
-    if (getattr(&inode, &st)) {
+    int home_num = 0;
+    for (int h = 0; h < JOURNAL_HASH_NUM; h++) {
+        for (struct journal_block* jb = journal.hash[h]; jb != NULL; jb = jb->next) {
+            homes[home_num] = jb->block_pos;
+            images[home_num++] = jb->buf;
+        }
+    }
+    int ret = device_write_many(homes, images, home_num);
+    free(images);
+    if (ret) {
+        pthread_mutex_unlock(&journal.map_lock);
+        free(homes);
         return -1;
     }
-    ctx->filler(ctx->buf, entry->name, &st, 0);
-    return 0;
+    journal_forget();
+    // the running transaction went home with the others, so the blocks it freed are free on the disk
+    journal.tid++;
+    pthread_mutex_unlock(&journal.map_lock);
+
+    // the cached copies now match the disk and may be written back again
+    for (int i = 0; i < home_num; i++) {
+        journal_sync_cache_line(homes[i], false, 0, NULL, 0);
+    }
+    free(homes);
+
+    journal.head = 0;
+    return journal_write_superblock(journal.tid);
 }
 
-// Read all entries in a directory
-// Update the `atime` of the directory
-// `ls` command can trigger this function
-int fs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, [[maybe_unused]] off_t offset, struct fuse_file_info* fi)
+// Take the images of the running transaction as in the log, and start the next one empty
+// The caller must hold `map_lock`
+void journal_end_txn()
 {
-    printf("Readdir is called:%s\n", path);
-
-    // read the inode
-    struct inode inode;
-    int inode_pos = resolve_path_to_inode(path, &inode);
-    if (inode_pos == -1) {
-        return -ENOENT;
+    for (struct journal_block* jb = journal.txn.txn_next; jb != &journal.txn; jb = jb->txn_next) {
+        jb->dirty = false;
+        jb->logged = true;
     }
+    journal.txn.txn_prev = journal.txn.txn_next = &journal.txn;
+    journal.txn_num = journal.revoke_num = 0;
+}
 
-    struct fill_dir_context context = {
-        .filler = filler,
-        .buf = buffer,
+// Write the running transaction to the log: descriptor, images and commit block
+// The caller must hold `map_lock`
+int journal_write_txn()
+{
+    char buf[FS_BLOCK_SIZE];
+    memset(buf, 0, FS_BLOCK_SIZE);
+    struct journal_header* header = (struct journal_header*)buf;
+    *header = (struct journal_header) {
+        .magic = JOURNAL_MAGIC,
+        .type = JOURNAL_DESCRIPTOR,
+        .tid = journal.tid,
+        .block_num = journal.txn_num,
+        .revoke_num = journal.revoke_num,
     };
-    if (walk_dir_entry(&inode, readaddr_callback, &context)) {
+    int n = 0;
+    for (struct journal_block* jb = journal.txn.txn_next; jb != &journal.txn; jb = jb->txn_next) {
+        header->blocks[n++] = jb->block_pos;
+    }
+    memcpy(header->blocks + n, journal.revoke, journal.revoke_num * sizeof(uint32_t));
+    uint32_t checksum = journal_checksum(2166136261u, header->blocks, (journal.txn_num + journal.revoke_num) * sizeof(uint32_t));
+
+    // the descriptor and the images in one request; the commit block only once they are all on the disk
+    int* log = malloc(sizeof(int) * (journal.txn_num + 1));
+    char** images = malloc(sizeof(char*) * (journal.txn_num + 1));
+    if (log == NULL || images == NULL) {
+        free(log);
+        free(images);
         return -1;
     }
-
-    // update the inode
-    inode.atime = time(NULL);
-    if (inode_write(inode_pos, &inode)) {
+    int pos = JOURNAL_LOG_START + journal.head;
+    n = 0;
+    log[n] = pos++;
+    images[n++] = buf;
+    for (struct journal_block* jb = journal.txn.txn_next; jb != &journal.txn; jb = jb->txn_next) {
+        checksum = journal_checksum(checksum, jb->buf, FS_BLOCK_SIZE);
+        log[n] = pos++;
+        images[n++] = jb->buf;
+    }
+    int ret = device_write_many(log, images, n);
+    free(log);
+    free(images);
+    if (ret) {
         return -1;
     }
+    memset(buf, 0, FS_BLOCK_SIZE);
+    *header = (struct journal_header) {
+        .magic = JOURNAL_MAGIC,
+        .type = JOURNAL_COMMIT,
+        .tid = journal.tid,
+        .block_num = journal.txn_num,
+        .revoke_num = journal.revoke_num,
+        .checksum = checksum,
+    };
+    if (device_write(pos++, buf)) {
+        return -1;
+    }
+
+    journal_end_txn();
+    journal.head = pos - JOURNAL_LOG_START;
+    journal.tid++;
     return 0;
 }
 
-// Read the contents of a regular file
-// Update the `atime` of the file
-// `cat` command can trigger this function
-// Return the number of bytes read
-int fs_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi)
+// Commit the running transaction; the caller holds `lock` and no handle is running
+int journal_commit_locked()
 {
-    printf("Read is called:%s\n", path);
+    journal.committing = true;
+    pthread_mutex_unlock(&journal.lock);
 
-    int inode_pos = fi->fh;
+    // ordered: the data reaches the disk before the metadata that points to it
+    int ret = sync_cache();
 
-    struct inode inode;
-    if (inode_read(inode_pos, &inode)) {
+    pthread_mutex_lock(&journal.map_lock);
+    bool fits = !journal.overflow && journal.txn_num + 2 <= JOURNAL_LOG_SIZE - journal.head && journal.txn_num + journal.revoke_num <= (int)JOURNAL_DESCRIPTOR_ENTRIES;
+    if (ret == 0 && fits && journal.txn_num + journal.revoke_num > 0) {
+        ret = journal_write_txn();
+    }
+    pthread_mutex_unlock(&journal.map_lock);
+
+    // lazily: only once the log has no room for another full transaction
+    if (ret == 0 && (!fits || JOURNAL_LOG_SIZE - journal.head < JOURNAL_TXN_MAX + 2)) {
+        ret = journal_checkpoint();
+    }
+
+    release_spliced_reads(false);
+    if (ret == 0) {
+        release_freed_blocks(journal.tid);
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    journal.committing = false;
+    pthread_cond_broadcast(&journal.cond);
+    return ret;
+}
+
+// Commit the running transaction, waiting for its handles to end
+// Must not be called inside a handle
+int journal_commit()
+{
+    assert(journal_depth == 0);
+    pthread_mutex_lock(&journal.lock);
+    while (journal.committing || journal.handles > 0) {
+        pthread_cond_wait(&journal.cond, &journal.lock);
+    }
+    int ret = journal_commit_locked();
+    pthread_mutex_unlock(&journal.lock);
+    return ret;
+}
+
+// Commit and write every image home, leaving the log empty, at unmount
+int journal_flush()
+{
+    pthread_mutex_lock(&journal.lock);
+    while (journal.committing || journal.handles > 0) {
+        pthread_cond_wait(&journal.cond, &journal.lock);
+    }
+    int ret = journal_commit_locked();
+    if (ret == 0) {
+        journal.committing = true;
+        pthread_mutex_unlock(&journal.lock);
+        ret = journal_checkpoint();
+        if (ret == 0) {
+            release_freed_blocks(journal.tid);
+        }
+        pthread_mutex_lock(&journal.lock);
+        journal.committing = false;
+        pthread_cond_broadcast(&journal.cond);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return ret;
+}
+
+void* journal_thread([[maybe_unused]] void* arg)
+{
+    for (;;) {
+        sleep(JOURNAL_COMMIT_INTERVAL);
+        journal_commit();
+    }
+    return NULL;
+}
+
+void start_journal_thread()
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, journal_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// Start an empty log, at format time
+// Transactions left in the log by an earlier format must not pass for ones of the new log, so its first transaction
+// id follows all of theirs, or is picked from the clock if there is no earlier journal
+int journal_format()
+{
+    char buf[FS_BLOCK_SIZE];
+    struct journal_header* header = (struct journal_header*)buf;
+    if (device_read(JOURNAL_START, buf) == 0 && header->magic == JOURNAL_MAGIC && header->type == JOURNAL_SUPERBLOCK) {
+        journal.tid = header->tid + JOURNAL_LOG_SIZE;
+    } else {
+        journal.tid = time(NULL);
+    }
+    journal.head = 0;
+    return journal_write_superblock(journal.tid);
+}
+
+// Read the header of the log block `pos`, checking that it is a record of type `type` for transaction `tid`
+// Return 1 if it is, 0 if it is not, as past the end of the log, or -1 if the block cannot be read
+int journal_read_record(int pos, int type, uint32_t tid, char* buf)
+{
+    struct journal_header* header = (struct journal_header*)buf;
+    if (pos >= JOURNAL_LOG_SIZE) {
+        return 0;
+    }
+    if (device_read(JOURNAL_LOG_START + pos, buf)) {
+        return -1;
+    }
+    return header->magic == JOURNAL_MAGIC && header->type == (uint32_t)type && header->tid == tid;
+}
+
+// Scan the log from transaction `*tid` for the transactions that were committed completely, with a valid checksum
+// Call `apply` on each of them, and set `*tid` to the id of the first transaction after them
+// Return -1 if a log block cannot be read or `apply` fails, stopping at that transaction
+typedef int (*journal_txn_callback)(struct journal_header* descriptor, int image_pos, uint32_t tid, void* context);
+int journal_scan(uint32_t* tid, journal_txn_callback apply, void* context)
+{
+    char descriptor[FS_BLOCK_SIZE], buf[FS_BLOCK_SIZE];
+    struct journal_header* header = (struct journal_header*)descriptor;
+    int pos = 0, ret;
+    while ((ret = journal_read_record(pos, JOURNAL_DESCRIPTOR, *tid, descriptor)) == 1) {
+        int block_num = header->block_num, revoke_num = header->revoke_num;
+        if (block_num + revoke_num > (int)JOURNAL_DESCRIPTOR_ENTRIES || pos + block_num + 2 > JOURNAL_LOG_SIZE) {
+            break;
+        }
+        uint32_t checksum = journal_checksum(2166136261u, header->blocks, (block_num + revoke_num) * sizeof(uint32_t));
+        for (int i = 0; i < block_num; i++) {
+            if (device_read(JOURNAL_LOG_START + pos + 1 + i, buf)) {
+                return -1;
+            }
+            checksum = journal_checksum(checksum, buf, FS_BLOCK_SIZE);
+        }
+        ret = journal_read_record(pos + 1 + block_num, JOURNAL_COMMIT, *tid, buf);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == 0 || ((struct journal_header*)buf)->checksum != checksum) {
+            break;
+        }
+        if (apply(header, pos + 1, *tid, context)) {
+            return -1;
+        }
+        pos += block_num + 2;
+        (*tid)++;
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+// The latest transaction that revoked each block, while replaying
+struct journal_revokes {
+    int num;
+    uint32_t* block; // JOURNAL_LOG_SIZE * 2 of them
+    uint32_t* tid;
+};
+int journal_collect_revokes(struct journal_header* descriptor, [[maybe_unused]] int image_pos, uint32_t tid, void* context)
+{
+    struct journal_revokes* revokes = context;
+    // dropping a revoke would replay a stale image over a reused block
+    if (descriptor->revoke_num > (uint32_t)(JOURNAL_LOG_SIZE * 2 - revokes->num)) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < descriptor->revoke_num; i++) {
+        revokes->block[revokes->num] = descriptor->blocks[descriptor->block_num + i];
+        revokes->tid[revokes->num++] = tid;
+    }
+    return 0;
+}
+int journal_replay_txn(struct journal_header* descriptor, int image_pos, uint32_t tid, void* context)
+{
+    struct journal_revokes* revokes = context;
+    char buf[FS_BLOCK_SIZE];
+    for (uint32_t i = 0; i < descriptor->block_num; i++) {
+        // an image is stale if a later transaction revoked its block
+        bool revoked = false;
+        for (int r = 0; r < revokes->num && !revoked; r++) {
+            revoked = revokes->block[r] == descriptor->blocks[i] && revokes->tid[r] > tid;
+        }
+        if (revoked) {
+            continue;
+        }
+        if (device_read(JOURNAL_LOG_START + image_pos + i, buf)) {
+            return -1;
+        }
+        // read-only, the images stay in the journal, from where reads see them, as for transactions not yet checkpointed
+        if (device_read_only ? journal_write(descriptor->blocks[i], buf) : device_write(descriptor->blocks[i], buf)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Replay the committed transactions of the log into their home locations, at mount
+// Return the number of transactions replayed, or -1 if the device holds no journal or the replay fails, in which case
+// the log is left as it is, to be replayed again by the next mount
+int journal_recover()
+{
+    char buf[FS_BLOCK_SIZE];
+    struct journal_header* header = (struct journal_header*)buf;
+    if (device_read(JOURNAL_START, buf) || header->magic != JOURNAL_MAGIC || header->type != JOURNAL_SUPERBLOCK) {
+        return -1;
+    }
+    uint32_t start_tid = header->tid, end_tid = start_tid, replay_tid = start_tid;
+
+    struct journal_revokes revokes = {
+        .block = malloc(sizeof(uint32_t) * JOURNAL_LOG_SIZE * 2),
+        .tid = malloc(sizeof(uint32_t) * JOURNAL_LOG_SIZE * 2),
+    };
+    int ret = -1;
+    if (revokes.block != NULL && revokes.tid != NULL) {
+        ret = journal_scan(&end_tid, journal_collect_revokes, &revokes);
+        if (ret == 0) {
+            ret = journal_scan(&replay_tid, journal_replay_txn, &revokes);
+        }
+    }
+    free(revokes.block);
+    free(revokes.tid);
+    if (ret) {
+        return -1;
+    }
+
+    journal.tid = end_tid;
+    journal.head = 0;
+    // read-only, the replayed images are as committed ones not yet checkpointed, never written again
+    if (device_read_only) {
+        pthread_mutex_lock(&journal.map_lock);
+        journal_end_txn();
+        pthread_mutex_unlock(&journal.map_lock);
+    } else if (journal_write_superblock(journal.tid)) {
+        return -1;
+    }
+    return end_tid - start_tid;
+}
+
+// Describe `size` bytes at `offset` of a block as a FUSE buffer for a reply
+// A cached block, or a range over several device blocks, is copied into a new memory buffer; otherwise the backing file
+// of the device block is opened and `out` refers to it, so libfuse can splice it to the channel; the caller closes
+// `out->fd` once the reply has been sent
+int cached_disk_read_buf(int block_pos, int offset, int size, struct fuse_buf* out)
+{
+    struct cache_stripe* stripe = cache_stripe_of(block_pos);
+    pthread_mutex_lock(&stripe->lock);
+    if (find_cache_line(stripe, block_pos) != NULL || offset / BLOCK_SIZE != (offset + size - 1) / BLOCK_SIZE) {
+        pthread_mutex_unlock(&stripe->lock);
+        *out = (struct fuse_buf) {
+            .size = size,
+            .mem = malloc(size),
+            .fd = -1,
+        };
+        if (out->mem == NULL || cached_disk_read_part(block_pos, offset, out->mem, size)) {
+            free(out->mem);
+            out->mem = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    // a block that is not cached is up to date on the disk
+    trace_block(block_pos, BLOCK_TRACE_PEEK);
+    int fd = disk_open(block_pos * DEVICE_BLOCKS_PER_BLOCK + offset / BLOCK_SIZE, O_RDONLY);
+    pthread_mutex_unlock(&stripe->lock);
+    if (fd == -1) {
+        return -1;
+    }
+    *out = (struct fuse_buf) {
+        .size = size,
+        .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+        .fd = fd,
+        .pos = offset % BLOCK_SIZE,
+    };
+    return 0;
+}
+
+// Every bitmap block is an allocation group with its own lock
+#define BITMAP_BITS_PER_BLOCK (FS_BLOCK_SIZE * 8)
+// Both are indexed by block, up to INODE_TABLE_START; the counts only at the first block of each bitmap
+pthread_mutex_t* bitmap_lock;
+atomic_int* bitmap_used;
+
+// Data blocks freed by a transaction that has not committed: the allocators pass over them until it commits, as the
+// new contents of a reused block could reach the disk before the free, and a crash would give them to the old owner
+// `freed_bitmap` has a bit per data block, under the lock of its group; `freed_blocks` lists them with their transaction
+struct freed_block {
+    int block_pos;
+    uint32_t tid;
+};
+char* freed_bitmap;
+struct freed_block* freed_blocks;
+atomic_int freed_num;
+int freed_cap;
+pthread_mutex_t freed_lock = PTHREAD_MUTEX_INITIALIZER;
+// How many replies being sent splice each data block from its backing file, see `data_read_buf`; a pinned block that
+// is freed meanwhile is not released to the allocators either
+atomic_ushort* block_pins;
+
+int init_bitmap_locks()
+{
+    free(bitmap_lock);
+    free(bitmap_used);
+    free(freed_bitmap);
+    free(freed_blocks);
+    free(block_pins);
+    bitmap_lock = malloc(sizeof(pthread_mutex_t) * INODE_TABLE_START);
+    bitmap_used = calloc(INODE_TABLE_START, sizeof(atomic_int));
+    freed_bitmap = calloc(INODE_TABLE_START - BITMAP_BLOCK_DATA, FS_BLOCK_SIZE);
+    block_pins = calloc(DATA_BLOCK_SIZE, sizeof(atomic_ushort));
+    freed_blocks = NULL;
+    freed_num = freed_cap = 0;
+    if (bitmap_lock == NULL || bitmap_used == NULL || freed_bitmap == NULL || block_pins == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < INODE_TABLE_START; i++) {
+        pthread_mutex_init(&bitmap_lock[i], NULL);
+    }
+    return 0;
+}
+
+// The bits of a group that may not be allocated: the bitmap `block_bitmap`, with the blocks freed by transactions that
+// have not committed for a group of the data bitmap, built in `buf`
+// The caller must hold the lock of the group
+char* taken_bits(int group_block, char* block_bitmap, char* buf)
+{
+    if (group_block < BITMAP_BLOCK_DATA || freed_num == 0) {
+        return block_bitmap;
+    }
+    const char* freed = freed_bitmap + (group_block - BITMAP_BLOCK_DATA) * FS_BLOCK_SIZE;
+    for (int i = 0; i < FS_BLOCK_SIZE; i++) {
+        buf[i] = block_bitmap[i] | freed[i];
+    }
+    return buf;
+}
+
+// Return the blocks freed by transactions before `tid` to the allocators, once those have committed
+// A pinned block waits for a later commit
+void release_freed_blocks(uint32_t tid)
+{
+    pthread_mutex_lock(&freed_lock);
+    int n = 0;
+    for (int i = 0; i < freed_num; i++) {
+        struct freed_block* fb = &freed_blocks[i];
+        if ((int32_t)(fb->tid - tid) >= 0 || block_pins[fb->block_pos] > 0) {
+            freed_blocks[n++] = *fb;
+            continue;
+        }
+        pthread_mutex_t* lock = &bitmap_lock[BITMAP_BLOCK_DATA + fb->block_pos / BITMAP_BITS_PER_BLOCK];
+        pthread_mutex_lock(lock);
+        clear_bit(freed_bitmap, fb->block_pos);
+        pthread_mutex_unlock(lock);
+    }
+    freed_num = n;
+    pthread_mutex_unlock(&freed_lock);
+}
+
+// Allocate a bit in the group stored in `group_block`, which covers `group_size` bits
+// The caller must hold the lock of the group
+int alloc_in_group(int group_block, int group_size)
+{
+    char block_bitmap[FS_BLOCK_SIZE], taken[FS_BLOCK_SIZE];
+    if (cached_disk_read(group_block, block_bitmap)) {
+        return -1;
+    }
+
+    // find an empty block
+    int block_pos = find_empty_bit(taken_bits(group_block, block_bitmap, taken), group_size);
+    if (block_pos == -1) {
+        return -1;
+    }
+
+    // set the block bitmap
+    set_bit(block_bitmap, block_pos);
+    if (journal_write_part(group_block, block_pos / 8, block_bitmap + block_pos / 8, 1)) {
+        return -1;
+    }
+    return block_pos;
+}
+
+// The bitmap starting at `bitmap_block` spans as many blocks as `bitmap_size` bits need
+// Groups whose lock is busy are skipped on the first pass, so concurrent allocations spread over the groups
+int alloc_block(int bitmap_block, int bitmap_size)
+{
+    int group_num = ceil_div(bitmap_size, BITMAP_BITS_PER_BLOCK);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int g = 0; g < group_num; g++) {
+            pthread_mutex_t* lock = &bitmap_lock[bitmap_block + g];
+            if (pass == 0) {
+                if (pthread_mutex_trylock(lock)) {
+                    continue;
+                }
+            } else {
+                pthread_mutex_lock(lock);
+            }
+            int group_size = min(bitmap_size - g * BITMAP_BITS_PER_BLOCK, BITMAP_BITS_PER_BLOCK);
+            int block_pos = alloc_in_group(bitmap_block + g, group_size);
+            pthread_mutex_unlock(lock);
+            if (block_pos != -1) {
+                bitmap_used[bitmap_block]++;
+                return g * BITMAP_BITS_PER_BLOCK + block_pos;
+            }
+        }
+    }
+    return -1;
+}
+
+// Allocate up to `count` consecutive bits from the first free bit at or after `start` in a group
+// The caller must hold the lock of the group
+int alloc_run_in_group(int group_block, int group_size, int start, int count, int* got)
+{
+    char block_bitmap[FS_BLOCK_SIZE], taken_buf[FS_BLOCK_SIZE];
+    if (cached_disk_read(group_block, block_bitmap)) {
+        return -1;
+    }
+    char* taken = taken_bits(group_block, block_bitmap, taken_buf);
+
+    int first = start;
+    while (first < group_size && get_bit(taken, first)) {
+        first++;
+    }
+    if (first == group_size) {
+        return -1;
+    }
+    int len = 0;
+    while (len < count && first + len < group_size && !get_bit(taken, first + len)) {
+        set_bit(block_bitmap, first + len);
+        len++;
+    }
+
+    if (journal_write_part(group_block, first / 8, block_bitmap + first / 8, (first + len - 1) / 8 - first / 8 + 1)) {
+        return -1;
+    }
+    *got = len;
+    return first;
+}
+
+// Allocate a run of up to `count` consecutive bits, starting from the first free bit at or after `goal`
+// The search wraps around to the start of the bitmap
+// Return the first bit of the run, whose length is stored in `*got`, or -1 if the bitmap is full
+int alloc_run(int bitmap_block, int bitmap_size, int goal, int count, int* got)
+{
+    int group_num = ceil_div(bitmap_size, BITMAP_BITS_PER_BLOCK), goal_group = goal / BITMAP_BITS_PER_BLOCK;
+    // the goal group is visited twice, the second time for the bits before the goal
+    for (int i = 0; i <= group_num; i++) {
+        int g = (goal_group + i) % group_num;
+        int start = i == 0 ? goal % BITMAP_BITS_PER_BLOCK : 0;
+        int group_size = min(bitmap_size - g * BITMAP_BITS_PER_BLOCK, BITMAP_BITS_PER_BLOCK);
+        pthread_mutex_lock(&bitmap_lock[bitmap_block + g]);
+        int first = alloc_run_in_group(bitmap_block + g, group_size, start, count, got);
+        pthread_mutex_unlock(&bitmap_lock[bitmap_block + g]);
+        if (first != -1) {
+            bitmap_used[bitmap_block] += *got;
+            return g * BITMAP_BITS_PER_BLOCK + first;
+        }
+    }
+    return -1;
+}
+
+// Find the first run of at least `count` free bits within a group of the bitmap, without allocating it
+// Return the first bit of the run, or -1 if there is none
+int find_free_run(int bitmap_block, int bitmap_size, int count)
+{
+    char block_bitmap[FS_BLOCK_SIZE], taken_buf[FS_BLOCK_SIZE];
+    int group_num = ceil_div(bitmap_size, BITMAP_BITS_PER_BLOCK);
+    for (int g = 0; g < group_num; g++) {
+        int group_size = min(bitmap_size - g * BITMAP_BITS_PER_BLOCK, BITMAP_BITS_PER_BLOCK);
+        pthread_mutex_lock(&bitmap_lock[bitmap_block + g]);
+        int ret = cached_disk_read(bitmap_block + g, block_bitmap);
+        char* taken = ret ? NULL : taken_bits(bitmap_block + g, block_bitmap, taken_buf);
+        pthread_mutex_unlock(&bitmap_lock[bitmap_block + g]);
+        if (ret) {
+            return -1;
+        }
+        for (int i = 0, len = 0; i < group_size; i++) {
+            len = get_bit(taken, i) ? 0 : len + 1;
+            if (len == count) {
+                return g * BITMAP_BITS_PER_BLOCK + i - count + 1;
+            }
+        }
+    }
+    return -1;
+}
+
+// List a data block just freed, to be released once its transaction commits
+// The tid is read after the bitmap is journaled, so it is never older than the transaction that frees the block
+// Without memory the block stays out of the allocators until the next mount
+int hold_freed_block(int block_pos)
+{
+    pthread_mutex_lock(&journal.map_lock);
+    uint32_t tid = journal.tid;
+    pthread_mutex_unlock(&journal.map_lock);
+
+    pthread_mutex_lock(&freed_lock);
+    if (freed_num == freed_cap) {
+        int cap = max(freed_cap * 2, 64);
+        struct freed_block* blocks = realloc(freed_blocks, sizeof(struct freed_block) * cap);
+        if (blocks == NULL) {
+            pthread_mutex_unlock(&freed_lock);
+            return 0;
+        }
+        freed_blocks = blocks;
+        freed_cap = cap;
+    }
+    freed_blocks[freed_num++] = (struct freed_block) { .block_pos = block_pos, .tid = tid };
+    pthread_mutex_unlock(&freed_lock);
+    return 0;
+}
+
+int clear_block(int bitmap_block, int block_pos)
+{
+    // revoked before the bit is cleared, so it never drops the journal image of the block's next owner
+    if (bitmap_block == BITMAP_BLOCK_DATA) {
+        journal_revoke(DATA_BLOCK_START + block_pos);
+        device_set_metadata(DATA_BLOCK_START + block_pos, false);
+    }
+
+    int group_block = bitmap_block + block_pos / BITMAP_BITS_PER_BLOCK, bit = block_pos % BITMAP_BITS_PER_BLOCK;
+    pthread_mutex_lock(&bitmap_lock[group_block]);
+
+    // read the block bitmap
+    char block_bitmap[FS_BLOCK_SIZE];
+    if (cached_disk_read(group_block, block_bitmap)) {
+        pthread_mutex_unlock(&bitmap_lock[group_block]);
+        return -1;
+    }
+
+    // clear the block bitmap
+    clear_bit(block_bitmap, bit);
+    if (journal_write_part(group_block, bit / 8, block_bitmap + bit / 8, 1)) {
+        pthread_mutex_unlock(&bitmap_lock[group_block]);
+        return -1;
+    }
+    if (bitmap_block == BITMAP_BLOCK_DATA) {
+        set_bit(freed_bitmap, block_pos);
+    }
+
+    pthread_mutex_unlock(&bitmap_lock[group_block]);
+    bitmap_used[bitmap_block]--;
+    return bitmap_block == BITMAP_BLOCK_DATA ? hold_freed_block(block_pos) : 0;
+}
+
+// Count the set bits of a bitmap, a word at a time
+int count_bitmap(int bitmap_block, int bitmap_size)
+{
+    int used = 0;
+    uint64_t buf[FS_BLOCK_SIZE / sizeof(uint64_t)];
+    for (int g = 0; g < ceil_div(bitmap_size, BITMAP_BITS_PER_BLOCK); g++) {
+        if (cached_disk_read(bitmap_block + g, (char*)buf)) {
+            return -1;
+        }
+        for (int i = 0; i < FS_BLOCK_SIZE / (int)sizeof(uint64_t); i++) {
+            used += __builtin_popcountll(buf[i]);
+        }
+    }
+    return used;
+}
+
+// Compression, on with `-o compress`: when a whole cluster of consecutive file blocks is flushed from the write buffer,
+// it is compressed into an extent of fewer blocks, and each block pointer of the cluster points to the extent
+// Such a pointer has the top bit set, with the extent length and the position of the block in the cluster above its
+// address; the blocks of an extent get one reference per pointer, so extents are shared and released like cloned blocks
+// Files written without compression, and filesystems mounted without it, read compressed clusters all the same
+#define COMPRESS_CLUSTER 4 // blocks
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER * FS_BLOCK_SIZE)
+#define COMPRESSED_FLAG 0x80000000u
+#define COMPRESSED_LEN_SHIFT 28
+#define COMPRESSED_IDX_SHIFT 24
+#define BLOCK_ADDR_MASK ((1u << COMPRESSED_IDX_SHIFT) - 1)
+static_assert(COMPRESS_CLUSTER <= 1 << (COMPRESSED_LEN_SHIFT - COMPRESSED_IDX_SHIFT), "The position in a cluster should fit in a block pointer");
+
+bool is_compressed(int block_pos)
+{
+    return block_pos != -1 && ((uint32_t)block_pos & COMPRESSED_FLAG) && ((uint32_t)block_pos >> COMPRESSED_LEN_SHIFT & 7) != 0;
+}
+int extent_addr(int block_pos)
+{
+    return (uint32_t)block_pos & BLOCK_ADDR_MASK;
+}
+int extent_len(int block_pos)
+{
+    return is_compressed(block_pos) ? (int)((uint32_t)block_pos >> COMPRESSED_LEN_SHIFT & 7) : 1;
+}
+int compressed_pointer(int addr, int len, int idx)
+{
+    return (int)(COMPRESSED_FLAG | (uint32_t)len << COMPRESSED_LEN_SHIFT | (uint32_t)idx << COMPRESSED_IDX_SHIFT | addr);
+}
+
+// Tail packing, on with `-o tailpack`: the last partial block of a small file is stored with the tails of other files
+// in a shared block, cut into TAIL_SLOTS slots; a tail takes as many slots as its header and its bytes need
+// Its pointer has the top bit set like a compressed one, an extent length of 0, and its first slot above the address;
+// the length of the tail is in its header, so the pointer names (block, offset, length) without a field in the inode
+// A tail block gets one reference per pointer, so tails are shared, copied on write and released like cloned blocks
+#define TAIL_SLOTS 16 // per block
+#define TAIL_SLOT_SIZE (FS_BLOCK_SIZE / TAIL_SLOTS)
+#define TAIL_MAX_SLOTS (TAIL_SLOTS - 2) // a tail saving less than an eighth of a block gets a block of its own
+static_assert(TAIL_SLOTS <= 1 << (COMPRESSED_LEN_SHIFT - COMPRESSED_IDX_SHIFT), "The slot of a tail should fit in a block pointer");
+
+bool is_tail(int block_pos)
+{
+    return block_pos != -1 && ((uint32_t)block_pos & COMPRESSED_FLAG) && ((uint32_t)block_pos >> COMPRESSED_LEN_SHIFT & 7) == 0;
+}
+int tail_slot(int block_pos)
+{
+    return (uint32_t)block_pos >> COMPRESSED_IDX_SHIFT & ((1 << (COMPRESSED_LEN_SHIFT - COMPRESSED_IDX_SHIFT)) - 1);
+}
+int tail_pointer(int addr, int slot)
+{
+    return (int)(COMPRESSED_FLAG | (uint32_t)slot << COMPRESSED_IDX_SHIFT | addr);
+}
+
+// A small LZ77 codec in the format of LZ4 blocks: a token with the literal and match lengths in its nibbles, longer
+// lengths continued in bytes of 255, the literals, then a 2-byte offset; the last sequence has literals only
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+uint32_t lz_hash(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Append a length continued in bytes of 255
+void lz_put_len(uint8_t* out, int* op, int len)
+{
+    for (; len >= 255; len -= 255) {
+        out[(*op)++] = 255;
+    }
+    out[(*op)++] = len;
+}
+
+// Append a sequence; `match_len` is 0 for the last one
+// Return -1 if it does not fit in `out_max` bytes
+int lz_put_seq(uint8_t* out, int* op, int out_max, const uint8_t* lit, int lit_len, int offset, int match_len)
+{
+    if (*op + 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 > out_max) {
+        return -1;
+    }
+    int lit_nibble = min(lit_len, 15), match_nibble = match_len == 0 ? 0 : min(match_len - LZ_MIN_MATCH, 15);
+    out[(*op)++] = lit_nibble << 4 | match_nibble;
+    if (lit_nibble == 15) {
+        lz_put_len(out, op, lit_len - 15);
+    }
+    memcpy(out + *op, lit, lit_len);
+    *op += lit_len;
+    if (match_len > 0) {
+        out[(*op)++] = offset & 0xff;
+        out[(*op)++] = offset >> 8;
+        if (match_nibble == 15) {
+            lz_put_len(out, op, match_len - LZ_MIN_MATCH - 15);
+        }
+    }
+    return 0;
+}
+
+// Return the compressed size, or -1 if it is over `out_max`
+int lz_compress(const uint8_t* in, int in_len, uint8_t* out, int out_max)
+{
+    int table[1 << LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+    int anchor = 0, op = 0;
+    for (int pos = 0; pos + LZ_MIN_MATCH <= in_len;) {
+        uint32_t h = lz_hash(in + pos);
+        int candidate = table[h];
+        table[h] = pos;
+        if (candidate == -1 || pos - candidate > 0xffff || memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (pos + len < in_len && in[candidate + len] == in[pos + len]) {
+            len++;
+        }
+        if (lz_put_seq(out, &op, out_max, in + anchor, pos - anchor, pos - candidate, len)) {
+            return -1;
+        }
+        pos += len;
+        anchor = pos;
+    }
+    if (lz_put_seq(out, &op, out_max, in + anchor, in_len - anchor, 0, 0)) {
+        return -1;
+    }
+    return op;
+}
+
+// Read a length continued in bytes of 255
+int lz_get_len(const uint8_t* in, int* ip, int in_len, int len)
+{
+    for (int byte = 255; byte == 255; len += byte) {
+        if (*ip >= in_len) {
+            return -1;
+        }
+        byte = in[(*ip)++];
+    }
+    return len;
+}
+
+// Return 0 if `in` decompresses to exactly `out_len` bytes, -1 if it is corrupted
+int lz_decompress(const uint8_t* in, int in_len, uint8_t* out, int out_len)
+{
+    int ip = 0, op = 0;
+    while (ip < in_len) {
+        int token = in[ip++];
+        int lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = lz_get_len(in, &ip, in_len, lit_len)) == -1) {
+            return -1;
+        }
+        if (lit_len > in_len - ip || lit_len > out_len - op) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == in_len) {
+            break;
+        }
+
+        if (ip + 2 > in_len) {
+            return -1;
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        int match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && (match_len = lz_get_len(in, &ip, in_len, match_len)) == -1) {
+            return -1;
+        }
+        if (offset == 0 || offset > op || match_len > out_len - op) {
+            return -1;
+        }
+        // the match may overlap the bytes it produces: they repeat with a period of `offset`, so the copied span doubles
+        for (int from = op - offset, n; match_len > 0; op += n, match_len -= n) {
+            n = min(match_len, op - from);
+            memcpy(out + op, out + from, n);
+        }
+    }
+    return op == out_len ? 0 : -1;
+}
+
+// An extent starts with the compressed size, followed by the compressed cluster
+struct extent_header {
+    uint32_t size;
+};
+
+// Decompressed clusters, so reading the blocks of a cluster one by one decompresses it once
+// An entry stays valid while its extent is referenced, as extents are never written in place; it is dropped when the
+// extent is freed
+#define CLUSTER_CACHE_NUM 16
+struct cluster_cache_entry {
+    int addr; // of the extent, -1 if unused
+    char* buf; // of COMPRESS_CLUSTER_SIZE bytes
+};
+struct {
+    pthread_mutex_t lock;
+    struct cluster_cache_entry entry[CLUSTER_CACHE_NUM];
+    int next; // the entry replaced next, round robin
+} cluster_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int init_cluster_cache()
+{
+    for (int i = 0; i < CLUSTER_CACHE_NUM; i++) {
+        cluster_cache.entry[i].addr = -1;
+        free(cluster_cache.entry[i].buf);
+        if ((cluster_cache.entry[i].buf = malloc(COMPRESS_CLUSTER_SIZE)) == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void cluster_cache_put(int addr, const char* buf)
+{
+    pthread_mutex_lock(&cluster_cache.lock);
+    struct cluster_cache_entry* entry = &cluster_cache.entry[cluster_cache.next];
+    cluster_cache.next = (cluster_cache.next + 1) % CLUSTER_CACHE_NUM;
+    entry->addr = addr;
+    memcpy(entry->buf, buf, COMPRESS_CLUSTER_SIZE);
+    pthread_mutex_unlock(&cluster_cache.lock);
+}
+
+void cluster_cache_drop(int addr)
+{
+    pthread_mutex_lock(&cluster_cache.lock);
+    for (int i = 0; i < CLUSTER_CACHE_NUM; i++) {
+        if (cluster_cache.entry[i].addr == addr) {
+            cluster_cache.entry[i].addr = -1;
+        }
+    }
+    pthread_mutex_unlock(&cluster_cache.lock);
+}
+
+// Read part of a block of a compressed cluster, decompressing the cluster unless it is cached
+int compressed_read_part(int block_pos, int offset, char* buf, int size)
+{
+    int addr = extent_addr(block_pos), cluster_offset = ((uint32_t)block_pos >> COMPRESSED_IDX_SHIFT & (COMPRESS_CLUSTER - 1)) * FS_BLOCK_SIZE + offset;
+    pthread_mutex_lock(&cluster_cache.lock);
+    for (int i = 0; i < CLUSTER_CACHE_NUM; i++) {
+        if (cluster_cache.entry[i].addr == addr) {
+            memcpy(buf, cluster_cache.entry[i].buf + cluster_offset, size);
+            pthread_mutex_unlock(&cluster_cache.lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&cluster_cache.lock);
+
+    char extent[COMPRESS_CLUSTER_SIZE], cluster[COMPRESS_CLUSTER_SIZE];
+    for (int i = 0; i < extent_len(block_pos); i++) {
+        if (cached_disk_read(DATA_BLOCK_START + addr + i, extent + i * FS_BLOCK_SIZE)) {
+            return -1;
+        }
+    }
+    struct extent_header* header = (struct extent_header*)extent;
+    if (header->size > extent_len(block_pos) * FS_BLOCK_SIZE - sizeof(*header)
+        || lz_decompress((uint8_t*)(header + 1), header->size, (uint8_t*)cluster, COMPRESS_CLUSTER_SIZE)) {
+        return -1;
+    }
+    cluster_cache_put(addr, cluster);
+    memcpy(buf, cluster + cluster_offset, size);
+    return 0;
+}
+
+// A tail starts with its length, followed by its bytes
+struct tail_header {
+    uint32_t size;
+};
+
+// Read part of a block whose bytes are a packed tail; the block reads as zeros past the end of the tail
+int tail_read_part(int block_pos, int offset, char* buf, int size)
+{
+    int addr = extent_addr(block_pos), start = tail_slot(block_pos) * TAIL_SLOT_SIZE;
+    struct tail_header header;
+    if (cached_disk_read_part(DATA_BLOCK_START + addr, start, (char*)&header, sizeof(header))) {
+        return -1;
+    }
+    if (header.size > (uint32_t)(FS_BLOCK_SIZE - start - (int)sizeof(header))) {
+        return -1;
+    }
+    int stored = min(max((int)header.size - offset, 0), size);
+    if (stored > 0 && cached_disk_read_part(DATA_BLOCK_START + addr, start + sizeof(header) + offset, buf, stored)) {
+        return -1;
+    }
+    memset(buf + stored, 0, size - stored);
+    return 0;
+}
+
+// Data blocks shared between files by cloning, or by the pointers of a compressed cluster or of packed tails, carry a count of their extra
+// references, REFCOUNT_SIZE bytes per block,
+// so a block with a count of 0 has a single owner and is written in place; a shared one is copied on write
+// Every pointer counts, so a clone adds COMPRESS_CLUSTER references to each block of a compressed extent
+// Counts change through the journal, together with the block pointers that hold them
+#define REFCOUNT_MAX UINT16_MAX
+static_assert(FS_CLONE_MAX * COMPRESS_CLUSTER <= REFCOUNT_MAX, "the clones fs_ioctl.h promises fit in a count");
+pthread_mutex_t* refcount_lock; // one per block of counts
+
+int init_refcount_locks()
+{
+    free(refcount_lock);
+    if ((refcount_lock = malloc(sizeof(pthread_mutex_t) * REFCOUNT_BLOCK_NUM)) == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < REFCOUNT_BLOCK_NUM; i++) {
+        pthread_mutex_init(&refcount_lock[i], NULL);
+    }
+    return 0;
+}
+
+// Return the extra references of a data block, or -1 on error
+int block_refcount(int block_pos)
+{
+    uint16_t count;
+    if (cached_disk_read_part(REFCOUNT_START + block_pos / REFCOUNTS_PER_BLOCK, block_pos % REFCOUNTS_PER_BLOCK * REFCOUNT_SIZE, (char*)&count, REFCOUNT_SIZE)) {
+        return -1;
+    }
+    return count;
+}
+
+// Set the extra references of a data block, whose refcount lock the caller holds
+int set_block_refcount(int block_pos, int count)
+{
+    uint16_t value = count;
+    return journal_write_part(REFCOUNT_START + block_pos / REFCOUNTS_PER_BLOCK, block_pos % REFCOUNTS_PER_BLOCK * REFCOUNT_SIZE, (char*)&value, REFCOUNT_SIZE);
+}
+
+// Add a reference to a single data block
+// Return -EMLINK if the block has as many references as its count can hold
+int ref_one_block(int block_pos)
+{
+    pthread_mutex_t* lock = &refcount_lock[block_pos / REFCOUNTS_PER_BLOCK];
+    pthread_mutex_lock(lock);
+    int count = block_refcount(block_pos);
+    int ret = count == -1 ? -1 : count == REFCOUNT_MAX ? -EMLINK : set_block_refcount(block_pos, count + 1);
+    pthread_mutex_unlock(lock);
+    return ret;
+}
+
+// Drop a reference to a single data block, freeing the block with its last reference
+// Return 1 if the block was freed
+int release_one_block(int block_pos)
+{
+    pthread_mutex_t* lock = &refcount_lock[block_pos / REFCOUNTS_PER_BLOCK];
+    pthread_mutex_lock(lock);
+    int count = block_refcount(block_pos);
+    int ret = count > 0 ? set_block_refcount(block_pos, count - 1) : 0;
+    pthread_mutex_unlock(lock);
+    if (count == -1 || ret) {
+        return -1;
+    }
+    return count > 0 ? 0 : (clear_block(BITMAP_BLOCK_DATA, block_pos) ? -1 : 1);
+}
+
+// Add a reference to the block a file block pointer holds, every block of the extent for a compressed cluster
+// Return -EMLINK if a block has as many references as its count can hold, in which case none is added
+int ref_block(int block_pos)
+{
+    int addr = extent_addr(block_pos), len = extent_len(block_pos);
+    for (int i = 0; i < len; i++) {
+        int ret = ref_one_block(addr + i);
+        if (ret) {
+            while (--i >= 0) {
+                release_one_block(addr + i);
+            }
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// Drop a reference to the block a file block pointer holds, freeing it with its last reference
+// A block with a single reference can only be reached through the inode whose lock the caller holds,
+// so no clone can add a reference between the count being read and the block being freed
+int release_block(int block_pos)
+{
+    int addr = extent_addr(block_pos), freed = 0;
+    for (int i = 0; i < extent_len(block_pos); i++) {
+        int ret = release_one_block(addr + i);
+        if (ret == -1) {
+            return -1;
+        }
+        freed |= ret;
+    }
+    if (freed && is_compressed(block_pos)) {
+        cluster_cache_drop(addr);
+    }
+    return 0;
+}
+
+// Whether the block a file block pointer holds must not be written in place: it is shared, part of an extent or a tail
+// Return 1 if so, 0 if not, -1 on error
+int block_shared(int block_pos)
+{
+    if (is_compressed(block_pos) || is_tail(block_pos)) {
+        return 1;
+    }
+    int count = block_refcount(block_pos);
+    return count == -1 ? -1 : count > 0;
+}
+
+// Per-inode reader/writer locks, striped over a fixed table
+#define INODE_LOCK_NUM 1024
+pthread_rwlock_t inode_lock[INODE_LOCK_NUM];
+
+void init_inode_locks()
+{
+    for (int i = 0; i < INODE_LOCK_NUM; i++) {
+        pthread_rwlock_init(&inode_lock[i], NULL);
+    }
+}
+
+void lock_inode_read(int inode_pos)
+{
+    pthread_rwlock_rdlock(&inode_lock[inode_pos % INODE_LOCK_NUM]);
+}
+void lock_inode_write(int inode_pos)
+{
+    pthread_rwlock_wrlock(&inode_lock[inode_pos % INODE_LOCK_NUM]);
+}
+void unlock_inode(int inode_pos)
+{
+    pthread_rwlock_unlock(&inode_lock[inode_pos % INODE_LOCK_NUM]);
+}
+bool trylock_inode_write(int inode_pos)
+{
+    return pthread_rwlock_trywrlock(&inode_lock[inode_pos % INODE_LOCK_NUM]) == 0;
+}
+bool same_inode_lock(int a, int b)
+{
+    return a % INODE_LOCK_NUM == b % INODE_LOCK_NUM;
+}
+
+// Versions of the data of every inode, for the kernel page cache of `-o kcache`, see `open_keep_cache`
+// Bumped whenever the data or size of an inode changes, or the inode is freed for reuse; kept in memory only
+// The version of a directory only changes when it is freed, which `defrag_lock` relies on
+struct inode_version {
+    atomic_uint version;
+    atomic_uint opened; // the version when the inode was last opened
+    atomic_uint listed; // directories only: when a readdir last returned a page of it, see `compact_dir`
+};
+struct inode_version* inode_versions; // INODE_NUM of them
+
+int init_inode_versions()
+{
+    free(inode_versions);
+    inode_versions = calloc(INODE_NUM, sizeof(struct inode_version));
+    return inode_versions == NULL ? -1 : 0;
+}
+
+void inode_changed(int inode_pos)
+{
+    inode_versions[inode_pos].version++;
+}
+
+// Whether the kernel may keep the cached pages of `inode_pos` when it is opened: the data has not changed since
+// the previous open, when the kernel cached what it read through that one
+bool open_keep_cache(int inode_pos)
+{
+    unsigned int version = inode_versions[inode_pos].version;
+    return atomic_exchange(&inode_versions[inode_pos].opened, version) == version && options.kcache;
+}
+
+// Get the real block position (block pointer) corresponding to the block_id of the inode
+int get_block_pos(struct inode* inode, int id, int* block_pos)
+{
+    if (id < DIRECT_BLOCK_NUM) {
+        *block_pos = inode->block_point[id];
+        return 0;
+    } else {
+        int indirect_index = (id - DIRECT_BLOCK_NUM) / INDIRECT_POINTERS_PER_BLOCK, indirect_offset = (id - DIRECT_BLOCK_NUM) % INDIRECT_POINTERS_PER_BLOCK;
+
+        if (indirect_index >= SINGLE_INDIRECT_BLOCK_NUM) {
+            return -1; // Out of bounds
+        }
+
+        if (inode->block_point_indirect[indirect_index] == -1) {
+            *block_pos = -1;
+            return 0;
+        }
+
+        // only the pointer itself is copied out of the indirect block
+        uint32_t pointer;
+        if (cached_disk_read_part(DATA_BLOCK_START + inode->block_point_indirect[indirect_index], indirect_offset * sizeof(uint32_t), (char*)&pointer, sizeof(pointer))) {
+            return -1;
+        }
+
+        *block_pos = pointer;
+        return 0;
+    }
+}
+
+// Set the real block position (block pointer) corresponding to the block_id of the inode
+int set_block_pos(struct inode* inode, int id, int block_pos)
+{
+    if (id < DIRECT_BLOCK_NUM) {
+        inode->block_point[id] = block_pos;
+        return 0;
+    } else {
+        int indirect_index = (id - DIRECT_BLOCK_NUM) / INDIRECT_POINTERS_PER_BLOCK, indirect_offset = (id - DIRECT_BLOCK_NUM) % INDIRECT_POINTERS_PER_BLOCK;
+
+        if (indirect_index >= SINGLE_INDIRECT_BLOCK_NUM) {
+            return -1; // Out of bounds
+        }
+
+        if (inode->block_point_indirect[indirect_index] == -1) {
+            if (block_pos == -1) {
+                return 0; // Nothing to do, already -1
+            }
+            int indirect_block_pos = alloc_block(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE);
+            if (indirect_block_pos == -1) {
+                return -1;
+            }
+            inode->block_point_indirect[indirect_index] = indirect_block_pos;
+            // Initialize the indirect block
+            uint32_t zero_buf[INDIRECT_POINTERS_PER_BLOCK];
+            memset(zero_buf, -1, sizeof(zero_buf));
+            if (journal_write(DATA_BLOCK_START + indirect_block_pos, (char*)zero_buf)) {
+                return -1;
+            }
+        }
+
+        uint32_t pointer = block_pos;
+        if (journal_write_part(DATA_BLOCK_START + inode->block_point_indirect[indirect_index], indirect_offset * sizeof(uint32_t), (char*)&pointer, sizeof(pointer))) {
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+// Read and write the inode
+int inode_read(int inode_pos, struct inode* inode)
+{
+    int inode_block = inode_pos * INODE_SIZE / FS_BLOCK_SIZE, inode_offset = inode_pos * INODE_SIZE % FS_BLOCK_SIZE;
+    if (cached_disk_read_part(INODE_TABLE_START + inode_block, inode_offset, (char*)inode, sizeof(struct inode))) {
+        return -1;
+    }
+    return 0;
+}
+int inode_write(int inode_pos, struct inode* inode)
+{
+    // only the inode itself is written, so inodes sharing the block can be updated concurrently
+    int inode_block = inode_pos * INODE_SIZE / FS_BLOCK_SIZE, inode_offset = inode_pos * INODE_SIZE % FS_BLOCK_SIZE;
+    if (journal_write_part(INODE_TABLE_START + inode_block, inode_offset, (char*)inode, sizeof(struct inode))) {
+        return -1;
+    }
+    return 0;
+}
+
+// Inode-table blocks are zeroed lazily, the first time one of their inodes is allocated or by a background thread,
+// so formatting does not write the whole table; which blocks are zeroed is recorded in the superblock
+#define INODE_PER_BLOCK (FS_BLOCK_SIZE / INODE_SIZE)
+#define INODE_TABLE_INIT_DELAY 10000 // microseconds between blocks zeroed in the background
+uint8_t inode_table_init[MAX_INODE_TABLE_SIZE / 8];
+pthread_mutex_t inode_table_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Zero the inode-table block holding `inode_pos` unless it is already
+// Must be called inside a journal handle, so the block and the superblock recording it are committed together
+int init_inode_table_block(int inode_pos)
+{
+    int block = inode_pos / INODE_PER_BLOCK;
+    pthread_mutex_lock(&inode_table_init_lock);
+    if (get_bit((char*)inode_table_init, block)) {
+        pthread_mutex_unlock(&inode_table_init_lock);
+        return 0;
+    }
+    char buf[FS_BLOCK_SIZE];
+    memset(buf, 0, FS_BLOCK_SIZE);
+    int ret = journal_write(INODE_TABLE_START + block, buf);
+    if (ret == 0) {
+        set_bit((char*)inode_table_init, block);
+        ret = write_superblock(FS_MOUNTED);
+    }
+    pthread_mutex_unlock(&inode_table_init_lock);
+    return ret;
+}
+
+void* inode_table_init_thread([[maybe_unused]] void* arg)
+{
+    for (int block = 0; block < INODE_TABLE_SIZE; block++) {
+        pthread_mutex_lock(&inode_table_init_lock);
+        bool done = get_bit((char*)inode_table_init, block);
+        pthread_mutex_unlock(&inode_table_init_lock);
+        if (done) {
+            continue;
+        }
+        usleep(INODE_TABLE_INIT_DELAY);
+        journal_start();
+        init_inode_table_block(block * INODE_PER_BLOCK);
+        journal_stop();
+    }
+    return NULL;
+}
+
+void start_inode_table_init_thread()
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, inode_table_init_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// Read several inodes, reading each inode-table block only once
+// `inodes[i]` receives the inode at `inode_pos[i]`
+int compare_inode_pos(const void* a, const void* b)
+{
+    return **(const int**)a - **(const int**)b;
+}
+int inode_read_batch(const int* inode_pos, struct inode* inodes, int count)
+{
+    const int* order[DIR_ENTRY_NUM];
+    assert(count <= DIR_ENTRY_NUM);
+    for (int i = 0; i < count; i++) {
+        order[i] = &inode_pos[i];
+    }
+    qsort(order, count, sizeof(order[0]), compare_inode_pos);
+
+    char buf[FS_BLOCK_SIZE];
+    int loaded_block = -1;
+    for (int i = 0; i < count; i++) {
+        int inode_block = *order[i] * INODE_SIZE / FS_BLOCK_SIZE, inode_offset = *order[i] * INODE_SIZE % FS_BLOCK_SIZE;
+        if (inode_block != loaded_block) {
+            if (cached_disk_read(INODE_TABLE_START + inode_block, buf)) {
+                return -1;
+            }
+            loaded_block = inode_block;
+        }
+        memcpy(&inodes[order[i] - inode_pos], buf + inode_offset, sizeof(struct inode));
+    }
+    return 0;
+}
+
+void init_inode(struct inode* inode, mode_t mode)
+{
+    inode->mode = mode;
+    inode->size = 0;
+    inode->atime = inode->mtime = inode->ctime = time(NULL);
+    memset(inode->block_point, -1, sizeof(inode->block_point));
+    memset(inode->block_point_indirect, -1, sizeof(inode->block_point_indirect));
+    inode->dir_free_block = 0;
+}
+int update_inode(int inode_pos)
+{
+    struct inode inode;
+    if (inode_read(inode_pos, &inode)) {
+        return -1;
+    }
+    inode.ctime = time(NULL);
+    if (inode_write(inode_pos, &inode)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Read and write the data block; a block of a compressed cluster reads decompressed, a tail reads padded with zeros,
+// and neither is ever written
+int data_read(int block_pos, char* buf)
+{
+    if (is_compressed(block_pos)) {
+        return compressed_read_part(block_pos, 0, buf, FS_BLOCK_SIZE);
+    }
+    if (is_tail(block_pos)) {
+        return tail_read_part(block_pos, 0, buf, FS_BLOCK_SIZE);
+    }
+    if (cached_disk_read(DATA_BLOCK_START + block_pos, buf)) {
+        return -1;
+    }
+    return 0;
+}
+int data_write(int block_pos, char* buf)
+{
+    if (cached_disk_write(DATA_BLOCK_START + block_pos, buf)) {
+        return -1;
+    }
+    return 0;
+}
+int data_write_many(const int* block_pos, char* const* bufs, int count)
+{
+    int* homes = malloc(sizeof(int) * count);
+    if (homes == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        homes[i] = DATA_BLOCK_START + block_pos[i];
+    }
+    int ret = cached_disk_write_many(homes, bufs, count);
+    free(homes);
+    return ret;
+}
+
+// Directory blocks are metadata, written through the journal
+int dir_block_write(int block_pos, char* buf)
+{
+    return journal_write(DATA_BLOCK_START + block_pos, buf);
+}
+
+// Read part of a data block straight into the caller's buffer; a hole (-1) reads as zeros
+int data_read_part(int block_pos, int offset, char* buf, int size)
+{
+    if (block_pos == -1) {
+        memset(buf, 0, size);
+        return 0;
+    }
+    if (is_compressed(block_pos)) {
+        return compressed_read_part(block_pos, offset, buf, size);
+    }
+    if (is_tail(block_pos)) {
+        return tail_read_part(block_pos, offset, buf, size);
+    }
+    return cached_disk_read_part(DATA_BLOCK_START + block_pos, offset, buf, size);
+}
+
+// Describe part of a data block as a FUSE buffer, see `cached_disk_read_buf`
+// Holes, compressed blocks and tails are described by memory buffers
+// A block spliced from its backing file is pinned and stored in `*pinned`, -1 otherwise, until `unpin_blocks` once the
+// reply has been sent: the file may lose the block meanwhile, but no other file gets it and writes it in place
+int data_read_buf(int block_pos, int offset, int size, struct fuse_buf* out, int* pinned)
+{
+    *pinned = -1;
+    if (block_pos == -1 || is_compressed(block_pos) || is_tail(block_pos)) {
+        *out = (struct fuse_buf) {
+            .size = size,
+            .mem = malloc(size),
+            .fd = -1,
+        };
+        if (out->mem == NULL || data_read_part(block_pos, offset, out->mem, size)) {
+            free(out->mem);
+            out->mem = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    if (cached_disk_read_buf(DATA_BLOCK_START + block_pos, offset, size, out)) {
+        return -1;
+    }
+    if (out->flags & FUSE_BUF_IS_FD) {
+        block_pins[block_pos]++;
+        *pinned = block_pos;
+    }
+    return 0;
+}
+
+void unpin_blocks(const int* pins, int num)
+{
+    for (int i = 0; i < num; i++) {
+        if (pins[i] != -1) {
+            block_pins[pins[i]]--;
+        }
+    }
+}
+
+// Backing files handed to libfuse by `fs_read_buf`, with the blocks they pin
+// libfuse sends the reply right after the read returns but only frees its memory buffers, so the files are closed and
+// the blocks unpinned by a commit: not the first one after the read, which may run while the reply is sent, but the next
+struct spliced_read {
+    int fd;
+    int block_pos;
+    unsigned int generation;
+};
+struct spliced_read* spliced_reads;
+int spliced_num, spliced_cap;
+unsigned int spliced_generation; // advanced by every commit
+pthread_mutex_t spliced_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Keep the backing files of a buffer vector from `inode_read_buf` open and the blocks in `pins` pinned, see `spliced_read`
+// Return 0, or -1 if the list cannot grow, in which case none of them is held
+int hold_spliced_reads(const struct fuse_bufvec* bufv, const int* pins)
+{
+    pthread_mutex_lock(&spliced_lock);
+    if (spliced_num + (int)bufv->count > spliced_cap) {
+        int cap = max(spliced_cap * 2, spliced_num + (int)bufv->count + 64);
+        struct spliced_read* reads = realloc(spliced_reads, sizeof(struct spliced_read) * cap);
+        if (reads == NULL) {
+            pthread_mutex_unlock(&spliced_lock);
+            return -1;
+        }
+        spliced_reads = reads;
+        spliced_cap = cap;
+    }
+    for (size_t i = 0; i < bufv->count; i++) {
+        if (bufv->buf[i].flags & FUSE_BUF_IS_FD) {
+            spliced_reads[spliced_num++] = (struct spliced_read) { .fd = bufv->buf[i].fd, .block_pos = pins[i], .generation = spliced_generation };
+        }
+    }
+    pthread_mutex_unlock(&spliced_lock);
+    return 0;
+}
+
+// Close the backing files and unpin the blocks of the reads held since before the previous commit, or of `all` of them
+// once no reply can be in flight, and start a new generation
+void release_spliced_reads(bool all)
+{
+    pthread_mutex_lock(&spliced_lock);
+    int n = 0;
+    for (int i = 0; i < spliced_num; i++) {
+        struct spliced_read* read = &spliced_reads[i];
+        if (!all && read->generation == spliced_generation) {
+            spliced_reads[n++] = *read;
+            continue;
+        }
+        unpin_blocks(&read->block_pos, 1);
+        close(read->fd);
+    }
+    spliced_num = n;
+    spliced_generation++;
+    pthread_mutex_unlock(&spliced_lock);
+}
+
+// Delayed allocation: writes to regular files land in a per-inode buffer of dirty pages,
+// and their data blocks are allocated only when the buffer is flushed, all in one run where possible
+// A page is a whole block image, so reads of the file must look at the buffer first
+// Data blocks for pages over holes are reserved at write time, so a flush does not run out of space
+// A page over a block shared with another file, over a compressed cluster or over a tail, is treated like one over a
+// hole: it gets a block of its own at flush, so a tail that grows is split out of its tail block
+#define WRITE_BUFFER_PAGES 64 // per inode
+#define DIRTY_PAGE_LIMIT 4096 // over all inodes, beyond it other inodes are written back
+struct dirty_page {
+    int block_idx; // in the file
+    int block_pos; // -1 until allocated
+    int shared_pos; // the shared block the page replaces, released once the page has a block of its own, or -1
+    char buf[]; // of FS_BLOCK_SIZE bytes
+};
+struct write_buffer {
+    int inode_pos;
+    int page_num;
+    struct dirty_page* page[WRITE_BUFFER_PAGES];
+    struct write_buffer *prev, *next; // in the list of dirty inodes
+};
+// `write_buffers[i]` is guarded by the lock of inode i
+struct write_buffer** write_buffers; // INODE_NUM of them
+struct write_buffer dirty_inodes = { .prev = &dirty_inodes, .next = &dirty_inodes };
+pthread_mutex_t dirty_inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_int dirty_page_num;
+atomic_int reserved_blocks;
+
+// Sized for the inodes of the geometry, at mount, when no buffer holds pages
+int init_write_buffers()
+{
+    free(write_buffers);
+    write_buffers = calloc(INODE_NUM, sizeof(struct write_buffer*));
+    return write_buffers == NULL ? -1 : 0;
+}
+
+// The caller must hold the lock of the inode
+struct dirty_page* find_dirty_page(int inode_pos, int block_idx)
+{
+    struct write_buffer* wb = write_buffers[inode_pos];
+    if (wb == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < wb->page_num; i++) {
+        if (wb->page[i]->block_idx == block_idx) {
+            return wb->page[i];
+        }
+    }
+    return NULL;
+}
+
+// Reserve a data block for a page over a hole
+int reserve_block()
+{
+    // the blocks waiting for the commit of the transaction that freed them cannot be allocated yet
+    if (atomic_fetch_add(&reserved_blocks, 1) + bitmap_used[BITMAP_BLOCK_DATA] + freed_num >= DATA_BLOCK_SIZE) {
+        reserved_blocks--;
+        return -1;
+    }
+    return 0;
+}
+
+// Remove the page `i` of a buffer, and the buffer itself once it is empty
+// The caller must hold the lock of the inode for writing
+void remove_dirty_page(struct write_buffer* wb, int i)
+{
+    if (wb->page[i]->block_pos == -1) {
+        reserved_blocks--;
+    }
+    free(wb->page[i]);
+    wb->page[i] = wb->page[--wb->page_num];
+    dirty_page_num--;
+    if (wb->page_num == 0) {
+        pthread_mutex_lock(&dirty_inodes_lock);
+        wb->prev->next = wb->next;
+        wb->next->prev = wb->prev;
+        pthread_mutex_unlock(&dirty_inodes_lock);
+        write_buffers[wb->inode_pos] = NULL;
+        free(wb);
+    }
+}
+
+// Drop the buffered pages from `block_idx` on, for a file that is truncated or released
+// The caller must hold the lock of the inode for writing
+void drop_dirty_pages(int inode_pos, int block_idx)
+{
+    struct write_buffer* wb = write_buffers[inode_pos];
+    // the buffer itself is freed with its last page
+    for (int i = wb == NULL ? -1 : wb->page_num - 1; i >= 0 && write_buffers[inode_pos] != NULL; i--) {
+        if (wb->page[i]->block_idx >= block_idx) {
+            remove_dirty_page(wb, i);
+        }
+    }
+}
+
+int compare_dirty_page(const void* a, const void* b)
+{
+    return (*(struct dirty_page**)a)->block_idx - (*(struct dirty_page**)b)->block_idx;
+}
+
+// Where the data of block `block_idx` of a file best goes: right after the block before it, or 0
+int alloc_goal(struct inode* inode, int block_idx)
+{
+    int prev;
+    if (block_idx > 0 && get_block_pos(inode, block_idx - 1, &prev) == 0 && prev != -1) {
+        return extent_addr(prev) + extent_len(prev);
+    }
+    return 0;
+}
+
+// Compress a whole cluster of buffered pages into an extent and point the blocks of the cluster to it
+// The blocks the pages replace are released, and their pages are left with the new pointers
+// Return 1 if done, 0 if the cluster does not compress into fewer blocks or no run of free blocks fits it, -1 on error
+int compress_cluster(struct inode* inode, struct dirty_page** pages)
+{
+    char cluster[COMPRESS_CLUSTER_SIZE], extent[COMPRESS_CLUSTER_SIZE - FS_BLOCK_SIZE];
+    memset(extent, 0, sizeof(extent));
+    for (int i = 0; i < COMPRESS_CLUSTER; i++) {
+        memcpy(cluster + i * FS_BLOCK_SIZE, pages[i]->buf, FS_BLOCK_SIZE);
+    }
+    struct extent_header* header = (struct extent_header*)extent;
+    int size = lz_compress((uint8_t*)cluster, COMPRESS_CLUSTER_SIZE, (uint8_t*)(header + 1), sizeof(extent) - sizeof(*header));
+    if (size == -1) {
+        return 0;
+    }
+    header->size = size;
+    int len = ceil_div(sizeof(*header) + size, FS_BLOCK_SIZE);
+
+    // the pages over holes hold reservations; any block the extent needs beyond them is reserved first
+    int holes = 0;
+    for (int i = 0; i < COMPRESS_CLUSTER; i++) {
+        holes += pages[i]->block_pos == -1;
+    }
+    int extra = max(len - holes, 0);
+    for (int i = 0; i < extra; i++) {
+        if (reserve_block()) {
+            reserved_blocks -= i;
+            return 0;
+        }
+    }
+    int got, addr = alloc_run(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE, alloc_goal(inode, pages[0]->block_idx), len, &got);
+    if (addr == -1 || got < len) {
+        for (int i = 0; addr != -1 && i < got; i++) {
+            clear_block(BITMAP_BLOCK_DATA, addr + i);
+        }
+        reserved_blocks -= extra;
+        return 0;
+    }
+    reserved_blocks -= extra + holes;
+
+    for (int i = 0; i < len; i++) {
+        pthread_mutex_t* lock = &refcount_lock[(addr + i) / REFCOUNTS_PER_BLOCK];
+        pthread_mutex_lock(lock);
+        int ret = set_block_refcount(addr + i, COMPRESS_CLUSTER - 1);
+        pthread_mutex_unlock(lock);
+        if (ret || data_write(addr + i, extent + i * FS_BLOCK_SIZE)) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < COMPRESS_CLUSTER; i++) {
+        struct dirty_page* page = pages[i];
+        int old = page->block_pos != -1 ? page->block_pos : page->shared_pos;
+        page->block_pos = compressed_pointer(addr, len, i);
+        page->shared_pos = -1;
+        if (set_block_pos(inode, page->block_idx, page->block_pos) || (old != -1 && release_block(old))) {
+            return -1;
+        }
+    }
+    cluster_cache_put(addr, cluster);
+    return 1;
+}
+
+// The blocks tails are appended to, a few at once so most tails find slots that fit them closely
+// The packer holds a reference of its own on each of them until it moves on to another block, so a block cannot be
+// freed, with all its tails, while slots are still handed out
+// Slots are never reused: the space of a tail that is released comes back when the whole block does
+// Lock order: taken under an inode lock, before the bitmap and refcount locks
+#define TAIL_OPEN_BLOCKS 4
+struct tail_packer {
+    pthread_mutex_t lock;
+    int block_pos[TAIL_OPEN_BLOCKS]; // -1 if none
+    int next_slot[TAIL_OPEN_BLOCKS];
+} tail_packer = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void init_tail_packer()
+{
+    for (int i = 0; i < TAIL_OPEN_BLOCKS; i++) {
+        tail_packer.block_pos[i] = -1;
+    }
+}
+
+// Drop the references of the packer on its blocks, at unmount, with a journal handle
+// After a crash the references are left in the counts; the blocks are then freed only by `fs_check`
+int close_tail_blocks()
+{
+    int ret = 0;
+    pthread_mutex_lock(&tail_packer.lock);
+    for (int i = 0; i < TAIL_OPEN_BLOCKS; i++) {
+        if (tail_packer.block_pos[i] != -1 && release_one_block(tail_packer.block_pos[i]) == -1) {
+            ret = -1;
+        }
+        tail_packer.block_pos[i] = -1;
+    }
+    pthread_mutex_unlock(&tail_packer.lock);
+    return ret;
+}
+
+// Whether the page is the last, partial block of the file, small enough to be packed as a tail
+bool tail_fits(struct inode* inode, struct dirty_page* page)
+{
+    int len = inode->size % FS_BLOCK_SIZE;
+    return S_ISREG(inode->mode) && len != 0 && page->block_idx == inode->size / FS_BLOCK_SIZE
+        && ceil_div(sizeof(struct tail_header) + len, TAIL_SLOT_SIZE) <= TAIL_MAX_SLOTS;
+}
+
+// Pack the page over a hole as a tail, into the free slots of an open tail block, or into a new block if none has enough
+// The reservation of the page pays for a new block; the block the page replaces is released
+// Return 1 if done, 0 if the chosen block has as many references as its count can hold, -1 on error
+int pack_tail(struct inode* inode, struct dirty_page* page)
+{
+    int len = inode->size % FS_BLOCK_SIZE, slots = ceil_div(sizeof(struct tail_header) + len, TAIL_SLOT_SIZE);
+    char tail[FS_BLOCK_SIZE];
+    memset(tail, 0, sizeof(tail));
+    ((struct tail_header*)tail)->size = len;
+    memcpy(tail + sizeof(struct tail_header), page->buf, len);
+
+    // the open block with the fewest free slots that still hold the tail, or else the fullest one is replaced
+    pthread_mutex_lock(&tail_packer.lock);
+    int best = -1, fullest = 0;
+    for (int i = 0; i < TAIL_OPEN_BLOCKS; i++) {
+        int free_slots = tail_packer.block_pos[i] == -1 ? -1 : TAIL_SLOTS - tail_packer.next_slot[i];
+        if (free_slots >= slots && (best == -1 || free_slots < TAIL_SLOTS - tail_packer.next_slot[best])) {
+            best = i;
+        }
+        if (tail_packer.block_pos[fullest] != -1 && (free_slots == -1 || tail_packer.next_slot[i] > tail_packer.next_slot[fullest])) {
+            fullest = i;
+        }
+    }
+    int addr, slot, ret = 0;
+    if (best != -1) {
+        addr = tail_packer.block_pos[best];
+        slot = tail_packer.next_slot[best];
+        ret = ref_one_block(addr);
+        if (ret == 0) {
+            ret = cached_disk_write_part(DATA_BLOCK_START + addr, slot * TAIL_SLOT_SIZE, tail, sizeof(struct tail_header) + len);
+        }
+    } else {
+        // a new block is written whole, so it is never read first
+        int old = tail_packer.block_pos[fullest];
+        best = fullest;
+        slot = 0;
+        addr = alloc_block(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE);
+        if (addr == -1 || ref_one_block(addr) || data_write(addr, tail) || (old != -1 && release_one_block(old) == -1)) {
+            ret = -1;
+        } else {
+            tail_packer.block_pos[best] = addr;
+        }
+    }
+    if (ret == 0) {
+        tail_packer.next_slot[best] = slot + slots;
+    }
+    pthread_mutex_unlock(&tail_packer.lock);
+    if (ret == -EMLINK) {
+        return 0;
+    }
+    if (ret) {
+        return -1;
+    }
+
+    reserved_blocks--;
+    int old = page->shared_pos;
+    page->block_pos = tail_pointer(addr, slot);
+    page->shared_pos = -1;
+    if (set_block_pos(inode, page->block_idx, page->block_pos) || (old != -1 && release_block(old))) {
+        return -1;
+    }
+    return 1;
+}
+
+// Write the buffered pages of an inode to the disk
+// With compression on, whole clusters inside the file are compressed first
+// With tail packing on, the last block of a small file is packed next, if it is partial and over a hole
+// The other pages over holes get a run of blocks right after the block before them in the file, where it is free
+// The caller must hold the lock of the inode for writing, and writes `inode` back
+int flush_write_buffer(int inode_pos, struct inode* inode)
+{
+    struct write_buffer* wb = write_buffers[inode_pos];
+    if (wb == NULL) {
+        return 0;
+    }
+    qsort(wb->page, wb->page_num, sizeof(wb->page[0]), compare_dirty_page);
+
+    bool packed[WRITE_BUFFER_PAGES] = { false };
+    for (int i = 0; options.compress && i + COMPRESS_CLUSTER <= wb->page_num; i++) {
+        int first = wb->page[i]->block_idx;
+        if (first % COMPRESS_CLUSTER != 0 || wb->page[i + COMPRESS_CLUSTER - 1]->block_idx != first + COMPRESS_CLUSTER - 1
+            || first + COMPRESS_CLUSTER > ceil_div(inode->size, FS_BLOCK_SIZE)) {
+            continue;
+        }
+        int ret = compress_cluster(inode, wb->page + i);
+        if (ret == -1) {
+            return -1;
+        }
+        for (int j = 0; ret == 1 && j < COMPRESS_CLUSTER; j++) {
+            packed[i + j] = true;
+        }
+    }
+    // sorted, so the last block of the file can only be the last page
+    int last = wb->page_num - 1;
+    if (options.tailpack && !packed[last] && wb->page[last]->block_pos == -1 && tail_fits(inode, wb->page[last])) {
+        int ret = pack_tail(inode, wb->page[last]);
+        if (ret == -1) {
+            return -1;
+        }
+        packed[last] = ret == 1;
+    }
+
+    int unallocated = 0;
+    for (int i = 0; i < wb->page_num; i++) {
+        unallocated += !packed[i] && wb->page[i]->block_pos == -1;
+    }
+
+    // the pages are written together, so a device may write them in parallel
+    int written[WRITE_BUFFER_PAGES];
+    char* bufs[WRITE_BUFFER_PAGES];
+    int written_num = 0;
+    int run_start = -1, run_len = 0;
+    for (int i = 0; i < wb->page_num; i++) {
+        struct dirty_page* page = wb->page[i];
+        if (packed[i]) {
+            continue;
+        }
+        if (page->block_pos == -1) {
+            if (run_len == 0) {
+                run_start = alloc_run(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE, alloc_goal(inode, page->block_idx), unallocated, &run_len);
+                if (run_start == -1) {
+                    return -1;
+                }
+            }
+            page->block_pos = run_start++;
+            run_len--;
+            unallocated--;
+            reserved_blocks--;
+            if (set_block_pos(inode, page->block_idx, page->block_pos)) {
+                return -1;
+            }
+            if (page->shared_pos != -1 && release_block(page->shared_pos)) {
+                return -1;
+            }
+            page->shared_pos = -1;
+        }
+        // a whole block is written, so it is never read first
+        written[written_num] = page->block_pos;
+        bufs[written_num++] = page->buf;
+    }
+    if (written_num > 0 && data_write_many(written, bufs, written_num)) {
+        return -1;
+    }
+
+    while (write_buffers[inode_pos] != NULL) {
+        remove_dirty_page(wb, wb->page_num - 1);
+    }
+    return 0;
+}
+
+// Flush the buffered pages of an inode whose lock the caller holds for writing
+int sync_inode_locked(int inode_pos)
+{
+    if (write_buffers[inode_pos] == NULL) {
+        return 0;
+    }
+    struct inode inode;
+    if (inode_read(inode_pos, &inode) || flush_write_buffer(inode_pos, &inode) || inode_write(inode_pos, &inode)) {
+        return -1;
+    }
+    return 0;
+}
+
+int sync_inode(int inode_pos)
+{
+    JOURNAL_HANDLE();
+    lock_inode_write(inode_pos);
+    int ret = sync_inode_locked(inode_pos);
+    unlock_inode(inode_pos);
+    return ret;
+}
+
+// Flush the buffers of other inodes when too many pages are buffered
+// The caller holds the lock of `self` for writing, so busy inodes are skipped rather than waited for
+void write_back_dirty_inodes(int self)
+{
+    int victims[WRITE_BUFFER_PAGES], victim_num = 0;
+    pthread_mutex_lock(&dirty_inodes_lock);
+    for (struct write_buffer* wb = dirty_inodes.next; wb != &dirty_inodes && victim_num < WRITE_BUFFER_PAGES; wb = wb->next) {
+        if (wb->inode_pos != self) {
+            victims[victim_num++] = wb->inode_pos;
+        }
+    }
+    pthread_mutex_unlock(&dirty_inodes_lock);
+
+    for (int i = 0; i < victim_num && dirty_page_num >= DIRTY_PAGE_LIMIT && !journal_handle_busy(); i++) {
+        if (same_inode_lock(victims[i], self)) {
+            sync_inode_locked(victims[i]);
+        } else if (trylock_inode_write(victims[i])) {
+            sync_inode_locked(victims[i]);
+            unlock_inode(victims[i]);
+        }
+    }
+}
+
+// Flush every buffered page and commit, at unmount
+int sync_all()
+{
+    for (;;) {
+        pthread_mutex_lock(&dirty_inodes_lock);
+        int inode_pos = dirty_inodes.next == &dirty_inodes ? -1 : dirty_inodes.next->inode_pos;
+        pthread_mutex_unlock(&dirty_inodes_lock);
+        if (inode_pos == -1) {
+            break;
+        }
+        if (sync_inode(inode_pos)) {
+            return -1;
+        }
+    }
+    return journal_commit();
+}
+
+// Get the buffered page of block `block_idx` of an inode, adding it to the buffer if needed
+// The page is loaded from the disk unless the caller is about to overwrite all of it
+// The caller must hold the lock of the inode for writing
+// Return NULL on error, or if no data block can be reserved for a page over a hole
+struct dirty_page* get_dirty_page(int inode_pos, struct inode* inode, int block_idx, bool overwrite)
+{
+    struct dirty_page* page = find_dirty_page(inode_pos, block_idx);
+    if (page != NULL) {
+        return page;
+    }
+
+    struct write_buffer* wb = write_buffers[inode_pos];
+    if (wb != NULL && wb->page_num == WRITE_BUFFER_PAGES) {
+        if (flush_write_buffer(inode_pos, inode)) {
+            return NULL;
+        }
+        wb = NULL;
+    }
+    if (dirty_page_num >= DIRTY_PAGE_LIMIT) {
+        write_back_dirty_inodes(inode_pos);
+    }
+
+    int block_pos;
+    if (get_block_pos(inode, block_idx, &block_pos)) {
+        return NULL;
+    }
+    page = malloc(sizeof(struct dirty_page) + FS_BLOCK_SIZE);
+    if (page == NULL) {
+        return NULL;
+    }
+    page->block_idx = block_idx;
+    page->block_pos = block_pos;
+    page->shared_pos = -1;
+    if (overwrite || block_pos == -1) {
+        memset(page->buf, 0, FS_BLOCK_SIZE);
+    } else if (data_read(block_pos, page->buf)) {
+        free(page);
+        return NULL;
+    }
+    if (block_pos != -1) {
+        int shared = block_shared(block_pos);
+        if (shared == -1) {
+            free(page);
+            return NULL;
+        }
+        if (shared) {
+            page->shared_pos = block_pos;
+            page->block_pos = -1;
+        }
+    }
+    if (page->block_pos == -1 && reserve_block()) {
+        free(page);
+        return NULL;
+    }
+
+    if (wb == NULL) {
+        wb = calloc(1, sizeof(struct write_buffer));
+        if (wb == NULL) {
+            if (page->block_pos == -1) {
+                reserved_blocks--;
+            }
+            free(page);
+            return NULL;
+        }
+        wb->inode_pos = inode_pos;
+        write_buffers[inode_pos] = wb;
+        pthread_mutex_lock(&dirty_inodes_lock);
+        wb->prev = dirty_inodes.prev;
+        wb->next = &dirty_inodes;
+        dirty_inodes.prev->next = wb;
+        dirty_inodes.prev = wb;
+        pthread_mutex_unlock(&dirty_inodes_lock);
+    }
+    wb->page[wb->page_num++] = page;
+    dirty_page_num++;
+    return page;
+}
+
+// Iterate over the allocated data blocks of an inode, loading one block at a time
+// Unallocated direct pointers and whole unallocated indirect ranges are skipped without any disk access
+struct block_iter {
+    struct inode* inode;
+    int block_id; // logical block id of the current block
+    int block_pos; // physical block position of the current block
+    int indirect_index; // which indirect block is cached in `indirect_buf`, -1 if none
+    uint32_t indirect_buf[MAX_BLOCK_SIZE / sizeof(uint32_t)]; // INDIRECT_POINTERS_PER_BLOCK of them are used
+};
+
+void block_iter_init(struct block_iter* iter, struct inode* inode, int start_block_id)
+{
+    iter->inode = inode;
+    iter->block_id = start_block_id - 1;
+    iter->block_pos = -1;
+    iter->indirect_index = -1;
+}
+
+// Advance to the next allocated block
+// Return 1 if a block is found, 0 at the end, -1 on error
+int block_iter_next(struct block_iter* iter)
+{
+    struct inode* inode = iter->inode;
+    for (int id = iter->block_id + 1; id < DATA_BLOCK_PER_INODE; id++) {
+        if (id < DIRECT_BLOCK_NUM) {
+            if (inode->block_point[id] == -1) {
+                continue;
+            }
+            iter->block_id = id;
+            iter->block_pos = inode->block_point[id];
+            return 1;
+        }
+
+        int indirect_index = (id - DIRECT_BLOCK_NUM) / INDIRECT_POINTERS_PER_BLOCK, indirect_offset = (id - DIRECT_BLOCK_NUM) % INDIRECT_POINTERS_PER_BLOCK;
+        if (inode->block_point_indirect[indirect_index] == -1) {
+            // skip the whole range covered by this indirect block
+            id = DIRECT_BLOCK_NUM + (indirect_index + 1) * INDIRECT_POINTERS_PER_BLOCK - 1;
+            continue;
+        }
+        if (iter->indirect_index != indirect_index) {
+            if (cached_disk_read(DATA_BLOCK_START + inode->block_point_indirect[indirect_index], (char*)iter->indirect_buf)) {
+                return -1;
+            }
+            iter->indirect_index = indirect_index;
+        }
+        if (iter->indirect_buf[indirect_offset] == -1) {
+            continue;
+        }
+        iter->block_id = id;
+        iter->block_pos = iter->indirect_buf[indirect_offset];
+        return 1;
+    }
+    iter->block_id = DATA_BLOCK_PER_INODE;
+    return 0;
+}
+
+// Directory iterator: each allocated directory block is read once and its records are walked in place
+struct dir_iter {
+    struct block_iter blocks;
+    uint32_t seen; // bytes of used records visited so far, compared against the directory size
+    char buf[MAX_BLOCK_SIZE]; // FS_BLOCK_SIZE of it is used
+};
+
+void dir_iter_init(struct dir_iter* iter, struct inode* inode, int start_block_id)
+{
+    block_iter_init(&iter->blocks, inode, start_block_id);
+    iter->seen = 0;
+}
+
+// Load the next directory block into `iter->buf`
+// Return 1 if a block is loaded, 0 at the end (or once all entries of the directory have been seen), -1 on error
+int dir_iter_next(struct dir_iter* iter)
+{
+    if (iter->seen >= iter->blocks.inode->size) {
+        return 0;
+    }
+    int ret = block_iter_next(&iter->blocks);
+    if (ret != 1) {
+        return ret;
+    }
+    if (data_read(iter->blocks.block_pos, iter->buf)) {
+        return -1;
+    }
+    return 1;
+}
+
+// Write the current directory block back
+int dir_iter_write(struct dir_iter* iter)
+{
+    return dir_block_write(iter->blocks.block_pos, iter->buf);
+}
+
+// The record at byte `offset` of a directory block
+struct dir_entry* dir_rec(char* buf, int offset)
+{
+    return (struct dir_entry*)(buf + offset);
+}
+
+// A record spanning a whole 64 KiB block stores DIR_REC_LEN_MAX, never a real length as records are aligned
+#define DIR_REC_LEN_MAX UINT16_MAX
+int rec_len_of(const struct dir_entry* rec)
+{
+    return rec->rec_len == DIR_REC_LEN_MAX ? DIR_REC_LEN_MAX + 1 : rec->rec_len;
+}
+void set_rec_len(struct dir_entry* rec, int rec_len)
+{
+    rec->rec_len = rec_len > DIR_REC_LEN_MAX ? DIR_REC_LEN_MAX : rec_len;
+}
+
+// The offset of the record after the one at `offset`, or -1 if that record is corrupt: its length does not tile the block
+// in aligned steps, or is too short for its name
+// Every walk over the records of a block goes through this, so a bad length can never loop or read past the block
+int dir_rec_next(char* buf, int offset)
+{
+    const struct dir_entry* rec = dir_rec(buf, offset);
+    int rec_len = rec_len_of(rec);
+    if (rec_len < (int)DIR_REC_HEADER_SIZE || rec_len % DIR_REC_ALIGN != 0 || offset + rec_len > FS_BLOCK_SIZE
+        || (rec->inode_pos != 0 && (rec->name_len == 0 || rec_len < DIR_REC_LEN(rec->name_len)))) {
+        return -1;
+    }
+    return offset + rec_len;
+}
+
+// Find the used record named `name` within one directory block, adding the used bytes visited to `used`
+// `prev` receives the offset of the record before it, -1 if it is the first one
+// Return the offset of the record in the block, -1 if not found, or -EIO if a record is corrupt
+int dir_block_find(char* buf, const char* name, int name_len, uint32_t* used, int* prev)
+{
+    *prev = -1;
+    for (int offset = 0, next; offset < FS_BLOCK_SIZE; *prev = offset, offset = next) {
+        struct dir_entry* rec = dir_rec(buf, offset);
+        next = dir_rec_next(buf, offset);
+        if (next == -1) {
+            return -EIO;
+        }
+        if (rec->inode_pos == 0) {
+            continue;
+        }
+        *used += DIR_REC_LEN(rec->name_len);
+        // compare the lengths first, so most mismatches never touch the names
+        if (rec->name_len == name_len && memcmp(rec->name, name, name_len) == 0) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+// Find a record with at least `rec_len` bytes of slack within one directory block
+// Return the offset of that record, -1 if the block has no room, or -EIO if a record is corrupt
+int dir_block_find_free(char* buf, int rec_len)
+{
+    for (int offset = 0, next; offset < FS_BLOCK_SIZE; offset = next) {
+        struct dir_entry* rec = dir_rec(buf, offset);
+        next = dir_rec_next(buf, offset);
+        if (next == -1) {
+            return -EIO;
+        }
+        int used = rec->inode_pos == 0 ? 0 : DIR_REC_LEN(rec->name_len);
+        if (rec_len_of(rec) - used >= rec_len) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+bool dir_block_empty(char* buf)
+{
+    return dir_rec(buf, 0)->inode_pos == 0 && rec_len_of(dir_rec(buf, 0)) == FS_BLOCK_SIZE;
+}
+
+// Initialize a directory block holding a single unused record
+void dir_block_init(char* buf)
+{
+    memset(buf, 0, FS_BLOCK_SIZE);
+    set_rec_len(dir_rec(buf, 0), FS_BLOCK_SIZE);
+}
+
+// Copy a record out of a directory block, terminating its name
+void dir_rec_copy(struct dir_entry* dst, const struct dir_entry* rec)
+{
+    memcpy(dst, rec, DIR_REC_HEADER_SIZE + rec->name_len);
+    dst->name[rec->name_len] = '\0';
+}
+
+// Insert the entry into the directory
+// The search starts from the free block hint stored in the inode, so appending to a directory is O(1)
+// Return 0 on success, -EIO if a directory block is corrupt, or -1 on other errors
+int add_dir_entry(struct inode* inode, const struct dir_entry* entry)
+{
+    int rec_len = DIR_REC_LEN(entry->name_len);
+    char buf[FS_BLOCK_SIZE];
+    for (int block_id = inode->dir_free_block; block_id < DATA_BLOCK_PER_INODE; block_id++) {
+        int block_pos;
+        if (get_block_pos(inode, block_id, &block_pos)) {
+            return -1;
+        }
+        if (block_pos == -1) {
+            block_pos = alloc_block(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE);
+            if (block_pos == -1) {
+                return -1;
+            }
+            if (set_block_pos(inode, block_id, block_pos)) {
+                return -1;
+            }
+            dir_block_init(buf);
+        } else if (data_read(block_pos, buf)) {
+            return -1;
+        }
+
+        int offset = dir_block_find_free(buf, rec_len);
+        if (offset == -1) {
+            continue;
+        }
+        if (offset < 0) {
+            return offset;
+        }
+
+        // split the slack off the end of the record found, or reuse it if it is unused
+        struct dir_entry* rec = dir_rec(buf, offset);
+        if (rec->inode_pos != 0) {
+            int used = DIR_REC_LEN(rec->name_len);
+            int slack = rec_len_of(rec) - used;
+            set_rec_len(rec, used);
+            offset += used;
+            rec = dir_rec(buf, offset);
+            set_rec_len(rec, slack);
+        }
+        rec->inode_pos = entry->inode_pos;
+        rec->name_len = entry->name_len;
+        rec->type = entry->type;
+        memcpy(rec->name, entry->name, entry->name_len);
+        if (dir_block_write(block_pos, buf)) {
+            return -1;
+        }
+        inode->size += rec_len;
+        inode->dir_free_block = block_id;
+        return 0;
+    }
+    return -1;
+}
+
+// Find the entry named `entry_name` in the directory and copy it into `found`
+// Return 0 if found, -1 if not found or on error, or -EIO if a directory block is corrupt
+int find_dir_entry(struct inode* inode, const char* entry_name, struct dir_entry* found)
+{
+    int name_len = strlen(entry_name);
+    if (name_len > MAX_FILENAME_LEN) {
+        return -1;
+    }
+
+    struct dir_iter iter;
+    dir_iter_init(&iter, inode, 0);
+    while (dir_iter_next(&iter) == 1) {
+        int prev;
+        int offset = dir_block_find(iter.buf, entry_name, name_len, &iter.seen, &prev);
+        if (offset < -1) {
+            return offset;
+        }
+        if (offset != -1) {
+            dir_rec_copy(found, dir_rec(iter.buf, offset));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Remove the entry named `entry_name` from the directory and copy it into `old_entry`
+// The record is merged into the one before it, so the records after it keep their offsets
+// A directory block left empty is released immediately
+// Return 0 if the entry is removed, -1 if not found or on error, or -EIO if a directory block is corrupt
+int remove_dir_entry(struct inode* inode, const char* entry_name, struct dir_entry* old_entry)
+{
+    int name_len = strlen(entry_name);
+    if (name_len > MAX_FILENAME_LEN) {
+        return -1;
+    }
+
+    struct dir_iter iter;
+    dir_iter_init(&iter, inode, 0);
+    while (dir_iter_next(&iter) == 1) {
+        int prev;
+        int offset = dir_block_find(iter.buf, entry_name, name_len, &iter.seen, &prev);
+        if (offset == -1) {
+            continue;
+        }
+        if (offset < 0) {
+            return offset;
+        }
+
+        struct dir_entry* rec = dir_rec(iter.buf, offset);
+        dir_rec_copy(old_entry, rec);
+        inode->size -= DIR_REC_LEN(rec->name_len);
+        if (prev == -1) {
+            rec->inode_pos = 0;
+        } else {
+            set_rec_len(dir_rec(iter.buf, prev), rec_len_of(dir_rec(iter.buf, prev)) + rec_len_of(rec));
+        }
+        if (iter.blocks.block_id < inode->dir_free_block) {
+            inode->dir_free_block = iter.blocks.block_id;
+        }
+
+        if (dir_block_empty(iter.buf)) {
+            if (clear_block(BITMAP_BLOCK_DATA, iter.blocks.block_pos)) {
+                return -1;
+            }
+            if (set_block_pos(inode, iter.blocks.block_id, -1)) {
+                return -1;
+            }
+            return 0;
+        }
+        if (dir_iter_write(&iter)) {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// Point the entry named `entry_name` in the directory to the inode of `entry`, in its own record, and copy what it held
+// into `old_entry`; unlike removing and adding it, this never needs room in the directory
+// Return 0 if the entry is replaced, -1 if not found or on error, or -EIO if a directory block is corrupt
+int replace_dir_entry(struct inode* inode, const char* entry_name, const struct dir_entry* entry, struct dir_entry* old_entry)
+{
+    int name_len = strlen(entry_name);
+    if (name_len > MAX_FILENAME_LEN) {
+        return -1;
+    }
+
+    struct dir_iter iter;
+    dir_iter_init(&iter, inode, 0);
+    while (dir_iter_next(&iter) == 1) {
+        int prev;
+        int offset = dir_block_find(iter.buf, entry_name, name_len, &iter.seen, &prev);
+        if (offset == -1) {
+            continue;
+        }
+        if (offset < 0) {
+            return offset;
+        }
+
+        struct dir_entry* rec = dir_rec(iter.buf, offset);
+        dir_rec_copy(old_entry, rec);
+        rec->inode_pos = entry->inode_pos;
+        rec->type = entry->type;
+        return dir_iter_write(&iter) ? -1 : 0;
+    }
+    return -1;
+}
+
+// Called every time a directory entry is visited. Return 0 to continue, nonzero to break
+typedef int (*walk_dir_entry_callback)(struct dir_entry*, void* context);
+int walk_dir_entry(struct inode* inode, walk_dir_entry_callback callback, void* context)
+{
+    assert(inode->size % DIR_REC_ALIGN == 0);
+    struct dir_iter iter;
+    dir_iter_init(&iter, inode, 0);
+    int ret;
+    while ((ret = dir_iter_next(&iter)) == 1) {
+        for (int offset = 0, next; offset < FS_BLOCK_SIZE; offset = next) {
+            struct dir_entry* rec = dir_rec(iter.buf, offset);
+            next = dir_rec_next(iter.buf, offset);
+            if (next == -1) {
+                return -EIO;
+            }
+            if (rec->inode_pos == 0) {
+                continue;
+            }
+            iter.seen += DIR_REC_LEN(rec->name_len);
+            struct dir_entry entry;
+            dir_rec_copy(&entry, rec);
+            if (callback(&entry, context)) {
+                return 0;
+            }
+        }
+    }
+    return ret;
+}
+
+// Look up `name` in the directory `parent_inode` and copy its entry into `entry`
+// Only this one directory is locked, so walking down a path never holds two directory locks
+// Return the inode position of the entry, or -ENOENT if there is no such entry
+int lookup_inode(int parent_inode, const char* name, struct dir_entry* entry)
+{
+    struct inode inode;
+    lock_inode_read(parent_inode);
+    int ret = inode_read(parent_inode, &inode) ? -1 : find_dir_entry(&inode, name, entry);
+    unlock_inode(parent_inode);
+    return ret == 0 ? (int)entry->inode_pos : ret == -1 ? -ENOENT : ret;
+}
+
+#define MAX_LAYER 130
+
+// Resolve the path to the inode
+// Return the inode position if the path exists, -1 otherwise
+int resolve_path_to_inode(const char* path, struct inode* inode)
+{
+    char path_layer[MAX_LAYER][MAX_FILENAME_LEN + 1];
+    int layer_count = 0;
+    char* path4dir = strdup(path);
+    char* dir = path4dir;
+    for (; strcmp(dir, "/") != 0 && strcmp(dir, ".") != 0; layer_count++, dir = dirname(dir)) {
+        const char* base = basename(dir);
+        assert(layer_count < MAX_LAYER);
+        if (strlen(base) > MAX_FILENAME_LEN) {
+            free(path4dir);
+            return -1;
+        }
+        strcpy(path_layer[layer_count], base);
+    }
+    free(path4dir);
+
+    int inode_pos = ROOT_INODE;
+    while (layer_count-- > 0) {
+        struct dir_entry entry;
+        inode_pos = lookup_inode(inode_pos, path_layer[layer_count], &entry);
+        if (inode_pos < 0) {
+            return -1;
+        }
+    }
+
+    if (inode_read(inode_pos, inode)) {
+        return -1;
+    }
+    return inode_pos;
+}
+
+// Whether a geometry, from `set_geometry` or from a superblock, describes a filesystem this code can mount
+// Each area must be large enough for what it holds, in this order; areas may be larger, as in older layouts
+bool geometry_valid(const struct geometry* g)
+{
+    int bits_per_block = g->block_size * 8, inode_per_block = g->block_size / INODE_SIZE;
+    int data_block_num = g->block_num - g->data_block;
+    return g->block_size >= MIN_BLOCK_SIZE && g->block_size <= MAX_BLOCK_SIZE && (g->block_size & (g->block_size - 1)) == 0
+        && g->block_num > 0 && (int64_t)g->block_num * g->block_size <= DISK_SIZE
+        && g->inode_num > 0 && g->inode_num % inode_per_block == 0 && g->inode_num / inode_per_block <= MAX_INODE_TABLE_SIZE
+        && g->block_bitmap_block - BITMAP_BLOCK_INODE >= ceil_div(g->inode_num, bits_per_block)
+        && g->inode_block - g->block_bitmap_block >= ceil_div(data_block_num, bits_per_block)
+        && g->journal_block - g->inode_block >= g->inode_num / inode_per_block
+        && g->journal_block_num >= JOURNAL_MIN_BLOCK_NUM && g->refcount_block - g->journal_block >= g->journal_block_num
+        && g->data_block - g->refcount_block >= ceil_div(data_block_num, g->block_size / REFCOUNT_SIZE)
+        && data_block_num > 0 && data_block_num - 1 <= (int)BLOCK_ADDR_MASK;
+}
+
+// Lay out a device of `device_size` bytes in blocks of `block_size` bytes, with room for at least `inode_num` inodes
+// Return 0, or -1 if that leaves no usable filesystem, in which case the geometry is unchanged
+int set_geometry(int block_size, int inode_num, int64_t device_size)
+{
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || inode_num <= 0 || device_size <= 0 || device_size > DISK_SIZE) {
+        return -1;
+    }
+    int inode_per_block = block_size / INODE_SIZE;
+    struct geometry g = {
+        .block_size = block_size,
+        .block_num = device_size / block_size,
+        .inode_num = ceil_div(inode_num, inode_per_block) * inode_per_block,
+        .journal_block_num = max(JOURNAL_SIZE / block_size, JOURNAL_MIN_BLOCK_NUM),
+    };
+    g.block_bitmap_block = BITMAP_BLOCK_INODE + ceil_div(g.inode_num, block_size * 8);
+    g.inode_block = g.block_bitmap_block + ceil_div(g.block_num, block_size * 8);
+    g.journal_block = g.inode_block + g.inode_num / inode_per_block;
+    g.refcount_block = g.journal_block + g.journal_block_num;
+    g.data_block = g.refcount_block + ceil_div(g.block_num, block_size / REFCOUNT_SIZE);
+    if (!geometry_valid(&g)) {
+        return -1;
+    }
+    geo = g;
+    return 0;
+}
+
+// Fill a superblock with the geometry and the current free counts
+void make_superblock(struct superblock* sb, enum fs_state state)
+{
+    *sb = (struct superblock) {
+        .block_size = FS_BLOCK_SIZE,
+        .inode_size = INODE_SIZE,
+        .inode_num = INODE_NUM,
+        .block_num = FS_BLOCK_NUM,
+        .inode_bitmap_block = BITMAP_BLOCK_INODE,
+        .block_bitmap_block = BITMAP_BLOCK_DATA,
+        .inode_block = INODE_TABLE_START,
+        .data_block = DATA_BLOCK_START,
+        .journal_block = JOURNAL_START,
+        .journal_block_num = JOURNAL_BLOCK_NUM,
+        .refcount_block = REFCOUNT_START,
+        .magic = FS_MAGIC,
+        .state = state,
+        .free_block_num = DATA_BLOCK_SIZE - bitmap_used[BITMAP_BLOCK_DATA],
+        .free_inode_num = INODE_NUM - bitmap_used[BITMAP_BLOCK_INODE],
+    };
+    memcpy(sb->inode_table_init, inode_table_init, sizeof(inode_table_init));
+}
+
+// Read the geometry back from the superblock, before anything else of the device is read
+// The superblock is in the first device block whatever the block size, and its geometry never changes after mkfs,
+// so the copy at home is good even if newer images of the block wait in the journal
+// Return 0 on success, -1 if the device holds no filesystem this code can mount
+int load_geometry()
+{
+    char buf[BLOCK_SIZE];
+    struct superblock* sb = (struct superblock*)buf;
+    if (disk_read(SUPERBLOCK_BLOCK, buf) || sb->magic != FS_MAGIC || sb->inode_size != INODE_SIZE || sb->inode_bitmap_block != BITMAP_BLOCK_INODE) {
+        return -1;
+    }
+    struct geometry g = {
+        .block_size = sb->block_size,
+        .block_num = sb->block_num,
+        .inode_num = sb->inode_num,
+        .block_bitmap_block = sb->block_bitmap_block,
+        .inode_block = sb->inode_block,
+        .journal_block = sb->journal_block,
+        .journal_block_num = sb->journal_block_num,
+        .refcount_block = sb->refcount_block,
+        .data_block = sb->data_block,
+    };
+    if (!geometry_valid(&g)) {
+        return -1;
+    }
+    geo = g;
+    return 0;
+}
+
+// Write the superblock, with the current free counts
+int write_superblock(enum fs_state state)
+{
+    struct superblock sb;
+    make_superblock(&sb, state);
+    return journal_write_part(SUPERBLOCK_BLOCK, 0, (char*)&sb, sizeof(sb));
+}
+
+// Format the virtual block device with the current geometry: basic filesystem structure, root directory, etc.
+// Return 0 if the operation is successful, not 0 otherwise
+int mkfs()
+{
+    printf("Mkfs is called\n");
+
+    // clear only the superblock, the bitmaps and the reference counts; the inode table is zeroed lazily, and data blocks
+    // are always written before they are read
+    // everything before the data blocks is metadata, the journal included, and none of the data blocks is any longer,
+    // whatever an earlier filesystem on the device left there
+    for (int i = 0; i < FS_BLOCK_NUM; i++) {
+        device_set_metadata(i, i < DATA_BLOCK_START);
+    }
+    char buf[FS_BLOCK_SIZE];
+    memset(buf, 0, FS_BLOCK_SIZE);
+    for (int i = 0; i < INODE_TABLE_START; i++) {
+        if (cached_disk_write(i, buf)) {
+            return -1;
+        }
+    }
+    for (int i = REFCOUNT_START; i < REFCOUNT_START + REFCOUNT_BLOCK_NUM; i++) {
+        if (cached_disk_write(i, buf)) {
+            return -1;
+        }
+    }
+    memset(inode_table_init, 0, sizeof(inode_table_init));
+    bitmap_used[BITMAP_BLOCK_INODE] = bitmap_used[BITMAP_BLOCK_DATA] = 0;
+
+    // the geometry goes straight to the device, as mount reads it from there before it replays the journal: a write
+    // to the cached block would wait for eviction, and the journal takes the block up before then
+    make_superblock((struct superblock*)buf, FS_MOUNTED);
+    if (cached_disk_write(SUPERBLOCK_BLOCK, buf) || device_write(SUPERBLOCK_BLOCK, buf)) {
+        return -1;
+    }
+
+    static_assert(sizeof(struct inode) <= INODE_SIZE, "The inode should be smaller than INODE_SIZE");
+    static_assert(sizeof(struct superblock) <= MIN_BLOCK_SIZE, "The superblock should fit in the first device block");
+    static_assert(MIN_BLOCK_SIZE % INODE_SIZE == 0, "The inode should be aligned with the block size");
+
+    // the defaults meet the requirements, other geometries may trade space for files or the other way around
+    static_assert(DEFAULT_INODE_NUM >= MIN_FILE_NUM, "The file size should be larger than MIN_FILE_NUM");
+    static_assert((DIRECT_BLOCK_NUM + SINGLE_INDIRECT_BLOCK_NUM * MIN_BLOCK_SIZE / sizeof(uint32_t)) * MIN_BLOCK_SIZE >= MIN_FILE_SIZE_LIMIT,
+        "The file size should be larger than MIN_FILE_SIZE_LIMIT");
+    if ((int64_t)DATA_BLOCK_SIZE * FS_BLOCK_SIZE < MIN_AVAILABLE_SIZE || INODE_NUM < MIN_FILE_NUM) {
+        printf("The geometry leaves less than %d bytes or %d files\n", MIN_AVAILABLE_SIZE, MIN_FILE_NUM);
+    }
+
+    static_assert(DIR_REC_LEN(MAX_FILENAME_LEN) <= MIN_BLOCK_SIZE, "The longest directory record should fit in a block");
+    static_assert(MAX_BLOCK_SIZE <= DIR_REC_LEN_MAX + 1, "The record length should fit in `rec_len`");
+    static_assert(MIN_BLOCK_SIZE % DIR_REC_ALIGN == 0, "The directory records should be aligned with the block size");
+
+    if (journal_format()) {
+        return -1;
+    }
+
+    // write the root directory
+    struct inode root_inode;
+    init_inode(&root_inode, DIRMODE);
+    if (init_inode_table_block(ROOT_INODE) || inode_write(ROOT_INODE, &root_inode)) {
+        return -1;
+    }
+
+    int root_block_id = alloc_block(BITMAP_BLOCK_INODE, INODE_NUM);
+    assert(root_block_id == ROOT_INODE);
+
+    if (write_superblock(FS_MOUNTED)) {
+        return -1;
+    }
+    return journal_commit();
+}
+
+// Mount the filesystem left on the device by an earlier run
+// The free counts come from the superblock after a clean unmount, and from counting the bitmaps otherwise
+// Return 0 if mounted, -1 if the device holds no filesystem with the geometry from `load_geometry`
+int mount_fs()
+{
+    struct superblock sb;
+    if (cached_disk_read_part(SUPERBLOCK_BLOCK, 0, (char*)&sb, sizeof(sb))) {
+        return -1;
+    }
+    if (sb.magic != FS_MAGIC || sb.block_size != (uint32_t)FS_BLOCK_SIZE || sb.block_num != (uint32_t)FS_BLOCK_NUM || sb.inode_num != (uint32_t)INODE_NUM) {
+        return -1;
+    }
+
+    memcpy(inode_table_init, sb.inode_table_init, sizeof(inode_table_init));
+    if (sb.state == FS_CLEAN) {
+        bitmap_used[BITMAP_BLOCK_DATA] = DATA_BLOCK_SIZE - sb.free_block_num;
+        bitmap_used[BITMAP_BLOCK_INODE] = INODE_NUM - sb.free_inode_num;
+    } else {
+        int used_blocks = count_bitmap(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE), used_inodes = count_bitmap(BITMAP_BLOCK_INODE, INODE_NUM);
+        if (used_blocks == -1 || used_inodes == -1) {
+            return -1;
+        }
+        bitmap_used[BITMAP_BLOCK_DATA] = used_blocks;
+        bitmap_used[BITMAP_BLOCK_INODE] = used_inodes;
+    }
+
+    // read-only, the state on the disk is left as it is, unclean if it was
+    if (device_read_only) {
+        return 0;
+    }
+    // the counts on the disk go stale from now on, until the next clean unmount
+    if (write_superblock(FS_MOUNTED)) {
+        return -1;
+    }
+    return journal_commit();
+}
+
+// Write everything back and mark the filesystem clean, at unmount
+int unmount_fs()
+{
+    defrag_stop();
+    fs_rmtree_wait();
+    if (sync_all()) {
+        return -1;
+    }
+    journal_start();
+    int ret = close_tail_blocks() || write_superblock(FS_CLEAN);
+    journal_stop();
+    if (ret || journal_flush()) {
+        return -1;
+    }
+    return 0;
+}
+
+int getattr(struct inode* inode, struct stat* attr)
+{
+    *attr = (struct stat) {
+        .st_mode = inode->mode,
+        .st_nlink = 1,
+        .st_uid = getuid(),
+        .st_gid = getgid(),
+        .st_size = inode->size,
+        .st_atime = inode->atime,
+        .st_mtime = inode->mtime,
+        .st_ctime = inode->ctime,
+    };
+    return 0;
+}
+
+// Query the attributes of a regular file or directory
+// Return -ENOENT if the file or directory does not exist
+int fs_getattr(const char* path, struct stat* attr)
+{
+    OP_SCOPE(OP_GETATTR, path, -1);
+    log_op(OP_GETATTR, path, NULL, 0, 0, 0);
+
+    struct inode inode;
+    int inode_pos = resolve_path_to_inode(path, &inode);
+    if (inode_pos == -1) {
+        return -ENOENT;
+    }
+
+    return getattr(&inode, attr);
+}
+
+// Fill the stat of a directory entry from the file type stored in the entry alone, without reading its inode
+void dir_entry_stat(const struct dir_entry* entry, struct stat* attr)
+{
+    *attr = (struct stat) {
+        .st_ino = entry->inode_pos,
+        .st_mode = DTTOIF(entry->type),
+    };
+}
+
+// Read one page of entries of a directory, whose lock the caller holds
+// `offset` is a cookie: the byte position of the last entry returned plus one, so a large directory is returned in pages
+// With the `readdir_stat` option the full stat of every entry is returned, reading each inode-table block once per directory block
+int read_dir_page(int inode_pos, void* buffer, fuse_fill_dir_t filler, off_t offset)
+{
+    struct inode inode;
+    if (inode_read(inode_pos, &inode)) {
+        return -1;
+    }
+
+    // update the inode once per listing rather than once per page, on the first page as a listing can stop at any page
+    if (offset == 0) {
+        inode.atime = time(NULL);
+        if (inode_write(inode_pos, &inode)) {
+            return -1;
+        }
+    }
+
+    inode_versions[inode_pos].listed = time(NULL);
+    struct dir_iter iter;
+    dir_iter_init(&iter, &inode, offset / FS_BLOCK_SIZE);
+    int ret;
+    while ((ret = dir_iter_next(&iter)) == 1) {
+        off_t block_start = (off_t)iter.blocks.block_id * FS_BLOCK_SIZE;
+
+        int count = 0, offsets[DIR_ENTRY_NUM], children[DIR_ENTRY_NUM];
+        for (int rec_offset = 0, next; rec_offset < FS_BLOCK_SIZE; rec_offset = next) {
+            struct dir_entry* rec = dir_rec(iter.buf, rec_offset);
+            next = dir_rec_next(iter.buf, rec_offset);
+            if (next == -1) {
+                return -EIO;
+            }
+            if (rec->inode_pos == 0) {
+                continue;
+            }
+            iter.seen += DIR_REC_LEN(rec->name_len);
+            // records only move while nobody lists the directory, so everything before the offset has been returned already
+            if (block_start + rec_offset < offset) {
+                continue;
+            }
+            offsets[count] = rec_offset;
+            children[count++] = rec->inode_pos;
+        }
+
+        struct inode child_inodes[DIR_ENTRY_NUM];
+        if (options.readdir_stat && inode_read_batch(children, child_inodes, count)) {
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            struct dir_entry entry;
+            dir_rec_copy(&entry, dir_rec(iter.buf, offsets[i]));
+            struct stat st;
+            if (options.readdir_stat) {
+                getattr(&child_inodes[i], &st);
+                st.st_ino = entry.inode_pos;
+            } else {
+                dir_entry_stat(&entry, &st);
+            }
+            if (filler(buffer, entry.name, &st, block_start + offsets[i] + 1)) {
+                // the buffer is full, the kernel will come back with the offset of this entry
+                return 0;
+            }
+        }
+    }
+    return ret;
+}
+
+// Read all entries in a directory
+// Update the `atime` of the directory
+// `ls` command can trigger this function
+int fs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_READDIR, path, -1);
+    log_op(OP_READDIR, path, NULL, 0, 0, 0);
+    JOURNAL_HANDLE();
+
+    // read the inode
+    struct inode inode;
+    int inode_pos = resolve_path_to_inode(path, &inode);
+    if (inode_pos == -1) {
+        return -ENOENT;
+    }
+
+    lock_inode_read(inode_pos);
+    int ret = read_dir_page(inode_pos, buffer, filler, offset);
+    unlock_inode(inode_pos);
+    return ret;
+}
+
+// Read the contents of an inode, whose lock the caller holds
+// Update the `atime` of the file
+// Return the number of bytes read
+int inode_read_data(int inode_pos, char* buffer, size_t size, off_t offset)
+{
+    struct inode inode;
+    if (inode_read(inode_pos, &inode)) {
+        return -1;
+    }
+
+    if (offset >= inode.size) {
+        return 0;
+    }
+
+    size = min(size, inode.size - offset);
+    int total_read = 0;
+
+    while (size > 0) {
+        int block_idx = (offset + total_read) / FS_BLOCK_SIZE, block_offset = (offset + total_read) % FS_BLOCK_SIZE;
+        int read_from_block = min(size, FS_BLOCK_SIZE - block_offset);
+
+        // copied straight from the write buffer or the cache into the reply buffer
+        struct dirty_page* page = find_dirty_page(inode_pos, block_idx);
+        int block_pos;
+        if (page != NULL) {
+            memcpy(buffer + total_read, page->buf + block_offset, read_from_block);
+        } else if (get_block_pos(&inode, block_idx, &block_pos) || data_read_part(block_pos, block_offset, buffer + total_read, read_from_block)) {
+            return -1;
+        }
+
+        total_read += read_from_block;
+        size -= read_from_block;
+    }
+
+    inode.atime = time(NULL);
+    if (inode_write(inode_pos, &inode)) {
+        return -1;
+    }
+    return total_read;
+}
+
+// Read the contents of a regular file
+// Update the `atime` of the file
+// `cat` command can trigger this function
+// Return the number of bytes read
+int fs_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_READ, path, fi->fh);
+    log_op(OP_READ, path, NULL, 2, offset, size);
+    JOURNAL_HANDLE();
+
+    int inode_pos = fi->fh;
+    lock_inode_read(inode_pos);
+    int ret = inode_read_data(inode_pos, buffer, size, offset);
+    unlock_inode(inode_pos);
+    return ret;
+}
+
+// Create a regular file or directory named `name` in the directory `parent_inode`, depending on the `mode`
+// Update the `ctime` and `mtime` of the parent directory
+// Return the inode position of the new file, -ENOSPC if no enough space or file nodes, or -ENAMETOOLONG if the name is too long
+int create_inode(int parent_inode, const char* name, mode_t mode)
+{
+    struct dir_entry entry = {
+        .type = IFTODT(mode),
+        .name_len = strlen(name),
+    };
+    if (strlen(name) > MAX_FILENAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(entry.name, name, entry.name_len);
+
+    // allocate an inode
+    int inode_pos = alloc_block(BITMAP_BLOCK_INODE, INODE_NUM);
+    if (inode_pos == -1) {
+        return -ENOSPC;
+    }
+    entry.inode_pos = inode_pos;
+
+    // write the inode, nobody else can reach it before the directory entry is added
+    struct inode inode;
+    init_inode(&inode, mode);
+    if (init_inode_table_block(inode_pos) || inode_write(inode_pos, &inode)) {
+        clear_block(BITMAP_BLOCK_INODE, inode_pos);
+        return -1;
+    }
+
+    // add the directory entry to the parent directory
+    lock_inode_write(parent_inode);
+    int ret = add_dir_entry_locked(parent_inode, &entry);
+    unlock_inode(parent_inode);
+    if (ret) {
+        clear_block(BITMAP_BLOCK_INODE, inode_pos);
+        return ret;
+    }
+    return inode_pos;
+}
+
+// Create a regular file or directory, depending on the `mode`
+// Update the `ctime` and `mtime` of the parent directory
+// Return -ENOSPC if no enough space or file nodes
+int make_file(const char* path, mode_t mode)
+{
+    struct dir_entry name;
+    int parent_inode = resolve_parent(path, &name);
+    if (parent_inode < 0) {
+        return parent_inode;
+    }
+    int inode_pos = create_inode(parent_inode, name.name, mode);
+    return inode_pos < 0 ? inode_pos : 0;
+}
+
+// Create a regular file
+// `touch` and `echo x > file` commands can trigger this function
+// Update the `ctime` and `mtime` of the parent directory
+// Return -ENOSPC if no enough space or file nodes
+int fs_mknod(const char* path, [[maybe_unused]] mode_t mode, [[maybe_unused]] dev_t dev)
+{
+    OP_SCOPE(OP_MKNOD, path, -1);
+    log_op(OP_MKNOD, path, NULL, 0, 0, 0);
+    JOURNAL_HANDLE();
+    return make_file(path, REGMODE);
+}
+
+// Create a directory
+// `mkdir` command can trigger this function
+// Update the `ctime` and `mtime` of the parent directory
+// Return -ENOSPC if no enough space or file nodes
+int fs_mkdir(const char* path, [[maybe_unused]] mode_t mode)
+{
+    OP_SCOPE(OP_MKDIR, path, -1);
+    log_op(OP_MKDIR, path, NULL, 0, 0, 0);
+    JOURNAL_HANDLE();
+    return make_file(path, DIRMODE);
+}
+
+// Resolve the parent directory of `path` and copy the base name into `entry`
+// Return the inode position of the parent, -ENAMETOOLONG if the base name is too long, or -ENOENT if the parent does not exist
+int resolve_parent(const char* path, struct dir_entry* entry)
+{
+    char* path4base = strdup(path);
+    char* base = basename(path4base);
+    if (strlen(base) > MAX_FILENAME_LEN) {
+        free(path4base);
+        return -ENAMETOOLONG;
+    }
+    entry->name_len = strlen(base);
+    strcpy(entry->name, base);
+    free(path4base);
+
+    struct inode inode;
+    char* path4dir = strdup(path);
+    char* dir = dirname(path4dir);
+    int parent_inode = resolve_path_to_inode(dir, &inode);
+    free(path4dir);
+    if (parent_inode == -1) {
+        return -ENOENT;
+    }
+    return parent_inode;
+}
+
+// Remove the entry named `name` from the directory `parent_inode`, whose lock the caller holds for writing
+// Update the `mtime` and `ctime` of the parent directory
+// Return the inode position of the removed entry, -ENOENT if there is no such entry, or -1 on error
+int remove_dir_entry_locked(int parent_inode, const char* name, struct dir_entry* old_entry)
+{
+    struct inode inode;
+    if (inode_read(parent_inode, &inode)) {
+        return -1;
+    }
+    int ret = remove_dir_entry(&inode, name, old_entry);
+    if (ret) {
+        return ret == -1 ? -ENOENT : ret;
+    }
+
+    inode.atime = inode.mtime = inode.ctime = time(NULL);
+    if (inode_write(parent_inode, &inode)) {
+        return -1;
+    }
+    return old_entry->inode_pos;
+}
+
+// Find the entry named `name` in the directory `parent_inode`, whose lock the caller holds
+// Return the inode of the entry, -ENOENT if there is none, or -1 on error
+int lookup_dir_entry_locked(int parent_inode, const char* name, struct dir_entry* entry)
+{
+    struct inode inode;
+    if (inode_read(parent_inode, &inode)) {
+        return -1;
+    }
+    int ret = find_dir_entry(&inode, name, entry);
+    return ret == 0 ? (int)entry->inode_pos : ret == -1 ? -ENOENT : ret;
+}
+
+// Point the entry named `name` in the directory `parent_inode`, whose lock the caller holds for writing, to the inode
+// of `entry`, see `replace_dir_entry`
+// Update the `mtime` and `ctime` of the parent directory
+// Return the inode the entry held, -ENOENT if there is no such entry, or -1 on error
+int replace_dir_entry_locked(int parent_inode, const char* name, const struct dir_entry* entry, struct dir_entry* old_entry)
+{
+    struct inode inode;
+    if (inode_read(parent_inode, &inode)) {
+        return -1;
+    }
+    int ret = replace_dir_entry(&inode, name, entry, old_entry);
+    if (ret) {
+        return ret == -1 ? -ENOENT : ret;
+    }
+
+    inode.atime = inode.mtime = inode.ctime = time(NULL);
+    if (inode_write(parent_inode, &inode)) {
+        return -1;
+    }
+    return old_entry->inode_pos;
+}
+
+// Add the entry to the directory `parent_inode`, whose lock the caller holds for writing
+// Update the `mtime` and `ctime` of the parent directory
+int add_dir_entry_locked(int parent_inode, const struct dir_entry* entry)
+{
+    struct inode inode;
+    if (inode_read(parent_inode, &inode)) {
+        return -1;
+    }
+    int ret = add_dir_entry(&inode, entry);
+    if (ret) {
+        return ret == -1 ? -ENOSPC : ret;
+    }
+
+    inode.atime = inode.mtime = inode.ctime = time(NULL);
+    if (inode_write(parent_inode, &inode)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Release an inode that is no longer referenced by any directory, with its data blocks
+int free_inode(int inode_pos)
+{
+    lock_inode_write(inode_pos);
+    drop_dirty_pages(inode_pos, 0);
+    struct inode inode;
+    if (inode_read(inode_pos, &inode)) {
+        unlock_inode(inode_pos);
+        return -1;
+    }
+    for (int i = 0; i < ceil_div(inode.size, FS_BLOCK_SIZE); i++) {
+        int block_pos;
+        if (get_block_pos(&inode, i, &block_pos)) {
+            unlock_inode(inode_pos);
+            return -1;
+        }
+        if (block_pos == -1) {
+            continue;
+        }
+        if (release_block(block_pos)) {
+            unlock_inode(inode_pos);
+            return -1;
+        }
+    }
+    inode_changed(inode_pos);
+    unlock_inode(inode_pos);
+    clear_block(BITMAP_BLOCK_INODE, inode_pos);
+    return 0;
+}
+
+// Remove the entry named `name` from the directory `parent_inode` and release its inode
+// Update the `mtime` and `ctime` of the parent directory
+int unlink_inode(int parent_inode, const char* name)
+{
+    struct dir_entry entry;
+    lock_inode_write(parent_inode);
+    int old_inode_pos = remove_dir_entry_locked(parent_inode, name, &entry);
+    unlock_inode(parent_inode);
+    if (old_inode_pos < 0) {
+        return old_inode_pos;
+    }
+    return free_inode(old_inode_pos);
+}
+
+int remove_file(const char* path)
+{
+    struct dir_entry name;
+    int parent_inode = resolve_parent(path, &name);
+    if (parent_inode < 0) {
+        return parent_inode;
+    }
+    return unlink_inode(parent_inode, name.name);
+}
+
+// Remove a directory
+// The directory must be empty
+// `rm -r` command can trigger this function
+// Update the `mtime` and `ctime` of the parent directory
+int fs_rmdir(const char* path)
+{
+    OP_SCOPE(OP_RMDIR, path, -1);
+    log_op(OP_RMDIR, path, NULL, 0, 0, 0);
+    JOURNAL_HANDLE();
+    return remove_file(path);
+}
+
+// Remove a regular file
+// `rm` command can trigger this function
+// Update the `mtime` and `ctime` of the parent directory
+int fs_unlink(const char* path)
+{
+    OP_SCOPE(OP_UNLINK, path, -1);
+    log_op(OP_UNLINK, path, NULL, 0, 0, 0);
+    JOURNAL_HANDLE();
+    return remove_file(path);
+}
+
+// Recursive removal, see `FS_IOC_RMTREE`
+// The root of the tree is unlinked from its parent at once, and the tree is freed by a background worker: it reads
+// the tree level by level, each inode-table and directory block once and without filling the cache, then releases
+// all of its blocks and then all of its inodes in ascending order, so each bitmap and refcount block is read and
+// journaled once for a run of bits
+// Unlike `free_inode`, the indirect blocks of the files are released too
+// Space comes back as the worker goes; trees not yet freed at a crash stay allocated while nothing reaches them
+#define RMTREE_BATCH 16 // block pointers or inodes released per journal handle
+
+// A growable list of inode positions or block pointers
+struct pos_list {
+    int* pos;
+    int num, cap;
+};
+int pos_list_add(struct pos_list* list, int pos)
+{
+    if (list->num == list->cap) {
+        int cap = list->cap == 0 ? 1024 : list->cap * 2;
+        int* grown = realloc(list->pos, cap * sizeof(int));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->pos = grown;
+        list->cap = cap;
+    }
+    list->pos[list->num++] = pos;
+    return 0;
+}
+
+struct rmtree_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled when a tree is queued, and when the last one is freed
+    struct pos_list roots;
+    int pending; // trees queued or being freed
+    bool started;
+} rmtree_queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+int compare_extent_addr(const void* a, const void* b)
+{
+    return extent_addr(*(const int*)a) - extent_addr(*(const int*)b);
+}
+int compare_int(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+// Add the block pointers of an unlinked inode, its indirect blocks, and for a directory the inodes of its entries
+// Nothing else reaches the inode any more, so its directory blocks are read without caching them
+int rmtree_collect(struct inode* inode, struct pos_list* children, struct pos_list* blocks)
+{
+    for (int i = 0; i < SINGLE_INDIRECT_BLOCK_NUM; i++) {
+        if (inode->block_point_indirect[i] != -1 && pos_list_add(blocks, inode->block_point_indirect[i])) {
+            return -1;
+        }
+    }
+    struct block_iter* iter = malloc(sizeof(struct block_iter));
+    char* buf = malloc(FS_BLOCK_SIZE);
+    int ret = iter == NULL || buf == NULL ? -1 : 0;
+    if (ret == 0) {
+        block_iter_init(iter, inode, 0);
+    }
+    while (ret == 0 && (ret = block_iter_next(iter)) == 1) {
+        ret = pos_list_add(blocks, iter->block_pos);
+        if (ret || inode->mode != DIRMODE) {
+            continue;
+        }
+        ret = cached_disk_peek(DATA_BLOCK_START + iter->block_pos, buf);
+        for (int offset = 0, next; ret == 0 && offset < FS_BLOCK_SIZE; offset = next) {
+            int child = dir_rec(buf, offset)->inode_pos;
+            next = dir_rec_next(buf, offset);
+            ret = next == -1 ? -EIO : child != 0 ? pos_list_add(children, child) : 0;
+        }
+    }
+    free(iter);
+    free(buf);
+    return ret;
+}
+
+// Collect the inodes and blocks of one level of the tree, whose inodes are given in `level`, and the next level
+// The inodes are read in ascending order, each inode-table block once and without caching it
+int rmtree_collect_level(struct pos_list* level, struct pos_list* next, struct pos_list* blocks)
+{
+    qsort(level->pos, level->num, sizeof(int), compare_int);
+    char* buf = malloc(FS_BLOCK_SIZE);
+    int ret = buf == NULL ? -1 : 0, loaded_block = -1;
+    for (int i = 0; ret == 0 && i < level->num; i++) {
+        int inode_pos = level->pos[i];
+        // a flush of its buffered pages may be running, which the inode lock waits for
+        lock_inode_write(inode_pos);
+        drop_dirty_pages(inode_pos, 0);
+        inode_changed(inode_pos);
+        unlock_inode(inode_pos);
+
+        int inode_block = inode_pos * INODE_SIZE / FS_BLOCK_SIZE;
+        if (inode_block != loaded_block) {
+            ret = cached_disk_peek(INODE_TABLE_START + inode_block, buf);
+            loaded_block = inode_block;
+        }
+        struct inode inode;
+        memcpy(&inode, buf + inode_pos * INODE_SIZE % FS_BLOCK_SIZE, sizeof(inode));
+        ret = ret || rmtree_collect(&inode, next, blocks) ? -1 : 0;
+    }
+    free(buf);
+    return ret;
+}
+
+// Free the tree rooted at the unlinked inode `root`
+int rmtree_free(int root)
+{
+    struct pos_list inodes = { 0 }, blocks = { 0 }, next = { 0 };
+    int ret = pos_list_add(&next, root);
+    // level by level, the inodes of each level being the tail of `inodes`
+    while (ret == 0 && next.num > 0) {
+        int start = inodes.num;
+        for (int i = 0; ret == 0 && i < next.num; i++) {
+            ret = pos_list_add(&inodes, next.pos[i]);
+        }
+        next.num = 0;
+        struct pos_list level = { .pos = inodes.pos + start, .num = inodes.num - start };
+        ret = ret || rmtree_collect_level(&level, &next, &blocks) ? -1 : 0;
+    }
+
+    // on error the tree is left allocated, as after a crash
+    if (ret == 0) {
+        qsort(blocks.pos, blocks.num, sizeof(int), compare_extent_addr);
+        qsort(inodes.pos, inodes.num, sizeof(int), compare_int);
+    }
+    for (int i = 0; ret == 0 && i < blocks.num;) {
+        journal_start();
+        for (int n = 0; ret == 0 && i < blocks.num && n < RMTREE_BATCH && !journal_handle_busy(); n++) {
+            ret = release_block(blocks.pos[i++]);
+        }
+        journal_stop();
+    }
+    for (int i = 0; ret == 0 && i < inodes.num;) {
+        journal_start();
+        for (int n = 0; ret == 0 && i < inodes.num && n < RMTREE_BATCH && !journal_handle_busy(); n++) {
+            ret = clear_block(BITMAP_BLOCK_INODE, inodes.pos[i++]);
+        }
+        journal_stop();
+    }
+    free(inodes.pos);
+    free(blocks.pos);
+    free(next.pos);
+    return ret;
+}
+
+void* rmtree_thread([[maybe_unused]] void* arg)
+{
+    pthread_mutex_lock(&rmtree_queue.lock);
+    for (;;) {
+        while (rmtree_queue.roots.num == 0) {
+            pthread_cond_wait(&rmtree_queue.cond, &rmtree_queue.lock);
+        }
+        int root = rmtree_queue.roots.pos[--rmtree_queue.roots.num];
+        pthread_mutex_unlock(&rmtree_queue.lock);
+        rmtree_free(root);
+        pthread_mutex_lock(&rmtree_queue.lock);
+        if (--rmtree_queue.pending == 0) {
+            pthread_cond_broadcast(&rmtree_queue.cond);
+        }
+    }
+    return NULL;
+}
+
+// Hand an unlinked tree to the worker, which is started with the first one
+int rmtree_queue_add(int root)
+{
+    pthread_mutex_lock(&rmtree_queue.lock);
+    if (!rmtree_queue.started) {
+        pthread_t thread;
+        rmtree_queue.started = pthread_create(&thread, NULL, rmtree_thread, NULL) == 0 && pthread_detach(thread) == 0;
+    }
+    if (!rmtree_queue.started || pos_list_add(&rmtree_queue.roots, root)) {
+        pthread_mutex_unlock(&rmtree_queue.lock);
+        return -1;
+    }
+    rmtree_queue.pending++;
+    pthread_cond_broadcast(&rmtree_queue.cond);
+    pthread_mutex_unlock(&rmtree_queue.lock);
+    return 0;
+}
+
+// Wait for every queued tree to be freed
+void fs_rmtree_wait()
+{
+    pthread_mutex_lock(&rmtree_queue.lock);
+    while (rmtree_queue.pending > 0) {
+        pthread_cond_wait(&rmtree_queue.cond, &rmtree_queue.lock);
+    }
+    pthread_mutex_unlock(&rmtree_queue.lock);
+}
+
+// Unlink the entry `name` of the directory `parent_inode` and free everything below it in the background
+// Return -ENOTDIR if `parent_inode` is not a directory, -ENOENT if there is no such entry, -EINVAL for `.` or `..`
+int rmtree_inode(int parent_inode, const char* name)
+{
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL) {
+        return -EINVAL;
+    }
+    struct inode parent;
+    struct dir_entry entry;
+    lock_inode_write(parent_inode);
+    int root = inode_read(parent_inode, &parent) ? -1 : parent.mode != DIRMODE ? -ENOTDIR : remove_dir_entry_locked(parent_inode, name, &entry);
+    unlock_inode(parent_inode);
+    if (root < 0) {
+        return root;
+    }
+    return rmtree_queue_add(root);
+}
+
+// Online defragmentation, see `FS_IOC_DEFRAG` and `-o defrag`
+// A file whose blocks lie in short runs is copied into one run of free blocks, a chunk per journal handle, and its block
+// pointers are moved over; only the blocks of the file alone move, shared blocks and compressed extents stay in place
+// A directory has the entries of its last blocks moved into the free space of its first ones, a block per journal
+// handle, and the blocks emptied are freed; records move, so a directory listed lately is left alone
+// Every entry is worked on with the read lock of its directory held, so it is neither unlinked nor freed meanwhile;
+// the lock of the entry itself is only tried, as `fs_rename` may hold it while it waits for the directory
+#define DEFRAG_MIN_RUN 64 // blocks: a file whose runs are this long on average is left alone
+#define DEFRAG_CHUNK 64 // blocks of a file moved per journal handle
+#define DEFRAG_LIST_IDLE 60 // seconds since a directory was last listed before its records may move
+#define DEFRAG_LOCK_TRIES 16 // attempts to lock an entry before it is skipped
+
+struct defrag_state {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled when a background pass ends
+    bool running; // a background pass is under way
+    atomic_int generation; // bumped at unmount, which ends the background thread of that mount
+} defrag_state = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Take the read lock of the directory `parent`, if it is still the one of `parent_version`, and the write lock of its
+// entry `name`, if it is still the inode `inode_pos`; the root has no parent (-1) and is locked alone
+// Return 0 if the locks are held, -1 if the entry is gone or its lock stays busy
+int defrag_lock(int parent, unsigned int parent_version, const char* name, int inode_pos)
+{
+    if (parent == -1) {
+        lock_inode_write(inode_pos);
+        return 0;
+    }
+    if (same_inode_lock(parent, inode_pos)) {
+        return -1;
+    }
+    for (int i = 0; i < DEFRAG_LOCK_TRIES; i++) {
+        struct inode inode;
+        struct dir_entry entry;
+        lock_inode_read(parent);
+        if (inode_versions[parent].version != parent_version || inode_read(parent, &inode) || find_dir_entry(&inode, name, &entry)
+            || (int)entry.inode_pos != inode_pos) {
+            unlock_inode(parent);
+            return -1;
+        }
+        if (trylock_inode_write(inode_pos)) {
+            return 0;
+        }
+        unlock_inode(parent);
+        usleep(1000);
+    }
+    return -1;
+}
+
+void defrag_unlock(int parent, int inode_pos)
+{
+    unlock_inode(inode_pos);
+    if (parent != -1) {
+        unlock_inode(parent);
+    }
+}
+
+// The blocks of a file to move, in file order, and where they go
+struct defrag_plan {
+    struct pos_list ids, olds;
+    int target;
+};
+
+// Plan the move of a file whose lock the caller holds, after its buffered pages are written
+// Return 1 if the file is worth moving and a run of free blocks holds it, 0 if not, -1 on error
+int defrag_plan_file(struct inode* inode, struct defrag_plan* plan)
+{
+    struct block_iter* iter = malloc(sizeof(struct block_iter));
+    if (iter == NULL) {
+        return -1;
+    }
+    int ret, runs = 0, prev = -2;
+    block_iter_init(iter, inode, 0);
+    while ((ret = block_iter_next(iter)) == 1) {
+        int shared = block_shared(iter->block_pos);
+        if (shared == -1) {
+            ret = -1;
+            break;
+        }
+        if (shared) {
+            prev = -2;
+            continue;
+        }
+        runs += iter->block_pos != prev + 1;
+        prev = iter->block_pos;
+        if (pos_list_add(&plan->ids, iter->block_id) || pos_list_add(&plan->olds, iter->block_pos)) {
+            ret = -1;
+            break;
+        }
+    }
+    free(iter);
+    if (ret == -1) {
+        return -1;
+    }
+    int num = plan->ids.num;
+    if (num < 2 || num / runs >= DEFRAG_MIN_RUN || DATA_BLOCK_SIZE - bitmap_used[BITMAP_BLOCK_DATA] - reserved_blocks - freed_num < num) {
+        return 0;
+    }
+    plan->target = find_free_run(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE, num);
+    return plan->target == -1 ? 0 : 1;
+}
+
+// Move the next chunk of a planned file, whose lock the caller holds, starting at block `done` of the plan
+// Return the number of blocks moved, 0 if the file changed or the run was taken meanwhile, -1 on error
+int defrag_move_chunk(struct inode* inode, struct defrag_plan* plan, int done, char* bufs)
+{
+    int num = min(DEFRAG_CHUNK, plan->ids.num - done);
+    for (int i = done; i < done + num; i++) {
+        int block_pos;
+        if (get_block_pos(inode, plan->ids.pos[i], &block_pos)) {
+            return -1;
+        }
+        int shared = block_pos == plan->olds.pos[i] ? block_shared(block_pos) : 1;
+        if (shared) {
+            return shared == -1 ? -1 : 0;
+        }
+    }
+
+    int got;
+    int first = alloc_run(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE, plan->target + done, num, &got);
+    if (first == -1) {
+        return 0;
+    }
+    if (first != plan->target + done || got != num) {
+        for (int i = 0; i < got; i++) {
+            clear_block(BITMAP_BLOCK_DATA, first + i);
+        }
+        return 0;
+    }
+
+    // the old blocks are read without filling cache lines, and the new ones written in one request
+    int news[DEFRAG_CHUNK] = { 0 };
+    char* images[DEFRAG_CHUNK] = { NULL };
+    for (int i = 0; i < num; i++) {
+        news[i] = first + i;
+        images[i] = bufs + i * FS_BLOCK_SIZE;
+        if (cached_disk_peek(DATA_BLOCK_START + plan->olds.pos[done + i], images[i])) {
+            return -1;
+        }
+    }
+    if (data_write_many(news, images, num)) {
+        return -1;
+    }
+    for (int i = 0; i < num; i++) {
+        if (set_block_pos(inode, plan->ids.pos[done + i], first + i) || clear_block(BITMAP_BLOCK_DATA, plan->olds.pos[done + i])) {
+            return -1;
+        }
+    }
+    return num;
+}
+
+// Move the data of the regular file `inode_pos`, the entry `name` of the directory `parent`, into one run of free blocks
+// Return the number of blocks moved, or -1 on error
+int defrag_file(int parent, unsigned int parent_version, const char* name, int inode_pos)
+{
+    struct defrag_plan plan = { 0 };
+    char* bufs = malloc(DEFRAG_CHUNK * FS_BLOCK_SIZE);
+    int done = 0, ret = bufs == NULL ? -1 : 1;
+    while (ret > 0 && (done == 0 || done < plan.ids.num)) {
+        journal_start();
+        if (defrag_lock(parent, parent_version, name, inode_pos)) {
+            journal_stop();
+            break;
+        }
+        // pages buffered since the last chunk are written first, so none of them still points to a block that moves
+        struct inode inode;
+        ret = sync_inode_locked(inode_pos) || inode_read(inode_pos, &inode) ? -1 : inode.mode != REGMODE ? 0 : 1;
+        if (ret > 0 && done == 0) {
+            ret = defrag_plan_file(&inode, &plan);
+        }
+        if (ret > 0) {
+            ret = defrag_move_chunk(&inode, &plan, done, bufs);
+        }
+        if (ret > 0) {
+            done += ret;
+            ret = inode_write(inode_pos, &inode) ? -1 : ret;
+        }
+        defrag_unlock(parent, inode_pos);
+        journal_stop();
+    }
+    free(plan.ids.pos);
+    free(plan.olds.pos);
+    free(bufs);
+    return ret == -1 ? -1 : done;
+}
+
+// Move the records of the last block of a directory, whose lock the caller holds, into the free space of the blocks
+// before it, from `dir_free_block` on, freeing the last block once it is empty
+// Stops early when the handle has changed many blocks, and when a record fits nowhere
+// Return 1 if a block was freed, 0 if not, -1 on error
+int compact_dir_step(struct inode* inode, char* last, char* dst, bool* done)
+{
+    struct block_iter* iter = malloc(sizeof(struct block_iter));
+    if (iter == NULL) {
+        return -1;
+    }
+    int last_id = -1, last_pos = -1, ret;
+    block_iter_init(iter, inode, 0);
+    while ((ret = block_iter_next(iter)) == 1) {
+        last_id = iter->block_id;
+        last_pos = iter->block_pos;
+    }
+    free(iter);
+    *done = true;
+    if (ret == -1 || last_id == -1) {
+        return ret;
+    }
+    if (data_read(last_pos, last)) {
+        return -1;
+    }
+
+    int dst_id = inode->dir_free_block, dst_pos = -1;
+    bool dst_changed = false, moved = false;
+    for (int offset = 0, prev = -1, next; offset < FS_BLOCK_SIZE; offset = next) {
+        struct dir_entry* rec = dir_rec(last, offset);
+        next = dir_rec_next(last, offset);
+        if (next == -1) {
+            return -EIO;
+        }
+        if (rec->inode_pos == 0) {
+            prev = offset;
+            continue;
+        }
+
+        // the first block before the last one with room for the record
+        int rec_len = DIR_REC_LEN(rec->name_len), dst_offset = -1;
+        for (; dst_id < last_id; dst_id++, dst_pos = -1) {
+            if (dst_pos == -1) {
+                if (get_block_pos(inode, dst_id, &dst_pos) || (dst_pos != -1 && data_read(dst_pos, dst))) {
+                    return -1;
+                }
+                if (dst_pos == -1) {
+                    continue;
+                }
+            }
+            dst_offset = dir_block_find_free(dst, rec_len);
+            if (dst_offset < -1) {
+                return dst_offset;
+            }
+            if (dst_offset != -1) {
+                break;
+            }
+            if (dst_changed && dir_block_write(dst_pos, dst)) {
+                return -1;
+            }
+            dst_changed = false;
+        }
+        if (dst_id == last_id) {
+            break;
+        }
+
+        // split the slack off the record found, as in `add_dir_entry`, then drop the record from the last block, as in
+        // `remove_dir_entry`
+        struct dir_entry* free_rec = dir_rec(dst, dst_offset);
+        if (free_rec->inode_pos != 0) {
+            int used = DIR_REC_LEN(free_rec->name_len), slack = rec_len_of(free_rec) - used;
+            set_rec_len(free_rec, used);
+            free_rec = dir_rec(dst, dst_offset + used);
+            set_rec_len(free_rec, slack);
+        }
+        free_rec->inode_pos = rec->inode_pos;
+        free_rec->name_len = rec->name_len;
+        free_rec->type = rec->type;
+        memcpy(free_rec->name, rec->name, rec->name_len);
+        dst_changed = moved = true;
+        if (prev == -1) {
+            rec->inode_pos = 0;
+            prev = offset;
+        } else {
+            set_rec_len(dir_rec(last, prev), rec_len_of(dir_rec(last, prev)) + rec_len_of(rec));
+        }
+        if (journal_handle_busy()) {
+            *done = false;
+            break;
+        }
+    }
+    if (dst_changed && dir_block_write(dst_pos, dst)) {
+        return -1;
+    }
+    inode->dir_free_block = min(dst_id, last_id);
+
+    if (dir_block_empty(last)) {
+        *done = false;
+        return clear_block(BITMAP_BLOCK_DATA, last_pos) || set_block_pos(inode, last_id, -1) ? -1 : 1;
+    }
+    return moved && dir_block_write(last_pos, last) ? -1 : 0;
+}
+
+// Release the indirect blocks of a directory, whose lock the caller holds, that no longer point to any block
+// Return the number of blocks freed, or -1 on error
+int release_empty_indirect(struct inode* inode)
+{
+    uint32_t pointers[MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    int freed = 0;
+    for (int i = 0; i < SINGLE_INDIRECT_BLOCK_NUM; i++) {
+        if (inode->block_point_indirect[i] == -1) {
+            continue;
+        }
+        if (cached_disk_read(DATA_BLOCK_START + inode->block_point_indirect[i], (char*)pointers)) {
+            return -1;
+        }
+        bool empty = true;
+        for (int j = 0; j < INDIRECT_POINTERS_PER_BLOCK && empty; j++) {
+            empty = pointers[j] == -1;
+        }
+        if (!empty) {
+            continue;
+        }
+        if (clear_block(BITMAP_BLOCK_DATA, inode->block_point_indirect[i])) {
+            return -1;
+        }
+        inode->block_point_indirect[i] = -1;
+        freed++;
+    }
+    return freed;
+}
+
+// Compact the directory `inode_pos`, the entry `name` of the directory `parent` (-1 for the root)
+// Return the number of blocks freed, or -1 on error
+int compact_dir(int parent, unsigned int parent_version, const char* name, int inode_pos)
+{
+    char* last = malloc(FS_BLOCK_SIZE);
+    char* dst = malloc(FS_BLOCK_SIZE);
+    int freed = 0, ret = last == NULL || dst == NULL ? -1 : 0;
+    for (bool done = false; ret == 0 && !done;) {
+        journal_start();
+        if (defrag_lock(parent, parent_version, name, inode_pos)) {
+            journal_stop();
+            break;
+        }
+        struct inode inode;
+        ret = inode_read(inode_pos, &inode);
+        if (ret == 0 && inode.mode == DIRMODE && time(NULL) - inode_versions[inode_pos].listed >= DEFRAG_LIST_IDLE) {
+            ret = compact_dir_step(&inode, last, dst, &done);
+            freed += ret == 1;
+            ret = ret < 0 ? -1 : 0;
+            if (ret == 0 && done) {
+                int released = release_empty_indirect(&inode);
+                freed += released == -1 ? 0 : released;
+                ret = released == -1 ? -1 : 0;
+            }
+            ret = ret || inode_write(inode_pos, &inode) ? -1 : 0;
+        } else {
+            done = true;
+        }
+        defrag_unlock(parent, inode_pos);
+        journal_stop();
+    }
+    free(last);
+    free(dst);
+    return ret == -1 ? -1 : freed;
+}
+
+// The entries of a directory, as listed before any of them is worked on, with the versions of the directories
+struct defrag_list {
+    struct dir_entry* entries;
+    unsigned int* versions;
+    int num, cap;
+    bool failed;
+};
+int defrag_list_add(struct dir_entry* entry, void* context)
+{
+    struct defrag_list* list = context;
+    if (list->num == list->cap) {
+        int cap = list->cap == 0 ? 64 : list->cap * 2;
+        struct dir_entry* entries = realloc(list->entries, cap * sizeof(struct dir_entry));
+        if (entries != NULL) {
+            list->entries = entries;
+        }
+        unsigned int* versions = realloc(list->versions, cap * sizeof(unsigned int));
+        if (versions != NULL) {
+            list->versions = versions;
+        }
+        if (entries == NULL || versions == NULL) {
+            list->failed = true;
+            return 1;
+        }
+        list->cap = cap;
+    }
+    // the entry is held by the locked directory, so it is alive and its version is current
+    list->versions[list->num] = inode_versions[entry->inode_pos].version;
+    list->entries[list->num++] = *entry;
+    return 0;
+}
+
+// Defragment the files and compact the directories below the directory `dir_pos`, if it is still the one of `version`
+// A background pass ends early at unmount, when the generation it was started in is over
+// Return 0, or -1 on error
+int defrag_tree(int dir_pos, unsigned int version, int generation)
+{
+    struct defrag_list list = { 0 };
+    struct inode inode;
+    lock_inode_read(dir_pos);
+    int ret = inode_versions[dir_pos].version != version ? 0 : inode_read(dir_pos, &inode) ? -1 : inode.mode != DIRMODE ? 0
+        : walk_dir_entry(&inode, defrag_list_add, &list);
+    unlock_inode(dir_pos);
+    ret = ret || list.failed ? -1 : 0;
+
+    for (int i = 0; ret == 0 && i < list.num; i++) {
+        if (generation != -1 && generation != defrag_state.generation) {
+            break;
+        }
+        struct dir_entry* entry = &list.entries[i];
+        if (entry->type == DT_DIR) {
+            ret = compact_dir(dir_pos, version, entry->name, entry->inode_pos) == -1
+                || defrag_tree(entry->inode_pos, list.versions[i], generation) ? -1 : 0;
+        } else {
+            ret = defrag_file(dir_pos, version, entry->name, entry->inode_pos) == -1 ? -1 : 0;
+        }
+    }
+    free(list.entries);
+    free(list.versions);
+    return ret;
+}
+
+// Defragment everything below the directory `dir_pos`, and the directory itself through its entry `name` of the
+// directory `parent`, -1 if it is the root or not known
+int defrag_inode(int parent, const char* name, int dir_pos)
+{
+    unsigned int parent_version = parent == -1 ? 0 : inode_versions[parent].version, version = inode_versions[dir_pos].version;
+    if ((parent != -1 || dir_pos == ROOT_INODE) && compact_dir(parent, parent_version, name, dir_pos) == -1) {
+        return -1;
+    }
+    return defrag_tree(dir_pos, version, -1);
+}
+
+void* defrag_thread(void* arg)
+{
+    int generation = (intptr_t)arg;
+    for (;;) {
+        sleep(options.defrag);
+        pthread_mutex_lock(&defrag_state.lock);
+        if (generation != defrag_state.generation) {
+            pthread_mutex_unlock(&defrag_state.lock);
+            return NULL;
+        }
+        defrag_state.running = true;
+        pthread_mutex_unlock(&defrag_state.lock);
+
+        defrag_tree(ROOT_INODE, inode_versions[ROOT_INODE].version, generation);
+        compact_dir(-1, 0, NULL, ROOT_INODE);
+
+        pthread_mutex_lock(&defrag_state.lock);
+        defrag_state.running = false;
+        pthread_cond_broadcast(&defrag_state.cond);
+        pthread_mutex_unlock(&defrag_state.lock);
+    }
+    return NULL;
+}
+
+// Start a background pass over the whole tree every `-o defrag` seconds
+void start_defrag_thread()
+{
+    if (options.defrag <= 0) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, defrag_thread, (void*)(intptr_t)defrag_state.generation) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// End the background passes of this mount, waiting for one under way
+void defrag_stop()
+{
+    pthread_mutex_lock(&defrag_state.lock);
+    defrag_state.generation++;
+    while (defrag_state.running) {
+        pthread_cond_wait(&defrag_state.cond, &defrag_state.lock);
+    }
+    pthread_mutex_unlock(&defrag_state.lock);
+}
+
+// Consistency check, see `fs_check`
+// The inode table is split among threads, which walk the block pointers of every allocated inode into a count of
+// references per data block, and the records of every directory into a list of entries; then the entries are followed
+// from the root, and the bitmaps and reference counts on the disk are compared with what was found
+// Repairs leave the filesystem as the references say: entries to inodes that are free, or that another entry reaches
+// already, are removed; inodes nothing reaches are freed, as a tree `FS_IOC_RMTREE` had not freed at a crash; a data
+// block no pointer holds is freed, as the indirect blocks `free_inode` and `inode_truncate` leave behind; and a block
+// two pointers hold gets a count of one extra reference, so it is copied on the next write through either of them
+#define FSCK_SCAN_CHUNK 8 // inode-table blocks a thread takes at a time
+
+struct fsck_entry {
+    int parent, child;
+    int block_pos, offset; // where the record is
+    int order; // of the record in its directory
+    uint8_t name_len, type;
+    bool remove, fix_type;
+};
+
+struct fsck {
+    bool repair;
+    FILE* out;
+    pthread_mutex_t lock; // `out` and `entries`
+    char* inode_bitmap; // as on the disk
+    atomic_uint* refs; // pointers holding each data block
+    uint8_t* types; // of every allocated inode: `DT_DIR`, `DT_REG`, or 0 if it is unusable and only its bit is freed
+    bool* bad_pointers; // inodes holding pointers out of the data area, which are not counted
+    bool* fix_sizes; // directories whose size is not what their records hold, or will not be once entries are removed
+    bool* released; // data blocks the inodes freed by repairs held, which are not reported again as leaked
+    uint32_t* dir_sizes; // bytes of used records found in every directory
+    atomic_int next_block;
+    struct fsck_entry* entries;
+    int entry_num, entry_cap;
+    atomic_int found, left; // problems found, and those not repaired
+    atomic_bool broken_dirs; // some records could not be read, so an inode nothing reaches may still be linked
+    atomic_bool failed;
+};
+
+// Report a problem, which stays if it is not `repairable` or repairs are off
+[[gnu::format(printf, 3, 4)]] void fsck_report(struct fsck* fsck, bool repairable, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&fsck->lock);
+    fprintf(fsck->out, "fsck: ");
+    vfprintf(fsck->out, fmt, args);
+    fputs(repairable && fsck->repair ? ", repaired\n" : "\n", fsck->out);
+    pthread_mutex_unlock(&fsck->lock);
+    va_end(args);
+    fsck->found++;
+    fsck->left += !repairable || !fsck->repair;
+}
+
+// Whether a file block pointer holds blocks of the data area, one, a whole compressed extent or a tail
+bool fsck_pointer_valid(int block_pos, bool dir)
+{
+    if (is_tail(block_pos)) {
+        return !dir && extent_addr(block_pos) < DATA_BLOCK_SIZE;
+    }
+    if (!is_compressed(block_pos)) {
+        return block_pos >= 0 && block_pos < DATA_BLOCK_SIZE;
+    }
+    int idx = (uint32_t)block_pos >> COMPRESSED_IDX_SHIFT & ((1 << (COMPRESSED_LEN_SHIFT - COMPRESSED_IDX_SHIFT)) - 1);
+    return !dir && extent_len(block_pos) >= 1 && extent_len(block_pos) <= COMPRESS_CLUSTER && idx < COMPRESS_CLUSTER
+        && extent_addr(block_pos) + extent_len(block_pos) <= DATA_BLOCK_SIZE;
+}
+
+// The entries a scanning thread has found, merged into `fsck->entries` when it ends
+struct fsck_list {
+    struct fsck_entry* entries;
+    int num, cap;
+};
+
+// Parse the records of a directory block into `list`, adding the bytes of the used ones to `*size`
+// Return 0, 1 if the records do not tile the block, or -1 on error
+int fsck_dir_block(int dir_pos, int block_id, int block_pos, char* buf, struct fsck_list* list, uint32_t* size)
+{
+    for (int offset = 0, next; offset < FS_BLOCK_SIZE; offset = next) {
+        struct dir_entry* rec = dir_rec(buf, offset);
+        next = dir_rec_next(buf, offset);
+        if (next == -1) {
+            return 1;
+        }
+        if (rec->inode_pos != 0) {
+            if (list->num == list->cap) {
+                int cap = list->cap == 0 ? 256 : list->cap * 2;
+                struct fsck_entry* grown = realloc(list->entries, cap * sizeof(struct fsck_entry));
+                if (grown == NULL) {
+                    return -1;
+                }
+                list->entries = grown;
+                list->cap = cap;
+            }
+            list->entries[list->num++] = (struct fsck_entry) {
+                .parent = dir_pos,
+                .child = rec->inode_pos,
+                .block_pos = block_pos,
+                .offset = offset,
+                .order = block_id * FS_BLOCK_SIZE + offset,
+                .name_len = rec->name_len,
+                .type = rec->type,
+            };
+            *size += DIR_REC_LEN(rec->name_len);
+        }
+    }
+    return 0;
+}
+
+// Add `delta` to the references of every block an inode holds, its indirect blocks included, skipping bad pointers
+// With a `list`, the inode is checked as well: its bad pointers are reported, and the records of a directory parsed
+int fsck_inode_blocks(struct fsck* fsck, int inode_pos, struct inode* inode, int delta, struct fsck_list* list)
+{
+    bool dir = inode->mode == DIRMODE;
+    uint32_t pointers[MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    char buf[MAX_BLOCK_SIZE];
+    uint32_t size = 0;
+    for (int id = 0; id < DATA_BLOCK_PER_INODE; id++) {
+        int block_pos;
+        if (id < DIRECT_BLOCK_NUM) {
+            block_pos = inode->block_point[id];
+        } else {
+            int index = (id - DIRECT_BLOCK_NUM) / INDIRECT_POINTERS_PER_BLOCK, offset = (id - DIRECT_BLOCK_NUM) % INDIRECT_POINTERS_PER_BLOCK;
+            int indirect = inode->block_point_indirect[index];
+            if (indirect == -1 || !fsck_pointer_valid(indirect, true)) {
+                if (indirect != -1 && list != NULL) {
+                    fsck_report(fsck, true, "inode %d: indirect block %#x is outside the data area", inode_pos, (uint32_t)indirect);
+                    fsck->bad_pointers[inode_pos] = true;
+                }
+                id += INDIRECT_POINTERS_PER_BLOCK - 1;
+                continue;
+            }
+            if (offset == 0) {
+                fsck->refs[indirect] += delta;
+                if (delta < 0) {
+                    fsck->released[indirect] = true;
+                }
+                if (cached_disk_peek(DATA_BLOCK_START + indirect, (char*)pointers)) {
+                    return -1;
+                }
+            }
+            block_pos = pointers[offset];
+        }
+        if (block_pos == -1) {
+            continue;
+        }
+        if (!fsck_pointer_valid(block_pos, dir)) {
+            if (list != NULL) {
+                fsck_report(fsck, true, "inode %d: block %d points to %#x, outside the data area", inode_pos, id, (uint32_t)block_pos);
+                fsck->bad_pointers[inode_pos] = true;
+            }
+            continue;
+        }
+        for (int i = 0; i < extent_len(block_pos); i++) {
+            fsck->refs[extent_addr(block_pos) + i] += delta;
+            if (delta < 0) {
+                fsck->released[extent_addr(block_pos) + i] = true;
+            }
+        }
+        if (dir && list != NULL) {
+            int ret = cached_disk_peek(DATA_BLOCK_START + block_pos, buf) ? -1 : fsck_dir_block(inode_pos, id, block_pos, buf, list, &size);
+            if (ret == -1) {
+                return -1;
+            }
+            if (ret == 1) {
+                fsck_report(fsck, false, "directory %d: block %d holds broken records", inode_pos, id);
+                fsck->broken_dirs = true;
+            }
+        }
+    }
+    if (dir && list != NULL) {
+        fsck->dir_sizes[inode_pos] = size;
+        if (inode->size != size) {
+            fsck->fix_sizes[inode_pos] = true;
+            fsck_report(fsck, true, "directory %d: size is %u, its records hold %u bytes", inode_pos, inode->size, size);
+        }
+    }
+    return 0;
+}
+
+// Check every allocated inode of the inode-table blocks the thread takes
+void* fsck_scan_thread(void* arg)
+{
+    struct fsck* fsck = arg;
+    struct fsck_list list = { 0 };
+    char buf[MAX_BLOCK_SIZE];
+    for (int first; !fsck->failed && (first = atomic_fetch_add(&fsck->next_block, FSCK_SCAN_CHUNK)) < INODE_TABLE_SIZE;) {
+        for (int block = first; block < min(first + FSCK_SCAN_CHUNK, INODE_TABLE_SIZE) && !fsck->failed; block++) {
+            bool init = get_bit((char*)inode_table_init, block);
+            if (init && cached_disk_peek(INODE_TABLE_START + block, buf)) {
+                fsck->failed = true;
+                break;
+            }
+            for (int pos = block * INODE_PER_BLOCK; pos < (block + 1) * INODE_PER_BLOCK; pos++) {
+                if (!get_bit(fsck->inode_bitmap, pos)) {
+                    continue;
+                }
+                if (!init) {
+                    fsck_report(fsck, true, "inode %d: allocated in a block of the inode table never zeroed", pos);
+                    continue;
+                }
+                struct inode* inode = (struct inode*)(buf + pos % INODE_PER_BLOCK * INODE_SIZE);
+                if (inode->mode != DIRMODE && inode->mode != REGMODE) {
+                    fsck_report(fsck, true, "inode %d: unknown mode %#o", pos, inode->mode);
+                    continue;
+                }
+                fsck->types[pos] = IFTODT(inode->mode);
+                if (inode->size > MAX_FILE_SIZE) {
+                    fsck_report(fsck, false, "inode %d: size %u is beyond the largest file", pos, inode->size);
+                }
+                if (fsck_inode_blocks(fsck, pos, inode, 1, &list)) {
+                    fsck->failed = true;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_lock(&fsck->lock);
+    if (fsck->entry_num + list.num > fsck->entry_cap) {
+        int cap = max(fsck->entry_cap * 2, fsck->entry_num + list.num);
+        struct fsck_entry* grown = realloc(fsck->entries, cap * sizeof(struct fsck_entry));
+        if (grown == NULL) {
+            fsck->failed = true;
+        } else {
+            fsck->entries = grown;
+            fsck->entry_cap = cap;
+        }
+    }
+    if (!fsck->failed && list.num > 0) {
+        memcpy(fsck->entries + fsck->entry_num, list.entries, list.num * sizeof(struct fsck_entry));
+        fsck->entry_num += list.num;
+    }
+    pthread_mutex_unlock(&fsck->lock);
+    free(list.entries);
+    return NULL;
+}
+
+int compare_fsck_entry(const void* a, const void* b)
+{
+    const struct fsck_entry *x = a, *y = b;
+    return x->parent != y->parent ? x->parent - y->parent : x->order - y->order;
+}
+
+// Follow the entries from the root, marking those to remove or retype, into the inodes reached
+int fsck_walk_tree(struct fsck* fsck, bool* reached)
+{
+    int* first = calloc(INODE_NUM + 1, sizeof(int));
+    int* queue = malloc(sizeof(int) * INODE_NUM);
+    if (first == NULL || queue == NULL) {
+        free(first);
+        free(queue);
+        return -1;
+    }
+    qsort(fsck->entries, fsck->entry_num, sizeof(struct fsck_entry), compare_fsck_entry);
+    for (int i = 0; i < fsck->entry_num; i++) {
+        first[fsck->entries[i].parent + 1]++;
+    }
+    for (int i = 0; i < INODE_NUM; i++) {
+        first[i + 1] += first[i];
+    }
+
+    int head = 0, tail = 0;
+    reached[ROOT_INODE] = true;
+    queue[tail++] = ROOT_INODE;
+    while (head < tail) {
+        int dir_pos = queue[head++];
+        for (int i = first[dir_pos]; i < first[dir_pos + 1]; i++) {
+            struct fsck_entry* entry = &fsck->entries[i];
+            int child = entry->child;
+            if (child >= INODE_NUM || !get_bit(fsck->inode_bitmap, child) || fsck->types[child] == 0) {
+                fsck_report(fsck, true, "directory %d: entry at %d+%d links inode %d, which is free", dir_pos, entry->block_pos, entry->offset, child);
+                entry->remove = true;
+            } else if (reached[child]) {
+                fsck_report(fsck, true, "directory %d: entry at %d+%d links inode %d a second time", dir_pos, entry->block_pos, entry->offset, child);
+                entry->remove = true;
+            } else {
+                reached[child] = true;
+                if (entry->type != fsck->types[child]) {
+                    fsck_report(fsck, true, "directory %d: entry at %d+%d has type %d, inode %d is of type %d", dir_pos, entry->block_pos, entry->offset,
+                        entry->type, child, fsck->types[child]);
+                    entry->fix_type = true;
+                }
+                if (fsck->types[child] == DT_DIR) {
+                    queue[tail++] = child;
+                }
+            }
+        }
+    }
+    free(first);
+    free(queue);
+    return 0;
+}
+
+// Remove a directory record in place, as `remove_dir_entry` does, but leave the block to the directory even if empty
+int fsck_remove_record(const struct fsck_entry* entry)
+{
+    char buf[FS_BLOCK_SIZE];
+    if (data_read(entry->block_pos, buf)) {
+        return -1;
+    }
+    int prev = -1;
+    for (int offset = 0, next; offset < entry->offset; prev = offset, offset = next) {
+        next = dir_rec_next(buf, offset);
+        if (next == -1) {
+            return -EIO;
+        }
+    }
+    struct dir_entry* rec = dir_rec(buf, entry->offset);
+    if (prev == -1) {
+        rec->inode_pos = 0;
+    } else {
+        set_rec_len(dir_rec(buf, prev), rec_len_of(dir_rec(buf, prev)) + rec_len_of(rec));
+    }
+    return dir_block_write(entry->block_pos, buf);
+}
+
+// Clear the pointers of an inode that lead out of the data area
+int fsck_clear_bad_pointers(int inode_pos, struct inode* inode)
+{
+    for (int i = 0; i < SINGLE_INDIRECT_BLOCK_NUM; i++) {
+        if (inode->block_point_indirect[i] != -1 && !fsck_pointer_valid(inode->block_point_indirect[i], true)) {
+            inode->block_point_indirect[i] = -1;
+        }
+    }
+    for (int id = 0; id < DATA_BLOCK_PER_INODE; id++) {
+        int block_pos;
+        if (get_block_pos(inode, id, &block_pos)) {
+            return -1;
+        }
+        if (block_pos != -1 && !fsck_pointer_valid(block_pos, inode->mode == DIRMODE) && set_block_pos(inode, id, -1)) {
+            return -1;
+        }
+    }
+    return inode_write(inode_pos, inode);
+}
+
+// Repair the entries and inodes, each in a journal handle of its own: remove and retype entries, then clear bad
+// pointers, set the sizes of directories to what their records hold, and free the inodes nothing reaches, taking
+// their blocks out of the references
+int fsck_repair_inodes(struct fsck* fsck, const bool* reached, bool free_unreached)
+{
+    int ret = 0;
+    for (int i = 0; ret == 0 && i < fsck->entry_num; i++) {
+        struct fsck_entry* entry = &fsck->entries[i];
+        journal_start();
+        if (entry->remove) {
+            ret = fsck_remove_record(entry);
+            fsck->dir_sizes[entry->parent] -= DIR_REC_LEN(entry->name_len);
+            fsck->fix_sizes[entry->parent] = true;
+        } else if (entry->fix_type) {
+            ret = journal_write_part(DATA_BLOCK_START + entry->block_pos, entry->offset + offsetof(struct dir_entry, type), (char*)&fsck->types[entry->child], 1);
+        }
+        journal_stop();
+    }
+    for (int pos = 0; ret == 0 && pos < INODE_NUM; pos++) {
+        bool fix = reached[pos] ? fsck->bad_pointers[pos] || fsck->fix_sizes[pos] : free_unreached;
+        if (!get_bit(fsck->inode_bitmap, pos) || !fix) {
+            continue;
+        }
+        journal_start();
+        struct inode inode;
+        if (fsck->types[pos] != 0 && inode_read(pos, &inode)) {
+            ret = -1;
+        } else if (!reached[pos]) {
+            ret = fsck->types[pos] != 0 && fsck_inode_blocks(fsck, pos, &inode, -1, NULL) ? -1 : clear_block(BITMAP_BLOCK_INODE, pos);
+            inode_changed(pos);
+        } else if (fsck->bad_pointers[pos]) {
+            ret = fsck_clear_bad_pointers(pos, &inode);
+        }
+        if (ret == 0 && reached[pos] && fsck->fix_sizes[pos]) {
+            inode.size = fsck->dir_sizes[pos];
+            ret = inode_write(pos, &inode);
+        }
+        journal_stop();
+    }
+    return ret;
+}
+
+// Compare the data bitmap and the reference counts with the references found, and rewrite the blocks that differ
+// A block freed here may have a journaled image as an indirect or directory block, which is revoked, as in `clear_block`
+int fsck_check_blocks(struct fsck* fsck)
+{
+    // aligned for the reference counts they also hold
+    _Alignas(uint16_t) char disk[FS_BLOCK_SIZE], want[FS_BLOCK_SIZE];
+    for (int g = 0; g < DATA_BITMAP_BLOCK_NUM; g++) {
+        if (cached_disk_peek(BITMAP_BLOCK_DATA + g, disk)) {
+            return -1;
+        }
+        memcpy(want, disk, FS_BLOCK_SIZE);
+        bool differs = false;
+        for (int bit = 0; bit < BITMAP_BITS_PER_BLOCK && g * BITMAP_BITS_PER_BLOCK + bit < DATA_BLOCK_SIZE; bit++) {
+            int block_pos = g * BITMAP_BITS_PER_BLOCK + bit;
+            bool used = fsck->refs[block_pos] > 0;
+            if (used == get_bit(disk, bit)) {
+                continue;
+            }
+            if (!fsck->released[block_pos]) {
+                fsck_report(fsck, true, used ? "data block %d: in use, but marked free" : "data block %d: marked in use, but nothing holds it", block_pos);
+            }
+            differs = true;
+            if (used) {
+                set_bit(want, bit);
+            } else if (fsck->repair) {
+                clear_bit(want, bit);
+                journal_revoke(DATA_BLOCK_START + block_pos);
+                device_set_metadata(DATA_BLOCK_START + block_pos, false);
+                cluster_cache_drop(block_pos);
+            }
+        }
+        if (differs && fsck->repair) {
+            journal_start();
+            int ret = journal_write(BITMAP_BLOCK_DATA + g, want);
+            journal_stop();
+            if (ret) {
+                return -1;
+            }
+        }
+    }
+
+    uint16_t *counts = (uint16_t*)disk, *want_counts = (uint16_t*)want;
+    for (int b = 0; b < REFCOUNT_BLOCK_NUM; b++) {
+        if (cached_disk_peek(REFCOUNT_START + b, disk)) {
+            return -1;
+        }
+        memcpy(want, disk, FS_BLOCK_SIZE);
+        bool differs = false;
+        for (int i = 0; i < REFCOUNTS_PER_BLOCK && b * REFCOUNTS_PER_BLOCK + i < DATA_BLOCK_SIZE; i++) {
+            int block_pos = b * REFCOUNTS_PER_BLOCK + i, extra = max((int)fsck->refs[block_pos] - 1, 0);
+            if (counts[i] == extra) {
+                continue;
+            }
+            if (extra > REFCOUNT_MAX) {
+                fsck_report(fsck, false, "data block %d: held by %d pointers, more than a count can hold", block_pos, extra + 1);
+                continue;
+            }
+            fsck_report(fsck, true, counts[i] == 0 ? "data block %d: held by %d pointers, but not counted as shared" : "data block %d: held by %d pointers, counted %d", block_pos,
+                extra + 1, counts[i] + 1);
+            want_counts[i] = extra;
+            differs = true;
+        }
+        if (differs && fsck->repair) {
+            journal_start();
+            int ret = journal_write(REFCOUNT_START + b, want);
+            journal_stop();
+            if (ret) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Check the filesystem, from the inode table with `threads` threads, see fs.h
+int fs_check(int threads, bool repair, FILE* out)
+{
+    struct fsck fsck = {
+        .repair = repair,
+        .out = out,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .inode_bitmap = malloc((BITMAP_BLOCK_DATA - BITMAP_BLOCK_INODE) * FS_BLOCK_SIZE),
+        .refs = calloc(DATA_BLOCK_SIZE, sizeof(atomic_uint)),
+        .types = calloc(INODE_NUM, sizeof(uint8_t)),
+        .bad_pointers = calloc(INODE_NUM, sizeof(bool)),
+        .dir_sizes = calloc(INODE_NUM, sizeof(uint32_t)),
+        .fix_sizes = calloc(INODE_NUM, sizeof(bool)),
+        .released = calloc(DATA_BLOCK_SIZE, sizeof(bool)),
+    };
+    bool* reached = calloc(INODE_NUM, sizeof(bool));
+    pthread_t* scanners = calloc(max(threads, 1), sizeof(pthread_t));
+    int ret = fsck.inode_bitmap == NULL || fsck.refs == NULL || fsck.types == NULL || fsck.bad_pointers == NULL || fsck.dir_sizes == NULL
+            || fsck.fix_sizes == NULL || fsck.released == NULL || reached == NULL || scanners == NULL
+        ? -1
+        : 0;
+    for (int g = 0; ret == 0 && g < BITMAP_BLOCK_DATA - BITMAP_BLOCK_INODE; g++) {
+        ret = cached_disk_peek(BITMAP_BLOCK_INODE + g, fsck.inode_bitmap + g * FS_BLOCK_SIZE);
+    }
+
+    // the free counts, from the superblock after a clean unmount, against the bitmaps
+    int used_blocks = ret ? -1 : count_bitmap(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE), used_inodes = ret ? -1 : count_bitmap(BITMAP_BLOCK_INODE, INODE_NUM);
+    ret = used_blocks == -1 || used_inodes == -1 ? -1 : 0;
+    if (ret == 0 && bitmap_used[BITMAP_BLOCK_DATA] != used_blocks) {
+        fsck_report(&fsck, true, "%d data blocks counted free, the bitmap has %d", DATA_BLOCK_SIZE - bitmap_used[BITMAP_BLOCK_DATA], DATA_BLOCK_SIZE - used_blocks);
+    }
+    if (ret == 0 && bitmap_used[BITMAP_BLOCK_INODE] != used_inodes) {
+        fsck_report(&fsck, true, "%d inodes counted free, the bitmap has %d", INODE_NUM - bitmap_used[BITMAP_BLOCK_INODE], INODE_NUM - used_inodes);
+    }
+
+    // the scan, on this thread too
+    int started = 0;
+    for (; ret == 0 && started < threads - 1; started++) {
+        if (pthread_create(&scanners[started], NULL, fsck_scan_thread, &fsck)) {
+            break;
+        }
+    }
+    if (ret == 0) {
+        fsck_scan_thread(&fsck);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(scanners[i], NULL);
+    }
+    ret = ret || fsck.failed ? -1 : 0;
+
+    if (ret == 0 && fsck.types[ROOT_INODE] != DT_DIR) {
+        fsck_report(&fsck, false, "the root directory is gone");
+    } else if (ret == 0) {
+        ret = fsck_walk_tree(&fsck, reached);
+        // with broken records, an inode nothing reaches may be linked from them, so it stays
+        bool free_unreached = !fsck.broken_dirs;
+        for (int pos = 0; ret == 0 && pos < INODE_NUM; pos++) {
+            if (get_bit(fsck.inode_bitmap, pos) && !reached[pos] && fsck.types[pos] != 0) {
+                fsck_report(&fsck, free_unreached, "inode %d: allocated, but no entry links it", pos);
+            }
+        }
+        if (ret == 0 && repair) {
+            ret = fsck_repair_inodes(&fsck, reached, free_unreached);
+        }
+        ret = ret || fsck_check_blocks(&fsck) ? -1 : 0;
+    }
+
+    // the free counts are taken from the repaired bitmaps
+    if (ret == 0 && repair) {
+        used_blocks = count_bitmap(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE);
+        used_inodes = count_bitmap(BITMAP_BLOCK_INODE, INODE_NUM);
+        ret = used_blocks == -1 || used_inodes == -1 ? -1 : 0;
+    }
+    if (ret == 0 && repair) {
+        bitmap_used[BITMAP_BLOCK_DATA] = used_blocks;
+        bitmap_used[BITMAP_BLOCK_INODE] = used_inodes;
+        journal_start();
+        ret = write_superblock(FS_MOUNTED);
+        journal_stop();
+        ret = ret || journal_commit() ? -1 : 0;
+    }
+
+    free(fsck.inode_bitmap);
+    free(fsck.refs);
+    free(fsck.types);
+    free(fsck.bad_pointers);
+    free(fsck.dir_sizes);
+    free(fsck.fix_sizes);
+    free(fsck.released);
+    free(fsck.entries);
+    free(reached);
+    free(scanners);
+    if (ret) {
+        return -1;
+    }
+    fprintf(out, "fsck: %d problems found, %d left\n", (int)fsck.found, (int)fsck.left);
+    return (fsck.found > fsck.left ? FSCK_REPAIRED : 0) | (fsck.left > 0 ? FSCK_LEFT : 0);
+}
+
+// Move the entry `old_name` of the directory `old_parent` to `new_name` in the directory `new_parent`
+// An existing target is replaced
+int rename_inode(int old_parent, const char* old_name, int new_parent, const char* new_name)
+{
+    struct dir_entry new_entry = {
+        .name_len = strlen(new_name),
+    };
+    if (strlen(new_name) > MAX_FILENAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(new_entry.name, new_name, new_entry.name_len);
+
+    // lock both parents in ascending lock index order, see the lock order above
+    int first = old_parent % INODE_LOCK_NUM <= new_parent % INODE_LOCK_NUM ? old_parent : new_parent;
+    int second = first == old_parent ? new_parent : old_parent;
+    bool same_lock = first % INODE_LOCK_NUM == second % INODE_LOCK_NUM;
+    lock_inode_write(first);
+    if (!same_lock) {
+        lock_inode_write(second);
+    }
+
+    // the new name takes over the record of the target it replaces, or is added before the old name is removed, so a
+    // rename that fails for lack of room in the new parent leaves both names as they were
+    struct dir_entry entry, replaced;
+    int replaced_pos = -1;
+    int ret = lookup_dir_entry_locked(old_parent, old_name, &entry);
+    if (ret >= 0) {
+        new_entry.inode_pos = entry.inode_pos;
+        new_entry.type = entry.type;
+        replaced_pos = replace_dir_entry_locked(new_parent, new_name, &new_entry, &replaced);
+        ret = replaced_pos == -ENOENT ? add_dir_entry_locked(new_parent, &new_entry) : min(replaced_pos, 0);
+    }
+    // both names are already links to the same inode
+    if (ret >= 0 && replaced_pos == (int)entry.inode_pos) {
+        replaced_pos = -1;
+    } else if (ret >= 0) {
+        ret = remove_dir_entry_locked(old_parent, old_name, &entry);
+    }
+
+    if (!same_lock) {
+        unlock_inode(second);
+    }
+    unlock_inode(first);
+
+    // the replaced target is freed only after the parents are unlocked
+    if (replaced_pos >= 0 && free_inode(replaced_pos)) {
         return -1;
     }
+    return ret < 0 ? ret : 0;
+}
+
+// Change the name or location of a file or directory
+// `mv` command can trigger this function
+// An existing target is replaced
+int fs_rename(const char* oldpath, const char* newpath)
+{
+    OP_SCOPE(OP_RENAME, oldpath, -1);
+    log_op(OP_RENAME, oldpath, newpath, 0, 0, 0);
+    JOURNAL_HANDLE();
+
+    struct dir_entry old_name, new_name;
+    int old_parent = resolve_parent(oldpath, &old_name);
+    if (old_parent < 0) {
+        return old_parent;
+    }
+    int new_parent = resolve_parent(newpath, &new_name);
+    if (new_parent < 0) {
+        return new_parent;
+    }
+    return rename_inode(old_parent, old_name.name, new_parent, new_name.name);
+}
+
+int inode_truncate(struct inode* inode, off_t size)
+{
+    assert(size <= MAX_FILE_SIZE);
+
+    // a file grows sparse: the new blocks are holes until they are written
+    inode->atime = inode->ctime = time(NULL);
+    if (inode->size > size) {
+        // release the data blocks
+        for (int i = ceil_div(size, FS_BLOCK_SIZE); i < ceil_div(inode->size, FS_BLOCK_SIZE); i++) {
+            int block_pos;
+            if (get_block_pos(inode, i, &block_pos)) {
+                return -1;
+            }
+            // a hole, or a block whose data is still in the write buffer
+            if (block_pos == -1) {
+                continue;
+            }
+            if (release_block(block_pos)) {
+                return -1;
+            }
+            if (set_block_pos(inode, i, -1)) {
+                return -1;
+            }
+        }
+
+        // zero the rest of the last block, which would show again if the file grows
+        // a shared or compressed last block is left alone, its copy in the write buffer was zeroed instead
+        int block_pos;
+        if (size % FS_BLOCK_SIZE != 0) {
+            if (get_block_pos(inode, size / FS_BLOCK_SIZE, &block_pos)) {
+                return -1;
+            }
+            int shared = block_pos == -1 ? 0 : block_shared(block_pos);
+            char zero_buf[FS_BLOCK_SIZE];
+            memset(zero_buf, 0, FS_BLOCK_SIZE);
+            if (shared == -1 || (block_pos != -1 && !shared && cached_disk_write_part(DATA_BLOCK_START + block_pos, size % FS_BLOCK_SIZE, zero_buf, FS_BLOCK_SIZE - size % FS_BLOCK_SIZE))) {
+                return -1;
+            }
+        }
+    }
+    inode->size = size;
 
-    if (offset >= inode.size) {
+    return 0;
+}
+
+// Write the data in a FUSE buffer vector to an inode, whose lock the caller holds for writing
+// Update the `mtime` and `ctime` of the file
+// Return the number of bytes written which should be equal to the size of `src`, or less on error
+int inode_write_buf(int inode_pos, struct fuse_bufvec* src, off_t offset, bool append)
+{
+    struct inode inode;
+    if (inode_read(inode_pos, &inode)) {
         return 0;
     }
 
-    size = min(size, inode.size - offset);
-    int total_read = 0;
+    if (append) {
+        // the system should set the file offset to the end of the file when `O_APPEND` is set
+        // but we explicitly set again to prevent some unexpected behavior
+        offset = inode.size;
+    }
 
-    char buf[BLOCK_SIZE];
+    size_t size = fuse_buf_size(src);
+    if (offset + size > MAX_FILE_SIZE) {
+        return 0;
+    }
+
+    // the data goes to the write buffer, the blocks are allocated when it is flushed
+    int total_written = 0;
     while (size > 0) {
-        int block_idx = (offset + total_read) / BLOCK_SIZE, block_offset = (offset + total_read) % BLOCK_SIZE;
-        int read_from_block = min(size, BLOCK_SIZE - block_offset);
+        int block_idx = (offset + total_written) / FS_BLOCK_SIZE, block_offset = (offset + total_written) % FS_BLOCK_SIZE;
+        int write_to_block = min(size, FS_BLOCK_SIZE - block_offset);
 
-        int block_pos;
-        if (get_block_pos(&inode, block_idx, &block_pos)) {
-            return -1;
+        struct dirty_page* page = get_dirty_page(inode_pos, &inode, block_idx, write_to_block == FS_BLOCK_SIZE);
+        if (page == NULL) {
+            break;
         }
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(write_to_block);
+        dst.buf[0].mem = page->buf + block_offset;
+        if (fuse_buf_copy(&dst, src, 0) != write_to_block) {
+            break;
+        }
+
+        total_written += write_to_block;
+        size -= write_to_block;
+    }
+
+    // written even when nothing was, as a flush of the write buffer may have moved the block pointers
+    if (total_written > 0) {
+        inode.size = max(inode.size, offset + total_written);
+        inode.mtime = inode.ctime = time(NULL);
+        inode_changed(inode_pos);
+    }
+    if (inode_write(inode_pos, &inode)) {
+        return 0;
+    }
+
+    return total_written;
+}
+
+// Write data to an inode, whose lock the caller holds for writing
+// Return the number of bytes written which should be equal to `size`, or 0 on error
+int inode_write_data(int inode_pos, const char* buffer, size_t size, off_t offset, bool append)
+{
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void*)buffer;
+    return inode_write_buf(inode_pos, &src, offset, append);
+}
+
+void release_read_buf(struct fuse_bufvec* bufv, const int* pins);
+
+// Describe the contents of an inode, whose lock the caller holds, as a FUSE buffer vector with one buffer per block
+// Update the `atime` of the file
+// The vector is allocated into `*bufp`, and the block each buffer pins stored in `pins`, see `data_read_buf`; both are
+// released with `release_read_buf`
+// Return the number of bytes described, or -1 on error, in which case nothing is left allocated or pinned
+int inode_read_buf(int inode_pos, size_t size, off_t offset, struct fuse_bufvec** bufp, int* pins)
+{
+    struct inode inode;
+    if (inode_read(inode_pos, &inode)) {
+        return -1;
+    }
+
+    size = offset >= inode.size ? 0 : min(size, inode.size - offset);
+    int count = size == 0 ? 1 : (offset + size - 1) / FS_BLOCK_SIZE - offset / FS_BLOCK_SIZE + 1;
+    struct fuse_bufvec* bufv = calloc(1, sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+    if (bufv == NULL) {
+        return -1;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+    *bufp = bufv;
+    for (int i = 0; i < count; i++) {
+        pins[i] = -1;
+    }
+
+    int total_read = 0;
+    while (size > 0) {
+        int block_idx = (offset + total_read) / FS_BLOCK_SIZE, block_offset = (offset + total_read) % FS_BLOCK_SIZE;
+        int read_from_block = min(size, FS_BLOCK_SIZE - block_offset);
 
-        if (data_read(block_pos, buf) == -1) {
+        struct dirty_page* page = find_dirty_page(inode_pos, block_idx);
+        struct fuse_buf* buf = &bufv->buf[bufv->count];
+        int block_pos;
+        if (page != NULL) {
+            *buf = (struct fuse_buf) {
+                .size = read_from_block,
+                .mem = malloc(read_from_block),
+                .fd = -1,
+            };
+            if (buf->mem == NULL) {
+                release_read_buf(bufv, pins);
+                return -1;
+            }
+            memcpy(buf->mem, page->buf + block_offset, read_from_block);
+        } else if (get_block_pos(&inode, block_idx, &block_pos) || data_read_buf(block_pos, block_offset, read_from_block, buf, &pins[bufv->count])) {
+            release_read_buf(bufv, pins);
             return -1;
         }
+        bufv->count++;
 
-        memcpy(buffer + total_read, buf + block_offset, read_from_block);
         total_read += read_from_block;
         size -= read_from_block;
     }
+    if (bufv->count == 0) {
+        bufv->count = 1;
+    }
 
     inode.atime = time(NULL);
     if (inode_write(inode_pos, &inode)) {
+        release_read_buf(bufv, pins);
         return -1;
     }
     return total_read;
 }
 
-// Create a regular file or directory, depending on the `mode`
-// Update the `ctime` and `mtime` of the parent directory
-// Return -ENOSPC if no enough space or file nodes
-int make_file(const char* path, mode_t mode)
+// Close the backing files referred to by a buffer vector from `inode_read_buf`, unpin their blocks and free it
+void release_read_buf(struct fuse_bufvec* bufv, const int* pins)
 {
-    // allocate an inode
-    int inode_pos = alloc_block(BITMAP_BLOCK_INODE, INODE_NUM);
-    if (inode_pos == -1) {
-        return -ENOSPC;
+    unpin_blocks(pins, bufv->count);
+    for (size_t i = 0; i < bufv->count; i++) {
+        if (bufv->buf[i].flags & FUSE_BUF_IS_FD) {
+            close(bufv->buf[i].fd);
+        }
+        free(bufv->buf[i].mem);
+    }
+    free(bufv);
+}
+
+// Write data to a regular file
+// Update the `mtime` and `ctime` of the file
+// Return the number of bytes written which should be equal to `size`, or 0 on error
+int fs_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_WRITE, path, fi->fh);
+    log_op(OP_WRITE, path, NULL, 2, offset, size);
+    JOURNAL_HANDLE();
+
+    int inode_pos = fi->fh;
+    lock_inode_write(inode_pos);
+    int ret = inode_write_data(inode_pos, buffer, size, offset, fi->flags & O_APPEND);
+    unlock_inode(inode_pos);
+    return ret;
+}
+
+// Read the contents of a regular file as a buffer vector
+// Blocks that are not cached are handed to libfuse as file descriptors, so they can be spliced to the channel without a
+// copy; the files stay open and their blocks pinned until a later commit, see `spliced_read`
+int fs_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_READ, path, fi->fh);
+    log_op(OP_READ, path, NULL, 2, offset, size);
+    JOURNAL_HANDLE();
+
+    int inode_pos = fi->fh, pins[READ_BUF_MAX];
+    lock_inode_read(inode_pos);
+    int ret = inode_read_buf(inode_pos, min(size, MAX_IO_SIZE), offset, bufp, pins);
+    unlock_inode(inode_pos);
+    if (ret < 0) {
+        return ret;
+    }
+    if (hold_spliced_reads(*bufp, pins)) {
+        release_read_buf(*bufp, pins);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// Write data to a regular file from a buffer vector
+// Data arriving in a pipe is copied straight into the cache, or spliced into the backing file for whole uncached blocks
+int fs_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_WRITE, path, fi->fh);
+    log_op(OP_WRITE, path, NULL, 2, offset, fuse_buf_size(buf));
+    JOURNAL_HANDLE();
+
+    int inode_pos = fi->fh;
+    lock_inode_write(inode_pos);
+    int ret = inode_write_buf(inode_pos, buf, offset, fi->flags & O_APPEND);
+    unlock_inode(inode_pos);
+    return ret;
+}
+
+// Write the buffered data of a file, and everything cached, to the disk
+int fs_fsync(const char* path, [[maybe_unused]] int datasync, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_FSYNC, path, fi->fh);
+    log_op(OP_FSYNC, path, NULL, 0, 0, 0);
+
+    if (sync_inode(fi->fh) || journal_commit()) {
+        return -EIO;
+    }
+    return 0;
+}
+
+// Cut the write buffer of an inode at `size`: pages past it are dropped and the tail of the last one is zeroed
+// A last block that is shared or compressed is copied into the buffer first, so the tail is zeroed in the copy only
+// The caller must hold the lock of the inode for writing
+int truncate_dirty_pages(int inode_pos, struct inode* inode, off_t size)
+{
+    if (size >= inode->size) {
+        return 0;
+    }
+    drop_dirty_pages(inode_pos, ceil_div(size, FS_BLOCK_SIZE));
+    if (size % FS_BLOCK_SIZE == 0) {
+        return 0;
     }
+    struct dirty_page* page = find_dirty_page(inode_pos, size / FS_BLOCK_SIZE);
+    if (page == NULL) {
+        int block_pos, shared = 0;
+        if (get_block_pos(inode, size / FS_BLOCK_SIZE, &block_pos) || (block_pos != -1 && (shared = block_shared(block_pos)) == -1)) {
+            return -1;
+        }
+        if (shared && (page = get_dirty_page(inode_pos, inode, size / FS_BLOCK_SIZE, false)) == NULL) {
+            return -1;
+        }
+    }
+    if (page != NULL) {
+        memset(page->buf + size % FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE - size % FS_BLOCK_SIZE);
+    }
+    return 0;
+}
 
-    // write the inode
+// Change the size of the regular file `inode_pos`
+// Update the `ctime` of the file
+// Return -EFBIG if the size is over the maximum file size
+int inode_set_size(int inode_pos, off_t size)
+{
+    if (size > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
     struct inode inode;
-    init_inode(&inode, mode);
-    if (inode_write(inode_pos, &inode)) {
-        return -1;
+    lock_inode_write(inode_pos);
+    int ret = 0;
+    if (inode_read(inode_pos, &inode)) {
+        ret = -1;
+    } else if (inode.mode != REGMODE) {
+        ret = -EISDIR;
+    } else {
+        if (truncate_dirty_pages(inode_pos, &inode, size) || inode_truncate(&inode, size) || inode_write(inode_pos, &inode)) {
+            ret = -1;
+        }
+        inode_changed(inode_pos);
     }
+    unlock_inode(inode_pos);
+    return ret;
+}
 
-    // write the parent directory inode
-    char* path4dir = strdup(path);
-    char* dir = dirname(path4dir);
-    int parent_inode = resolve_path_to_inode(dir, &inode);
-    if (parent_inode == -1) {
+// Change the access and modification times of `inode_pos`
+// Update the `ctime` of the file
+int inode_set_times(int inode_pos, time_t atime, time_t mtime)
+{
+    struct inode inode;
+    lock_inode_write(inode_pos);
+    int ret = 0;
+    if (inode_read(inode_pos, &inode)) {
+        ret = -1;
+    } else {
+        inode.atime = atime;
+        inode.mtime = mtime;
+        inode.ctime = time(NULL);
+        if (inode_write(inode_pos, &inode)) {
+            ret = -1;
+        }
+    }
+    unlock_inode(inode_pos);
+    return ret;
+}
+
+// Make the regular file `dst_pos` a copy of the regular file `src_pos` that shares its data blocks, replacing its contents
+// Only metadata is written: block pointers and reference counts, besides the buffered pages of `src_pos`
+// Return -EINVAL if the files are the same or `src_pos` is not a regular file, -EISDIR if `dst_pos` is a directory,
+// -EMLINK if a block already has as many references as its count holds, as a clone never copies data
+int clone_inode(int src_pos, int dst_pos)
+{
+    if (src_pos == dst_pos) {
+        return -EINVAL;
+    }
+    // lock both files in ascending lock index order, like the parents of a rename
+    int first = src_pos % INODE_LOCK_NUM <= dst_pos % INODE_LOCK_NUM ? src_pos : dst_pos;
+    int second = first == src_pos ? dst_pos : src_pos;
+    bool same_lock = same_inode_lock(first, second);
+    lock_inode_write(first);
+    if (!same_lock) {
+        lock_inode_write(second);
+    }
+
+    // the shared blocks must hold the latest data, so the source is flushed first
+    struct inode src, dst;
+    int ret = 0;
+    if (sync_inode_locked(src_pos) || inode_read(src_pos, &src) || inode_read(dst_pos, &dst)) {
+        ret = -1;
+    } else if (src.mode != REGMODE) {
+        ret = -EINVAL;
+    } else if (dst.mode != REGMODE) {
+        ret = -EISDIR;
+    } else if (truncate_dirty_pages(dst_pos, &dst, 0) || inode_truncate(&dst, 0)) {
+        ret = -1;
+    }
+    if (ret) {
+        goto out;
+    }
+
+    // on error the blocks not yet cloned are left as holes
+    dst.size = src.size;
+    dst.mtime = dst.ctime = time(NULL);
+    inode_changed(dst_pos);
+    struct block_iter iter;
+    block_iter_init(&iter, &src, 0);
+    while (ret == 0 && (ret = block_iter_next(&iter)) == 1) {
+        ret = ref_block(iter.block_pos);
+        if (ret == 0 && set_block_pos(&dst, iter.block_id, iter.block_pos)) {
+            ret = -1;
+        }
+    }
+    if (inode_write(dst_pos, &dst)) {
+        ret = -1;
+    }
+
+out:
+    if (!same_lock) {
+        unlock_inode(second);
+    }
+    unlock_inode(first);
+    return ret;
+}
+
+// Change the size of a regular file
+// `truncate` command can trigger this function
+// Update the `ctime` of the file
+// Return -EFBIG if the size is over the maximum file size
+int fs_truncate(const char* path, off_t size)
+{
+    OP_SCOPE(OP_TRUNCATE, path, -1);
+    log_op(OP_TRUNCATE, path, NULL, 1, size, 0);
+    JOURNAL_HANDLE();
+
+    struct inode inode;
+    int inode_pos = resolve_path_to_inode(path, &inode);
+    if (inode_pos == -1) {
         return -ENOENT;
     }
-    free(path4dir);
+    return inode_set_size(inode_pos, size);
+}
 
-    struct dir_entry entry = {
-        .inode_pos = inode_pos,
+// Change the access and modification times of a regular file or directory
+// Update the `ctime` of the file
+int fs_utime(const char* path, struct utimbuf* buffer)
+{
+    OP_SCOPE(OP_UTIME, path, -1);
+    log_op(OP_UTIME, path, NULL, 2, buffer->actime, buffer->modtime);
+    JOURNAL_HANDLE();
+
+    struct inode inode;
+    int inode_pos = resolve_path_to_inode(path, &inode);
+    if (inode_pos == -1) {
+        return -ENOENT;
+    }
+    return inode_set_times(inode_pos, buffer->actime, buffer->modtime);
+}
+
+// Get file system statistics
+// `df` command can trigger this function
+int fs_statfs([[maybe_unused]] const char* path, struct statvfs* stat)
+{
+    OP_SCOPE(OP_STATFS, path, -1);
+    log_op(OP_STATFS, path, NULL, 0, 0, 0);
+
+    // f_bfree == f_bavail, f_ffree == f_favail
+    *stat = (struct statvfs) {
+        .f_bsize = FS_BLOCK_SIZE,
+        .f_blocks = DATA_BLOCK_SIZE,
+        .f_bfree = DATA_BLOCK_SIZE - bitmap_used[BITMAP_BLOCK_DATA] - reserved_blocks,
+        .f_bavail = DATA_BLOCK_SIZE - bitmap_used[BITMAP_BLOCK_DATA] - reserved_blocks,
+        .f_files = INODE_NUM,
+        .f_ffree = INODE_NUM - bitmap_used[BITMAP_BLOCK_INODE],
+        .f_favail = INODE_NUM - bitmap_used[BITMAP_BLOCK_INODE],
+        .f_namemax = MAX_FILENAME_LEN,
     };
-    char* path4base = strdup(path);
-    char* base = basename(strdup(path));
-    strncpy(entry.name, base, MAX_FILENAME_LEN);
-    free(path4base);
 
-    // add the directory entry
-    if (add_dir_entry(&inode, &entry) == NULL) {
-        return -1;
+    return 0;
+}
+
+// Open a regular file
+// `fi->fh` is a reserved field for file handle
+// `fi->flags` contains the flags. Where `O_APPEND` requires special handling and is tested with `echo x >> file`.
+int fs_open(const char* path, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_OPEN, path, -1);
+
+    // if the file does not exist, create it
+    if (fi->flags & O_CREAT) {
+        fs_mknod(path, 0, 0);
     }
-    inode.atime = inode.mtime = inode.ctime = time(NULL);
-    if (inode_write(parent_inode, &inode)) {
-        return -1;
+    log_op(OP_OPEN, path, NULL, 0, 0, 0);
+
+    struct inode inode;
+    int inode_pos = resolve_path_to_inode(path, &inode);
+    if (inode_pos == -1) {
+        return -ENOENT;
     }
 
+    fi->fh = inode_pos;
+    fi->keep_cache = open_keep_cache(inode_pos);
     return 0;
 }
 
-// Create a regular file
-// `touch` and `echo x > file` commands can trigger this function
-// Update the `ctime` and `mtime` of the parent directory
-// Return -ENOSPC if no enough space or file nodes
-int fs_mknod(const char* path, [[maybe_unused]] mode_t mode, [[maybe_unused]] dev_t dev)
+// Remove the entry named in `FS_IOC_RMTREE` from the opened directory `path` with everything below it, see `rmtree_inode`
+// The kernel may still hold the removed entry for the `entry_timeout` of the mount
+int fs_rmtree(const char* path, struct fs_rmtree_args* args)
 {
-    printf("Mknod is called:%s\n", path);
-    return make_file(path, REGMODE);
+    OP_SCOPE(OP_RMTREE, path, -1);
+    args->name[FS_RMTREE_NAME_MAX - 1] = '\0';
+    char tree[FS_CLONE_PATH_MAX + FS_RMTREE_NAME_MAX];
+    snprintf(tree, sizeof(tree), "%s/%s", strcmp(path, "/") == 0 ? "" : path, args->name);
+    log_op(OP_RMTREE, tree, NULL, 0, 0, 0);
+    JOURNAL_HANDLE();
+
+    struct inode inode;
+    int parent_pos = resolve_path_to_inode(path, &inode);
+    if (parent_pos == -1) {
+        return -ENOENT;
+    }
+    return rmtree_inode(parent_pos, args->name);
 }
 
-// Create a directory
-// `mkdir` command can trigger this function
-// Update the `ctime` and `mtime` of the parent directory
-// Return -ENOSPC if no enough space or file nodes
-int fs_mkdir(const char* path, [[maybe_unused]] mode_t mode)
+// Defragment the opened directory `path` and everything below it, see `defrag_inode`
+int fs_defrag(const char* path)
 {
-    printf("Mkdir is called:%s\n", path);
-    return make_file(path, DIRMODE);
+    OP_SCOPE(OP_DEFRAG, path, -1);
+    log_op(OP_DEFRAG, path, NULL, 0, 0, 0);
+
+    struct inode inode;
+    int dir_pos = resolve_path_to_inode(path, &inode);
+    if (dir_pos == -1) {
+        return -ENOENT;
+    }
+    if (dir_pos == ROOT_INODE) {
+        return defrag_inode(-1, NULL, dir_pos) ? -1 : 0;
+    }
+    struct dir_entry name;
+    int parent_pos = resolve_parent(path, &name);
+    if (parent_pos < 0) {
+        return parent_pos;
+    }
+    return defrag_inode(parent_pos, name.name, dir_pos) ? -1 : 0;
 }
 
-// Remove a directory entry by path
-// Update the `mtime` and `ctime` of the parent directory
-// Return the inode position of file specified by path, or -ENOENT if the file does not exist, or -1 on error
-int remove_path_dir_entry(const char* path)
+// Clone the file named in `FS_IOC_CLONE` into the opened regular file, see fs_ioctl.h
+// `cp --reflink` has no way to reach this, as FICLONE passes a file descriptor the server cannot use; see reflink.c
+// The path-based API cannot invalidate what the kernel caches of the target: with `-o kcache`, its attributes may
+// stay stale for `kcache_timeout` seconds, while its pages are dropped at the next open
+// `FS_IOC_RMTREE` is served by `fs_rmtree` and `FS_IOC_DEFRAG` by `fs_defrag`; return -ENOTTY for any other ioctl
+int fs_ioctl(const char* path, int cmd, [[maybe_unused]] void* arg, struct fuse_file_info* fi, [[maybe_unused]] unsigned int flags, void* data)
 {
+    if (cmd == (int)FS_IOC_RMTREE) {
+        return fs_rmtree(path, data);
+    }
+    if (cmd == (int)FS_IOC_DEFRAG) {
+        return fs_defrag(path);
+    }
+    OP_SCOPE(OP_IOCTL, path, fi->fh);
+    if (cmd != (int)FS_IOC_CLONE) {
+        return -ENOTTY;
+    }
+    struct fs_clone_args* args = data;
+    args->src[FS_CLONE_PATH_MAX - 1] = '\0';
+    log_op(OP_IOCTL, path, args->src, 0, 0, 0);
+    JOURNAL_HANDLE();
+
     struct inode inode;
-    char* path4dir = strdup(path);
-    char* dir = dirname(path4dir);
-    int parent_inode = resolve_path_to_inode(dir, &inode);
-    free(path4dir);
-    if (parent_inode == -1) {
+    int src_pos = resolve_path_to_inode(args->src, &inode);
+    if (src_pos == -1) {
         return -ENOENT;
     }
+    return clone_inode(src_pos, fi->fh);
+}
+
+// Ask the kernel for large requests, for splicing in both directions, and for ioctls on directories (`FS_IOC_RMTREE`)
+void negotiate_conn(struct fuse_conn_info* conn)
+{
+    conn->want |= FUSE_CAP_BIG_WRITES;
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_IOCTL_DIR);
+    conn->max_write = MAX_IO_SIZE;
+    conn->max_readahead = MAX_IO_SIZE;
+}
+
+// Low-level front end, selected with `-o lowlevel`
+// Requests carry inode numbers instead of paths, so no path is parsed and no path is walked from the root:
+// the kernel looks up one component at a time and every other request goes straight to the inode
+// FUSE numbers the root 1, so an inode number is the inode position plus `FUSE_ROOT_ID`
+
+fuse_ino_t inode_to_ino(int inode_pos)
+{
+    return (fuse_ino_t)inode_pos + FUSE_ROOT_ID;
+}
+int ino_to_inode(fuse_ino_t ino)
+{
+    return (int)(ino - FUSE_ROOT_ID);
+}
 
-    struct dir_entry entry;
-    char* path4base = strdup(path);
-    char* base = basename(path4base);
-    int ret = remove_dir_entry(&inode, base, &entry);
-    free(path4base);
-    if (ret) {
-        return -1;
-    }
+// The channel of the session, to notify the kernel of changes it has not seen, see `ll_ioctl`
+struct fuse_chan* ll_chan;
 
-    inode.atime = inode.mtime = inode.ctime = time(NULL);
-    if (inode_write(parent_inode, &inode)) {
-        return -1;
-    }
+// Seconds the kernel may cache the entries and attributes it is replied
+double ll_timeout()
+{
+    return options.kcache ? options.kcache_timeout : 0;
+}
 
-    return entry.inode_pos;
+// Reply with the status returned by the core, where -1 is a generic I/O error
+void ll_reply_status(fuse_req_t req, int ret)
+{
+    fuse_reply_err(req, ret == -1 ? EIO : -min(ret, 0));
 }
 
-int add_path_dir_entry(const char* path, int inode_pos)
+int ll_stat(int inode_pos, struct stat* attr)
 {
     struct inode inode;
-    char* path4dir = strdup(path);
-    char* dir = dirname(path4dir);
-    int parent_inode = resolve_path_to_inode(dir, &inode);
-    free(path4dir);
-    if (parent_inode == -1) {
-        return -ENOENT;
+    if (inode_read(inode_pos, &inode)) {
+        return -1;
     }
+    getattr(&inode, attr);
+    attr->st_ino = inode_to_ino(inode_pos);
+    return 0;
+}
 
-    struct dir_entry entry = {
-        .inode_pos = inode_pos,
+void ll_reply_entry(fuse_req_t req, int inode_pos)
+{
+    if (inode_pos < 0) {
+        ll_reply_status(req, inode_pos);
+        return;
+    }
+    struct fuse_entry_param e = {
+        .ino = inode_to_ino(inode_pos),
+        .attr_timeout = ll_timeout(),
+        .entry_timeout = ll_timeout(),
     };
-    char* path4base = strdup(path);
-    char* base = basename(path4base);
-    strncpy(entry.name, base, MAX_FILENAME_LEN);
-    int ret = add_dir_entry(&inode, &entry) == NULL;
-    free(path4base);
-    if (ret) {
-        return -1;
+    if (ll_stat(inode_pos, &e.attr)) {
+        ll_reply_status(req, -1);
+        return;
     }
+    fuse_reply_entry(req, &e);
+}
 
-    inode.atime = inode.mtime = inode.ctime = time(NULL);
-    if (inode_write(parent_inode, &inode)) {
-        return -1;
-    }
+void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    OP_SCOPE(OP_LOOKUP, name, ino_to_inode(parent));
+    struct dir_entry entry;
+    ll_reply_entry(req, lookup_inode(ino_to_inode(parent), name, &entry));
+}
 
-    return 0;
+// Inodes are not cached, so there is nothing to drop
+void ll_forget(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino, [[maybe_unused]] unsigned long nlookup)
+{
+    fuse_reply_none(req);
 }
 
-int remove_file(const char* path)
+void ll_getattr(fuse_req_t req, fuse_ino_t ino, [[maybe_unused]] struct fuse_file_info* fi)
 {
-    int old_inode_pos = remove_path_dir_entry(path);
-    if (old_inode_pos < 0) {
-        return old_inode_pos;
+    OP_SCOPE(OP_GETATTR, NULL, ino_to_inode(ino));
+    struct stat attr;
+    if (ll_stat(ino_to_inode(ino), &attr)) {
+        ll_reply_status(req, -1);
+        return;
     }
-    struct inode inode;
-    if (inode_read(old_inode_pos, &inode)) {
-        return -1;
+    fuse_reply_attr(req, &attr, ll_timeout());
+}
+
+// Only the size and the times can be changed, the mode and owner are fixed
+void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, [[maybe_unused]] struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_SETATTR, NULL, ino_to_inode(ino));
+    JOURNAL_HANDLE();
+    int inode_pos = ino_to_inode(ino);
+    int ret = 0;
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        ret = inode_set_size(inode_pos, attr->st_size);
     }
-    for (int i = 0; i < ceil_div(inode.size, BLOCK_SIZE); i++) {
-        int block_pos;
-        if (get_block_pos(&inode, i, &block_pos)) {
-            return -1;
-        }
-        if (block_pos == -1) {
-            continue;
-        }
-        if (clear_block(BITMAP_BLOCK_DATA, block_pos)) {
-            return -1;
+    if (ret == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct inode inode;
+        if (inode_read(inode_pos, &inode)) {
+            ret = -1;
+        } else {
+            time_t now = time(NULL);
+            time_t atime = to_set & FUSE_SET_ATTR_ATIME_NOW ? now : to_set & FUSE_SET_ATTR_ATIME ? attr->st_atime : inode.atime;
+            time_t mtime = to_set & FUSE_SET_ATTR_MTIME_NOW ? now : to_set & FUSE_SET_ATTR_MTIME ? attr->st_mtime : inode.mtime;
+            ret = inode_set_times(inode_pos, atime, mtime);
         }
     }
-    clear_block(BITMAP_BLOCK_INODE, old_inode_pos);
+    if (ret) {
+        ll_reply_status(req, ret);
+        return;
+    }
+    ll_getattr(req, ino, fi);
+}
 
-    return 0;
+void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, [[maybe_unused]] mode_t mode, [[maybe_unused]] dev_t rdev)
+{
+    OP_SCOPE(OP_MKNOD, name, ino_to_inode(parent));
+    JOURNAL_HANDLE();
+    ll_reply_entry(req, create_inode(ino_to_inode(parent), name, REGMODE));
 }
 
-// Remove a directory
-// The directory must be empty
-// `rm -r` command can trigger this function
-// Update the `mtime` and `ctime` of the parent directory
-int fs_rmdir(const char* path)
+void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, [[maybe_unused]] mode_t mode)
 {
-    printf("Rmdir is called:%s\n", path);
-    return remove_file(path);
+    OP_SCOPE(OP_MKDIR, name, ino_to_inode(parent));
+    JOURNAL_HANDLE();
+    ll_reply_entry(req, create_inode(ino_to_inode(parent), name, DIRMODE));
 }
 
-// Remove a regular file
-// `rm` command can trigger this function
-// Update the `mtime` and `ctime` of the parent directory
-int fs_unlink(const char* path)
+void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-    printf("Unlink is callded:%s\n", path);
-    return remove_file(path);
+    OP_SCOPE(OP_UNLINK, name, ino_to_inode(parent));
+    JOURNAL_HANDLE();
+    ll_reply_status(req, unlink_inode(ino_to_inode(parent), name));
 }
 
-// Change the name or location of a file or directory
-// `mv` command can trigger this function
-int fs_rename(const char* oldpath, const char* newpath)
+void ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname)
 {
-    printf("Rename is called:%s\n", newpath);
+    OP_SCOPE(OP_RENAME, name, ino_to_inode(parent));
+    JOURNAL_HANDLE();
+    ll_reply_status(req, rename_inode(ino_to_inode(parent), name, ino_to_inode(newparent), newname));
+}
 
-    int inode_pos = remove_path_dir_entry(oldpath);
-    if (inode_pos < 0) {
-        return inode_pos;
-    }
+void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_OPEN, NULL, ino_to_inode(ino));
+    fi->fh = ino_to_inode(ino);
+    fi->keep_cache = open_keep_cache(fi->fh);
+    fuse_reply_open(req, fi);
+}
 
-    if (add_path_dir_entry(newpath, inode_pos)) {
-        return -1;
+// Uncached blocks are spliced from their backing files; they are closed as soon as the reply is sent
+void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, [[maybe_unused]] struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_READ, NULL, ino_to_inode(ino));
+    JOURNAL_HANDLE();
+    struct fuse_bufvec* bufv;
+    int inode_pos = ino_to_inode(ino), pins[READ_BUF_MAX];
+    lock_inode_read(inode_pos);
+    int ret = inode_read_buf(inode_pos, min(size, MAX_IO_SIZE), off, &bufv, pins);
+    unlock_inode(inode_pos);
+    if (ret < 0) {
+        ll_reply_status(req, ret);
+        return;
     }
-    return 0;
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    release_read_buf(bufv, pins);
 }
 
-int inode_truncate(struct inode* inode, off_t size)
+void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* bufv, off_t off, struct fuse_file_info* fi)
 {
-    assert(size <= MAX_FILE_SIZE);
-
-    inode->atime = inode->ctime = time(NULL);
-    if (inode->size < size) {
-        // allocate the data blocks
-        for (int i = ceil_div(inode->size + 1, BLOCK_SIZE); i <= ceil_div(size, BLOCK_SIZE); i++) {
-            int block_pos = alloc_block(BITMAP_BLOCK_DATA, DATA_BLOCK_SIZE);
-            if (block_pos == -1) {
-                return -ENOSPC;
-            }
-            if (set_block_pos(inode, i, block_pos)) {
-                return -1;
-            }
-        }
-
-    } else if (inode->size > size) {
-        // release the data blocks
-        for (int i = ceil_div(size + 1, BLOCK_SIZE); i <= ceil_div(inode->size, BLOCK_SIZE); i++) {
-            int block_pos;
-            if (get_block_pos(inode, i, &block_pos)) {
-                return -1;
-            }
-            if (clear_block(BITMAP_BLOCK_DATA, block_pos)) {
-                return -1;
-            }
-            if (set_block_pos(inode, i, -1)) {
-                return -1;
-            }
-        }
+    OP_SCOPE(OP_WRITE, NULL, ino_to_inode(ino));
+    JOURNAL_HANDLE();
+    size_t size = fuse_buf_size(bufv);
+    int inode_pos = ino_to_inode(ino);
+    lock_inode_write(inode_pos);
+    int ret = inode_write_buf(inode_pos, bufv, off, fi->flags & O_APPEND);
+    unlock_inode(inode_pos);
+    if (ret == 0 && size != 0) {
+        fuse_reply_err(req, ENOSPC);
+        return;
     }
-    inode->size = size;
-
-    return 0;
+    fuse_reply_write(req, ret);
 }
 
-// Write data to a regular file
-// Update the `mtime` and `ctime` of the file
-// Return the number of bytes written which should be equal to `size`, or 0 on error
-int fs_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi)
+void ll_fsync(fuse_req_t req, fuse_ino_t ino, [[maybe_unused]] int datasync, [[maybe_unused]] struct fuse_file_info* fi)
 {
-    printf("Write is called:%s\n", path);
-
-    int inode_pos = fi->fh;
+    OP_SCOPE(OP_FSYNC, NULL, ino_to_inode(ino));
+    ll_reply_status(req, sync_inode(ino_to_inode(ino)) || journal_commit() ? -1 : 0);
+}
 
-    struct inode inode;
-    if (inode_read(inode_pos, &inode)) {
-        return -1;
+// The kernel drops the removed entry before the reply, with `-o kcache` when it may cache it
+void ll_rmtree(fuse_req_t req, fuse_ino_t ino, const struct fs_rmtree_args* in)
+{
+    OP_SCOPE(OP_RMTREE, in->name, ino_to_inode(ino));
+    struct fs_rmtree_args args;
+    memcpy(&args, in, sizeof(args));
+    args.name[FS_RMTREE_NAME_MAX - 1] = '\0';
+    JOURNAL_HANDLE();
+    int ret = rmtree_inode(ino_to_inode(ino), args.name);
+    if (ret < 0) {
+        ll_reply_status(req, ret);
+        return;
     }
-
-    if (fi->flags & O_APPEND) {
-        // the system should set the file offset to the end of the file when `O_APPEND` is set
-        // but we explicitly set again to prevent some unexpected behavior
-        offset = inode.size;
+    if (options.kcache) {
+        fuse_lowlevel_notify_inval_entry(ll_chan, ino, args.name, strlen(args.name));
     }
+    fuse_reply_ioctl(req, 0, NULL, 0);
+}
 
-    // Adjust the size of the file first
-    if (offset + size > inode.size) {
-        if (inode_truncate(&inode, offset + size)) {
-            return 0;
-        }
+// An inode number does not tell in which directory the directory is an entry, so only what lies below it is
+// defragmented, and the root itself
+void ll_defrag(fuse_req_t req, fuse_ino_t ino)
+{
+    OP_SCOPE(OP_DEFRAG, NULL, ino_to_inode(ino));
+    int dir_pos = ino_to_inode(ino);
+    if (defrag_inode(-1, NULL, dir_pos)) {
+        ll_reply_status(req, -1);
+        return;
     }
+    fuse_reply_ioctl(req, 0, NULL, 0);
+}
 
-    int total_written = 0;
-    char buf[BLOCK_SIZE];
-    while (size > 0) {
-        int block_idx = (offset + total_written) / BLOCK_SIZE, block_offset = (offset + total_written) % BLOCK_SIZE;
-        int write_to_block = min(size, BLOCK_SIZE - block_offset);
+void ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, [[maybe_unused]] void* arg, [[maybe_unused]] struct fuse_file_info* fi, [[maybe_unused]] unsigned flags,
+    const void* in_buf, size_t in_bufsz, [[maybe_unused]] size_t out_bufsz)
+{
+    if (cmd == (int)FS_IOC_RMTREE && in_bufsz >= sizeof(struct fs_rmtree_args)) {
+        ll_rmtree(req, ino, in_buf);
+        return;
+    }
+    if (cmd == (int)FS_IOC_DEFRAG) {
+        ll_defrag(req, ino);
+        return;
+    }
+    OP_SCOPE(OP_IOCTL, NULL, ino_to_inode(ino));
+    if (cmd != (int)FS_IOC_CLONE || in_bufsz < sizeof(struct fs_clone_args)) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    struct fs_clone_args args;
+    memcpy(&args, in_buf, sizeof(args));
+    args.src[FS_CLONE_PATH_MAX - 1] = '\0';
+    JOURNAL_HANDLE();
+    struct inode inode;
+    int src_pos = resolve_path_to_inode(args.src, &inode);
+    int ret = src_pos == -1 ? -ENOENT : clone_inode(src_pos, ino_to_inode(ino));
+    if (ret < 0) {
+        ll_reply_status(req, ret);
+        return;
+    }
+    // the kernel has not seen the target change, so its cached attributes and pages are dropped before the reply
+    if (options.kcache) {
+        fuse_lowlevel_notify_inval_inode(ll_chan, ino, 0, 0);
+    }
+    fuse_reply_ioctl(req, 0, NULL, 0);
+}
 
-        int block_pos;
-        if (get_block_pos(&inode, block_idx, &block_pos)) {
-            return 0;
-        }
+void ll_init([[maybe_unused]] void* userdata, struct fuse_conn_info* conn)
+{
+    negotiate_conn(conn);
+    start_stats_thread();
+    start_journal_thread();
+    start_inode_table_init_thread();
+    start_defrag_thread();
+}
 
-        if (data_read(block_pos, buf) == -1) {
-            return 0;
-        }
-        memcpy(buf + block_offset, buffer + total_written, write_to_block);
-        if (data_write(block_pos, buf)) {
-            return 0;
-        }
+// The same teardown as the high-level interface, which also completes the op log and the block trace
+void ll_destroy(void* userdata)
+{
+    fs_destroy(userdata);
+}
 
-        total_written += write_to_block;
-        size -= write_to_block;
+// Reply buffer of a low-level readdir, filled through the same filler interface as the high-level one
+struct ll_dir_buf {
+    fuse_req_t req;
+    char* buf;
+    size_t size;
+    size_t used;
+};
+int ll_fill_dir(void* context, const char* name, const struct stat* st, off_t off)
+{
+    struct ll_dir_buf* dir_buf = context;
+    struct stat attr = *st;
+    attr.st_ino = inode_to_ino(st->st_ino);
+    size_t len = fuse_add_direntry(dir_buf->req, dir_buf->buf + dir_buf->used, dir_buf->size - dir_buf->used, name, &attr, off);
+    if (len > dir_buf->size - dir_buf->used) {
+        return 1;
     }
+    dir_buf->used += len;
+    return 0;
+}
 
-    inode.mtime = inode.ctime = time(NULL);
-    if (inode_write(inode_pos, &inode)) {
-        return 0;
+void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, [[maybe_unused]] struct fuse_file_info* fi)
+{
+    OP_SCOPE(OP_READDIR, NULL, ino_to_inode(ino));
+    JOURNAL_HANDLE();
+    struct ll_dir_buf dir_buf = {
+        .req = req,
+        .buf = malloc(size),
+        .size = size,
+    };
+    if (dir_buf.buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int inode_pos = ino_to_inode(ino);
+    lock_inode_read(inode_pos);
+    int ret = read_dir_page(inode_pos, &dir_buf, ll_fill_dir, off);
+    unlock_inode(inode_pos);
+    if (ret) {
+        ll_reply_status(req, ret);
+    } else {
+        fuse_reply_buf(req, dir_buf.buf, dir_buf.used);
     }
+    free(dir_buf.buf);
+}
 
-    return total_written;
+void ll_statfs(fuse_req_t req, [[maybe_unused]] fuse_ino_t ino)
+{
+    struct statvfs stat;
+    fs_statfs("/", &stat);
+    fuse_reply_statfs(req, &stat);
 }
 
-// Change the size of a regular file
-// `truncate` command can trigger this function
-// Update the `ctime` of the file
-// Return -ENOSPC if no enough space
-int fs_truncate(const char* path, off_t size)
+void ll_release(fuse_req_t req, fuse_ino_t ino, [[maybe_unused]] struct fuse_file_info* fi)
 {
-    printf("Truncate is called:%s\n", path);
+    OP_SCOPE(OP_RELEASE, NULL, ino_to_inode(ino));
+    fuse_reply_err(req, 0);
+}
 
-    struct inode inode;
-    int inode_pos = resolve_path_to_inode(path, &inode);
-    assert(inode.mode == REGMODE);
+static struct fuse_lowlevel_ops ll_operations = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mknod = ll_mknod,
+    .mkdir = ll_mkdir,
+    .unlink = ll_unlink,
+    .rmdir = ll_unlink,
+    .rename = ll_rename,
+    .open = ll_open,
+    .read = ll_read,
+    .write_buf = ll_write_buf,
+    .fsync = ll_fsync,
+    .ioctl = ll_ioctl,
+    .release = ll_release,
+    .opendir = ll_open,
+    .readdir = ll_readdir,
+    .releasedir = ll_release,
+    .statfs = ll_statfs,
+};
 
-    if (inode_truncate(&inode, size)) {
-        return -ENOSPC;
+// Mount and serve the low-level front end, the counterpart of `fuse_main`
+int lowlevel_main(struct fuse_args* args)
+{
+    char* mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
+    struct fuse_chan* ch = fuse_mount(mountpoint, args);
+    if (ch == NULL) {
+        free(mountpoint);
+        return 1;
     }
 
-    if (inode_write(inode_pos, &inode)) {
+    int ret = 1;
+    struct fuse_session* se = fuse_lowlevel_new(args, &ll_operations, sizeof(ll_operations), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) != -1) {
+            fuse_session_add_chan(se, ch);
+            ll_chan = ch;
+            fuse_daemonize(foreground);
+            ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+    free(mountpoint);
+    return ret ? 1 : 0;
+}
+
+// Size the caches, locks and tables that depend on the geometry, once it is known
+int init_geometry_state()
+{
+    if (init_cache() || init_bitmap_locks() || init_refcount_locks() || init_cluster_cache() || init_write_buffers()
+        || init_inode_versions() || start_block_trace()) {
         return -1;
     }
+    init_tail_packer();
     return 0;
 }
 
-// Change the access and modification times of a regular file or directory
-// Update the `ctime` of the file
-int fs_utime(const char* path, struct utimbuf* buffer)
+// Whether the first device block holds the magic of a superblock, so the device holds a filesystem of some layout
+bool superblock_present()
 {
-    printf("Utime is called:%s\n", path);
-
-    struct inode inode;
-    int inode_pos = resolve_path_to_inode(path, &inode);
+    char buf[BLOCK_SIZE];
+    return disk_read(SUPERBLOCK_BLOCK, buf) == 0 && ((struct superblock*)buf)->magic == FS_MAGIC;
+}
 
-    inode.atime = buffer->actime;
-    inode.mtime = buffer->modtime;
-    inode.ctime = time(NULL);
-    if (inode_write(inode_pos, &inode)) {
+// Mount the filesystem on the attached device, after replaying its journal
+int mount_attached()
+{
+    if (load_geometry() || init_geometry_state()) {
         return -1;
     }
+    return journal_recover() == -1 || mount_fs() ? -1 : 0;
+}
 
-    return 0;
+// Open the device and mount the filesystem on it, after replaying its journal
+// The device is formatted only if it holds no superblock yet, or if `format` is set; a filesystem that fails to mount,
+// from an error or a damaged journal, is left as it is
+// The geometry of a filesystem already on the device is read from its superblock; a new one gets the geometry of
+// the options
+int fs_start(bool format)
+{
+    device_read_only = false;
+    init_inode_locks();
+    bool attached = disk_attach() == 0;
+    if (!format && attached && superblock_present()) {
+        return mount_attached();
+    }
+    if (!attached && disk_init()) {
+        return -1;
+    }
+    if (set_geometry(options.block_size, options.inode_num, options.device_size) || init_geometry_state()) {
+        return -2;
+    }
+    return mkfs() ? -2 : 0;
 }
 
-// Get file system statistics
-// `df` command can trigger this function
-int fs_statfs([[maybe_unused]] const char* path, struct statvfs* stat)
+// Open the device and mount the filesystem on it, after replaying its journal, but never format it
+// Return 0 on success, -1 if the device cannot be opened or holds no filesystem
+int fs_attach()
 {
-    printf("Statfs is called:%s\n", path);
+    device_read_only = false;
+    init_inode_locks();
+    return disk_attach() ? -1 : mount_attached();
+}
 
-    // f_bfree == f_bavail, f_ffree == f_favail
-    *stat = (struct statvfs) {
-        .f_bsize = BLOCK_SIZE,
-        .f_blocks = DATA_BLOCK_SIZE,
-        .f_bfree = DATA_BLOCK_SIZE - bitmap_used[BITMAP_BLOCK_DATA],
-        .f_bavail = DATA_BLOCK_SIZE - bitmap_used[BITMAP_BLOCK_DATA],
-        .f_files = INODE_NUM,
-        .f_ffree = INODE_NUM - bitmap_used[BITMAP_BLOCK_INODE],
-        .f_favail = INODE_NUM - bitmap_used[BITMAP_BLOCK_INODE],
-        .f_namemax = 0,
-    };
+// Mount the filesystem already on the device without writing to it: the journal is replayed in memory only, and the
+// superblock keeps its state
+int fs_attach_read_only()
+{
+    device_read_only = true;
+    init_inode_locks();
+    return disk_attach() ? -1 : mount_attached();
+}
 
-    return 0;
+// Leave a filesystem attached read-only, dropping what the journal replayed in memory
+void fs_detach()
+{
+    pthread_mutex_lock(&journal.map_lock);
+    journal_forget();
+    pthread_mutex_unlock(&journal.map_lock);
+    device_read_only = false;
 }
 
-// Open a regular file
-// `fi->fh` is a reserved field for file handle
-// `fi->flags` contains the flags. Where `O_APPEND` requires special handling and is tested with `echo x >> file`.
-int fs_open(const char* path, struct fuse_file_info* fi)
+void fs_set_compression(bool enabled)
 {
-    printf("Open is called:%s\n", path);
+    options.compress = enabled;
+}
 
-    // if the file does not exist, create it
-    if (fi->flags & O_CREAT) {
-        fs_mknod(path, 0, 0);
-    }
+void fs_set_tail_packing(bool enabled)
+{
+    options.tailpack = enabled;
+}
 
-    struct inode inode;
-    int inode_pos = resolve_path_to_inode(path, &inode);
-    if (inode_pos == -1) {
-        return -ENOENT;
-    }
+void fs_set_block_trace(const char* path)
+{
+    options.block_trace = (char*)path;
+}
 
-    fi->fh = inode_pos;
-    return 0;
+void fs_set_geometry(int block_size, int inode_num, long device_size)
+{
+    options.block_size = block_size;
+    options.inode_num = inode_num;
+    options.device_size = device_size;
 }
 
 #pragma region fixed
 
+void* fs_init(struct fuse_conn_info* conn)
+{
+    negotiate_conn(conn);
+    start_stats_thread();
+    start_journal_thread();
+    start_inode_table_init_thread();
+    start_defrag_thread();
+    return NULL;
+}
+
+// Write back all buffered data, empty the journal and mark the filesystem clean at unmount
+void fs_destroy(void* private_data)
+{
+    // every reply has been sent by now
+    release_spliced_reads(true);
+    unmount_fs();
+    flush_op_log();
+    flush_block_trace();
+}
+
 // Release an opened regular file
 int fs_release(const char* path, struct fuse_file_info* fi)
 {
-    printf("Release is called:%s\n", path);
+    OP_SCOPE(OP_RELEASE, path, -1);
     return 0;
 }
 
 // Open a directory
 int fs_opendir(const char* path, struct fuse_file_info* fi)
 {
-    printf("Opendir is called:%s\n", path);
+    OP_SCOPE(OP_OPENDIR, path, -1);
     return 0;
 }
 
 // Release an opened directory
 int fs_releasedir(const char* path, struct fuse_file_info* fi)
 {
-    printf("Releasedir is called:%s\n", path);
+    OP_SCOPE(OP_RELEASEDIR, path, -1);
     return 0;
 }
 
+// The FUSE entry point is left out of the library build, see fs.h
+#ifndef FS_LIBRARY
 static struct fuse_operations fs_operations = {
     .getattr = fs_getattr,
     .readdir = fs_readdir,
     .read = fs_read,
+    .read_buf = fs_read_buf,
     .mkdir = fs_mkdir,
     .rmdir = fs_rmdir,
     .unlink = fs_unlink,
@@ -1137,24 +6660,62 @@ static struct fuse_operations fs_operations = {
     .utime = fs_utime,
     .mknod = fs_mknod,
     .write = fs_write,
+    .write_buf = fs_write_buf,
+    .fsync = fs_fsync,
+    .ioctl = fs_ioctl,
     .statfs = fs_statfs,
     .open = fs_open,
     .release = fs_release,
     .opendir = fs_opendir,
-    .releasedir = fs_releasedir
+    .releasedir = fs_releasedir,
+    .init = fs_init,
+    .destroy = fs_destroy,
 };
 
 int main(int argc, char* argv[])
 {
-    if (disk_init()) {
-        printf("Can't open virtual disk!\n");
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
+        printf("Invalid options!\n");
+        return -3;
+    }
+    // large requests, see `negotiate_conn`
+    char io_size_opts[64];
+    sprintf(io_size_opts, "-obig_writes,max_read=%d,max_write=%d", MAX_IO_SIZE, MAX_IO_SIZE);
+    fuse_opt_add_arg(&args, io_size_opts);
+    // kernel caching, see `open_keep_cache`; the low-level front end replies its timeouts itself
+    char timeout_opts[64];
+    sprintf(timeout_opts, "-oentry_timeout=%d,attr_timeout=%d", options.kcache_timeout, options.kcache_timeout);
+    if (options.kcache && !options.lowlevel) {
+        fuse_opt_add_arg(&args, timeout_opts);
+    }
+    // opened before FUSE changes the working directory
+    if (options.op_log != NULL && (op_log = fopen(options.op_log, "w")) == NULL) {
+        printf("Can't open the operation log!\n");
+        return -4;
+    }
+    block_stats_signals();
+    // mount the device of an earlier run, or format a new one
+    int start = fs_start(options.format);
+    if (start == -1) {
+        printf("Can't open virtual disk, or mount the filesystem on it!\n");
         return -1;
     }
-    if (mkfs()) {
+    if (start == -2) {
         printf("Mkfs failed!\n");
         return -2;
     }
-    return fuse_main(argc, argv, &fs_operations, NULL);
+    if (options.fsck) {
+        int check = fs_check(sysconf(_SC_NPROCESSORS_ONLN), true, stdout);
+        if (check == -1 || (check & FSCK_LEFT)) {
+            printf("The filesystem has errors fsck can't repair!\n");
+            return -5;
+        }
+    }
+    int ret = options.lowlevel ? lowlevel_main(&args) : fuse_main(args.argc, args.argv, &fs_operations, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }
+#endif
 
 #pragma endregion
\ No newline at end of file
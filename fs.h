@@ -0,0 +1,69 @@
+/*
+The filesystem core, for programs that drive it in-process instead of through a FUSE mount
+They link against libfs.a (fs.c built with -DFS_LIBRARY) and a block device implementing disk.h
+*/
+
+#ifndef FS_H
+#define FS_H
+
+#include "fs_ioctl.h"
+#include <fuse.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <utime.h>
+
+// Open the device and mount the filesystem on it, formatting it first if it holds none or if `format` is set
+// Return 0 on success, -1 if the device cannot be opened or its filesystem cannot be mounted, -2 if formatting fails
+int fs_start(bool format);
+// Compress file data written from now on, as `-o compress` does; compressed data is read back either way
+void fs_set_compression(bool enabled);
+// Pack the last partial blocks of small files written from now on, as `-o tailpack` does; tails read back either way
+void fs_set_tail_packing(bool enabled);
+// Log every access to the buffer cache of the mounts `fs_start` makes from now on to `path`, as `-o block_trace=` does
+// The log is written in batches, complete after `fs_destroy`; see block_trace.h
+void fs_set_block_trace(const char* path);
+// Geometry of the filesystems `fs_start` formats from now on, as `-o block_size=,inodes=,device_size=` do
+// A block size of 4 to 64 KiB, a number of inodes rounded up to fill inode-table blocks, and at most DISK_SIZE bytes
+void fs_set_geometry(int block_size, int inode_num, long device_size);
+// Mount the filesystem already on the device, as `fs_start` does, but never format it
+// Return 0 on success, -1 if the device cannot be opened or holds no filesystem
+int fs_attach();
+// Mount it as `fs_attach` does but never write to the device, replaying the journal in memory and leaving the state of
+// the superblock as it is; `fs_detach` ends such a mount, in place of `fs_destroy`
+int fs_attach_read_only();
+void fs_detach();
+// Check that the bitmaps, the reference counts, the block pointers and the directory entries agree, scanning the
+// inode table with `threads` threads, before any other operation; problems are reported to `out`, and repaired if
+// `repair` is set, so that the filesystem holds what its directories reach and nothing else
+// Return -1 on error, or the problems as the `FSCK_*` bits, 0 if there is none
+#define FSCK_REPAIRED 1 // problems were found and all or some repaired
+#define FSCK_LEFT 4 // problems are left, as repairs are off or cannot be made
+int fs_check(int threads, bool repair, FILE* out);
+// Wait until the trees removed with `FS_IOC_RMTREE` are freed, as unmounting does
+void fs_rmtree_wait();
+// Start the background threads, and stop them after writing everything back, as around a FUSE session
+void* fs_init(struct fuse_conn_info* conn);
+void fs_destroy(void* private_data);
+
+int fs_getattr(const char* path, struct stat* attr);
+int fs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi);
+int fs_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi);
+int fs_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi);
+int fs_mknod(const char* path, mode_t mode, dev_t dev);
+int fs_mkdir(const char* path, mode_t mode);
+int fs_rmdir(const char* path);
+int fs_unlink(const char* path);
+int fs_rename(const char* oldpath, const char* newpath);
+int fs_truncate(const char* path, off_t size);
+int fs_utime(const char* path, struct utimbuf* buffer);
+int fs_statfs(const char* path, struct statvfs* stat);
+int fs_open(const char* path, struct fuse_file_info* fi);
+int fs_release(const char* path, struct fuse_file_info* fi);
+int fs_fsync(const char* path, int datasync, struct fuse_file_info* fi);
+// `FS_IOC_CLONE` of fs_ioctl.h, on a file opened with `fs_open`, and `FS_IOC_RMTREE` and `FS_IOC_DEFRAG` on a directory
+int fs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data);
+
+// Per-operation latency histograms, as written on SIGUSR1
+void dump_stats(FILE* out);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+The ioctls of the filesystem, for tools that issue them on files of the mount
+*/
+
+#ifndef FS_IOCTL_H
+#define FS_IOCTL_H
+
+#include <sys/ioctl.h>
+
+#define FS_CLONE_PATH_MAX 4096
+
+// Issued on an open regular file, which becomes a copy of `src` sharing its data blocks until either is written
+// `src` is a path from the root of the mount
+// A data block counts up to 65535 extra references, one per block pointer, so a file can have FS_CLONE_MAX clones even
+// if each block is shared by the 4 pointers of a compressed cluster; a clone past the count fails with EMLINK, as it
+// never copies data
+#define FS_CLONE_MAX (65535 / 4)
+struct fs_clone_args {
+    char src[FS_CLONE_PATH_MAX];
+};
+#define FS_IOC_CLONE _IOW('f', 0x90, struct fs_clone_args)
+
+#define FS_RMTREE_NAME_MAX 256
+
+// Issued on an open directory, whose entry `name` is removed with everything below it
+// The entry is gone when the ioctl returns; the files below it are freed in the background, and their space with them
+struct fs_rmtree_args {
+    char name[FS_RMTREE_NAME_MAX];
+};
+#define FS_IOC_RMTREE _IOW('f', 0x91, struct fs_rmtree_args)
+
+// Issued on an open directory, whose files are moved into runs of consecutive blocks, and whose directories have
+// their entries packed into their first blocks, all the way down
+// Directories listed in the last minute keep their entries where they are, as readdir offsets point into them
+#define FS_IOC_DEFRAG _IO('f', 0x92)
+
+#endif
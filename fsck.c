@@ -0,0 +1,44 @@
+/*
+Check the filesystem on the device of the mount, which must not be mounted meanwhile, and optionally repair it
+  fsck [-y] [-j THREADS]
+-y repairs what it finds, and -j sets the threads scanning the inode table, one per processor by default
+Without -y the device is only read: the journal is replayed in memory, and a filesystem not cleanly unmounted stays so
+The exit status is that of e2fsck: 0 if the filesystem is sound, 1 if problems were repaired, 4 if some are left,
+8 if the check itself failed
+*/
+
+#include "fs.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[])
+{
+    bool repair = false;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), opt;
+    while ((opt = getopt(argc, argv, "yj:")) != -1) {
+        switch (opt) {
+        case 'y':
+            repair = true;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-y] [-j THREADS]\n", argv[0]);
+            return 8;
+        }
+    }
+    // without repairs the device is not written at all, not even to replay the journal or to mark it mounted
+    if (repair ? fs_attach() : fs_attach_read_only()) {
+        fprintf(stderr, "%s: no filesystem on the device\n", argv[0]);
+        return 8;
+    }
+    int ret = fs_check(threads, repair, stdout);
+    // unmounting marks the filesystem clean, with the free counts the check has set right
+    if (repair) {
+        fs_destroy(NULL);
+    } else {
+        fs_detach();
+    }
+    return ret == -1 ? 8 : ret;
+}
@@ -0,0 +1,104 @@
+/*
+A block device for running the filesystem in-process, see memdisk.h
+*/
+
+#include "memdisk.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char* memdisk_file;
+atomic_ulong memdisk_reads, memdisk_writes;
+
+static char* blocks; // in memory
+static int image_fd = -1; // in a file
+
+int disk_init()
+{
+    if (memdisk_file == NULL) {
+        free(blocks);
+        // pages of the device are only touched when written
+        blocks = calloc(BLOCK_NUM, BLOCK_SIZE);
+        return blocks == NULL;
+    }
+    if (image_fd != -1) {
+        close(image_fd);
+    }
+    image_fd = open(memdisk_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    return image_fd == -1 || ftruncate(image_fd, DISK_SIZE);
+}
+
+// Only an image file outlives the process, a device in memory is always new
+int disk_attach()
+{
+    if (memdisk_file == NULL) {
+        return blocks == NULL;
+    }
+    image_fd = open(memdisk_file, O_RDWR);
+    struct stat st;
+    if (image_fd == -1 || fstat(image_fd, &st) || st.st_size != DISK_SIZE) {
+        if (image_fd != -1) {
+            close(image_fd);
+            image_fd = -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+int disk_read(int block_id, void* buffer)
+{
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return 1;
+    memdisk_reads++;
+    if (blocks != NULL) {
+        memcpy(buffer, blocks + (size_t)block_id * BLOCK_SIZE, BLOCK_SIZE);
+        return 0;
+    }
+    return pread(image_fd, buffer, BLOCK_SIZE, (off_t)block_id * BLOCK_SIZE) != BLOCK_SIZE;
+}
+
+int disk_write(int block_id, void* buffer)
+{
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return 1;
+    memdisk_writes++;
+    if (blocks != NULL) {
+        memcpy(blocks + (size_t)block_id * BLOCK_SIZE, buffer, BLOCK_SIZE);
+        return 0;
+    }
+    return pwrite(image_fd, buffer, BLOCK_SIZE, (off_t)block_id * BLOCK_SIZE) != BLOCK_SIZE;
+}
+
+// There is no file per block to splice from, so the zero-copy read path is unavailable; `fs_read` works as usual
+int disk_open([[maybe_unused]] int block_id, [[maybe_unused]] int flags)
+{
+    return -1;
+}
+
+int disk_read_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (disk_read(block_ids[i], buffers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int disk_write_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (disk_write(block_ids[i], buffers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// One tier only
+void disk_set_metadata([[maybe_unused]] int block_id, [[maybe_unused]] int metadata)
+{
+}
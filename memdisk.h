@@ -0,0 +1,15 @@
+/*
+A block device for running the filesystem in-process: in memory, or in a single image file
+It implements disk.h in place of disk.c, and counts the block reads and writes
+*/
+
+#ifndef MEMDISK_H
+#define MEMDISK_H
+
+#include "disk.h"
+#include <stdatomic.h>
+
+extern const char* memdisk_file; // image file, set before the device is opened; NULL keeps the device in memory
+extern atomic_ulong memdisk_reads, memdisk_writes;
+
+#endif
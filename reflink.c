@@ -0,0 +1,64 @@
+/*
+Clone a file of the mount into another one without copying its data, with the FS_IOC_CLONE ioctl
+  reflink SRC DST
+DST is created if needed and is replaced by a copy sharing the data blocks of SRC; both must be on the same mount
+*/
+
+#include "fs_ioctl.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The path of `src` from the root of the mount it is on, found as the highest directory on the same device
+static int mount_relative_path(const char* src, char* out)
+{
+    char full[PATH_MAX], path[PATH_MAX];
+    struct stat st, parent_st;
+    if (realpath(src, full) == NULL || stat(full, &st) == -1) {
+        return -1;
+    }
+    strcpy(path, full);
+    int root_len = strlen(path);
+    for (;;) {
+        char* slash = strrchr(path, '/');
+        if (slash == NULL || slash == path) {
+            break;
+        }
+        *slash = '\0';
+        if (stat(path, &parent_st) == -1 || parent_st.st_dev != st.st_dev) {
+            *slash = '/';
+            break;
+        }
+        root_len = slash - path;
+    }
+    snprintf(out, FS_CLONE_PATH_MAX, "%s", full[root_len] == '\0' ? "/" : full + root_len);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SRC DST\n", argv[0]);
+        return 2;
+    }
+    static struct fs_clone_args args;
+    if (mount_relative_path(argv[1], args.src)) {
+        perror(argv[1]);
+        return 1;
+    }
+    int fd = open(argv[2], O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (ioctl(fd, FS_IOC_CLONE, &args) == -1) {
+        perror("FS_IOC_CLONE");
+        close(fd);
+        return 1;
+    }
+    return close(fd) == -1;
+}
@@ -0,0 +1,1163 @@
+/*
+Trace replay, to catch performance regressions of fs.c before they reach a mount
+  replay convert [-C dir] [-m mnt] trace.sh     turn a shell trace of traces/ into an operation log on stdout
+  replay run [-t] [-z] [-f image] [-B btrace] log...
+                                                replay operation logs in-process, each on a freshly formatted device,
+                                                and write the latency and device I/Os of every operation to stdout;
+                                                with -B, the buffer cache accesses go to a block trace for `cachesim`
+  replay compare [-T percent] baseline result   compare two results of `run`, failing on regressions
+Operation logs are also written by a live mount started with `-o op_log=FILE`; `run` converts a `.sh` file first
+*/
+
+#include "fs.h"
+#include "memdisk.h"
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATH_LEN 4096
+#define MAX_LINE_LEN (3 * MAX_PATH_LEN)
+#define MAX_WORDS 64
+#define IO_CHUNK (128 * 1024) // the largest read or write the kernel sends, see MAX_IO_SIZE in fs.c
+#define MAX_IO (1024 * 1024)
+
+// Operations of the log, named as in fs.c
+enum op_type {
+    OP_GETATTR,
+    OP_READDIR,
+    OP_READ,
+    OP_WRITE,
+    OP_MKNOD,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_TRUNCATE,
+    OP_UTIME,
+    OP_STATFS,
+    OP_OPEN,
+    OP_FSYNC,
+    OP_IOCTL,
+    OP_RMTREE,
+    OP_DEFRAG,
+    OP_TYPE_NUM
+};
+static const struct {
+    const char* name;
+    int path_num;
+    int arg_num;
+} op_types[OP_TYPE_NUM] = {
+    [OP_GETATTR] = { "getattr", 1, 0 },
+    [OP_READDIR] = { "readdir", 1, 0 },
+    [OP_READ] = { "read", 1, 2 }, // offset, size
+    [OP_WRITE] = { "write", 1, 2 }, // offset, size
+    [OP_MKNOD] = { "mknod", 1, 0 },
+    [OP_MKDIR] = { "mkdir", 1, 0 },
+    [OP_UNLINK] = { "unlink", 1, 0 },
+    [OP_RMDIR] = { "rmdir", 1, 0 },
+    [OP_RENAME] = { "rename", 2, 0 },
+    [OP_TRUNCATE] = { "truncate", 1, 1 }, // size
+    [OP_UTIME] = { "utime", 1, 2 }, // atime, mtime
+    [OP_STATFS] = { "statfs", 1, 0 },
+    [OP_OPEN] = { "open", 1, 0 },
+    [OP_FSYNC] = { "fsync", 1, 0 },
+    [OP_IOCTL] = { "ioctl", 2, 0 }, // FS_IOC_CLONE of the second path into the first
+    [OP_RMTREE] = { "rmtree", 1, 0 }, // FS_IOC_RMTREE of the path, issued on its parent directory
+    [OP_DEFRAG] = { "defrag", 1, 0 }, // FS_IOC_DEFRAG of the directory
+};
+
+static int find_op_type(const char* name)
+{
+    for (int i = 0; i < OP_TYPE_NUM; i++) {
+        if (strcmp(op_types[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Operation logs
+
+struct op {
+    uint64_t time; // microseconds
+    enum op_type type;
+    char path[MAX_PATH_LEN];
+    char path2[MAX_PATH_LEN];
+    long long arg[2];
+};
+
+// Paths are written with bytes that would split the line escaped as %xx, as fs.c does
+static void write_path(FILE* out, const char* path)
+{
+    fputc(' ', out);
+    for (const char* c = path; *c != '\0'; c++) {
+        if ((unsigned char)*c <= ' ' || *c == '%' || *c == 0x7f) {
+            fprintf(out, "%%%02x", (unsigned char)*c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+}
+
+static void unescape_path(char* path)
+{
+    char* out = path;
+    for (char* c = path; *c != '\0'; c++) {
+        unsigned int byte;
+        if (*c == '%' && sscanf(c + 1, "%2x", &byte) == 1) {
+            *out++ = byte;
+            c += 2;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+}
+
+static void write_op(FILE* out, const struct op* op)
+{
+    fprintf(out, "%llu %s", (unsigned long long)op->time, op_types[op->type].name);
+    write_path(out, op->path);
+    if (op_types[op->type].path_num > 1) {
+        write_path(out, op->path2);
+    }
+    for (int i = 0; i < op_types[op->type].arg_num; i++) {
+        fprintf(out, " %lld", op->arg[i]);
+    }
+    fputc('\n', out);
+}
+
+// Parse a line of an operation log
+// Return 1 if an operation is read, 0 for a line to skip, -1 for a malformed line
+static int parse_op(char* line, struct op* op)
+{
+    char name[32];
+    int len;
+    unsigned long long time;
+    if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0') {
+        return 0;
+    }
+    int type;
+    if (sscanf(line, "%llu %31s%n", &time, name, &len) != 2 || (type = find_op_type(name)) == -1) {
+        return -1;
+    }
+    op->time = time;
+    op->type = type;
+    char* rest = line + len;
+    char* paths[2] = { op->path, op->path2 };
+    for (int i = 0; i < op_types[op->type].path_num; i++) {
+        int n;
+        if (sscanf(rest, " %4095s%n", paths[i], &n) != 1) {
+            return -1;
+        }
+        unescape_path(paths[i]);
+        rest += n;
+    }
+    for (int i = 0; i < op_types[op->type].arg_num; i++) {
+        int n;
+        if (sscanf(rest, " %lld%n", &op->arg[i], &n) != 1) {
+            return -1;
+        }
+        rest += n;
+    }
+    return 1;
+}
+
+// Converting shell traces
+// The trace is interpreted against a model of the namespace, emitting the operations the kernel would send for each
+// command through the path-based API; commands on host files only matter for the sizes of files copied in
+
+struct node {
+    char path[MAX_PATH_LEN]; // in the mount
+    bool dir;
+    long long size;
+};
+
+static struct {
+    struct node* nodes;
+    int node_num, node_cap;
+    struct node* host; // host files created by the trace, with their sizes
+    int host_num, host_cap;
+    const char* host_dir; // where the trace runs
+    char mount[MAX_PATH_LEN]; // virtual path of the mount point, "/mnt"
+    char cwd[MAX_PATH_LEN]; // virtual path
+    uint64_t time; // microseconds, advanced by every command
+    FILE* out;
+} conv;
+
+static struct node* add_node(struct node** nodes, int* num, int* cap)
+{
+    if (*num == *cap) {
+        *cap = *cap == 0 ? 64 : *cap * 2;
+        *nodes = realloc(*nodes, sizeof(struct node) * *cap);
+        if (*nodes == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    return &(*nodes)[(*num)++];
+}
+
+static struct node* find_node(const char* path)
+{
+    for (int i = 0; i < conv.node_num; i++) {
+        if (strcmp(conv.nodes[i].path, path) == 0) {
+            return &conv.nodes[i];
+        }
+    }
+    return NULL;
+}
+
+static void make_node(const char* path, bool dir)
+{
+    struct node* node = add_node(&conv.nodes, &conv.node_num, &conv.node_cap);
+    snprintf(node->path, sizeof(node->path), "%s", path);
+    node->dir = dir;
+    node->size = 0;
+}
+
+static void remove_node(const char* path)
+{
+    struct node* node = find_node(path);
+    if (node != NULL) {
+        *node = conv.nodes[--conv.node_num];
+    }
+}
+
+// Whether `path` is `dir` or below it
+static bool is_below(const char* path, const char* dir)
+{
+    int len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/' || (len == 1 && dir[0] == '/'));
+}
+
+static void emit(enum op_type type, const char* path, const char* path2, long long a, long long b)
+{
+    struct op op = { .time = conv.time, .type = type, .arg = { a, b } };
+    snprintf(op.path, sizeof(op.path), "%s", path);
+    snprintf(op.path2, sizeof(op.path2), "%s", path2 == NULL ? "" : path2);
+    write_op(conv.out, &op);
+}
+
+// Resolve `arg` against the working directory into a normalized virtual path
+static void resolve(const char* arg, char* out)
+{
+    char joined[2 * MAX_PATH_LEN];
+    if (arg[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", arg);
+    } else {
+        snprintf(joined, sizeof(joined), "%s/%s", conv.cwd, arg);
+    }
+    out[0] = '\0';
+    int len = 0;
+    for (char* name = strtok(joined, "/"); name != NULL; name = strtok(NULL, "/")) {
+        if (strcmp(name, ".") == 0) {
+            continue;
+        }
+        if (strcmp(name, "..") == 0) {
+            while (len > 0 && out[--len] != '/') {
+            }
+            out[len] = '\0';
+            continue;
+        }
+        len += snprintf(out + len, MAX_PATH_LEN - len, "/%s", name);
+    }
+    if (len == 0) {
+        strcpy(out, "/");
+    }
+}
+
+// The path in the mount of a virtual path, or NULL for a host path
+static const char* mount_path(const char* vpath)
+{
+    if (!is_below(vpath, conv.mount)) {
+        return NULL;
+    }
+    const char* path = vpath + strlen(conv.mount);
+    return path[0] == '\0' ? "/" : path;
+}
+
+static long long host_size(const char* vpath)
+{
+    for (int i = 0; i < conv.host_num; i++) {
+        if (strcmp(conv.host[i].path, vpath) == 0) {
+            return conv.host[i].size;
+        }
+    }
+    char real[2 * MAX_PATH_LEN];
+    snprintf(real, sizeof(real), "%s%s", conv.host_dir, vpath);
+    struct stat st;
+    return stat(real, &st) == 0 ? st.st_size : 0;
+}
+
+static void set_host_size(const char* vpath, long long size)
+{
+    for (int i = 0; i < conv.host_num; i++) {
+        if (strcmp(conv.host[i].path, vpath) == 0) {
+            conv.host[i].size = size;
+            return;
+        }
+    }
+    struct node* node = add_node(&conv.host, &conv.host_num, &conv.host_cap);
+    snprintf(node->path, sizeof(node->path), "%s", vpath);
+    node->size = size;
+}
+
+static void emit_read(const char* path, long long size)
+{
+    emit(OP_OPEN, path, NULL, 0, 0);
+    for (long long offset = 0; offset < size; offset += IO_CHUNK) {
+        emit(OP_READ, path, NULL, offset, IO_CHUNK);
+    }
+}
+
+// Create the file if needed, or cut it to `offset` bytes, then write `size` bytes at `offset`
+static void emit_write(const char* path, long long offset, long long size)
+{
+    struct node* node = find_node(path);
+    emit(OP_GETATTR, path, NULL, 0, 0);
+    if (node == NULL) {
+        emit(OP_MKNOD, path, NULL, 0, 0);
+        make_node(path, false);
+        node = find_node(path);
+    } else if (node->size != offset) {
+        emit(OP_TRUNCATE, path, NULL, offset, 0);
+    }
+    emit(OP_OPEN, path, NULL, 0, 0);
+    for (long long done = 0; done < size; done += IO_CHUNK) {
+        emit(OP_WRITE, path, NULL, offset + done, done + IO_CHUNK <= size ? IO_CHUNK : size - done);
+    }
+    node->size = offset + size;
+}
+
+// A file copied into a directory keeps its name
+static void target_path(const char* dst, const char* src, char* out)
+{
+    struct node* node = find_node(dst);
+    const char* name = strrchr(src, '/');
+    if (node != NULL && node->dir && name != NULL) {
+        snprintf(out, MAX_PATH_LEN, "%s%s", strcmp(dst, "/") == 0 ? "" : dst, name);
+    } else {
+        snprintf(out, MAX_PATH_LEN, "%s", dst);
+    }
+}
+
+static void convert_remove(const char* path, bool recursive)
+{
+    struct node* node = find_node(path);
+    emit(OP_GETATTR, path, NULL, 0, 0);
+    if (node == NULL) {
+        return;
+    }
+    if (!node->dir) {
+        emit(OP_UNLINK, path, NULL, 0, 0);
+        remove_node(path);
+        return;
+    }
+    if (!recursive) {
+        return;
+    }
+    emit(OP_READDIR, path, NULL, 0, 0);
+    for (int i = 0; i < conv.node_num;) {
+        // children only; removing one reorders the array, so start over
+        const char* child = conv.nodes[i].path;
+        if (is_below(child, path) && strcmp(child, path) != 0 && strchr(child + strlen(path) + (strcmp(path, "/") != 0), '/') == NULL) {
+            char copy[MAX_PATH_LEN];
+            strcpy(copy, child);
+            convert_remove(copy, true);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+    emit(OP_RMDIR, path, NULL, 0, 0);
+    remove_node(path);
+}
+
+// Expand the wildcards of an argument against the names in its directory
+static int expand(const char* arg, char (*out)[MAX_PATH_LEN], int max)
+{
+    char vpath[MAX_PATH_LEN];
+    resolve(arg, vpath);
+    const char* path = mount_path(vpath);
+    if (path == NULL || strpbrk(path, "*?[") == NULL) {
+        strcpy(out[0], vpath);
+        return 1;
+    }
+    int num = 0;
+    for (int i = 0; i < conv.node_num && num < max; i++) {
+        // a match too long for a path with the mount point in front is left out
+        if (fnmatch(path, conv.nodes[i].path, FNM_PATHNAME) == 0
+            && snprintf(out[num], MAX_PATH_LEN, "%s%s", conv.mount, conv.nodes[i].path) < MAX_PATH_LEN) {
+            num++;
+        }
+    }
+    return num;
+}
+
+// Sizes like `1M` as in `dd bs=1M`
+static long long parse_size(const char* s)
+{
+    char* end;
+    long long size = strtoll(s, &end, 10);
+    switch (toupper(*end)) {
+    case 'K':
+        return size << 10;
+    case 'M':
+        return size << 20;
+    case 'G':
+        return size << 30;
+    }
+    return size;
+}
+
+// Split a command into words, honouring quotes; a `|` ends the command, and redirections of stderr are dropped
+// The target of `>` or `>>` is returned in `redirect`
+static int split_words(char* line, char** words, char** redirect, bool* append)
+{
+    int num = 0;
+    *redirect = NULL;
+    char* c = line;
+    for (;;) {
+        while (isspace((unsigned char)*c)) {
+            c++;
+        }
+        if (*c == '\0' || *c == '|' || *c == '#' || num == MAX_WORDS) {
+            break;
+        }
+        char* word = c;
+        char* out = c;
+        char quote = 0;
+        while (*c != '\0' && (quote || !isspace((unsigned char)*c))) {
+            if (quote ? *c == quote : (*c == '"' || *c == '\'')) {
+                quote = quote ? 0 : *c;
+                c++;
+                continue;
+            }
+            *out++ = *c++;
+        }
+        if (*c != '\0') {
+            c++;
+        }
+        *out = '\0';
+        if (strncmp(word, "2>", 2) == 0) {
+            continue;
+        }
+        if (word[0] == '>') {
+            *append = word[1] == '>';
+            char* target = word + 1 + *append;
+            if (*target == '\0') {
+                while (isspace((unsigned char)*c)) {
+                    c++;
+                }
+                target = c;
+                while (*c != '\0' && !isspace((unsigned char)*c)) {
+                    c++;
+                }
+                if (*c != '\0') {
+                    *c++ = '\0';
+                }
+            }
+            *redirect = target;
+            continue;
+        }
+        words[num++] = word;
+    }
+    return num;
+}
+
+// The arguments of a command that are not options
+static int operands(char** words, int num, char** out, const char* options_with_value)
+{
+    int count = 0;
+    for (int i = 1; i < num; i++) {
+        if (words[i][0] == '-' && words[i][1] != '\0') {
+            if (strchr(options_with_value, words[i][1]) != NULL && words[i][2] == '\0') {
+                i++;
+            }
+            continue;
+        }
+        out[count++] = words[i];
+    }
+    return count;
+}
+
+static void convert_command(char* line)
+{
+    char* words[MAX_WORDS];
+    char* redirect;
+    bool append = false;
+    int num = split_words(line, words, &redirect, &append);
+    if (num == 0) {
+        return;
+    }
+    conv.time += 1000;
+    const char* cmd = words[0];
+    char* args[MAX_WORDS];
+    char vpath[MAX_PATH_LEN], vpath2[MAX_PATH_LEN];
+
+    if (strcmp(cmd, "cd") == 0) {
+        resolve(num > 1 ? words[1] : "/", vpath);
+        strcpy(conv.cwd, vpath);
+        if (mount_path(vpath) != NULL) {
+            emit(OP_GETATTR, mount_path(vpath), NULL, 0, 0);
+        }
+    } else if (strcmp(cmd, "mkdir") == 0) {
+        bool parents = false;
+        for (int i = 1; i < num; i++) {
+            parents |= strcmp(words[i], "-p") == 0;
+        }
+        int n = operands(words, num, args, "m");
+        for (int i = 0; i < n; i++) {
+            resolve(args[i], vpath);
+            const char* path = mount_path(vpath);
+            if (path == NULL) {
+                continue;
+            }
+            // with -p, every missing parent is created first
+            for (char* slash = parents ? strchr(vpath + strlen(conv.mount) + 1, '/') : NULL;; slash = strchr(slash + 1, '/')) {
+                if (slash != NULL) {
+                    *slash = '\0';
+                }
+                const char* dir = mount_path(vpath);
+                emit(OP_GETATTR, dir, NULL, 0, 0);
+                if (find_node(dir) == NULL) {
+                    emit(OP_MKDIR, dir, NULL, 0, 0);
+                    make_node(dir, true);
+                }
+                if (slash == NULL) {
+                    break;
+                }
+                *slash = '/';
+            }
+        }
+    } else if (strcmp(cmd, "touch") == 0) {
+        int n = operands(words, num, args, "trd");
+        for (int i = 0; i < n; i++) {
+            resolve(args[i], vpath);
+            const char* path = mount_path(vpath);
+            if (path == NULL) {
+                continue;
+            }
+            emit(OP_GETATTR, path, NULL, 0, 0);
+            if (find_node(path) == NULL) {
+                emit(OP_MKNOD, path, NULL, 0, 0);
+                make_node(path, false);
+            }
+            emit(OP_UTIME, path, NULL, conv.time / 1000000, conv.time / 1000000);
+        }
+    } else if (strcmp(cmd, "ls") == 0) {
+        int n = operands(words, num, args, "");
+        for (int i = 0; i < (n == 0 ? 1 : n); i++) {
+            resolve(n == 0 ? "." : args[i], vpath);
+            const char* path = mount_path(vpath);
+            if (path != NULL) {
+                emit(OP_GETATTR, path, NULL, 0, 0);
+                struct node* node = find_node(path);
+                if (node == NULL || node->dir) {
+                    emit(OP_READDIR, path, NULL, 0, 0);
+                }
+            }
+        }
+    } else if (strcmp(cmd, "stat") == 0) {
+        int n = operands(words, num, args, "c");
+        for (int i = 0; i < n; i++) {
+            resolve(args[i], vpath);
+            if (mount_path(vpath) != NULL) {
+                emit(OP_GETATTR, mount_path(vpath), NULL, 0, 0);
+            }
+        }
+    } else if (strcmp(cmd, "mv") == 0 || strcmp(cmd, "cp") == 0) {
+        if (operands(words, num, args, "") != 2) {
+            return;
+        }
+        resolve(args[0], vpath);
+        resolve(args[1], vpath2);
+        const char *src = mount_path(vpath), *dst = mount_path(vpath2);
+        char target[MAX_PATH_LEN];
+        if (dst != NULL) {
+            target_path(dst, src != NULL ? src : vpath, target);
+        }
+        if (strcmp(cmd, "mv") == 0) {
+            if (src == NULL || dst == NULL) {
+                return;
+            }
+            emit(OP_GETATTR, src, NULL, 0, 0);
+            emit(OP_GETATTR, target, NULL, 0, 0);
+            emit(OP_RENAME, src, target, 0, 0);
+            remove_node(target);
+            for (int i = 0; i < conv.node_num; i++) {
+                if (is_below(conv.nodes[i].path, src)) {
+                    char moved[MAX_PATH_LEN];
+                    if (snprintf(moved, sizeof(moved), "%s%s", target, conv.nodes[i].path + strlen(src)) < (int)sizeof(moved)) {
+                        strcpy(conv.nodes[i].path, moved);
+                    }
+                }
+            }
+            return;
+        }
+        bool reflink = false;
+        for (int i = 1; i < num; i++) {
+            reflink |= strncmp(words[i], "--reflink", 9) == 0;
+        }
+        if (reflink && src != NULL && dst != NULL) {
+            emit(OP_GETATTR, src, NULL, 0, 0);
+            emit(OP_GETATTR, target, NULL, 0, 0);
+            if (find_node(target) == NULL) {
+                emit(OP_MKNOD, target, NULL, 0, 0);
+                make_node(target, false);
+            }
+            emit(OP_OPEN, target, NULL, 0, 0);
+            emit(OP_IOCTL, target, src, 0, 0);
+            struct node* node = find_node(src);
+            find_node(target)->size = node == NULL ? 0 : node->size;
+            return;
+        }
+        long long size;
+        if (src != NULL) {
+            struct node* node = find_node(src);
+            size = node == NULL ? 0 : node->size;
+            emit(OP_GETATTR, src, NULL, 0, 0);
+            emit_read(src, size);
+        } else {
+            size = host_size(vpath);
+        }
+        if (dst != NULL) {
+            emit_write(target, 0, size);
+        } else {
+            set_host_size(vpath2, size);
+        }
+    } else if (strcmp(cmd, "rm") == 0) {
+        bool recursive = false;
+        for (int i = 1; i < num; i++) {
+            recursive |= words[i][0] == '-' && strpbrk(words[i], "rR") != NULL;
+        }
+        int n = operands(words, num, args, "");
+        for (int i = 0; i < n; i++) {
+            static char matches[1024][MAX_PATH_LEN];
+            int match_num = expand(args[i], matches, 1024);
+            for (int j = 0; j < match_num; j++) {
+                if (mount_path(matches[j]) != NULL) {
+                    convert_remove(mount_path(matches[j]), recursive);
+                }
+            }
+        }
+    } else if (strcmp(cmd, "echo") == 0) {
+        if (redirect == NULL) {
+            return;
+        }
+        long long size = 1; // the newline
+        for (int i = 1; i < num; i++) {
+            size += strlen(words[i]) + (i > 1);
+        }
+        resolve(redirect, vpath);
+        const char* path = mount_path(vpath);
+        if (path == NULL) {
+            set_host_size(vpath, size);
+            return;
+        }
+        struct node* node = find_node(path);
+        emit_write(path, append && node != NULL ? node->size : 0, size);
+    } else if (strcmp(cmd, "truncate") == 0) {
+        long long size = 0;
+        for (int i = 1; i + 1 < num; i++) {
+            if (strcmp(words[i], "-s") == 0) {
+                size = parse_size(words[i + 1]);
+            }
+        }
+        int n = operands(words, num, args, "s");
+        for (int i = 0; i < n; i++) {
+            resolve(args[i], vpath);
+            const char* path = mount_path(vpath);
+            if (path == NULL) {
+                continue;
+            }
+            emit(OP_GETATTR, path, NULL, 0, 0);
+            if (find_node(path) == NULL) {
+                emit(OP_MKNOD, path, NULL, 0, 0);
+                make_node(path, false);
+            }
+            emit(OP_TRUNCATE, path, NULL, size, 0);
+            find_node(path)->size = size;
+        }
+    } else if (strcmp(cmd, "more") == 0 || strcmp(cmd, "cat") == 0 || strcmp(cmd, "less") == 0) {
+        int n = operands(words, num, args, "");
+        for (int i = 0; i < n; i++) {
+            resolve(args[i], vpath);
+            const char* path = mount_path(vpath);
+            struct node* node = path == NULL ? NULL : find_node(path);
+            if (node != NULL) {
+                emit(OP_GETATTR, path, NULL, 0, 0);
+                emit_read(path, node->size);
+            }
+        }
+    } else if (strcmp(cmd, "df") == 0) {
+        emit(OP_STATFS, "/", NULL, 0, 0);
+    } else if (strcmp(cmd, "dd") == 0) {
+        long long block = 512, count = 0;
+        char *input = NULL, *output = NULL;
+        for (int i = 1; i < num; i++) {
+            if (strncmp(words[i], "bs=", 3) == 0) {
+                block = parse_size(words[i] + 3);
+            } else if (strncmp(words[i], "count=", 6) == 0) {
+                count = parse_size(words[i] + 6);
+            } else if (strncmp(words[i], "if=", 3) == 0) {
+                input = words[i] + 3;
+            } else if (strncmp(words[i], "of=", 3) == 0) {
+                output = words[i] + 3;
+            }
+        }
+        if (input != NULL) {
+            resolve(input, vpath);
+            if (mount_path(vpath) != NULL && find_node(mount_path(vpath)) != NULL) {
+                emit_read(mount_path(vpath), block * count);
+            }
+        }
+        if (output != NULL) {
+            resolve(output, vpath);
+            if (mount_path(vpath) != NULL) {
+                emit_write(mount_path(vpath), 0, block * count);
+            } else {
+                set_host_size(vpath, block * count);
+            }
+        }
+    } else if (strcmp(cmd, "diff") != 0 && strcmp(cmd, "sed") != 0 && strcmp(cmd, "grep") != 0) {
+        fprintf(stderr, "replay: %s is not converted\n", cmd);
+    }
+}
+
+// Replace `$var` and `${var}` by `value`
+static void substitute(const char* line, const char* var, int value, char* out)
+{
+    char plain[64], braced[64];
+    snprintf(plain, sizeof(plain), "$%s", var);
+    snprintf(braced, sizeof(braced), "${%s}", var);
+    int len = 0;
+    for (const char* c = line; *c != '\0' && len < MAX_LINE_LEN - 16;) {
+        if (strncmp(c, braced, strlen(braced)) == 0) {
+            len += sprintf(out + len, "%d", value);
+            c += strlen(braced);
+        } else if (strncmp(c, plain, strlen(plain)) == 0 && !isalnum((unsigned char)c[strlen(plain)]) && c[strlen(plain)] != '_') {
+            len += sprintf(out + len, "%d", value);
+            c += strlen(plain);
+        } else {
+            out[len++] = *c++;
+        }
+    }
+    out[len] = '\0';
+}
+
+static bool is_done(const char* line)
+{
+    line += strspn(line, " \t");
+    return strncmp(line, "done", 4) == 0 && (line[4] == '\0' || isspace((unsigned char)line[4]) || line[4] == ';');
+}
+
+// Convert a shell trace; `for ((i=A;i<B;++i)); do ... done` loops are unrolled
+static int convert(const char* trace, FILE* out)
+{
+    FILE* in = fopen(trace, "r");
+    if (in == NULL) {
+        perror(trace);
+        return -1;
+    }
+    conv.node_num = conv.host_num = 0;
+    conv.time = 0;
+    conv.out = out;
+    strcpy(conv.cwd, "/");
+    make_node("/", true);
+
+    char line[MAX_LINE_LEN], expanded[MAX_LINE_LEN];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char var[32];
+        int from, to;
+        if (sscanf(line, " for ((%31[A-Za-z_]=%d;%*[A-Za-z_]<%d;", var, &from, &to) != 3) {
+            convert_command(line);
+            continue;
+        }
+        char(*body)[MAX_LINE_LEN] = NULL;
+        int body_num = 0;
+        while (fgets(line, sizeof(line), in) != NULL && !is_done(line)) {
+            body = realloc(body, sizeof(*body) * (body_num + 1));
+            line[strcspn(line, "\n")] = '\0';
+            strcpy(body[body_num++], line);
+        }
+        for (int i = from; i < to; i++) {
+            for (int j = 0; j < body_num; j++) {
+                substitute(body[j], var, i, expanded);
+                convert_command(expanded);
+            }
+        }
+        free(body);
+    }
+    fclose(in);
+    return 0;
+}
+
+// Replaying
+
+// Handles of the files opened by the log, as the kernel would keep them
+#define HANDLE_NUM 256
+static struct {
+    char path[MAX_PATH_LEN];
+    uint64_t fh;
+} handles[HANDLE_NUM];
+static int handle_num;
+
+static int get_handle(const char* path, struct fuse_file_info* fi)
+{
+    memset(fi, 0, sizeof(*fi));
+    for (int i = 0; i < handle_num; i++) {
+        if (strcmp(handles[i].path, path) == 0) {
+            fi->fh = handles[i].fh;
+            return 0;
+        }
+    }
+    int ret = fs_open(path, fi);
+    if (ret == 0) {
+        int i = handle_num < HANDLE_NUM ? handle_num++ : rand() % HANDLE_NUM;
+        snprintf(handles[i].path, MAX_PATH_LEN, "%s", path);
+        handles[i].fh = fi->fh;
+    }
+    return ret;
+}
+
+static int fill_nothing([[maybe_unused]] void* buf, [[maybe_unused]] const char* name, [[maybe_unused]] const struct stat* st, [[maybe_unused]] off_t off)
+{
+    return 0;
+}
+
+static char io_buf[MAX_IO];
+
+// Run one operation; the handle it needs, if any, is looked up in `fi` beforehand, so opening is not timed
+static int run_op(const struct op* op, struct fuse_file_info* fi)
+{
+    struct stat st;
+    struct statvfs sv;
+    struct utimbuf times = { op->arg[0], op->arg[1] };
+    size_t size = op->arg[1] < MAX_IO ? op->arg[1] : MAX_IO;
+    switch (op->type) {
+    case OP_GETATTR:
+        return fs_getattr(op->path, &st);
+    case OP_READDIR:
+        return fs_readdir(op->path, NULL, fill_nothing, 0, fi);
+    case OP_READ:
+        return fs_read(op->path, io_buf, size, op->arg[0], fi);
+    case OP_WRITE:
+        return fs_write(op->path, io_buf, size, op->arg[0], fi);
+    case OP_MKNOD:
+        return fs_mknod(op->path, 0644, 0);
+    case OP_MKDIR:
+        return fs_mkdir(op->path, 0755);
+    case OP_UNLINK:
+        return fs_unlink(op->path);
+    case OP_RMDIR:
+        return fs_rmdir(op->path);
+    case OP_RENAME:
+        return fs_rename(op->path, op->path2);
+    case OP_TRUNCATE:
+        return fs_truncate(op->path, op->arg[0]);
+    case OP_UTIME:
+        return fs_utime(op->path, &times);
+    case OP_STATFS:
+        return fs_statfs(op->path, &sv);
+    case OP_OPEN:
+        return fs_open(op->path, fi);
+    case OP_FSYNC:
+        return fs_fsync(op->path, 0, fi);
+    case OP_IOCTL: {
+        struct fs_clone_args args;
+        snprintf(args.src, sizeof(args.src), "%s", op->path2);
+        return fs_ioctl(op->path, FS_IOC_CLONE, NULL, fi, 0, &args);
+    }
+    case OP_RMTREE: {
+        struct fs_rmtree_args args;
+        char parent[MAX_PATH_LEN];
+        const char* name = strrchr(op->path, '/');
+        if (name == NULL) {
+            return -1;
+        }
+        snprintf(parent, sizeof(parent), "%.*s", name == op->path ? 1 : (int)(name - op->path), op->path);
+        snprintf(args.name, sizeof(args.name), "%s", name + 1);
+        return fs_ioctl(parent, FS_IOC_RMTREE, NULL, fi, 0, &args);
+    }
+    case OP_DEFRAG:
+        return fs_ioctl(op->path, FS_IOC_DEFRAG, NULL, fi, 0, NULL);
+    default:
+        return -1;
+    }
+}
+
+// Latency and device I/Os of every type of operation, over all logs replayed
+struct op_result {
+    uint64_t count, errors;
+    uint64_t* latency;
+    uint64_t latency_cap;
+    double total_ns;
+    unsigned long reads, writes;
+};
+static struct op_result results[OP_TYPE_NUM + 1]; // the last one is the total
+
+static void record(struct op_result* res, uint64_t latency, int ret, unsigned long reads, unsigned long writes)
+{
+    if (res->count == res->latency_cap) {
+        res->latency_cap = res->latency_cap == 0 ? 1024 : res->latency_cap * 2;
+        res->latency = realloc(res->latency, sizeof(uint64_t) * res->latency_cap);
+        if (res->latency == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    res->latency[res->count++] = latency;
+    res->errors += ret < 0;
+    res->total_ns += latency;
+    res->reads += reads;
+    res->writes += writes;
+}
+
+static int replay(FILE* in, bool timed)
+{
+    int start = fs_start(true);
+    if (start) {
+        fprintf(stderr, "cannot %s the device\n", start == -1 ? "open" : "format");
+        return -1;
+    }
+    handle_num = 0;
+
+    char line[MAX_LINE_LEN];
+    struct op op;
+    uint64_t first = 0, begin = now_ns();
+    bool started = false;
+    for (int line_num = 1; fgets(line, sizeof(line), in) != NULL; line_num++) {
+        int parsed = parse_op(line, &op);
+        if (parsed == -1) {
+            fprintf(stderr, "replay: malformed line %d: %s", line_num, line);
+        }
+        if (parsed != 1) {
+            continue;
+        }
+        if (!started) {
+            first = op.time;
+            started = true;
+        }
+        if (timed) {
+            uint64_t due = begin + (op.time - first) * 1000;
+            struct timespec ts = { due / 1000000000, due % 1000000000 };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        struct fuse_file_info fi = { 0 };
+        if (op.type == OP_READ || op.type == OP_WRITE || op.type == OP_FSYNC || op.type == OP_IOCTL) {
+            get_handle(op.path, &fi);
+        }
+        if (op.type == OP_UNLINK || op.type == OP_RMDIR || op.type == OP_RENAME || op.type == OP_RMTREE) {
+            handle_num = 0; // a path may now name another file
+        }
+        unsigned long reads = memdisk_reads, writes = memdisk_writes;
+        uint64_t op_start = now_ns();
+        int ret = run_op(&op, &fi);
+        uint64_t latency = now_ns() - op_start;
+        reads = memdisk_reads - reads;
+        writes = memdisk_writes - writes;
+        record(&results[op.type], latency, ret, reads, writes);
+        record(&results[OP_TYPE_NUM], latency, ret, reads, writes);
+    }
+
+    // the writes left for the unmount count in the total
+    unsigned long writes = memdisk_writes;
+    fs_destroy(NULL);
+    results[OP_TYPE_NUM].writes += memdisk_writes - writes;
+    return 0;
+}
+
+static int compare_latency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(struct op_result* res, double p)
+{
+    uint64_t i = p * res->count;
+    return res->latency[i < res->count ? i : res->count - 1];
+}
+
+static void write_results(FILE* out)
+{
+    fprintf(out, "# op count errors mean_ns p50_ns p99_ns reads_per_op writes_per_op\n");
+    for (int i = 0; i <= OP_TYPE_NUM; i++) {
+        struct op_result* res = &results[i];
+        if (res->count == 0) {
+            continue;
+        }
+        qsort(res->latency, res->count, sizeof(uint64_t), compare_latency);
+        fprintf(out, "%s %llu %llu %.0f %llu %llu %.3f %.3f\n", i == OP_TYPE_NUM ? "total" : op_types[i].name,
+            (unsigned long long)res->count, (unsigned long long)res->errors, res->total_ns / res->count,
+            (unsigned long long)percentile(res, 0.5), (unsigned long long)percentile(res, 0.99),
+            (double)res->reads / res->count, (double)res->writes / res->count);
+    }
+}
+
+// Comparing results
+
+struct result_line {
+    char op[32];
+    unsigned long long count, errors;
+    double mean, p50, p99, reads, writes;
+};
+
+static int read_results(const char* file, struct result_line* lines, int max)
+{
+    FILE* in = fopen(file, "r");
+    if (in == NULL) {
+        perror(file);
+        return -1;
+    }
+    char line[512];
+    int num = 0;
+    while (num < max && fgets(line, sizeof(line), in) != NULL) {
+        struct result_line* l = &lines[num];
+        if (line[0] != '#' && sscanf(line, "%31s %llu %llu %lf %lf %lf %lf %lf", l->op, &l->count, &l->errors, &l->mean, &l->p50, &l->p99, &l->reads, &l->writes) == 8) {
+            num++;
+        }
+    }
+    fclose(in);
+    return num;
+}
+
+// Whether `now` is worse than `base` by more than `threshold`; `slack` absorbs differences too small to matter
+static bool regressed(double base, double now, double threshold, double slack)
+{
+    return now > base * (1 + threshold) + slack;
+}
+
+// Latency is compared by the median, the mean follows a few slow outliers; I/Os are deterministic and always compared
+#define MIN_TIMED_OPS 100 // fewer operations of a type than this are too noisy to compare their latency
+
+static int compare(const char* baseline_file, const char* result_file, double threshold)
+{
+    struct result_line base[OP_TYPE_NUM + 1], now[OP_TYPE_NUM + 1];
+    int base_num = read_results(baseline_file, base, OP_TYPE_NUM + 1), now_num = read_results(result_file, now, OP_TYPE_NUM + 1);
+    if (base_num == -1 || now_num == -1) {
+        return 2;
+    }
+    int regressions = 0;
+    printf("%-10s %12s %12s %8s %10s %10s %10s %10s\n", "op", "base p50", "p50", "change", "base r/op", "r/op", "base w/op", "w/op");
+    for (int i = 0; i < now_num; i++) {
+        struct result_line *n = &now[i], *b = NULL;
+        for (int j = 0; j < base_num; j++) {
+            if (strcmp(base[j].op, n->op) == 0) {
+                b = &base[j];
+            }
+        }
+        if (b == NULL) {
+            printf("%-10s not in the baseline\n", n->op);
+            continue;
+        }
+        bool slower = n->count >= MIN_TIMED_OPS && b->count >= MIN_TIMED_OPS && regressed(b->p50, n->p50, threshold, 0);
+        bool more_io = regressed(b->reads, n->reads, threshold, 0.01) || regressed(b->writes, n->writes, threshold, 0.01);
+        printf("%-10s %12.0f %12.0f %+7.1f%% %10.3f %10.3f %10.3f %10.3f%s\n", n->op, b->p50, n->p50, b->p50 > 0 ? (n->p50 / b->p50 - 1) * 100 : 0.0,
+            b->reads, n->reads, b->writes, n->writes, slower || more_io ? "  REGRESSION" : "");
+        regressions += slower || more_io;
+    }
+    if (regressions > 0) {
+        printf("%d regressions above %.0f%%\n", regressions, threshold * 100);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: replay convert [-C dir] [-m mnt] trace.sh\n"
+                    "       replay run [-t] [-z] [-f image] [-B btrace] log|trace.sh...\n"
+                    "       replay compare [-T percent] baseline result\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        usage();
+    }
+    const char* cmd = argv[1];
+    argv++;
+    argc--;
+    conv.host_dir = ".";
+    snprintf(conv.mount, sizeof(conv.mount), "/mnt");
+    bool timed = false;
+    double threshold = 0.1;
+    int opt;
+    while ((opt = getopt(argc, argv, "C:m:tzf:B:T:")) != -1) {
+        switch (opt) {
+        case 'C':
+            conv.host_dir = optarg;
+            break;
+        case 'm':
+            snprintf(conv.mount, sizeof(conv.mount), "/%s", optarg);
+            break;
+        case 't':
+            timed = true;
+            break;
+        case 'z':
+            fs_set_compression(true);
+            break;
+        case 'f':
+            memdisk_file = optarg;
+            break;
+        case 'B':
+            fs_set_block_trace(optarg);
+            break;
+        case 'T':
+            threshold = atof(optarg) / 100;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (strcmp(cmd, "convert") == 0 && optind == argc - 1) {
+        return convert(argv[optind], stdout) ? 1 : 0;
+    }
+    if (strcmp(cmd, "compare") == 0 && optind == argc - 2) {
+        return compare(argv[optind], argv[optind + 1], threshold);
+    }
+    if (strcmp(cmd, "run") != 0 || optind == argc) {
+        usage();
+    }
+    for (int i = optind; i < argc; i++) {
+        int len = strlen(argv[i]);
+        FILE* log;
+        if (len > 3 && strcmp(argv[i] + len - 3, ".sh") == 0) {
+            log = tmpfile();
+            if (log == NULL || convert(argv[i], log)) {
+                return 1;
+            }
+            rewind(log);
+        } else if ((log = fopen(argv[i], "r")) == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        int ret = replay(log, timed);
+        fclose(log);
+        if (ret) {
+            return 1;
+        }
+    }
+    write_results(stdout);
+    return 0;
+}
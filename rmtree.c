@@ -0,0 +1,47 @@
+/*
+Remove directories of the mount with everything below them, with the FS_IOC_RMTREE ioctl
+  rmtree PATH...
+Each PATH is gone when the command returns; the filesystem frees the files below it in the background
+*/
+
+#include "fs_ioctl.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Issued on the parent directory, which names the tree to remove
+static int remove_tree(const char* path)
+{
+    char dir_copy[PATH_MAX], name_copy[PATH_MAX];
+    snprintf(dir_copy, sizeof(dir_copy), "%s", path);
+    snprintf(name_copy, sizeof(name_copy), "%s", path);
+    static struct fs_rmtree_args args;
+    snprintf(args.name, sizeof(args.name), "%s", basename(name_copy));
+    int fd = open(dirname(dir_copy), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+    if (ioctl(fd, FS_IOC_RMTREE, &args) == -1) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    return close(fd) == -1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s PATH...\n", argv[0]);
+        return 2;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        ret |= remove_tree(argv[i]);
+    }
+    return ret;
+}
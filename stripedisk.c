@@ -0,0 +1,304 @@
+/*
+A block device striped over several backing files, see stripedisk.h
+*/
+
+#include "stripedisk.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAX_STRIPES 16
+#define DEFAULT_STRIPE_UNIT 16
+#define STRIPE_MAGIC 0x50525453
+#define STRIPE_RUN_MAX 256 // blocks in one system call, well under IOV_MAX
+
+const char* stripedisk_paths;
+int stripedisk_unit;
+atomic_ulong stripedisk_reads, stripedisk_writes;
+
+// The first block of every backing file records the layout, so a device is never attached with another one
+struct stripe_header {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t index;
+    uint32_t unit;
+};
+
+// The blocks of a batch, each queued on the stripe that holds it; the caller waits for all of them
+struct stripe_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+    bool failed;
+};
+struct stripe_io {
+    bool write;
+    off_t offset;
+    void* buf;
+    struct stripe_batch* batch;
+    struct stripe_io* next;
+};
+
+// A backing file, served by a thread of its own
+static struct stripe {
+    char path[PATH_MAX];
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled when requests are queued
+    struct stripe_io* head;
+    struct stripe_io** tail;
+} stripes[MAX_STRIPES];
+static int stripe_num;
+static bool workers_started;
+
+// Blocks of the device in each backing file, besides its header
+static off_t stripe_blocks()
+{
+    int units = (BLOCK_NUM + stripedisk_unit - 1) / stripedisk_unit;
+    return (off_t)(units + stripe_num - 1) / stripe_num * stripedisk_unit;
+}
+
+// The stripe holding a block of the device, and the offset of the block in its file
+static int locate(int block_id, off_t* offset)
+{
+    int unit = block_id / stripedisk_unit;
+    *offset = ((off_t)(unit / stripe_num) * stripedisk_unit + block_id % stripedisk_unit + 1) * BLOCK_SIZE;
+    return unit % stripe_num;
+}
+
+// Serve the queued requests of a stripe, merging the runs of consecutive blocks into one system call
+static void* stripe_thread(void* arg)
+{
+    struct stripe* stripe = arg;
+    for (;;) {
+        pthread_mutex_lock(&stripe->lock);
+        while (stripe->head == NULL) {
+            pthread_cond_wait(&stripe->cond, &stripe->lock);
+        }
+        struct stripe_io* io = stripe->head;
+        stripe->head = NULL;
+        stripe->tail = &stripe->head;
+        pthread_mutex_unlock(&stripe->lock);
+
+        while (io != NULL) {
+            struct iovec iov[STRIPE_RUN_MAX];
+            struct stripe_io* run = io;
+            int n = 0;
+            for (; io != NULL && n < STRIPE_RUN_MAX && io->write == run->write && io->offset == run->offset + (off_t)n * BLOCK_SIZE; io = io->next) {
+                iov[n++] = (struct iovec) { io->buf, BLOCK_SIZE };
+            }
+            ssize_t size = run->write ? pwritev(stripe->fd, iov, n, run->offset) : preadv(stripe->fd, iov, n, run->offset);
+            for (int i = 0; i < n; i++) {
+                struct stripe_io* next = run->next;
+                struct stripe_batch* batch = run->batch;
+                pthread_mutex_lock(&batch->lock);
+                batch->failed |= size != (ssize_t)n * BLOCK_SIZE;
+                if (--batch->pending == 0) {
+                    pthread_cond_signal(&batch->done);
+                }
+                pthread_mutex_unlock(&batch->lock);
+                run = next;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Split the backing paths and start a thread per stripe, the first time
+// Return 1 if the configuration is invalid
+static int configure()
+{
+    const char* paths = stripedisk_paths != NULL ? stripedisk_paths : getenv("FS_STRIPES");
+    if (stripedisk_unit == 0) {
+        const char* unit = getenv("FS_STRIPE_UNIT");
+        stripedisk_unit = unit != NULL ? atoi(unit) : DEFAULT_STRIPE_UNIT;
+    }
+    if (paths == NULL || stripedisk_unit <= 0) {
+        return 1;
+    }
+    int num = 0;
+    for (const char* p = paths; *p != '\0'; p += *p == ':') {
+        int len = strcspn(p, ":");
+        if (num == MAX_STRIPES || len == 0 || len >= PATH_MAX - 16) {
+            return 1;
+        }
+        struct stat st;
+        snprintf(stripes[num].path, PATH_MAX, "%.*s", len, p);
+        if (stat(stripes[num].path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            sprintf(stripes[num].path + len, "/stripe%d", num);
+        }
+        num++;
+        p += len;
+    }
+    if (num == 0 || (workers_started && num != stripe_num)) {
+        return 1;
+    }
+    stripe_num = num;
+    for (int i = 0; !workers_started && i < stripe_num; i++) {
+        struct stripe* stripe = &stripes[i];
+        stripe->fd = -1;
+        stripe->tail = &stripe->head;
+        pthread_mutex_init(&stripe->lock, NULL);
+        pthread_cond_init(&stripe->cond, NULL);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, stripe_thread, stripe) != 0) {
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    workers_started = true;
+    return 0;
+}
+
+static void close_stripes()
+{
+    for (int i = 0; i < stripe_num; i++) {
+        if (stripes[i].fd != -1) {
+            close(stripes[i].fd);
+            stripes[i].fd = -1;
+        }
+    }
+}
+
+int disk_init()
+{
+    if (configure()) {
+        return 1;
+    }
+    close_stripes();
+    char block[BLOCK_SIZE];
+    for (int i = 0; i < stripe_num; i++) {
+        memset(block, 0, BLOCK_SIZE);
+        *(struct stripe_header*)block = (struct stripe_header) { STRIPE_MAGIC, stripe_num, i, stripedisk_unit };
+        stripes[i].fd = open(stripes[i].path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (stripes[i].fd == -1 || ftruncate(stripes[i].fd, (stripe_blocks() + 1) * BLOCK_SIZE)
+            || pwrite(stripes[i].fd, block, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+            close_stripes();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Use the backing files of an earlier run, laid out the same way
+// Return 1 if any of them is missing or has another layout
+int disk_attach()
+{
+    if (configure()) {
+        return 1;
+    }
+    close_stripes();
+    for (int i = 0; i < stripe_num; i++) {
+        struct stripe_header header;
+        struct stat st;
+        stripes[i].fd = open(stripes[i].path, O_RDWR);
+        if (stripes[i].fd == -1 || pread(stripes[i].fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != STRIPE_MAGIC || header.count != (uint32_t)stripe_num || header.index != (uint32_t)i
+            || header.unit != (uint32_t)stripedisk_unit || fstat(stripes[i].fd, &st) || st.st_size != (stripe_blocks() + 1) * BLOCK_SIZE) {
+            close_stripes();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int disk_read(int block_id, void* buffer)
+{
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return 1;
+    stripedisk_reads++;
+    off_t offset;
+    int stripe = locate(block_id, &offset);
+    return pread(stripes[stripe].fd, buffer, BLOCK_SIZE, offset) != BLOCK_SIZE;
+}
+
+int disk_write(int block_id, void* buffer)
+{
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return 1;
+    stripedisk_writes++;
+    off_t offset;
+    int stripe = locate(block_id, &offset);
+    return pwrite(stripes[stripe].fd, buffer, BLOCK_SIZE, offset) != BLOCK_SIZE;
+}
+
+// The blocks are spread over several files, none of them a file of its own to splice from; `fs_read` works as usual
+int disk_open([[maybe_unused]] int block_id, [[maybe_unused]] int flags)
+{
+    return -1;
+}
+
+// Queue every block on its stripe, in the order given, and wait for all of them
+static int stripe_batch(bool write, const int* block_ids, void* const* buffers, int count)
+{
+    if (count == 1) {
+        return write ? disk_write(block_ids[0], buffers[0]) : disk_read(block_ids[0], buffers[0]);
+    }
+    for (int i = 0; i < count; i++) {
+        if (block_ids[i] >= BLOCK_NUM || block_ids[i] < 0) {
+            return 1;
+        }
+    }
+    struct stripe_io* ios = malloc(sizeof(struct stripe_io) * count);
+    if (ios == NULL) {
+        return 1;
+    }
+    struct stripe_batch batch = { .pending = count };
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    struct stripe_io* heads[MAX_STRIPES] = { NULL };
+    struct stripe_io** tails[MAX_STRIPES];
+    for (int i = 0; i < stripe_num; i++) {
+        tails[i] = &heads[i];
+    }
+    for (int i = 0; i < count; i++) {
+        ios[i] = (struct stripe_io) { .write = write, .buf = buffers[i], .batch = &batch };
+        int stripe = locate(block_ids[i], &ios[i].offset);
+        *tails[stripe] = &ios[i];
+        tails[stripe] = &ios[i].next;
+    }
+    *(write ? &stripedisk_writes : &stripedisk_reads) += count;
+
+    for (int i = 0; i < stripe_num; i++) {
+        if (heads[i] == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&stripes[i].lock);
+        *stripes[i].tail = heads[i];
+        stripes[i].tail = tails[i];
+        pthread_cond_signal(&stripes[i].cond);
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0) {
+        pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    free(ios);
+    return batch.failed;
+}
+
+int disk_read_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    return stripe_batch(false, block_ids, buffers, count);
+}
+
+int disk_write_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    return stripe_batch(true, block_ids, buffers, count);
+}
+
+// One tier only
+void disk_set_metadata([[maybe_unused]] int block_id, [[maybe_unused]] int metadata)
+{
+}
@@ -0,0 +1,20 @@
+/*
+A block device striped over several backing files, which may sit on different disks
+It implements disk.h in place of disk.c: consecutive runs of `stripedisk_unit` blocks go to the files in turn, and the
+blocks of one `disk_read_blocks` or `disk_write_blocks` are read and written on all the files in parallel
+*/
+
+#ifndef STRIPEDISK_H
+#define STRIPEDISK_H
+
+#include "disk.h"
+#include <stdatomic.h>
+
+// Set before the device is opened; by default they come from the environment, for the FUSE binary:
+// FS_STRIPES, backing files separated by colons, where a directory stands for the file `stripe<i>` in it
+// FS_STRIPE_UNIT, blocks per stripe unit, 16 by default
+extern const char* stripedisk_paths;
+extern int stripedisk_unit;
+extern atomic_ulong stripedisk_reads, stripedisk_writes;
+
+#endif
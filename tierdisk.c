@@ -0,0 +1,388 @@
+/*
+A block device on a fast and a slow tier, see tierdisk.h
+*/
+
+#include "tierdisk.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIER_MAGIC 0x52454954
+#define TIER_TABLE_BLOCKS ((BLOCK_NUM * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define TIER_PINNED 0x80000000u // in a table entry, for a metadata block
+#define TIER_SLOT_MASK (~TIER_PINNED)
+#define TIER_HOT_MIN 4 // accesses a block on the slow tier needs, decayed by half every pass, to be worth promoting
+#define TIER_MIGRATE_MAX 1024 // blocks promoted in one pass
+#define DEFAULT_INTERVAL 1000
+
+const char* tierdisk_fast_path;
+const char* tierdisk_slow_path;
+int tierdisk_fast_blocks;
+int tierdisk_interval;
+atomic_ulong tierdisk_fast_io, tierdisk_slow_io, tierdisk_promotions, tierdisk_demotions;
+
+// The first block of each backing file; the table follows it in the fast file, and the fast slots follow the table
+struct tier_header {
+    uint32_t magic;
+    uint32_t tier; // 0 for the fast file, 1 for the slow one
+    uint32_t fast_blocks;
+    uint32_t block_num;
+};
+
+static int fast_fd = -1, slow_fd = -1;
+// For each block: its fast slot + 1, or 0 while it is on the slow tier, and `TIER_PINNED`
+// Taken for reading by every I/O, and for writing to change where a block is
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint32_t table[BLOCK_NUM];
+static int* slot_owner; // the block in each fast slot, -1 if free
+static int free_slots, next_free;
+// Accesses of each block since the migrator last halved them
+static _Atomic uint32_t heat[BLOCK_NUM];
+static bool migrator_started;
+static char move_buf[BLOCK_SIZE]; // under `map_lock` for writing
+
+static off_t fast_offset(int slot)
+{
+    return (off_t)(1 + TIER_TABLE_BLOCKS + slot) * BLOCK_SIZE;
+}
+
+static off_t slow_offset(int block_id)
+{
+    return (off_t)(1 + block_id) * BLOCK_SIZE;
+}
+
+// Write the table entry of a block back to the fast file
+static int save_entry(int block_id)
+{
+    return pwrite(fast_fd, &table[block_id], sizeof(uint32_t), BLOCK_SIZE + (off_t)block_id * sizeof(uint32_t)) != sizeof(uint32_t);
+}
+
+// Copy a block to a free fast slot, then point the table at it; the slow copy goes stale from then on
+// The caller must hold `map_lock` for writing
+static int promote(int block_id)
+{
+    if (free_slots == 0) {
+        return 1;
+    }
+    while (slot_owner[next_free] != -1) {
+        next_free = (next_free + 1) % tierdisk_fast_blocks;
+    }
+    int slot = next_free;
+    if (pread(slow_fd, move_buf, BLOCK_SIZE, slow_offset(block_id)) != BLOCK_SIZE
+        || pwrite(fast_fd, move_buf, BLOCK_SIZE, fast_offset(slot)) != BLOCK_SIZE) {
+        return 1;
+    }
+    table[block_id] = (table[block_id] & TIER_PINNED) | (slot + 1);
+    if (save_entry(block_id)) {
+        table[block_id] &= TIER_PINNED;
+        return 1;
+    }
+    slot_owner[slot] = block_id;
+    free_slots--;
+    tierdisk_promotions++;
+    return 0;
+}
+
+// Copy a block back home to the slow tier, then free its slot
+// The caller must hold `map_lock` for writing
+static int demote(int block_id)
+{
+    int slot = (table[block_id] & TIER_SLOT_MASK) - 1;
+    if (pread(fast_fd, move_buf, BLOCK_SIZE, fast_offset(slot)) != BLOCK_SIZE
+        || pwrite(slow_fd, move_buf, BLOCK_SIZE, slow_offset(block_id)) != BLOCK_SIZE) {
+        return 1;
+    }
+    table[block_id] &= TIER_PINNED;
+    if (save_entry(block_id)) {
+        table[block_id] |= slot + 1;
+        return 1;
+    }
+    slot_owner[slot] = -1;
+    free_slots++;
+    tierdisk_demotions++;
+    return 0;
+}
+
+struct candidate {
+    int block_id;
+    int heat;
+};
+
+static int compare_hotter(const void* a, const void* b)
+{
+    int x = ((const struct candidate*)a)->heat, y = ((const struct candidate*)b)->heat;
+    return (x < y) - (x > y);
+}
+
+int tierdisk_migrate()
+{
+    // the hottest blocks on the slow tier, pinned ones first, and the coldest unpinned ones on the fast tier
+    struct candidate* hot = malloc(sizeof(struct candidate) * BLOCK_NUM);
+    struct candidate* cold = malloc(sizeof(struct candidate) * BLOCK_NUM);
+    int hot_num = 0, cold_num = 0;
+    pthread_rwlock_rdlock(&map_lock);
+    if (hot == NULL || cold == NULL || fast_fd == -1) {
+        pthread_rwlock_unlock(&map_lock);
+        free(hot);
+        free(cold);
+        return 0;
+    }
+    for (int i = 0; i < BLOCK_NUM; i++) {
+        int h = heat[i];
+        bool fast = table[i] & TIER_SLOT_MASK, pinned = table[i] & TIER_PINNED;
+        if (!fast && (pinned || h >= TIER_HOT_MIN)) {
+            hot[hot_num++] = (struct candidate) { i, pinned ? INT32_MAX : h };
+        } else if (fast && !pinned) {
+            cold[cold_num++] = (struct candidate) { i, h };
+        }
+    }
+    pthread_rwlock_unlock(&map_lock);
+    for (int i = 0; i < BLOCK_NUM; i++) {
+        heat[i] /= 2;
+    }
+    qsort(hot, hot_num, sizeof(struct candidate), compare_hotter);
+    qsort(cold, cold_num, sizeof(struct candidate), compare_hotter);
+
+    // a block is moved under the lock, so I/O to other blocks waits only for one move at a time
+    int moved = 0, c = cold_num - 1;
+    for (int i = 0; i < hot_num && i < TIER_MIGRATE_MAX; i++) {
+        pthread_rwlock_wrlock(&map_lock);
+        int block_id = hot[i].block_id;
+        bool done = fast_fd == -1;
+        if (!done && !(table[block_id] & TIER_SLOT_MASK)) {
+            if (free_slots == 0) {
+                // the tiers change places only for a clear gain, so blocks of about the same heat do not move back and forth
+                while (c >= 0 && (table[cold[c].block_id] & TIER_PINNED || !(table[cold[c].block_id] & TIER_SLOT_MASK))) {
+                    c--;
+                }
+                done = c < 0 || cold[c].heat * 2 >= hot[i].heat || demote(cold[c--].block_id);
+                moved += !done;
+            }
+            done = done || promote(block_id);
+            moved += !done;
+        }
+        pthread_rwlock_unlock(&map_lock);
+        if (done) {
+            break;
+        }
+    }
+    free(hot);
+    free(cold);
+    return moved;
+}
+
+static void* migrator_thread([[maybe_unused]] void* arg)
+{
+    for (;;) {
+        struct timespec interval = { tierdisk_interval / 1000, tierdisk_interval % 1000 * 1000000L };
+        nanosleep(&interval, NULL);
+        tierdisk_migrate();
+    }
+    return NULL;
+}
+
+// Take the backing files and sizes from the environment unless set, and start the migrator, the first time
+// Return 1 if the configuration is invalid
+static int configure()
+{
+    if (tierdisk_fast_path == NULL) {
+        tierdisk_fast_path = getenv("FS_TIER_FAST");
+    }
+    if (tierdisk_slow_path == NULL) {
+        tierdisk_slow_path = getenv("FS_TIER_SLOW");
+    }
+    if (tierdisk_fast_blocks == 0) {
+        const char* blocks = getenv("FS_TIER_FAST_BLOCKS");
+        tierdisk_fast_blocks = blocks != NULL ? atoi(blocks) : BLOCK_NUM / 4;
+    }
+    if (tierdisk_interval == 0) {
+        const char* interval = getenv("FS_TIER_INTERVAL");
+        tierdisk_interval = interval != NULL ? atoi(interval) : DEFAULT_INTERVAL;
+    }
+    if (tierdisk_fast_path == NULL || tierdisk_slow_path == NULL || tierdisk_fast_blocks <= 0 || tierdisk_fast_blocks > BLOCK_NUM
+        || tierdisk_interval <= 0) {
+        return 1;
+    }
+    if (!migrator_started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, migrator_thread, NULL) != 0) {
+            return 1;
+        }
+        pthread_detach(thread);
+        migrator_started = true;
+    }
+    return 0;
+}
+
+// The caller must hold `map_lock` for writing
+static void close_tiers()
+{
+    if (fast_fd != -1) {
+        close(fast_fd);
+    }
+    if (slow_fd != -1) {
+        close(slow_fd);
+    }
+    fast_fd = slow_fd = -1;
+}
+
+// Size the slot map for the fast tier, with every slot free and every block on the slow tier
+// The caller must hold `map_lock` for writing
+static int reset_map()
+{
+    int* owner = realloc(slot_owner, sizeof(int) * tierdisk_fast_blocks);
+    if (owner == NULL) {
+        return 1;
+    }
+    slot_owner = owner;
+    for (int i = 0; i < tierdisk_fast_blocks; i++) {
+        slot_owner[i] = -1;
+    }
+    free_slots = tierdisk_fast_blocks;
+    next_free = 0;
+    memset(table, 0, sizeof(table));
+    for (int i = 0; i < BLOCK_NUM; i++) {
+        heat[i] = 0;
+    }
+    return 0;
+}
+
+int disk_init()
+{
+    if (configure()) {
+        return 1;
+    }
+    pthread_rwlock_wrlock(&map_lock);
+    close_tiers();
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    struct tier_header* header = (struct tier_header*)block;
+    *header = (struct tier_header) { TIER_MAGIC, 0, tierdisk_fast_blocks, BLOCK_NUM };
+    // the table is all zeros, every block on the slow tier
+    fast_fd = open(tierdisk_fast_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = reset_map() || fast_fd == -1 || ftruncate(fast_fd, fast_offset(tierdisk_fast_blocks))
+        || pwrite(fast_fd, block, BLOCK_SIZE, 0) != BLOCK_SIZE;
+    header->tier = 1;
+    slow_fd = ret ? -1 : open(tierdisk_slow_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ret = ret || slow_fd == -1 || ftruncate(slow_fd, slow_offset(BLOCK_NUM)) || pwrite(slow_fd, block, BLOCK_SIZE, 0) != BLOCK_SIZE;
+    if (ret) {
+        close_tiers();
+    }
+    pthread_rwlock_unlock(&map_lock);
+    return ret;
+}
+
+// Use the backing files of an earlier run, with the same size of the fast tier, and the blocks where they were left
+// Return 1 if either of them is missing, has another layout, or the table is damaged
+int disk_attach()
+{
+    if (configure()) {
+        return 1;
+    }
+    pthread_rwlock_wrlock(&map_lock);
+    close_tiers();
+    struct tier_header fast_header, slow_header;
+    fast_fd = open(tierdisk_fast_path, O_RDWR);
+    slow_fd = open(tierdisk_slow_path, O_RDWR);
+    int ret = reset_map() || fast_fd == -1 || slow_fd == -1
+        || pread(fast_fd, &fast_header, sizeof(fast_header), 0) != sizeof(fast_header)
+        || pread(slow_fd, &slow_header, sizeof(slow_header), 0) != sizeof(slow_header)
+        || fast_header.magic != TIER_MAGIC || fast_header.tier != 0 || slow_header.magic != TIER_MAGIC || slow_header.tier != 1
+        || fast_header.fast_blocks != (uint32_t)tierdisk_fast_blocks || fast_header.block_num != BLOCK_NUM
+        || pread(fast_fd, table, sizeof(table), BLOCK_SIZE) != sizeof(table);
+    for (int i = 0; !ret && i < BLOCK_NUM; i++) {
+        int slot = (table[i] & TIER_SLOT_MASK) - 1;
+        if (slot == -1) {
+            continue;
+        }
+        ret = slot >= tierdisk_fast_blocks || slot_owner[slot] != -1;
+        if (!ret) {
+            slot_owner[slot] = i;
+            free_slots--;
+        }
+    }
+    if (ret) {
+        close_tiers();
+    }
+    pthread_rwlock_unlock(&map_lock);
+    return ret;
+}
+
+static int tier_io(bool write, int block_id, void* buffer)
+{
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return 1;
+    heat[block_id]++;
+    pthread_rwlock_rdlock(&map_lock);
+    int slot = (table[block_id] & TIER_SLOT_MASK) - 1;
+    int fd = slot == -1 ? slow_fd : fast_fd;
+    off_t offset = slot == -1 ? slow_offset(block_id) : fast_offset(slot);
+    ssize_t size = write ? pwrite(fd, buffer, BLOCK_SIZE, offset) : pread(fd, buffer, BLOCK_SIZE, offset);
+    pthread_rwlock_unlock(&map_lock);
+    (*(slot == -1 ? &tierdisk_slow_io : &tierdisk_fast_io))++;
+    return size != BLOCK_SIZE;
+}
+
+int disk_read(int block_id, void* buffer)
+{
+    return tier_io(false, block_id, buffer);
+}
+
+int disk_write(int block_id, void* buffer)
+{
+    return tier_io(true, block_id, buffer);
+}
+
+// A block is in either of two files, never a file of its own to splice from; `fs_read` works as usual
+int disk_open([[maybe_unused]] int block_id, [[maybe_unused]] int flags)
+{
+    return -1;
+}
+
+int disk_read_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (tier_io(false, block_ids[i], buffers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int disk_write_blocks(const int* block_ids, void* const* buffers, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (tier_io(true, block_ids[i], buffers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A pinned block is promoted at once if a slot is free, and otherwise by the next pass of the migrator, which makes
+// room for it; an unpinned one stays where it is until its heat moves it
+void disk_set_metadata(int block_id, int metadata)
+{
+    if (block_id >= BLOCK_NUM || block_id < 0)
+        return;
+    pthread_rwlock_rdlock(&map_lock);
+    bool changed = fast_fd != -1 && (bool)(table[block_id] & TIER_PINNED) != (bool)metadata;
+    pthread_rwlock_unlock(&map_lock);
+    if (!changed) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&map_lock);
+    if (fast_fd != -1) {
+        table[block_id] = metadata ? table[block_id] | TIER_PINNED : table[block_id] & ~TIER_PINNED;
+        if ((table[block_id] & TIER_SLOT_MASK) || !metadata || promote(block_id)) {
+            save_entry(block_id);
+        }
+    }
+    pthread_rwlock_unlock(&map_lock);
+}
@@ -0,0 +1,29 @@
+/*
+A block device on two tiers: a small fast backing file, which holds a subset of the blocks, and a large slow one, which
+has room for all of them
+It implements disk.h in place of disk.c: blocks marked as metadata with `disk_set_metadata` are pinned to the fast tier,
+and the other blocks move between the tiers by how often they are read and written, as a background thread sees it
+Which blocks are on the fast tier is recorded in a table at the start of the fast file, so it survives a remount
+*/
+
+#ifndef TIERDISK_H
+#define TIERDISK_H
+
+#include "disk.h"
+#include <stdatomic.h>
+
+// Set before the device is opened; by default they come from the environment, for the FUSE binary:
+// FS_TIER_FAST and FS_TIER_SLOW, the backing files
+// FS_TIER_FAST_BLOCKS, blocks the fast tier holds, a quarter of the device by default
+// FS_TIER_INTERVAL, milliseconds between two passes of the migrator, 1000 by default
+extern const char* tierdisk_fast_path;
+extern const char* tierdisk_slow_path;
+extern int tierdisk_fast_blocks;
+extern int tierdisk_interval;
+extern atomic_ulong tierdisk_fast_io, tierdisk_slow_io, tierdisk_promotions, tierdisk_demotions;
+
+// Run a pass of the migrator at once, as the background thread does every `tierdisk_interval` milliseconds
+// Return the number of blocks moved
+int tierdisk_migrate();
+
+#endif